@@ -0,0 +1,40 @@
+if(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+    # in cache already
+    set(ZSTD_FOUND TRUE)
+else(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+    if(NOT WIN32)
+        # use pkg-config to get the directories and then use these values
+        # in the FIND_PATH() and FIND_LIBRARY() calls
+        find_package(PkgConfig)
+        pkg_check_modules(PC_ZSTD libzstd)
+    endif(NOT WIN32)
+
+    find_path(ZSTD_INCLUDE_DIR
+        NAMES
+        zstd.h
+        HINTS
+        ${PC_ZSTD_INCLUDE_DIRS}
+        PATHS
+        /usr/include
+        /usr/local/include
+        )
+
+    find_library(ZSTD_LIBRARY
+        NAMES
+        zstd
+        HINTS
+        ${PC_ZSTD_LIBRARY_DIRS}
+        PATHS
+        /usr/lib
+        /usr/lib64
+        /usr/local/lib
+        /usr/local/lib64
+        )
+    set(ZSTD_LIBRARIES ${ZSTD_LIBRARY})
+
+    # zstd is optional: ZSTD_FOUND is left false if it is missing
+    include(FindPackageHandleStandardArgs)
+    find_package_handle_standard_args(ZSTD DEFAULT_MSG ZSTD_LIBRARY ZSTD_INCLUDE_DIR)
+
+    mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
+endif(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
@@ -80,6 +80,11 @@ function launch_telegraf {
 	    ssh ${h} ${TELEGRAF_EXEC} --config "${TELEGRAF_TMP}/telegraf-client-${index}.conf" &
 	fi
     done
+
+    # the aggregators, for applications sending to them directly
+    # (DAAP_ENDPOINTS_FILE)
+    printf "%s:5555\n" "${servers[@]}" > "${TELEGRAF_TMP}/daap-endpoints"
+    echo "Aggregator endpoints: ${TELEGRAF_TMP}/daap-endpoints"
 }
 
 function kill_telegraf {
@@ -0,0 +1,517 @@
+/*
+ * Precompiled template bundles for the stdout parser
+ *
+ * Short parser runs launched per job step used to spend most of their time
+ * reading the templates and compiling every key regex. The compiled key
+ * set and table set are already flat arrays without pointers, so a bundle
+ * is simply those arrays, 8-byte aligned, behind a header holding the
+ * counts and the offset/length of each array (a section). The compiled
+ * pcre patterns are stored as the bytes pcre_compile produced, which
+ * pcre_exec can run from where they are mapped.
+ *
+ * A bundle is only used when it was written by the same build (byte
+ * order, layout and pcre version) from the same template files, judged by
+ * their path, size and mtime; otherwise the caller compiles the templates
+ * as before.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_bundle.h"
+
+#define BUNDLE_MAGIC "DAAPTPL"
+#define BUNDLE_VERSION 1
+#define BUNDLE_BYTE_ORDER 0x01020304
+#define BUNDLE_ALIGN 8
+
+/* sizes of the mapped structs; a bundle from a build where they differ is stale */
+#define BUNDLE_LAYOUT (sizeof(daap_table_def_t) << 24 | sizeof(daap_table_val_t) << 16 | \
+                       sizeof(daap_table_header_t) << 8 | sizeof(daap_value_type_t))
+
+/* the arrays of an automaton, in section order */
+#define AC_NEXT       0
+#define AC_OUT_START  1
+#define AC_OUT        2
+#define AC_LIT_START  3
+#define AC_LIT_OWNERS 4
+#define AC_SECTIONS   5
+
+/* sections of a bundle */
+#define SEC_KEY_REGEXES      0     /* uint64 offsets of the compiled patterns */
+#define SEC_KEY_NUM_REQUIRED 1
+#define SEC_KEY_ALWAYS       2
+#define SEC_KEY_TYPE_START   3
+#define SEC_KEY_TYPES        4
+#define SEC_KEY_UNITS        5
+#define SEC_KEY_AC           6
+#define SEC_TABLE_DEFS       (SEC_KEY_AC + AC_SECTIONS)
+#define SEC_TABLE_HEADERS    (SEC_TABLE_DEFS + 1)
+#define SEC_TABLE_VALS       (SEC_TABLE_DEFS + 2)
+#define SEC_TABLE_POOL       (SEC_TABLE_DEFS + 3)
+#define SEC_TABLE_AC         (SEC_TABLE_DEFS + 4)
+#define NUM_SECTIONS         (SEC_TABLE_AC + AC_SECTIONS)
+
+typedef struct {
+    uint64_t offset;
+    uint64_t len;
+} section_t;
+
+/* a template file a bundle was compiled from */
+typedef struct {
+    char path[PATH_MAX];           /* absolute, empty if there was none */
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} source_t;
+
+/* the scalar part of an automaton */
+typedef struct {
+    uint32_t num_states;
+    uint32_t num_classes;
+    uint32_t num_literals;
+    uint32_t pad;
+    uint8_t classmap[256];
+} bundle_ac_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint64_t layout;
+    uint64_t size;                 /* of the whole file */
+    uint64_t checksum;             /* of everything after the header */
+    char pcre_version[64];
+    source_t key_source;
+    source_t table_source;
+    int32_t num_regexes;
+    int32_t num_always;
+    uint32_t units_len;
+    uint32_t num_tables;
+    uint32_t num_headers;
+    uint32_t num_vals;
+    uint32_t pool_len;
+    uint32_t pad;
+    bundle_ac_t key_ac;
+    bundle_ac_t table_ac;
+    section_t sections[NUM_SECTIONS];
+} header_t;
+
+/* a bundle being written */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t size;
+} buffer_t;
+
+/* FNV-1a */
+static uint64_t checksum(const unsigned char *data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Append len bytes, padded to BUNDLE_ALIGN; returns their offset or -1 */
+static int64_t appendData(buffer_t *buf, const void *data, size_t len) {
+    size_t padded = (len + BUNDLE_ALIGN - 1) & ~(size_t)(BUNDLE_ALIGN - 1);
+    size_t offset = buf->len;
+    char *new_data;
+    size_t size;
+
+    if (buf->len + padded > buf->size) {
+        size = buf->size ? buf->size : 65536;
+        while (size < buf->len + padded) {
+            size *= 2;
+        }
+        if (!(new_data = realloc(buf->data, size))) {
+            return -1;
+        }
+        buf->data = new_data;
+        buf->size = size;
+    }
+    if (len > 0) {
+        memcpy(buf->data + offset, data, len);
+    }
+    memset(buf->data + offset + len, 0, padded - len);
+    buf->len += padded;
+    return offset;
+}
+
+/* Append an array as a section. The header is looked up again after the
+ * append since the buffer may have moved. */
+static int appendSection(buffer_t *buf, int section, const void *data, size_t len) {
+    int64_t offset = appendData(buf, data, len);
+
+    if (offset < 0) {
+        return -1;
+    }
+    ((header_t *)buf->data)->sections[section].offset = offset;
+    ((header_t *)buf->data)->sections[section].len = len;
+    return 0;
+}
+
+static int appendAutomaton(buffer_t *buf, int first, bundle_ac_t *scalars,
+                           daap_ac_t *ac) {
+    memset(scalars, 0, sizeof(bundle_ac_t));
+    scalars->num_states = ac->num_states;
+    scalars->num_classes = ac->num_classes;
+    scalars->num_literals = ac->num_literals;
+    memcpy(scalars->classmap, ac->classmap, sizeof(scalars->classmap));
+
+    if (appendSection(buf, first + AC_NEXT, ac->next,
+                      (size_t)ac->num_states * ac->num_classes * sizeof(int32_t)) < 0 ||
+        appendSection(buf, first + AC_OUT_START, ac->out_start,
+                      ac->out_start ? (ac->num_states + 1) * sizeof(uint32_t) : 0) < 0 ||
+        appendSection(buf, first + AC_OUT, ac->out,
+                      ac->out_start ? ac->out_start[ac->num_states] * sizeof(uint32_t) : 0) < 0 ||
+        appendSection(buf, first + AC_LIT_START, ac->lit_start,
+                      ac->lit_start ? (ac->num_literals + 1) * sizeof(uint32_t) : 0) < 0 ||
+        appendSection(buf, first + AC_LIT_OWNERS, ac->lit_owners,
+                      ac->lit_start ? ac->lit_start[ac->num_literals] * sizeof(uint32_t) : 0) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Record the path, size and mtime of a template file */
+static int recordSource(source_t *source, const char *file) {
+    struct stat st;
+
+    memset(source, 0, sizeof(source_t));
+    if (!file || !file[0]) {
+        return 0;
+    }
+    if (!realpath(file, source->path) || stat(source->path, &st) != 0) {
+        ERROR_OUTPUT(("Failed to stat template file %s: %s", file, strerror(errno)));
+        return -1;
+    }
+    source->size = st.st_size;
+    source->mtime_sec = st.st_mtim.tv_sec;
+    source->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+int daapBundleWrite(const char *path, daap_keyset_t *keys,
+                    daap_tableset_t *tables, const char *key_file,
+                    const char *table_file) {
+    buffer_t buf = { NULL, 0, 0 };
+    header_t header;
+    uint64_t *offsets = NULL;
+    size_t blob_size;
+    int64_t offset;
+    char tmp_path[PATH_MAX];
+    header_t *h;
+    ssize_t count;
+    size_t done;
+    int fd, i;
+
+    memset(&header, 0, sizeof(header_t));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+    header.byte_order = BUNDLE_BYTE_ORDER;
+    header.version = BUNDLE_VERSION;
+    header.layout = BUNDLE_LAYOUT;
+    snprintf(header.pcre_version, sizeof(header.pcre_version), "%s", pcre_version());
+    if (recordSource(&header.key_source, key_file) < 0 ||
+        recordSource(&header.table_source, table_file) < 0) {
+        return -1;
+    }
+    header.num_regexes = keys->num_regexes;
+    header.num_always = keys->num_always;
+    header.units_len = keys->units_len;
+    header.num_tables = tables->num_tables;
+    header.num_headers = tables->num_headers;
+    header.num_vals = tables->num_vals;
+    header.pool_len = tables->pool_len;
+    if (appendData(&buf, &header, sizeof(header_t)) < 0) {
+        goto nomem;
+    }
+
+    /* the compiled patterns, as pcre_compile laid them out */
+    offsets = calloc(keys->num_regexes + 1, sizeof(uint64_t));
+    if (!offsets) {
+        goto nomem;
+    }
+    for (i = 0; i < keys->num_regexes; i++) {
+        if (pcre_fullinfo(keys->regexes[i], NULL, PCRE_INFO_SIZE, &blob_size) != 0) {
+            ERROR_OUTPUT(("Failed to get the size of compiled regex %d", i));
+            free(offsets);
+            free(buf.data);
+            return -1;
+        }
+        if ((offset = appendData(&buf, keys->regexes[i], blob_size)) < 0) {
+            goto nomem;
+        }
+        offsets[i] = offset;
+    }
+
+    if (appendSection(&buf, SEC_KEY_REGEXES, offsets,
+                      keys->num_regexes * sizeof(uint64_t)) < 0 ||
+        appendSection(&buf, SEC_KEY_NUM_REQUIRED, keys->num_required,
+                      keys->num_regexes * sizeof(uint8_t)) < 0 ||
+        appendSection(&buf, SEC_KEY_ALWAYS, keys->always,
+                      keys->num_always * sizeof(int)) < 0 ||
+        appendSection(&buf, SEC_KEY_TYPE_START, keys->type_start,
+                      (keys->num_regexes + 1) * sizeof(uint32_t)) < 0 ||
+        appendSection(&buf, SEC_KEY_TYPES, keys->types,
+                      keys->type_start[keys->num_regexes] * sizeof(daap_value_type_t)) < 0 ||
+        appendSection(&buf, SEC_KEY_UNITS, keys->units, keys->units_len) < 0 ||
+        appendAutomaton(&buf, SEC_KEY_AC, &header.key_ac, &keys->ac) < 0 ||
+        appendSection(&buf, SEC_TABLE_DEFS, tables->tables,
+                      tables->num_tables * sizeof(daap_table_def_t)) < 0 ||
+        appendSection(&buf, SEC_TABLE_HEADERS, tables->headers,
+                      tables->num_headers * sizeof(daap_table_header_t)) < 0 ||
+        appendSection(&buf, SEC_TABLE_VALS, tables->vals,
+                      tables->num_vals * sizeof(daap_table_val_t)) < 0 ||
+        appendSection(&buf, SEC_TABLE_POOL, tables->pool, tables->pool_len) < 0 ||
+        appendAutomaton(&buf, SEC_TABLE_AC, &header.table_ac, &tables->ac) < 0) {
+        goto nomem;
+    }
+    free(offsets);
+
+    /* the automaton scalars were filled in after the header was appended */
+    h = (header_t *)buf.data;
+    h->key_ac = header.key_ac;
+    h->table_ac = header.table_ac;
+    h->size = buf.len;
+    h->checksum = checksum((unsigned char *)buf.data + sizeof(header_t),
+                           buf.len - sizeof(header_t));
+
+    /* write a temporary file and rename it, so readers never see half a bundle */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ERROR_OUTPUT(("Failed to create template bundle %s: %s", tmp_path, strerror(errno)));
+        free(buf.data);
+        return -1;
+    }
+    for (done = 0; done < buf.len; done += count) {
+        count = write(fd, buf.data + done, buf.len - done);
+        if (count < 0 && errno == EINTR) {
+            count = 0;
+        }
+        else if (count < 0) {
+            break;
+        }
+    }
+    free(buf.data);
+    if (done < buf.len || close(fd) != 0 || rename(tmp_path, path) != 0) {
+        ERROR_OUTPUT(("Failed to write template bundle %s: %s", path, strerror(errno)));
+        if (done < buf.len) {
+            close(fd);
+        }
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+
+ nomem:
+    ERROR_OUTPUT(("Failed to allocate template bundle"));
+    free(offsets);
+    free(buf.data);
+    return -1;
+}
+
+/* Whether a template file differs from the one a bundle was compiled from */
+static int sourceChanged(const source_t *source, const char *file) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!file[0] || !source->path[0]) {
+        return file[0] || source->path[0];
+    }
+    if (!realpath(file, path) || stat(path, &st) != 0) {
+        /* nothing to fall back to, so the bundle is the best there is */
+        DEBUG_OUTPUT(("Template file %s is missing, using the bundle", file));
+        return 0;
+    }
+    return strcmp(path, source->path) != 0 || (uint64_t)st.st_size != source->size ||
+        st.st_mtim.tv_sec != source->mtime_sec || st.st_mtim.tv_nsec != source->mtime_nsec;
+}
+
+/* Pointer to a section with the expected length, or NULL if it is empty.
+ * *ok is cleared if the section does not have that length. */
+static void *sectionData(daap_bundle_t *bundle, int section, uint64_t len, int *ok) {
+    header_t *h = (header_t *)bundle->map;
+    section_t *s = &h->sections[section];
+
+    if (s->len != len || s->offset % BUNDLE_ALIGN != 0 ||
+        s->offset > bundle->size || s->len > bundle->size - s->offset) {
+        ERROR_OUTPUT(("Template bundle section %d is corrupt", section));
+        *ok = 0;
+        return NULL;
+    }
+    return len ? (char *)bundle->map + s->offset : NULL;
+}
+
+/* len if the section was written, 0 if the array did not exist */
+static uint64_t optionalLen(daap_bundle_t *bundle, int section, uint64_t len) {
+    return ((header_t *)bundle->map)->sections[section].len ? len : 0;
+}
+
+static void mapAutomaton(daap_bundle_t *bundle, int first, bundle_ac_t *scalars,
+                         daap_ac_t *ac, int *ok) {
+    ac->num_states = scalars->num_states;
+    ac->num_classes = scalars->num_classes;
+    ac->num_literals = scalars->num_literals;
+    memcpy(ac->classmap, scalars->classmap, sizeof(ac->classmap));
+    ac->next = sectionData(bundle, first + AC_NEXT,
+                           (uint64_t)ac->num_states * ac->num_classes * sizeof(int32_t), ok);
+    ac->out_start = sectionData(bundle, first + AC_OUT_START,
+                                optionalLen(bundle, first + AC_OUT_START,
+                                            (ac->num_states + 1) * sizeof(uint32_t)), ok);
+    if (*ok) {
+        ac->out = sectionData(bundle, first + AC_OUT, ac->out_start ?
+                              ac->out_start[ac->num_states] * sizeof(uint32_t) : 0, ok);
+    }
+    ac->lit_start = sectionData(bundle, first + AC_LIT_START,
+                                optionalLen(bundle, first + AC_LIT_START,
+                                            (ac->num_literals + 1) * sizeof(uint32_t)), ok);
+    if (*ok) {
+        ac->lit_owners = sectionData(bundle, first + AC_LIT_OWNERS, ac->lit_start ?
+                                     ac->lit_start[ac->num_literals] * sizeof(uint32_t) : 0, ok);
+    }
+}
+
+int daapBundleLoad(daap_bundle_t *bundle, const char *path,
+                   char *key_file, char *table_file,
+                   daap_keyset_t *keys, daap_tableset_t *tables) {
+    struct stat st;
+    header_t *h;
+    uint64_t *offsets;
+    const char *error;
+    int fd, i, ok = 1;
+
+    memset(bundle, 0, sizeof(daap_bundle_t));
+    memset(keys, 0, sizeof(daap_keyset_t));
+    memset(tables, 0, sizeof(daap_tableset_t));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        DEBUG_OUTPUT(("No template bundle %s: %s", path, strerror(errno)));
+        return DAAP_BUNDLE_ERROR;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header_t)) {
+        ERROR_OUTPUT(("Template bundle %s is too short", path));
+        close(fd);
+        return DAAP_BUNDLE_ERROR;
+    }
+    bundle->size = st.st_size;
+    bundle->map = mmap(NULL, bundle->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bundle->map == MAP_FAILED) {
+        ERROR_OUTPUT(("Failed to map template bundle %s: %s", path, strerror(errno)));
+        bundle->map = NULL;
+        return DAAP_BUNDLE_ERROR;
+    }
+
+    h = (header_t *)bundle->map;
+    if (memcmp(h->magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) != 0 ||
+        h->byte_order != BUNDLE_BYTE_ORDER || h->size != bundle->size) {
+        ERROR_OUTPUT(("%s is not a template bundle", path));
+        daapBundleClose(bundle);
+        return DAAP_BUNDLE_ERROR;
+    }
+
+    /* the recorded sources are what a stale bundle is replaced by */
+    if (!key_file[0]) {
+        snprintf(key_file, PATH_MAX, "%s", h->key_source.path);
+        if (!table_file[0]) {
+            snprintf(table_file, PATH_MAX, "%s", h->table_source.path);
+        }
+    }
+    if (h->version != BUNDLE_VERSION || h->layout != BUNDLE_LAYOUT ||
+        strncmp(h->pcre_version, pcre_version(), sizeof(h->pcre_version)) != 0 ||
+        sourceChanged(&h->key_source, key_file) ||
+        sourceChanged(&h->table_source, table_file)) {
+        daapBundleClose(bundle);
+        return DAAP_BUNDLE_STALE;
+    }
+    if (checksum((unsigned char *)bundle->map + sizeof(header_t),
+                 bundle->size - sizeof(header_t)) != h->checksum) {
+        ERROR_OUTPUT(("Template bundle %s is corrupt", path));
+        daapBundleClose(bundle);
+        return DAAP_BUNDLE_ERROR;
+    }
+
+    /* the key set */
+    keys->mapped = 1;
+    keys->num_always = h->num_always;
+    keys->units_len = h->units_len;
+    offsets = sectionData(bundle, SEC_KEY_REGEXES, h->num_regexes * sizeof(uint64_t), &ok);
+    keys->num_required = sectionData(bundle, SEC_KEY_NUM_REQUIRED,
+                                     h->num_regexes * sizeof(uint8_t), &ok);
+    keys->always = sectionData(bundle, SEC_KEY_ALWAYS, h->num_always * sizeof(int), &ok);
+    keys->type_start = sectionData(bundle, SEC_KEY_TYPE_START,
+                                   (h->num_regexes + 1) * sizeof(uint32_t), &ok);
+    if (ok) {
+        keys->types = sectionData(bundle, SEC_KEY_TYPES, keys->type_start[h->num_regexes] *
+                                  sizeof(daap_value_type_t), &ok);
+    }
+    keys->units = sectionData(bundle, SEC_KEY_UNITS, h->units_len, &ok);
+    mapAutomaton(bundle, SEC_KEY_AC, &h->key_ac, &keys->ac, &ok);
+
+    /* the table set */
+    tables->mapped = 1;
+    tables->num_tables = h->num_tables;
+    tables->num_headers = h->num_headers;
+    tables->num_vals = h->num_vals;
+    tables->pool_len = h->pool_len;
+    tables->tables = sectionData(bundle, SEC_TABLE_DEFS,
+                                 h->num_tables * sizeof(daap_table_def_t), &ok);
+    tables->headers = sectionData(bundle, SEC_TABLE_HEADERS,
+                                  h->num_headers * sizeof(daap_table_header_t), &ok);
+    tables->vals = sectionData(bundle, SEC_TABLE_VALS,
+                               h->num_vals * sizeof(daap_table_val_t), &ok);
+    tables->pool = sectionData(bundle, SEC_TABLE_POOL, h->pool_len, &ok);
+    mapAutomaton(bundle, SEC_TABLE_AC, &h->table_ac, &tables->ac, &ok);
+    if (!ok) {
+        goto corrupt;
+    }
+
+    /* the patterns are used in place; only the JIT code is generated again */
+    keys->regexes = calloc(h->num_regexes + 1, sizeof(pcre *));
+    keys->extras = calloc(h->num_regexes + 1, sizeof(pcre_extra *));
+    if (!keys->regexes || !keys->extras) {
+        ERROR_OUTPUT(("Failed to allocate the key regexes"));
+        goto corrupt;
+    }
+    for (i = 0; i < h->num_regexes; i++) {
+        if (offsets[i] % BUNDLE_ALIGN != 0 || offsets[i] >= bundle->size) {
+            goto corrupt;
+        }
+        keys->regexes[i] = (pcre *)((char *)bundle->map + offsets[i]);
+        keys->num_regexes = i + 1;
+        /* checks the pattern's magic number (the byte order is already known to match) */
+        if (pcre_pattern_to_host_byte_order(keys->regexes[i], NULL, NULL) != 0) {
+            goto corrupt;
+        }
+        keys->extras[i] = pcre_study(keys->regexes[i], PCRE_STUDY_JIT_COMPILE, &error);
+        if (error != NULL) {
+            ERROR_OUTPUT(("Failed to study regex %d: %s", i, error));
+        }
+    }
+    return DAAP_BUNDLE_OK;
+
+ corrupt:
+    ERROR_OUTPUT(("Template bundle %s is corrupt", path));
+    daapKeysetFree(keys);
+    daapTablesetFree(tables);
+    daapBundleClose(bundle);
+    return DAAP_BUNDLE_ERROR;
+}
+
+void daapBundleClose(daap_bundle_t *bundle) {
+    if (bundle->map) {
+        munmap(bundle->map, bundle->size);
+    }
+    memset(bundle, 0, sizeof(daap_bundle_t));
+}
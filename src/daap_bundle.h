@@ -0,0 +1,46 @@
+#ifndef DAAP_BUNDLE_H
+#define DAAP_BUNDLE_H
+
+/* Precompiled template bundles for the stdout parser (not part of the API).
+ *
+ * stdout_parser --compile writes the compiled key regexes, their literal
+ * prefilter automaton and the table templates' state machines into one
+ * file. At startup the file is memory-mapped and its arrays are used in
+ * place, so nothing is read line by line or compiled with pcre_compile;
+ * only the JIT code is regenerated. A bundle records the size and mtime of
+ * the template files it was built from and is ignored once they change. */
+
+#include <linux/limits.h>
+#include <stddef.h>
+
+#include "daap_match.h"
+#include "daap_table.h"
+
+/* results of daapBundleLoad */
+#define DAAP_BUNDLE_OK     0
+#define DAAP_BUNDLE_STALE  1       /* the templates changed since --compile */
+#define DAAP_BUNDLE_ERROR -1
+
+typedef struct {
+    void *map;
+    size_t size;
+} daap_bundle_t;
+
+/* Write the compiled templates to path, recording the template files they
+ * were compiled from (table_file may be empty) */
+int daapBundleWrite(const char *path, daap_keyset_t *keys,
+                    daap_tableset_t *tables, const char *key_file,
+                    const char *table_file);
+
+/* Map the bundle at path and point keys/tables at it. key_file and
+ * table_file (PATH_MAX buffers) name the template files the bundle should
+ * match; when empty they are set to the files recorded in the bundle, so
+ * that a stale bundle can be replaced by its sources. */
+int daapBundleLoad(daap_bundle_t *bundle, const char *path,
+                   char *key_file, char *table_file,
+                   daap_keyset_t *keys, daap_tableset_t *tables);
+
+/* Unmap a bundle (after freeing the key/table sets that use it) */
+void daapBundleClose(daap_bundle_t *bundle);
+
+#endif /* DAAP_BUNDLE_H */
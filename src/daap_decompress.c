@@ -0,0 +1,350 @@
+/*
+ * Streaming decompression for the stdout parser
+ *
+ * Archived results files are often stored as .gz or .zst, and used to have
+ * to be decompressed to disk before they could be parsed. Here the file is
+ * decompressed by a separate thread into two buffers that alternate
+ * between that thread and the parser: the parser matches the lines of one
+ * buffer while the next buffer is decompressed, so decompression and
+ * regex matching overlap and nothing is written to disk.
+ *
+ * Concatenated gzip members and zstd frames are read as one stream, as
+ * gzip -d and zstd -d do.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef DAAP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef DAAP_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_decompress.h"
+
+/* size of each decompressed buffer */
+#define DECOMP_BUF_SIZE (1 << 20)
+/* size of the compressed input buffer */
+#define DECOMP_IN_SIZE (1 << 18)
+
+/* results of a buffer fill */
+#define FILL_MORE 0
+#define FILL_EOF 1
+#define FILL_ERROR -1
+
+int daapDecompFormat(const unsigned char *magic, size_t len) {
+    if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return DAAP_DECOMP_GZIP;
+    }
+    if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+        magic[2] == 0x2f && magic[3] == 0xfd) {
+        return DAAP_DECOMP_ZSTD;
+    }
+    return DAAP_DECOMP_NONE;
+}
+
+const char *daapDecompName(int format) {
+    switch (format) {
+    case DAAP_DECOMP_GZIP:
+        return "gzip";
+    case DAAP_DECOMP_ZSTD:
+        return "zstd";
+    }
+    return "uncompressed";
+}
+
+#if defined(DAAP_HAVE_ZLIB) || defined(DAAP_HAVE_ZSTD)
+/* Refill the input buffer once it has been used up. Returns the number of
+ * bytes read, 0 at the end of the file, -1 on error. */
+static ssize_t readInput(daap_decomp_t *decomp) {
+    ssize_t count;
+
+    if (decomp->in_pos < decomp->in_len) {
+        return decomp->in_len - decomp->in_pos;
+    }
+    do {
+        count = read(decomp->fd, decomp->in, decomp->in_size);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        ERROR_OUTPUT(("Failed to read compressed input: %s", strerror(errno)));
+        return -1;
+    }
+    decomp->in_len = count;
+    decomp->in_pos = 0;
+    return count;
+}
+#endif
+
+/* Fill out[0, size) with decompressed data; *len is set to the number of
+ * bytes written */
+static int fillGzip(daap_decomp_t *decomp, char *out, size_t size, size_t *len) {
+#ifdef DAAP_HAVE_ZLIB
+    z_stream *z = (z_stream *)decomp->stream;
+    ssize_t count;
+    int ret, status = FILL_MORE;
+
+    z->next_out = (Bytef *)out;
+    z->avail_out = size;
+    while (z->avail_out > 0) {
+        if ((count = readInput(decomp)) < 0) {
+            status = FILL_ERROR;
+            break;
+        }
+        if (count == 0) {
+            if (decomp->frame_open) {
+                ERROR_OUTPUT(("Truncated gzip input"));
+                status = FILL_ERROR;
+            }
+            else {
+                status = FILL_EOF;
+            }
+            break;
+        }
+
+        z->next_in = (Bytef *)decomp->in + decomp->in_pos;
+        z->avail_in = decomp->in_len - decomp->in_pos;
+        ret = inflate(z, Z_NO_FLUSH);
+        decomp->in_pos = decomp->in_len - z->avail_in;
+        if (ret == Z_STREAM_END) {
+            /* another member may follow */
+            decomp->frame_open = 0;
+            inflateReset(z);
+        }
+        else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+            decomp->frame_open = 1;
+        }
+        else {
+            ERROR_OUTPUT(("Corrupt gzip input: %s", z->msg ? z->msg : "unknown error"));
+            status = FILL_ERROR;
+            break;
+        }
+    }
+    *len = size - z->avail_out;
+    return status;
+#else
+    (void)decomp;
+    (void)out;
+    (void)size;
+    *len = 0;
+    return FILL_ERROR;
+#endif
+}
+
+static int fillZstd(daap_decomp_t *decomp, char *out, size_t size, size_t *len) {
+#ifdef DAAP_HAVE_ZSTD
+    ZSTD_outBuffer output = { out, size, 0 };
+    ZSTD_inBuffer input;
+    ssize_t count;
+    size_t ret;
+    int status = FILL_MORE;
+
+    while (output.pos < output.size) {
+        if ((count = readInput(decomp)) < 0) {
+            status = FILL_ERROR;
+            break;
+        }
+        if (count == 0) {
+            if (decomp->frame_open) {
+                ERROR_OUTPUT(("Truncated zstd input"));
+                status = FILL_ERROR;
+            }
+            else {
+                status = FILL_EOF;
+            }
+            break;
+        }
+
+        input.src = decomp->in;
+        input.size = decomp->in_len;
+        input.pos = decomp->in_pos;
+        ret = ZSTD_decompressStream((ZSTD_DStream *)decomp->stream, &output, &input);
+        decomp->in_pos = input.pos;
+        if (ZSTD_isError(ret)) {
+            ERROR_OUTPUT(("Corrupt zstd input: %s", ZSTD_getErrorName(ret)));
+            status = FILL_ERROR;
+            break;
+        }
+        /* 0 means a frame was completed and flushed */
+        decomp->frame_open = ret != 0;
+    }
+    *len = output.pos;
+    return status;
+#else
+    (void)decomp;
+    (void)out;
+    (void)size;
+    *len = 0;
+    return FILL_ERROR;
+#endif
+}
+
+/* Fill the two output buffers in turn until the input ends */
+static void *decompThread(void *arg) {
+    daap_decomp_t *decomp = (daap_decomp_t *)arg;
+    size_t len;
+    int idx = 0, status;
+
+    while (1) {
+        pthread_mutex_lock(&decomp->lock);
+        while (decomp->full[idx] && !decomp->stop) {
+            pthread_cond_wait(&decomp->cond, &decomp->lock);
+        }
+        if (decomp->stop) {
+            pthread_mutex_unlock(&decomp->lock);
+            break;
+        }
+        pthread_mutex_unlock(&decomp->lock);
+
+        /* the buffer is ours until it is marked full */
+        if (decomp->format == DAAP_DECOMP_GZIP) {
+            status = fillGzip(decomp, decomp->bufs[idx], decomp->buf_size, &len);
+        }
+        else {
+            status = fillZstd(decomp, decomp->bufs[idx], decomp->buf_size, &len);
+        }
+
+        pthread_mutex_lock(&decomp->lock);
+        if (len > 0) {
+            decomp->lens[idx] = len;
+            decomp->full[idx] = 1;
+        }
+        if (status != FILL_MORE) {
+            decomp->error = status == FILL_ERROR;
+            decomp->done = 1;
+        }
+        pthread_cond_broadcast(&decomp->cond);
+        pthread_mutex_unlock(&decomp->lock);
+
+        if (status != FILL_MORE) {
+            break;
+        }
+        idx ^= 1;
+    }
+    return NULL;
+}
+
+/* Free the decompression state (the thread must not be running) */
+static void freeDecomp(daap_decomp_t *decomp) {
+#ifdef DAAP_HAVE_ZLIB
+    if (decomp->format == DAAP_DECOMP_GZIP && decomp->stream) {
+        inflateEnd((z_stream *)decomp->stream);
+        free(decomp->stream);
+    }
+#endif
+#ifdef DAAP_HAVE_ZSTD
+    if (decomp->format == DAAP_DECOMP_ZSTD && decomp->stream) {
+        ZSTD_freeDStream((ZSTD_DStream *)decomp->stream);
+    }
+#endif
+    decomp->stream = NULL;
+    free(decomp->in);
+    free(decomp->bufs[0]);
+    free(decomp->bufs[1]);
+    decomp->in = decomp->bufs[0] = decomp->bufs[1] = NULL;
+}
+
+int daapDecompStart(daap_decomp_t *decomp, int fd, int format,
+                    const char *prefix, size_t prefix_len) {
+    memset(decomp, 0, sizeof(daap_decomp_t));
+    decomp->fd = fd;
+    decomp->format = format;
+
+    switch (format) {
+#ifdef DAAP_HAVE_ZLIB
+    case DAAP_DECOMP_GZIP:
+        decomp->stream = calloc(1, sizeof(z_stream));
+        /* 15 + 16: a gzip wrapper with the largest window */
+        if (decomp->stream && inflateInit2((z_stream *)decomp->stream, 15 + 16) != Z_OK) {
+            free(decomp->stream);
+            decomp->stream = NULL;
+        }
+        break;
+#endif
+#ifdef DAAP_HAVE_ZSTD
+    case DAAP_DECOMP_ZSTD:
+        decomp->stream = ZSTD_createDStream();
+        if (decomp->stream) {
+            ZSTD_initDStream((ZSTD_DStream *)decomp->stream);
+        }
+        break;
+#endif
+    default:
+        ERROR_OUTPUT(("stdout_parser was built without %s support",
+                      daapDecompName(format)));
+        return -1;
+    }
+
+    decomp->in_size = prefix_len > DECOMP_IN_SIZE ? prefix_len : DECOMP_IN_SIZE;
+    decomp->in = malloc(decomp->in_size);
+    decomp->buf_size = DECOMP_BUF_SIZE;
+    decomp->bufs[0] = malloc(decomp->buf_size);
+    decomp->bufs[1] = malloc(decomp->buf_size);
+    if (!decomp->stream || !decomp->in || !decomp->bufs[0] || !decomp->bufs[1]) {
+        ERROR_OUTPUT(("Failed to allocate %s decompression", daapDecompName(format)));
+        freeDecomp(decomp);
+        return -1;
+    }
+    /* the bytes read to find the format are the start of the input */
+    memcpy(decomp->in, prefix, prefix_len);
+    decomp->in_len = prefix_len;
+
+    pthread_mutex_init(&decomp->lock, NULL);
+    pthread_cond_init(&decomp->cond, NULL);
+    if (pthread_create(&decomp->thread, NULL, decompThread, decomp) != 0) {
+        ERROR_OUTPUT(("Failed to start the decompression thread"));
+        pthread_mutex_destroy(&decomp->lock);
+        pthread_cond_destroy(&decomp->cond);
+        freeDecomp(decomp);
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t daapDecompRead(daap_decomp_t *decomp, char *dst, size_t len) {
+    size_t count;
+
+    pthread_mutex_lock(&decomp->lock);
+    /* hand a used up buffer back and move on to the other one */
+    if (decomp->held && decomp->pos == decomp->lens[decomp->cur]) {
+        decomp->full[decomp->cur] = 0;
+        decomp->held = 0;
+        decomp->cur ^= 1;
+        decomp->pos = 0;
+        pthread_cond_broadcast(&decomp->cond);
+    }
+    if (!decomp->held) {
+        while (!decomp->full[decomp->cur] && !decomp->done) {
+            pthread_cond_wait(&decomp->cond, &decomp->lock);
+        }
+        if (!decomp->full[decomp->cur]) {
+            pthread_mutex_unlock(&decomp->lock);
+            return decomp->error ? -1 : 0;
+        }
+        decomp->held = 1;
+    }
+    pthread_mutex_unlock(&decomp->lock);
+
+    count = decomp->lens[decomp->cur] - decomp->pos;
+    if (count > len) {
+        count = len;
+    }
+    memcpy(dst, decomp->bufs[decomp->cur] + decomp->pos, count);
+    decomp->pos += count;
+    return count;
+}
+
+void daapDecompStop(daap_decomp_t *decomp) {
+    pthread_mutex_lock(&decomp->lock);
+    decomp->stop = 1;
+    pthread_cond_broadcast(&decomp->cond);
+    pthread_mutex_unlock(&decomp->lock);
+    pthread_join(decomp->thread, NULL);
+
+    pthread_mutex_destroy(&decomp->lock);
+    pthread_cond_destroy(&decomp->cond);
+    freeDecomp(decomp);
+}
@@ -0,0 +1,65 @@
+#ifndef DAAP_DECOMPRESS_H
+#define DAAP_DECOMPRESS_H
+
+/* Streaming decompression of results files for the stdout parser (not part
+ * of the API).
+ *
+ * A compressed file is recognized by its magic bytes and decompressed by a
+ * thread of its own into two output buffers: while the parser matches the
+ * lines of one buffer, the next one is being filled. gzip needs zlib and
+ * zstd needs libzstd at build time (DAAP_HAVE_ZLIB/DAAP_HAVE_ZSTD). */
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#define DAAP_DECOMP_NONE 0
+#define DAAP_DECOMP_GZIP 1
+#define DAAP_DECOMP_ZSTD 2
+
+/* longest magic number looked at by daapDecompFormat */
+#define DAAP_DECOMP_MAGIC_LEN 4
+
+typedef struct {
+    int fd;
+    int format;
+    void *stream;                  /* z_stream or ZSTD_DStream */
+    char *in;                      /* compressed input */
+    size_t in_size;
+    char *bufs[2];                 /* decompressed output */
+    size_t buf_size;
+    size_t lens[2];
+    int full[2];                   /* buffer waiting to be read */
+    int done;                      /* no more buffers will be filled */
+    int error;
+    int stop;
+    int cur;                       /* buffer being read */
+    int held;                      /* bufs[cur] belongs to the reader */
+    size_t pos;                    /* read position in bufs[cur] */
+    size_t in_len;                 /* bytes in in */
+    size_t in_pos;                 /* bytes of in used */
+    int frame_open;                /* inside a gzip member/zstd frame */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} daap_decomp_t;
+
+/* Returns the DAAP_DECOMP_* format of data starting with magic[0, len) */
+int daapDecompFormat(const unsigned char *magic, size_t len);
+
+/* Name of a format, for messages */
+const char *daapDecompName(int format);
+
+/* Start decompressing fd in the background. prefix[0, prefix_len) holds the
+ * bytes already read from fd (the magic number), if any. Returns -1 if the
+ * format was not built in or resources are missing. */
+int daapDecompStart(daap_decomp_t *decomp, int fd, int format,
+                    const char *prefix, size_t prefix_len);
+
+/* Copy up to len decompressed bytes to dst. Returns the number of bytes,
+ * 0 at the end of the data, or -1 if the input is corrupt. */
+ssize_t daapDecompRead(daap_decomp_t *decomp, char *dst, size_t len);
+
+/* Stop the decompression thread and free everything */
+void daapDecompStop(daap_decomp_t *decomp);
+
+#endif /* DAAP_DECOMPRESS_H */
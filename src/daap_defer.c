@@ -0,0 +1,865 @@
+/*
+ * Data Analytics Application Profiling API
+ *
+ * Deferred formatting
+ *
+ * Formatting a message with vsnprintf() is most of what daapLogWrite()
+ * costs the thread that logs. DAAP_LOG_DEFERRED() (and DAAP_LOG() when
+ * DAAP_LOG_DEFER is defined) instead keeps a site per call site, whose
+ * format string is parsed once, at its first call, into the types of its
+ * arguments and one piece of format per conversion. A call then only
+ * copies the site id, a timestamp and the raw arguments (strings copied
+ * whole) into a buffer of the calling thread, without taking a lock. A
+ * thread started with the first site formats the buffers of all threads
+ * every DEFER_PERIOD_MS, piece by piece with snprintf(), and sends the
+ * messages as records with the time of their call; daapFinalize() sends
+ * the rest.
+ *
+ * The buffer of a thread is a ring with one writer (the thread) and one
+ * reader (the formatting thread, or daapFinalize() once that has stopped).
+ * defer_mutex only guards the lists of sites and threads: the records are
+ * formatted and sent without it, so that a first call, which takes it,
+ * does not wait for a slow connection. A call falls back to
+ * formatting right away, as daapLogWrite() does, when its format cannot be
+ * deferred (%n, %m, positional or wide arguments), when a site is called
+ * with another format than its first one, or when the ring is full.
+ */
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+
+/* bytes of the ring of each thread that logs deferred; a power of 2 */
+#define DEFER_BUFFER_SIZE (1 << 20)
+/* call sites known at once; later ones format right away */
+#define DEFER_SITES_MAX 4096
+/* conversions of a format */
+#define DEFER_ARGS_MAX 64
+#define DEFER_PERIOD_MS 100
+/* arguments are stored in multiples of 8 bytes, and entries in multiples
+ * of their header, so that the end of the ring always holds a header */
+#define DEFER_ALIGN 8
+
+#define ALIGN_UP(n) (((n) + DEFER_ALIGN - 1) & ~(size_t)(DEFER_ALIGN - 1))
+#define ENTRY_ALIGN_UP(n) (((n) + sizeof(entry_t) - 1) & ~(sizeof(entry_t) - 1))
+
+/* how an argument is read from the call's arguments; all but strings and
+ * long doubles are stored in 8 bytes */
+typedef enum {
+    CAPTURE_INT,
+    CAPTURE_UINT,
+    CAPTURE_SCHAR,
+    CAPTURE_UCHAR,
+    CAPTURE_SHORT,
+    CAPTURE_USHORT,
+    CAPTURE_LONG,
+    CAPTURE_ULONG,
+    CAPTURE_LLONG,
+    CAPTURE_INTMAX,
+    CAPTURE_SIZE,
+    CAPTURE_PTRDIFF,
+    CAPTURE_DOUBLE,
+    CAPTURE_LDOUBLE,
+    CAPTURE_STRING,
+    CAPTURE_POINTER
+} capture_t;
+
+/* how the value of a piece is passed to snprintf() */
+typedef enum {
+    PIECE_TEXT,     /* no value */
+    PIECE_LLONG,    /* integer conversions, rewritten to take a long long */
+    PIECE_INT,      /* %c */
+    PIECE_DOUBLE,
+    PIECE_LDOUBLE,
+    PIECE_STRING,
+    PIECE_POINTER
+} piece_kind_t;
+
+/* text of the format up to and including one conversion */
+typedef struct {
+    char *format;
+    piece_kind_t kind;
+    /* width and precision given as arguments ('*') */
+    int stars;
+    /* precision of a %s given in the format, or -1, or given by the
+     * star before the value */
+    int precision;
+    bool precision_star;
+} piece_t;
+
+typedef struct {
+    const char *format;
+    int num_args;
+    capture_t args[DEFER_ARGS_MAX];
+    /* the last piece may be text alone */
+    int num_pieces;
+    piece_t pieces[DEFER_ARGS_MAX + 1];
+    /* bytes of an entry without its strings */
+    size_t fixed_size;
+    bool has_strings;
+} site_info_t;
+
+/* an entry of a ring, followed by the arguments; site 0 fills the end of
+ * the ring that was too short for the next entry */
+typedef struct {
+    uint32_t site;
+    uint32_t size;
+    uint64_t time_ns;
+} entry_t;
+
+typedef struct defer_thread {
+    char *buf;
+    /* bytes written and read since the thread started logging; each on its
+     * own cache line, and the writer's copy of the reader's position */
+    _Alignas(64) atomic_size_t head;
+    size_t tail_seen;
+    /* the formatting thread was woken, and has not drained the ring since */
+    atomic_bool woken;
+    /* a call is between its check of defer_stopped and its entry */
+    atomic_bool writing;
+    _Alignas(64) atomic_size_t tail;
+    atomic_bool exited;
+    /* the thread had exited before its ring was last drained (reader's) */
+    bool drained;
+    struct defer_thread *next;
+} defer_thread_t;
+
+static pthread_mutex_t defer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defer_cond = PTHREAD_COND_INITIALIZER;
+static site_info_t *sites[DEFER_SITES_MAX];
+static int num_sites = 0;
+static defer_thread_t *threads = NULL;
+static pthread_t defer_thread;
+static bool defer_running = false;
+static bool defer_stop = false;
+/* set by daapFinalize(), after which calls format right away */
+static atomic_bool defer_stopped = false;
+static bool sites_full_reported = false;
+
+static __thread defer_thread_t *self = NULL;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+/* Parses format into site; returns 0, or -1 if it cannot be deferred */
+static int parseFormat(site_info_t *site, const char *format) {
+    const char *start = format, *p = format;
+    piece_t *piece;
+    capture_t capture;
+    char length[3];
+    int stars, precision;
+    bool precision_star;
+    size_t len;
+
+    site->format = format;
+    site->fixed_size = sizeof(entry_t);
+    while (*p != '\0') {
+        if (*p != '%') {
+            p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+        /* flags, width and precision */
+        p++;
+        stars = 0;
+        precision = -1;
+        precision_star = false;
+        p += strspn(p, "-+ #0'I");
+        if (*p == '*') {
+            stars++;
+            p++;
+        }
+        p += strspn(p, "0123456789");
+        if (*p == '.') {
+            p++;
+            if (*p == '*') {
+                stars++;
+                precision_star = true;
+                p++;
+            }
+            else {
+                precision = (int)strtol(p, NULL, 10);
+                p += strspn(p, "0123456789");
+            }
+        }
+        if (*p == '$' || site->num_args + stars + 1 > DEFER_ARGS_MAX) {
+            return -1;
+        }
+
+        memset(length, 0, sizeof(length));
+        len = strspn(p, "hlLqjzt");
+        if (len > 2) {
+            return -1;
+        }
+        memcpy(length, p, len);
+        p += len;
+
+        piece = &site->pieces[site->num_pieces];
+        piece->stars = stars;
+        piece->precision = -1;
+        switch (*p) {
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X': {
+            bool is_signed = *p == 'd' || *p == 'i';
+
+            piece->kind = PIECE_LLONG;
+            if (length[0] == '\0') {
+                capture = is_signed ? CAPTURE_INT : CAPTURE_UINT;
+            }
+            else if (strcmp(length, "hh") == 0) {
+                capture = is_signed ? CAPTURE_SCHAR : CAPTURE_UCHAR;
+            }
+            else if (strcmp(length, "h") == 0) {
+                capture = is_signed ? CAPTURE_SHORT : CAPTURE_USHORT;
+            }
+            else if (strcmp(length, "l") == 0) {
+                capture = is_signed ? CAPTURE_LONG : CAPTURE_ULONG;
+            }
+            else if (strcmp(length, "ll") == 0 || strcmp(length, "q") == 0) {
+                capture = CAPTURE_LLONG;
+            }
+            else if (strcmp(length, "j") == 0) {
+                capture = CAPTURE_INTMAX;
+            }
+            else if (strcmp(length, "z") == 0) {
+                capture = CAPTURE_SIZE;
+            }
+            else if (strcmp(length, "t") == 0) {
+                capture = CAPTURE_PTRDIFF;
+            }
+            else {
+                return -1;
+            }
+            break;
+        }
+        case 'c':
+            if (length[0] != '\0') {
+                return -1;
+            }
+            piece->kind = PIECE_INT;
+            capture = CAPTURE_INT;
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (strcmp(length, "L") == 0) {
+                piece->kind = PIECE_LDOUBLE;
+                capture = CAPTURE_LDOUBLE;
+            }
+            else if (length[0] == '\0' || strcmp(length, "l") == 0) {
+                piece->kind = PIECE_DOUBLE;
+                capture = CAPTURE_DOUBLE;
+            }
+            else {
+                return -1;
+            }
+            break;
+        case 's':
+            if (length[0] != '\0') {
+                return -1;
+            }
+            piece->kind = PIECE_STRING;
+            piece->precision = precision;
+            piece->precision_star = precision_star;
+            capture = CAPTURE_STRING;
+            site->has_strings = true;
+            break;
+        case 'p':
+            piece->kind = PIECE_POINTER;
+            capture = CAPTURE_POINTER;
+            break;
+        default:
+            /* %n, %m, wide characters, or not a conversion */
+            return -1;
+        }
+
+        /* the piece's text, with the length of an integer conversion
+         * replaced by ll */
+        len = p - start - strlen(length);
+        piece->format = malloc(len + 4);
+        if (piece->format == NULL) {
+            return -1;
+        }
+        memcpy(piece->format, start, len);
+        if (piece->kind == PIECE_LLONG) {
+            memcpy(piece->format + len, "ll", 2);
+            len += 2;
+        }
+        else {
+            memcpy(piece->format + len, length, strlen(length));
+            len += strlen(length);
+        }
+        piece->format[len++] = *p;
+        piece->format[len] = '\0';
+        site->num_pieces++;
+
+        while (stars-- > 0) {
+            site->args[site->num_args++] = CAPTURE_INT;
+            site->fixed_size += sizeof(int64_t);
+        }
+        site->args[site->num_args++] = capture;
+        site->fixed_size += capture == CAPTURE_LDOUBLE ? ALIGN_UP(sizeof(long double)) :
+                                                         sizeof(int64_t);
+        start = ++p;
+    }
+
+    /* the text after the last conversion */
+    if (*start != '\0') {
+        piece = &site->pieces[site->num_pieces];
+        piece->kind = PIECE_TEXT;
+        piece->format = strdup(start);
+        if (piece->format == NULL) {
+            return -1;
+        }
+        site->num_pieces++;
+    }
+    return 0;
+}
+
+static void freeSite(site_info_t *site) {
+    int i;
+
+    for (i = 0; i < site->num_pieces; i++) {
+        free(site->pieces[i].format);
+    }
+    free(site);
+}
+
+/* Formats the arguments of an entry of site into out */
+static void formatEntry(const site_info_t *site, const char *args, char *out, size_t size) {
+    const piece_t *piece;
+    size_t len = 0;
+    int star[2], i, n = 0;
+    int64_t value;
+    const char *str;
+    uint32_t str_len;
+    long double ldouble;
+    double dbl;
+    void *ptr;
+
+#define PIECE_PRINT(val)                                                       \
+    (piece->stars == 0 ? snprintf(out + len, size - len, piece->format, val) : \
+     piece->stars == 1 ? snprintf(out + len, size - len, piece->format, star[0], val) : \
+                         snprintf(out + len, size - len, piece->format, star[0], star[1], val))
+
+    out[0] = '\0';
+    for (i = 0; i < site->num_pieces && len < size - 1; i++) {
+        piece = &site->pieces[i];
+        for (n = 0; n < piece->stars; n++) {
+            memcpy(&value, args, sizeof(value));
+            star[n] = (int)value;
+            args += sizeof(value);
+        }
+        switch (piece->kind) {
+        case PIECE_TEXT:
+            n = snprintf(out + len, size - len, piece->format, 0);
+            break;
+        case PIECE_LLONG:
+            memcpy(&value, args, sizeof(value));
+            args += sizeof(value);
+            n = PIECE_PRINT((long long)value);
+            break;
+        case PIECE_INT:
+            memcpy(&value, args, sizeof(value));
+            args += sizeof(value);
+            n = PIECE_PRINT((int)value);
+            break;
+        case PIECE_DOUBLE:
+            memcpy(&dbl, args, sizeof(dbl));
+            args += sizeof(dbl);
+            n = PIECE_PRINT(dbl);
+            break;
+        case PIECE_LDOUBLE:
+            memcpy(&ldouble, args, sizeof(ldouble));
+            args += ALIGN_UP(sizeof(ldouble));
+            n = PIECE_PRINT(ldouble);
+            break;
+        case PIECE_STRING:
+            /* the length, UINT32_MAX for a NULL pointer, then the bytes */
+            memcpy(&str_len, args, sizeof(str_len));
+            str = str_len == UINT32_MAX ? NULL : args + sizeof(int64_t);
+            args += sizeof(int64_t) + (str ? ALIGN_UP(str_len + 1) : 0);
+            n = PIECE_PRINT(str);
+            break;
+        case PIECE_POINTER:
+            memcpy(&ptr, args, sizeof(ptr));
+            args += sizeof(int64_t);
+            n = PIECE_PRINT(ptr);
+            break;
+        }
+        if (n > 0) {
+            len += (size_t)n < size - len ? (size_t)n : size - len - 1;
+        }
+    }
+#undef PIECE_PRINT
+}
+
+/* Sends the entries of a thread's ring. Called by the reader only. */
+static void drainThread(defer_thread_t *thread) {
+    size_t tail = atomic_load_explicit(&thread->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&thread->head, memory_order_acquire);
+    char message[DAAP_MAX_MSG_LEN + 1];
+    const entry_t *entry;
+    field_t field;
+
+    memset(&field, 0, sizeof(field));
+    field.field_name = MSG_KEY;
+    field.field_val = message;
+    while (tail != head) {
+        entry = (const entry_t *)(thread->buf + (tail & (DEFER_BUFFER_SIZE - 1)));
+        if (entry->site != 0) {
+            formatEntry(sites[entry->site - 1], (const char *)(entry + 1), message,
+                        sizeof(message));
+            daapLogFieldsAt((long)(entry->time_ns / 1000000), 0, NULL, 1, &field);
+        }
+        tail += entry->size;
+    }
+    atomic_store_explicit(&thread->tail, tail, memory_order_release);
+    atomic_store_explicit(&thread->woken, false, memory_order_relaxed);
+}
+
+/* Sends what every thread logged, and frees the state of threads that
+ * exited. Called by the reader only, without defer_mutex: new threads are
+ * only put at the head of the list, and only the reader removes any. */
+static void drainAll(void) {
+    defer_thread_t **link, *thread;
+    bool sent = false;
+
+    pthread_mutex_lock(&defer_mutex);
+    thread = threads;
+    pthread_mutex_unlock(&defer_mutex);
+
+    for (; thread != NULL; thread = thread->next) {
+        /* an exited thread logs no more, so what it wrote is all there is */
+        thread->drained = atomic_load_explicit(&thread->exited, memory_order_acquire);
+
+        if (atomic_load_explicit(&thread->head, memory_order_acquire) !=
+            atomic_load_explicit(&thread->tail, memory_order_relaxed)) {
+            drainThread(thread);
+            sent = true;
+        }
+    }
+    if (sent) {
+        daapLogFlush();
+    }
+
+    pthread_mutex_lock(&defer_mutex);
+    link = &threads;
+    while ((thread = *link) != NULL) {
+        if (thread->drained) {
+            *link = thread->next;
+            free(thread->buf);
+            free(thread);
+        }
+        else {
+            link = &thread->next;
+        }
+    }
+    pthread_mutex_unlock(&defer_mutex);
+}
+
+static void *deferMain(void *arg) {
+    struct timespec deadline;
+
+    (void)arg;
+    pthread_mutex_lock(&defer_mutex);
+    while (!defer_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += DEFER_PERIOD_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        /* woken early by a thread whose ring is half full */
+        if (!defer_stop) {
+            pthread_cond_timedwait(&defer_cond, &defer_mutex, &deadline);
+        }
+        pthread_mutex_unlock(&defer_mutex);
+        drainAll();
+        pthread_mutex_lock(&defer_mutex);
+    }
+    pthread_mutex_unlock(&defer_mutex);
+    return NULL;
+}
+
+/* Marks the state of an exiting thread, which the next drain frees */
+static void threadExited(void *arg) {
+    defer_thread_t *thread = arg;
+
+    self = NULL;
+    atomic_store_explicit(&thread->exited, true, memory_order_release);
+}
+
+static void createThreadKey(void) {
+    pthread_key_create(&thread_key, threadExited);
+}
+
+/* The calling thread's ring, made at its first deferred call */
+static defer_thread_t *threadState(void) {
+    defer_thread_t *thread;
+
+    if (self != NULL) {
+        return self;
+    }
+    thread = aligned_alloc(64, sizeof(*thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    memset(thread, 0, sizeof(*thread));
+    thread->buf = malloc(DEFER_BUFFER_SIZE);
+    if (thread->buf == NULL) {
+        free(thread);
+        return NULL;
+    }
+    pthread_once(&thread_key_once, createThreadKey);
+    pthread_setspecific(thread_key, thread);
+
+    pthread_mutex_lock(&defer_mutex);
+    thread->next = threads;
+    threads = thread;
+    pthread_mutex_unlock(&defer_mutex);
+    self = thread;
+    return thread;
+}
+
+/* Registers a call site at its first call, starting the formatting thread
+ * with the first one; returns its id, or -1 if its calls format right away */
+static int registerSite(daap_log_site_t *site, const char *format) {
+    site_info_t *info;
+    int id;
+
+    pthread_mutex_lock(&defer_mutex);
+    id = __atomic_load_n(&site->id, __ATOMIC_RELAXED);
+    if (id != 0) {
+        pthread_mutex_unlock(&defer_mutex);
+        return id;
+    }
+    id = -1;
+    if (atomic_load(&defer_stopped)) {
+        pthread_mutex_unlock(&defer_mutex);
+        return id;
+    }
+    if (!defer_running) {
+        defer_stop = false;
+        if (pthread_create(&defer_thread, NULL, deferMain, NULL) != 0) {
+            ERROR_OUTPUT(("Failed to start the thread of deferred formatting"));
+            pthread_mutex_unlock(&defer_mutex);
+            return id;
+        }
+        defer_running = true;
+    }
+
+    if (num_sites == DEFER_SITES_MAX) {
+        if (!sites_full_reported) {
+            ERROR_OUTPUT(("More than %d deferred log sites, formatting the others right away",
+                          DEFER_SITES_MAX));
+            sites_full_reported = true;
+        }
+    }
+    else if ((info = calloc(1, sizeof(*info))) != NULL) {
+        if (parseFormat(info, format) == 0) {
+            sites[num_sites++] = info;
+            id = num_sites;
+        }
+        else {
+            DEBUG_OUTPUT(("Format \"%s\" cannot be deferred", format));
+            freeSite(info);
+        }
+    }
+    __atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&defer_mutex);
+    return id;
+}
+
+/* Bytes of a %s argument that are printed: up to its precision, if any */
+static size_t stringLength(const piece_t *piece, const char *str, int star) {
+    if (piece->precision_star) {
+        return star >= 0 ? strnlen(str, (size_t)star) : strlen(str);
+    }
+    return piece->precision >= 0 ? strnlen(str, (size_t)piece->precision) : strlen(str);
+}
+
+/* Copies the arguments of a call into its entry */
+static void captureArgs(const site_info_t *site, char *out, va_list args) {
+    const piece_t *piece = site->pieces;
+    int64_t value = 0;
+    const char *str;
+    long double ldouble;
+    double dbl;
+    void *ptr;
+    size_t len;
+    int i, star = -1;
+
+    for (i = 0; i < site->num_args; i++) {
+        switch (site->args[i]) {
+        case CAPTURE_INT:
+            value = va_arg(args, int);
+            break;
+        case CAPTURE_UINT:
+            value = va_arg(args, unsigned int);
+            break;
+        case CAPTURE_SCHAR:
+            value = (signed char)va_arg(args, int);
+            break;
+        case CAPTURE_UCHAR:
+            value = (unsigned char)va_arg(args, int);
+            break;
+        case CAPTURE_SHORT:
+            value = (short)va_arg(args, int);
+            break;
+        case CAPTURE_USHORT:
+            value = (unsigned short)va_arg(args, int);
+            break;
+        case CAPTURE_LONG:
+            value = va_arg(args, long);
+            break;
+        case CAPTURE_ULONG:
+            value = (int64_t)va_arg(args, unsigned long);
+            break;
+        case CAPTURE_LLONG:
+            value = va_arg(args, long long);
+            break;
+        case CAPTURE_INTMAX:
+            value = va_arg(args, intmax_t);
+            break;
+        case CAPTURE_SIZE:
+            value = (int64_t)va_arg(args, size_t);
+            break;
+        case CAPTURE_PTRDIFF:
+            value = va_arg(args, ptrdiff_t);
+            break;
+        case CAPTURE_DOUBLE:
+            dbl = va_arg(args, double);
+            memcpy(out, &dbl, sizeof(dbl));
+            out += sizeof(int64_t);
+            continue;
+        case CAPTURE_LDOUBLE:
+            ldouble = va_arg(args, long double);
+            memcpy(out, &ldouble, sizeof(ldouble));
+            out += ALIGN_UP(sizeof(ldouble));
+            continue;
+        case CAPTURE_STRING:
+            /* the piece, for its precision */
+            while (piece->kind != PIECE_STRING) {
+                piece++;
+            }
+            str = va_arg(args, const char *);
+            if (str == NULL) {
+                memcpy(out, &(uint32_t){ UINT32_MAX }, sizeof(uint32_t));
+                out += sizeof(int64_t);
+            }
+            else {
+                len = stringLength(piece, str, star);
+                memcpy(out, &(uint32_t){ (uint32_t)len }, sizeof(uint32_t));
+                out += sizeof(int64_t);
+                memcpy(out, str, len);
+                out[len] = '\0';
+                out += ALIGN_UP(len + 1);
+            }
+            piece++;
+            continue;
+        case CAPTURE_POINTER:
+            ptr = va_arg(args, void *);
+            memcpy(out, &ptr, sizeof(ptr));
+            out += sizeof(int64_t);
+            continue;
+        }
+        star = (int)value;
+        memcpy(out, &value, sizeof(value));
+        out += sizeof(value);
+    }
+}
+
+/* Bytes of the strings of a call's entry */
+static size_t stringsSize(const site_info_t *site, va_list args) {
+    const piece_t *piece = site->pieces;
+    const char *str;
+    size_t size = 0, len;
+    int i, star = -1;
+
+    for (i = 0; i < site->num_args; i++) {
+        switch (site->args[i]) {
+        case CAPTURE_DOUBLE:
+            (void)va_arg(args, double);
+            break;
+        case CAPTURE_LDOUBLE:
+            (void)va_arg(args, long double);
+            break;
+        case CAPTURE_STRING:
+            while (piece->kind != PIECE_STRING) {
+                piece++;
+            }
+            str = va_arg(args, const char *);
+            if (str != NULL) {
+                len = stringLength(piece, str, star);
+                size += ALIGN_UP(len + 1);
+            }
+            piece++;
+            break;
+        case CAPTURE_POINTER:
+            (void)va_arg(args, void *);
+            break;
+        case CAPTURE_LONG:
+        case CAPTURE_ULONG:
+            (void)va_arg(args, long);
+            break;
+        case CAPTURE_LLONG:
+        case CAPTURE_INTMAX:
+            (void)va_arg(args, long long);
+            break;
+        case CAPTURE_SIZE:
+            (void)va_arg(args, size_t);
+            break;
+        case CAPTURE_PTRDIFF:
+            (void)va_arg(args, ptrdiff_t);
+            break;
+        default:
+            star = va_arg(args, int);
+            break;
+        }
+    }
+    return size;
+}
+
+/* Formats a call right away and sends it as daapLogWrite() does */
+static int writeNow(const char *format, va_list args) {
+    char message[DAAP_MAX_MSG_LEN + 1];
+
+    vsnprintf(message, sizeof(message), format, args);
+    return daapLogWrite("%s", message);
+}
+
+int daapLogDeferred(daap_log_site_t *site, const char *format, ...) {
+    const site_info_t *info;
+    defer_thread_t *thread;
+    struct timespec now;
+    entry_t *entry;
+    size_t size, head, pos, skip;
+    va_list args, copy;
+    int id, ret_val;
+
+    if (!daapInit_called) {
+        errno = EPERM;
+        return DAAP_ERROR;
+    }
+
+    va_start(args, format);
+    id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+    if (id == 0) {
+        id = registerSite(site, format);
+    }
+    if (id < 0 || (info = sites[id - 1])->format != format ||
+        atomic_load_explicit(&defer_stopped, memory_order_relaxed) ||
+        (thread = threadState()) == NULL) {
+        goto now;
+    }
+    /* said before defer_stopped is read again, so that daapDeferStop()
+     * either is seen here or waits for this entry before its last drain */
+    atomic_store(&thread->writing, true);
+    if (atomic_load(&defer_stopped)) {
+        goto not_written;
+    }
+
+    size = info->fixed_size;
+    if (info->has_strings) {
+        va_copy(copy, args);
+        size += stringsSize(info, copy);
+        va_end(copy);
+    }
+    size = ENTRY_ALIGN_UP(size);
+    if (size > DEFER_BUFFER_SIZE / 4) {
+        goto not_written;
+    }
+
+    /* an entry does not wrap around the end of the ring; the end is
+     * skipped with an empty entry when too short for it */
+    head = atomic_load_explicit(&thread->head, memory_order_relaxed);
+    pos = head & (DEFER_BUFFER_SIZE - 1);
+    skip = DEFER_BUFFER_SIZE - pos < size ? DEFER_BUFFER_SIZE - pos : 0;
+    if (head + skip + size - thread->tail_seen > DEFER_BUFFER_SIZE) {
+        thread->tail_seen = atomic_load_explicit(&thread->tail, memory_order_acquire);
+        if (head + skip + size - thread->tail_seen > DEFER_BUFFER_SIZE) {
+            goto not_written;
+        }
+    }
+    if (skip > 0) {
+        entry = (entry_t *)(thread->buf + pos);
+        entry->site = 0;
+        entry->size = (uint32_t)skip;
+        head += skip;
+        pos = 0;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    entry = (entry_t *)(thread->buf + pos);
+    entry->site = (uint32_t)id;
+    entry->size = (uint32_t)size;
+    entry->time_ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+    captureArgs(info, (char *)(entry + 1), args);
+    va_end(args);
+    atomic_store_explicit(&thread->head, head + size, memory_order_release);
+    atomic_store_explicit(&thread->writing, false, memory_order_release);
+    if (head + size - thread->tail_seen > DEFER_BUFFER_SIZE / 2 &&
+        !atomic_load_explicit(&thread->woken, memory_order_relaxed)) {
+        thread->tail_seen = atomic_load_explicit(&thread->tail, memory_order_acquire);
+        if (head + size - thread->tail_seen > DEFER_BUFFER_SIZE / 2) {
+            atomic_store_explicit(&thread->woken, true, memory_order_relaxed);
+            pthread_cond_signal(&defer_cond);
+        }
+    }
+    return DAAP_SUCCESS;
+
+ not_written:
+    atomic_store_explicit(&thread->writing, false, memory_order_release);
+ now:
+    ret_val = writeNow(format, args);
+    va_end(args);
+    return ret_val;
+}
+
+/* Stops the formatting thread and sends what is left; called by
+ * daapFinalize(). Later calls format right away. */
+void daapDeferStop(void) {
+    defer_thread_t *thread;
+
+    pthread_mutex_lock(&defer_mutex);
+    atomic_store(&defer_stopped, true);
+    if (!defer_running) {
+        pthread_mutex_unlock(&defer_mutex);
+        return;
+    }
+    defer_stop = true;
+    pthread_cond_signal(&defer_cond);
+    pthread_mutex_unlock(&defer_mutex);
+    pthread_join(defer_thread, NULL);
+
+    /* calls that read defer_stopped before it was set finish their entry,
+     * which the last drain then sends */
+    pthread_mutex_lock(&defer_mutex);
+    for (thread = threads; thread != NULL; thread = thread->next) {
+        while (atomic_load(&thread->writing)) {
+            sched_yield();
+        }
+    }
+    pthread_mutex_unlock(&defer_mutex);
+    drainAll();
+
+    pthread_mutex_lock(&defer_mutex);
+    defer_running = false;
+    pthread_mutex_unlock(&defer_mutex);
+}
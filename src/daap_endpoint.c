@@ -0,0 +1,309 @@
+/*
+ * Endpoints of the TCP transport
+ *
+ * Records used to go to one server, 127.0.0.1:5555, hard-coded. The list of
+ * servers now comes from DAAP_ENDPOINTS ("host:port" entries separated by
+ * commas or blanks) or from the file named by DAAP_ENDPOINTS_FILE (one
+ * entry per line, '#' starts a comment), so that ranks can send straight to
+ * the aggregators telegraf_run.sh sets up instead of all going through one
+ * listener. The port defaults to 5555; IPv6 addresses are written [addr]:port.
+ *
+ * Each endpoint has a number of points on a hash ring, and a key is owned by
+ * the endpoint of the first point at or after its hash. With DAAP_SHARD_BY
+ * set to "rank" (the default) the key is the MPI rank, and each process
+ * keeps a single connection; with "metric" it is the series of each record
+ * (its measurement and tags), so that a series always reaches the same
+ * aggregator, and a process connects to every endpoint its series land on.
+ * Adding or removing an endpoint only moves the keys next to its points.
+ *
+ * An endpoint that cannot be connected to or written to is skipped for a
+ * second, doubling up to half a minute while it keeps failing, and its keys
+ * go to the next endpoint on the ring meanwhile. While every endpoint is
+ * skipped, none is connected to: a connect to a server that is down can
+ * take CONNECT_TIMEOUT_MS, which each record would otherwise wait for.
+ */
+
+#include <time.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_endpoint.h"
+
+#define ENDPOINTS_ENVVAR "DAAP_ENDPOINTS"
+#define ENDPOINTS_FILE_ENVVAR "DAAP_ENDPOINTS_FILE"
+#define SHARD_BY_ENVVAR "DAAP_SHARD_BY"
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 5555
+/* largest endpoints file read */
+#define ENDPOINTS_FILE_MAX 65536
+/* points of each endpoint on the ring */
+#define RING_POINTS 64
+/* how long a failed endpoint is skipped, in seconds */
+#define BACKOFF_MIN 1.0
+#define BACKOFF_MAX 30.0
+
+typedef struct ring_point {
+    uint64_t hash;
+    int endpoint;
+} ring_point_t;
+
+static daap_endpoint_t endpoints[DAAP_ENDPOINTS_MAX];
+static int num_endpoints = 0;
+static ring_point_t *ring = NULL;
+static int ring_size = 0;
+static bool by_metric = false;
+
+static double monotonicTime(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* FNV-1a, finished with the splitmix64 mixer so that similar keys (ranks,
+ * "host:port#n") spread over the whole ring */
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t daapEndpointHash(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return mix64(hash);
+}
+
+uint64_t daapEndpointHashRank(long rank) {
+    return mix64((uint64_t)rank + 0x9e3779b97f4a7c15ULL);
+}
+
+/* Adds one "host", "host:port" or "[addr]:port" entry */
+static void addEndpoint(const char *entry, size_t len) {
+    daap_endpoint_t *ep;
+    const char *host = entry, *colon = NULL;
+    size_t host_len = len;
+    char *end;
+    long port = DEFAULT_PORT;
+
+    if (num_endpoints == DAAP_ENDPOINTS_MAX) {
+        ERROR_OUTPUT(("More than %d endpoints, ignoring %.*s", DAAP_ENDPOINTS_MAX, (int)len, entry));
+        return;
+    }
+    if (entry[0] == '[') {
+        host = entry + 1;
+        end = memchr(entry, ']', len);
+        if (end == NULL) {
+            goto invalid;
+        }
+        host_len = end - host;
+        if (end + 1 < entry + len) {
+            if (end[1] != ':') {
+                goto invalid;
+            }
+            colon = end + 1;
+        }
+    }
+    else {
+        colon = memchr(entry, ':', len);
+        if (colon) {
+            host_len = colon - entry;
+        }
+    }
+    if (colon) {
+        port = strtol(colon + 1, &end, 10);
+        if (end != entry + len || end == colon + 1 || port <= 0 || port > 65535) {
+            goto invalid;
+        }
+    }
+    if (host_len == 0 || host_len >= DAAP_ENDPOINT_HOST_MAX) {
+        goto invalid;
+    }
+
+    ep = &endpoints[num_endpoints++];
+    memset(ep, 0, sizeof(*ep));
+    memcpy(ep->host, host, host_len);
+    ep->host[host_len] = '\0';
+    ep->port = (int)port;
+    ep->sockfd = -1;
+    ep->queue.fd = -1;
+    return;
+
+ invalid:
+    ERROR_OUTPUT(("Invalid endpoint %.*s, ignored", (int)len, entry));
+}
+
+/* Adds the entries of a list separated by commas and blanks */
+static void addEndpoints(const char *list) {
+    const char *separators = ", \t\r\n";
+    size_t len;
+
+    while (*list) {
+        list += strspn(list, separators);
+        len = strcspn(list, separators);
+        if (len) {
+            addEndpoint(list, len);
+        }
+        list += len;
+    }
+}
+
+/* Adds the entries of an endpoints file, without its comments */
+static void addEndpointsFile(const char *path) {
+    char *buf, *comment, *eol;
+    size_t len;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        ERROR_OUTPUT(("Cannot read %s %s: %s", ENDPOINTS_FILE_ENVVAR, path, strerror(errno)));
+        return;
+    }
+    buf = malloc(ENDPOINTS_FILE_MAX + 1);
+    if (buf) {
+        len = fread(buf, 1, ENDPOINTS_FILE_MAX, file);
+        buf[len] = '\0';
+        while ((comment = strchr(buf, '#')) != NULL) {
+            eol = strchr(comment, '\n');
+            memset(comment, ' ', eol ? (size_t)(eol - comment) : strlen(comment));
+        }
+        addEndpoints(buf);
+        free(buf);
+    }
+    fclose(file);
+}
+
+static int comparePoints(const void *a, const void *b) {
+    const ring_point_t *pa = a, *pb = b;
+
+    if (pa->hash != pb->hash) {
+        return pa->hash < pb->hash ? -1 : 1;
+    }
+    return pa->endpoint - pb->endpoint;
+}
+
+int daapEndpointsLoad(void) {
+    const char *list = getenv(ENDPOINTS_ENVVAR);
+    const char *path = getenv(ENDPOINTS_FILE_ENVVAR);
+    const char *shard_by = getenv(SHARD_BY_ENVVAR);
+    char name[DAAP_ENDPOINT_HOST_MAX + 32];
+    int i, j, len;
+
+    daapEndpointsFree();
+    if (list && list[0]) {
+        addEndpoints(list);
+    }
+    else if (path && path[0]) {
+        addEndpointsFile(path);
+    }
+    if (num_endpoints == 0) {
+        addEndpoint(DEFAULT_HOST, strlen(DEFAULT_HOST));
+    }
+
+    by_metric = false;
+    if (shard_by && strcmp(shard_by, "metric") == 0) {
+        by_metric = true;
+    }
+    else if (shard_by && shard_by[0] && strcmp(shard_by, "rank") != 0) {
+        ERROR_OUTPUT(("Unknown %s %s, sharding by rank", SHARD_BY_ENVVAR, shard_by));
+    }
+
+    /* the points depend only on the endpoint, not its position in the list,
+     * so every process builds the same ring from a differently ordered list */
+    ring = malloc(sizeof(*ring) * num_endpoints * RING_POINTS);
+    if (ring == NULL) {
+        num_endpoints = 0;
+        return -1;
+    }
+    for (i = 0; i < num_endpoints; i++) {
+        for (j = 0; j < RING_POINTS; j++) {
+            len = snprintf(name, sizeof(name), "%s:%d#%d", endpoints[i].host,
+                           endpoints[i].port, j);
+            ring[ring_size].hash = daapEndpointHash(name, len);
+            ring[ring_size].endpoint = i;
+            ring_size++;
+        }
+    }
+    qsort(ring, ring_size, sizeof(*ring), comparePoints);
+
+    for (i = 0; i < num_endpoints; i++) {
+        DEBUG_OUTPUT(("Endpoint %d: %s:%d", i, endpoints[i].host, endpoints[i].port));
+    }
+    return num_endpoints;
+}
+
+int daapEndpointCount(void) {
+    return num_endpoints;
+}
+
+daap_endpoint_t *daapEndpointGet(int i) {
+    return &endpoints[i];
+}
+
+bool daapEndpointsByMetric(void) {
+    return by_metric;
+}
+
+daap_endpoint_t *daapEndpointFor(uint64_t hash, const bool *exclude) {
+    int lo = 0, hi = ring_size, i, n;
+    double now = monotonicTime();
+
+    if (num_endpoints == 1) {
+        return (exclude && exclude[0]) || endpoints[0].retry_at > now ? NULL : &endpoints[0];
+    }
+
+    /* first point at or after hash, wrapping around */
+    while (lo < hi) {
+        i = lo + (hi - lo) / 2;
+        if (ring[i].hash < hash) {
+            lo = i + 1;
+        }
+        else {
+            hi = i;
+        }
+    }
+
+    for (n = 0; n < ring_size; n++) {
+        i = ring[(lo + n) % ring_size].endpoint;
+        if ((!exclude || !exclude[i]) && endpoints[i].retry_at <= now) {
+            return &endpoints[i];
+        }
+    }
+    return NULL;
+}
+
+void daapEndpointFailed(daap_endpoint_t *ep) {
+    double backoff = BACKOFF_MIN;
+    int i;
+
+    for (i = 0; i < ep->failures && backoff < BACKOFF_MAX; i++) {
+        backoff *= 2;
+    }
+    if (backoff > BACKOFF_MAX) {
+        backoff = BACKOFF_MAX;
+    }
+    ep->failures++;
+    ep->retry_at = monotonicTime() + backoff;
+    DEBUG_OUTPUT(("Endpoint %s:%d failed %d times, skipped for %g s", ep->host, ep->port,
+                  ep->failures, backoff));
+}
+
+void daapEndpointSucceeded(daap_endpoint_t *ep) {
+    ep->failures = 0;
+    ep->retry_at = 0;
+}
+
+void daapEndpointsFree(void) {
+    free(ring);
+    ring = NULL;
+    ring_size = 0;
+    num_endpoints = 0;
+}
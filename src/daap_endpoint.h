@@ -0,0 +1,61 @@
+#ifndef DAAP_ENDPOINT_H
+#define DAAP_ENDPOINT_H
+
+/* Endpoints of the TCP transport (not part of the API).
+ *
+ * The servers records are sent to come from DAAP_ENDPOINTS or the file
+ * named by DAAP_ENDPOINTS_FILE (the node's telegraf, 127.0.0.1:5555, if
+ * neither is set). Records are spread over them by consistent hashing, of
+ * the MPI rank or of each record's metric (its series), and an endpoint
+ * that fails is skipped for a while in favor of the next one on the ring. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+#include "daap_send.h"
+
+#define DAAP_ENDPOINT_HOST_MAX 256
+#define DAAP_ENDPOINTS_MAX 64
+
+typedef struct daap_endpoint {
+    char host[DAAP_ENDPOINT_HOST_MAX];
+    int port;
+    /* the connection, managed by daap_tcp.c */
+    SSL *ssl;
+    int sockfd;
+    bool ktls_active;
+    /* what is queued on the io_uring send engine, if used */
+    daap_send_queue_t queue;
+    /* consecutive failures, and when the endpoint may be tried again */
+    int failures;
+    double retry_at;
+} daap_endpoint_t;
+
+/* Reads the endpoint list and builds the hash ring; returns the number of
+ * endpoints, or -1 if out of memory. Invalid entries are skipped. */
+int daapEndpointsLoad(void);
+
+/* Number of endpoints, and the i-th of them */
+int daapEndpointCount(void);
+daap_endpoint_t *daapEndpointGet(int i);
+
+/* True if records are placed by their metric rather than by rank */
+bool daapEndpointsByMetric(void);
+
+/* Hash of a key to place on the ring */
+uint64_t daapEndpointHash(const char *key, size_t len);
+uint64_t daapEndpointHashRank(long rank);
+
+/* The endpoint owning hash, skipping the ones in exclude and the ones that
+ * failed recently; NULL if none is left */
+daap_endpoint_t *daapEndpointFor(uint64_t hash, const bool *exclude);
+
+/* Records a connection that failed or succeeded */
+void daapEndpointFailed(daap_endpoint_t *ep);
+void daapEndpointSucceeded(daap_endpoint_t *ep);
+
+/* Frees the list (the connections must be closed) */
+void daapEndpointsFree(void);
+
+#endif /* DAAP_ENDPOINT_H */
@@ -0,0 +1,155 @@
+/*
+ * Influx line protocol escaping
+ *
+ * Application names, host names, tag values and messages go into records
+ * as they come, and almost never contain a character that has to be
+ * escaped. The copy is therefore made 32 (AVX2) or 16 (SSE2) bytes at a
+ * time: each block is stored to the output unconditionally and compared
+ * against the special characters, and only a block that contains one
+ * falls back to the byte at hand, so a string without special characters
+ * is scanned and copied in a single pass. AVX2 is used where the CPU has
+ * it; other architectures copy byte by byte.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#    define DAAP_ESCAPE_X86 1
+#    include <immintrin.h>
+#endif
+
+#include "daap_escape.h"
+
+/* the character written after the backslash for each special one */
+static const unsigned char escapes[2][256] = {
+    [DAAP_ESCAPE_KEY] = { [','] = ',', ['='] = '=', [' '] = ' ', ['\\'] = '\\', ['\n'] = 'n',
+                          ['\r'] = 'r' },
+    [DAAP_ESCAPE_STRING] = { ['"'] = '"', ['\\'] = '\\', ['\n'] = 'n', ['\r'] = 'r' },
+};
+
+/* the special characters of each kind, for the vector compares (the
+ * string set repeats some to have the same number) */
+static const char specials[2][6] = {
+    [DAAP_ESCAPE_KEY] = { ',', '=', ' ', '\\', '\n', '\r' },
+    [DAAP_ESCAPE_STRING] = { '"', '\\', '\n', '\r', '"', '\\' },
+};
+
+#ifdef DAAP_ESCAPE_X86
+/* Copies the bytes from i to the first special character in mask (the
+ * compare of the block ending at len, shifted to start at i) */
+static size_t copyTail(char *dst, const char *src, size_t len, size_t i, unsigned int mask) {
+    size_t n = mask ? (size_t)__builtin_ctz(mask) : len - i;
+
+    memcpy(dst + i, src + i, n);
+    return i + n;
+}
+
+/* Copies src[start..len) up to the first special character, 32 bytes at a
+ * time; returns the index of that character, or len. The last block is
+ * the one ending at len, overlapping bytes already checked, so there is no
+ * byte-by-byte scan of the tail. Stores may go past the copied bytes, but
+ * the output of what is left of the string will overwrite them. Needs
+ * len >= 32. */
+__attribute__((target("avx2")))
+static size_t copyPlainAVX2(char *dst, const char *src, size_t len, size_t start,
+                            const char *set, bool escaped) {
+    const __m256i c0 = _mm256_set1_epi8(set[0]), c1 = _mm256_set1_epi8(set[1]);
+    const __m256i c2 = _mm256_set1_epi8(set[2]), c3 = _mm256_set1_epi8(set[3]);
+    const __m256i c4 = _mm256_set1_epi8(set[4]), c5 = _mm256_set1_epi8(set[5]);
+    size_t i = start, block;
+    unsigned int mask;
+    __m256i v, hit;
+
+    while (i < len) {
+        block = len - i >= 32 ? i : len - 32;
+        v = _mm256_loadu_si256((const __m256i *)(src + block));
+        hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c0), _mm256_cmpeq_epi8(v, c1)),
+                              _mm256_or_si256(_mm256_cmpeq_epi8(v, c2), _mm256_cmpeq_epi8(v, c3)));
+        hit = _mm256_or_si256(hit, _mm256_or_si256(_mm256_cmpeq_epi8(v, c4),
+                                                   _mm256_cmpeq_epi8(v, c5)));
+        /* bytes before i were checked and copied already; once something
+         * was escaped the output there differs, and the block is not stored */
+        mask = (unsigned int)_mm256_movemask_epi8(hit) >> (i - block);
+        if (block < i && escaped) {
+            return copyTail(dst, src, len, i, mask);
+        }
+        _mm256_storeu_si256((__m256i *)(dst + block), v);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i = block + 32;
+    }
+    return len;
+}
+
+/* As above, 16 bytes at a time; needs len >= 16 */
+static size_t copyPlainSSE2(char *dst, const char *src, size_t len, size_t start,
+                            const char *set, bool escaped) {
+    const __m128i c0 = _mm_set1_epi8(set[0]), c1 = _mm_set1_epi8(set[1]);
+    const __m128i c2 = _mm_set1_epi8(set[2]), c3 = _mm_set1_epi8(set[3]);
+    const __m128i c4 = _mm_set1_epi8(set[4]), c5 = _mm_set1_epi8(set[5]);
+    size_t i = start, block;
+    unsigned int mask;
+    __m128i v, hit;
+
+    while (i < len) {
+        block = len - i >= 16 ? i : len - 16;
+        v = _mm_loadu_si128((const __m128i *)(src + block));
+        hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, c0), _mm_cmpeq_epi8(v, c1)),
+                           _mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3)));
+        hit = _mm_or_si128(hit, _mm_or_si128(_mm_cmpeq_epi8(v, c4), _mm_cmpeq_epi8(v, c5)));
+        mask = (unsigned int)_mm_movemask_epi8(hit) >> (i - block);
+        if (block < i && escaped) {
+            return copyTail(dst, src, len, i, mask);
+        }
+        _mm_storeu_si128((__m128i *)(dst + block), v);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i = block + 16;
+    }
+    return len;
+}
+
+/* found by the first call; calls on other threads may find it again */
+static atomic_int has_avx2 = -1;
+#endif
+
+size_t daapEscape(char *dst, const char *src, size_t len, int kind) {
+    const unsigned char *escape = escapes[kind];
+    size_t in = 0, out = 0, next;
+
+    /* the copy is done in place relative to the current output position,
+     * which runs ahead of the input by the number of escapes so far */
+    while (in < len) {
+#ifdef DAAP_ESCAPE_X86
+        int avx2 = atomic_load_explicit(&has_avx2, memory_order_relaxed);
+
+        if (avx2 < 0) {
+            avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+            atomic_store_explicit(&has_avx2, avx2, memory_order_relaxed);
+        }
+        if (avx2 && len >= 32) {
+            next = copyPlainAVX2(dst + out - in, src, len, in, specials[kind], out != in);
+        }
+        else if (len >= 16) {
+            next = copyPlainSSE2(dst + out - in, src, len, in, specials[kind], out != in);
+        }
+        else
+#endif
+        {
+            for (next = in; next < len && !escape[(unsigned char)src[next]]; next++) {
+                dst[out + next - in] = src[next];
+            }
+        }
+        out += next - in;
+        in = next;
+        if (in < len) {
+            dst[out++] = '\\';
+            dst[out++] = escape[(unsigned char)src[in++]];
+        }
+    }
+    return out;
+}
@@ -0,0 +1,20 @@
+#ifndef DAAP_ESCAPE_H
+#define DAAP_ESCAPE_H
+
+/* Influx line protocol escaping (not part of the API) */
+
+#include <stddef.h>
+
+/* Tag keys and values and field keys: ',', '=', ' ' and '\' get a backslash
+ * (a '\' left alone would escape the separator after it) */
+#define DAAP_ESCAPE_KEY 0
+/* String field values: '"' and '\' get a backslash */
+#define DAAP_ESCAPE_STRING 1
+
+/* Copies len bytes of src to dst, escaping the special characters of kind;
+ * a newline or carriage return, which would end the record, is written as
+ * \n or \r. dst must have room for 2 * len bytes. Returns the length
+ * written (no terminating NUL is added). */
+size_t daapEscape(char *dst, const char *src, size_t len, int kind);
+
+#endif /* DAAP_ESCAPE_H */
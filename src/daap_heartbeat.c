@@ -0,0 +1,141 @@
+/*
+ * Data Analytics Application Profiling API
+ *
+ * Background heartbeat
+ *
+ * With DAAP_HEARTBEAT_PERIOD set (in seconds), daapInit() starts a thread
+ * that sends a heartbeat every period, so applications no longer have to
+ * call daapLogHeartbeat() themselves. When every rank of a bulk-synchronous
+ * code sent its heartbeat from the same point of its time step, all of
+ * them reached the node's collector and the aggregators in the same
+ * instant. Here each rank instead beats in its own slot of the period:
+ * the slots are placed on the wall clock, which the nodes of a job share,
+ * at a phase derived from the MPI rank (the fractional parts of
+ * rank * golden ratio, which spread any number of consecutive ranks
+ * evenly over the period), plus a few percent of random jitter per beat.
+ *
+ * Each heartbeat carries the application's progress counter, which the
+ * application bumps with daapHeartbeatProgress() (one relaxed atomic add).
+ */
+
+#include <stdatomic.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+
+#define HEARTBEAT_PERIOD_ENVVAR "DAAP_HEARTBEAT_PERIOD"
+/* the shortest period accepted, in seconds */
+#define HEARTBEAT_MIN_PERIOD 0.1
+/* largest random delay of a beat, as a fraction of the period */
+#define HEARTBEAT_JITTER 0.05
+/* fractional part of the golden ratio */
+#define GOLDEN_FRACTION 0.6180339887498949
+
+static atomic_long heartbeat_progress;
+
+static pthread_t heartbeat_thread;
+static pthread_mutex_t heartbeat_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t heartbeat_cond = PTHREAD_COND_INITIALIZER;
+static bool heartbeat_running = false;
+static bool heartbeat_stop = false;
+static double heartbeat_period;
+
+void daapHeartbeatProgress(long count) {
+    atomic_fetch_add_explicit(&heartbeat_progress, count, memory_order_relaxed);
+}
+
+void daapheartbeatprogress_(long *count) {
+    daapHeartbeatProgress(*count);
+}
+
+long daapHeartbeatProgressValue(void) {
+    return atomic_load_explicit(&heartbeat_progress, memory_order_relaxed);
+}
+
+static double wallTime(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* Wall clock time of the first beat of this rank after now */
+static double nextBeat(double now, unsigned int *seed) {
+    double phase, slot;
+
+    /* read each time, since daapSetRank() may change the rank; both values
+     * are positive, so the casts truncate as floor() would */
+    phase = init_data.mpi_rank * GOLDEN_FRACTION;
+    phase = (phase - (long long)phase) * heartbeat_period;
+    slot = (long long)((now - phase) / heartbeat_period) + 1;
+    return slot * heartbeat_period + phase +
+        rand_r(seed) / (RAND_MAX + 1.0) * HEARTBEAT_JITTER * heartbeat_period;
+}
+
+static void *heartbeatMain(void *arg) {
+    unsigned int seed = (unsigned int)init_data.mpi_rank ^ (unsigned int)getpid();
+    struct timespec deadline;
+    double next;
+
+    (void)arg;
+    pthread_mutex_lock(&heartbeat_mutex);
+    while (!heartbeat_stop) {
+        next = nextBeat(wallTime(), &seed);
+        deadline.tv_sec = (time_t)next;
+        deadline.tv_nsec = (long)((next - deadline.tv_sec) * 1e9);
+        while (!heartbeat_stop &&
+               pthread_cond_timedwait(&heartbeat_cond, &heartbeat_mutex, &deadline) != ETIMEDOUT) {
+        }
+        if (heartbeat_stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&heartbeat_mutex);
+        daapLogHeartbeat();
+        pthread_mutex_lock(&heartbeat_mutex);
+    }
+    pthread_mutex_unlock(&heartbeat_mutex);
+    return NULL;
+}
+
+/* Starts the heartbeat thread if DAAP_HEARTBEAT_PERIOD is set; called at the
+ * end of daapInit() */
+int daapHeartbeatStart(void) {
+    const char *env = getenv(HEARTBEAT_PERIOD_ENVVAR);
+    double period;
+
+    if (env == NULL || heartbeat_running) {
+        return DAAP_SUCCESS;
+    }
+    period = strtod(env, NULL);
+    if (period <= 0) {
+        return DAAP_SUCCESS;
+    }
+    if (period < HEARTBEAT_MIN_PERIOD) {
+        ERROR_OUTPUT(("%s is below the minimum of %g s, using the minimum",
+                      HEARTBEAT_PERIOD_ENVVAR, HEARTBEAT_MIN_PERIOD));
+        period = HEARTBEAT_MIN_PERIOD;
+    }
+
+    heartbeat_period = period;
+    heartbeat_stop = false;
+    if (pthread_create(&heartbeat_thread, NULL, heartbeatMain, NULL) != 0) {
+        ERROR_OUTPUT(("Failed to start the heartbeat thread"));
+        return DAAP_ERROR;
+    }
+    heartbeat_running = true;
+    return DAAP_SUCCESS;
+}
+
+/* Stops the heartbeat thread, if running; called by daapFinalize() */
+void daapHeartbeatStop(void) {
+    if (!heartbeat_running) {
+        return;
+    }
+    pthread_mutex_lock(&heartbeat_mutex);
+    heartbeat_stop = true;
+    pthread_cond_signal(&heartbeat_cond);
+    pthread_mutex_unlock(&heartbeat_mutex);
+    pthread_join(heartbeat_thread, NULL);
+    heartbeat_running = false;
+}
@@ -10,7 +10,7 @@
  *
  *****************
  * daapFinalize(void)
- *   Cleans up / depopulates / dallocates (as required) structures
+ *   Stops the heartbeat thread (see daap_heartbeat.c) and cleans up / depopulates / dallocates (as required) structures
  *   populated by daapInit.
  *
  *****************
@@ -20,11 +20,16 @@
  * Additional authors: Hugh Greenberg, hng@lanl.gov
  */
 
+#include <strings.h>
+
 #include "daap_log.h"
 #include "daap_log_internal.h"
+#include "daap_journal.h"
+#include "daap_relay.h"
 
 bool daapInit_called = false;
 bool daapRank_zero = false;
+bool daapInit_decoupled = false;
 
 static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t finalize_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -36,7 +41,7 @@ char daap_hostname[LOCAL_MAXHOSTNAMELEN];
  * finalized in daapFinalize(), and accessed by the *Write() functions. */
 daap_init_t init_data;
 
-extern int daapInitializeSSL();
+extern int daapTCPWarmup(void);
 extern void daapShutdownSSL();
 
 /*
@@ -132,6 +137,32 @@ static int daap_gethostname(char **hostname) {
     return DAAP_ERROR;
 }
 
+/* Threshold of DAAP_LOG(): DAAP_LOG_LEVEL, a syslog level by name ("info")
+ * or number, if set, else msg_level */
+static int logLevel(int msg_level) {
+    static const char *names[] = { "emerg", "alert", "crit", "err", "warning", "notice",
+                                   "info", "debug" };
+    const char *env = getenv("DAAP_LOG_LEVEL");
+    char *end;
+    long level;
+    int i;
+
+    if (env == NULL || *env == '\0') {
+        return msg_level;
+    }
+    for (i = 0; i <= LOG_DEBUG; i++) {
+        if (strcasecmp(env, names[i]) == 0) {
+            return i;
+        }
+    }
+    level = strtol(env, &end, 10);
+    if (*end != '\0' || level < -1 || level > LOG_DEBUG) {
+        ERROR_OUTPUT(("Invalid DAAP_LOG_LEVEL %s, using %d", env, msg_level));
+        return msg_level;
+    }
+    return (int)level;
+}
+
 /* Initializer for library. */
 int daapInit(const char *app_name, int msg_level, int agg_val, transport transport_type) {
     /* Assume this needs to be thread safe.
@@ -150,8 +181,10 @@ int daapInit(const char *app_name, int msg_level, int agg_val, transport transpo
      * using the command line value */
     init_data.appname = calloc(strlen(app_name) + 1, 1);
     strcpy(init_data.appname, app_name);
+    init_data.level = msg_level;
     init_data.agg_val = agg_val;
     init_data.transport_type = transport_type;
+    daapSetLogLevel(logLevel(msg_level));
     init_data.start_time = (unsigned long) time(NULL);
     init_data.mpi_rank = 0;
     if( getenv("SLURMD_NODENAME") != NULL  ) {
@@ -191,8 +224,9 @@ int daapInit(const char *app_name, int msg_level, int agg_val, transport transpo
 #       endif
     }
     else if ( transport_type == TCP) {
-        daapInitializeSSL();
-
+        /* the SSL context and connection are set up by the first write, or
+         * in the background if DAAP_TCP_WARMUP is set */
+        daapTCPWarmup();
     }
 
     daapInit_called = true;
@@ -203,6 +237,11 @@ int daapInit(const char *app_name, int msg_level, int agg_val, transport transpo
         exit(1);
     }
 
+    /* opt-in node-local journal read by daapLogRead() (DAAP_JOURNAL). The
+     * opt-in features report their own failures and the library works
+     * without them, so they do not fail daapInit(). */
+    daapJournalOpen();
+
     /* Send job start message to message broker/syslog if DAAP_DECOUPLE env var
        not set or set to 0 and the mpi rank is 0 */
     if ( getenv("OMPI_COMM_WORLD_RANK") != NULL ) {
@@ -240,41 +279,82 @@ int daapInit(const char *app_name, int msg_level, int agg_val, transport transpo
         daapRank_zero = true;
     }
 
-    if ( daapRank_zero ) {
+    if ( daapRank_zero && !daapInit_decoupled ) {
         if ( (getenv("DAAP_DECOUPLE") == NULL) ||
            !(strcmp(getenv("DAAP_DECOUPLE"), "0")) ) {
             ret_val += daapLogJobStart();
         }
     }
 
+    /* opt-in background heartbeat (DAAP_HEARTBEAT_PERIOD) */
+    daapHeartbeatStart();
+
+    /* opt-in periodic flush of the region timings (DAAP_REGION_PERIOD) */
+    daapRegionStart();
+
+    /* opt-in resource sampler (DAAP_SAMPLE_PERIOD) */
+    daapSamplerStart();
+
     return ret_val;
 }
 
 void daapinit_(char* app_name, int len) {
     app_name[len] = '\0';
-    daapInit(app_name, 0, DAAP_AGG_OFF, TCP);
+    daapInit(app_name, LOG_NOTICE, DAAP_AGG_OFF, TCP);
 }
 
 /* Free memory from allocated components of init_data */
 int daapFinalize(void) {
-    int ret_val;
+    int ret_val = DAAP_SUCCESS;
 
     pthread_mutex_lock(&finalize_mutex);
+    /* a second call, as from both an application and the preload engine,
+     * has nothing left to do */
+    if (!daapInit_called) {
+        pthread_mutex_unlock(&finalize_mutex);
+        return DAAP_SUCCESS;
+    }
+
+    daapHeartbeatStop();
+    daapRegionStop();
+    daapSamplerStop();
+    daapDeferStop();
+
+    /* how many TLS handshakes were needed, and how many resumed */
+    if (init_data.transport_type == TCP) {
+        daapTCPLogStats();
+    }
+
+    /* send whatever is still batched, ahead of the job end message */
+    daapLogFlush();
 
     /* Send job end message to message broker/syslog if this is rank 0 and
        DAAP_DECOUPLE env var not set or set to 0. */
-    if ( daapRank_zero ) {
+    if ( daapRank_zero && !daapInit_decoupled ) {
         if ( (getenv("DAAP_DECOUPLE") == NULL) ||
            !(strcmp(getenv("DAAP_DECOUPLE"), "0")) ) {
             ret_val = daapLogJobEnd();
         }
     }
 
+    /* from here on records are refused, and daapInit() starts over */
+    pthread_mutex_lock(&init_mutex);
+    daapInit_called = false;
+    daapInit_decoupled = false;
+    pthread_mutex_unlock(&init_mutex);
+
     daapShutdownSSL();
+    if (init_data.transport_type == RELAY) {
+        daapRelayClose();
+    }
+    daapJournalClose();
 
     free(init_data.hostname);
     free(init_data.appname);
     free(init_data.cluster_name);
+    init_data.hostname = NULL;
+    init_data.appname = NULL;
+    init_data.cluster_name = NULL;
 
     pthread_mutex_unlock(&finalize_mutex);
     return ret_val;
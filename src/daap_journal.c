@@ -0,0 +1,458 @@
+/*
+ * Data Analytics Application Profiling API
+ *
+ * Node-local journal of recent records
+ *
+ * daapLogRead() gives an application the records of one key (or of all)
+ * that it logged in the last so many seconds, so that it can act on its own
+ * recent telemetry, for instance checkpoint sooner when its step time grows,
+ * without asking the analytics system for it. With DAAP_JOURNAL set, the
+ * records sent are also appended to a file mapped in memory (see
+ * daap_journal.h for its layout). A read finds where the interval starts in
+ * each segment by a binary search of its time index, then follows the
+ * chain of the key back from its last entry, so that it visits the records
+ * it returns and at most an index stride of others. The lines are copied
+ * out under the lock, as appends reuse the oldest segment in place.
+ *
+ * Records are not always appended in the order of their timestamps
+ * (deferred ones carry the time of their call), so the index holds the
+ * latest timestamp up to each point, which never goes back, even from one
+ * segment to the next, and the entries are checked one by one.
+ *
+ * The file is made under a random name and renamed into place, so that a
+ * file or link planted at its name is replaced rather than written through,
+ * and is removed by daapFinalize(); after a crash it is left for a look at
+ * the last records of the process. A forked child does not journal: the
+ * mapping is shared with the parent, but the lock is not.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_journal.h"
+
+#define JOURNAL_MAGIC "DAAPJ1\n"
+/* sizes of the journal in MiB */
+#define JOURNAL_DEFAULT_SIZE 16
+#define JOURNAL_MAX_SIZE 4096
+#define JOURNAL_SEGMENTS 4
+/* time points and key slots (a power of 2) of a segment */
+#define JOURNAL_POINTS 1024
+#define JOURNAL_KEYS 4096
+#define JOURNAL_PAGE 4096
+#define JOURNAL_ALIGN(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+/* first page of the file */
+typedef struct {
+    char magic[8];
+    uint32_t segments;
+    uint32_t current;        /* segment being appended to */
+    uint64_t segment_size;
+    uint64_t sequence;       /* of the current segment */
+} journal_header_t;
+
+/* the latest timestamp of the entries up to the one at offset */
+typedef struct {
+    int64_t max_ms;
+    uint64_t offset;
+} time_point_t;
+
+/* the last entry of a key; key 0 is a free slot */
+typedef struct {
+    int32_t key;
+    uint32_t offset;
+} key_slot_t;
+
+/* Offsets are from the start of the segment, 0 being none */
+typedef struct {
+    uint64_t sequence;       /* 0 for a segment not used yet */
+    uint64_t used;           /* end of the entries */
+    uint64_t last;           /* last entry */
+    int64_t max_ms;          /* latest timestamp up to the last entry */
+    uint32_t entries;
+    uint32_t num_points;
+    uint32_t num_keys;
+    uint32_t keys_full;      /* keys not in the table are not chained */
+    time_point_t points[JOURNAL_POINTS];
+    key_slot_t keys[JOURNAL_KEYS];
+} segment_header_t;
+
+/* An entry and its line take size bytes, a multiple of 8 */
+typedef struct {
+    int64_t ms;
+    int64_t max_ms;          /* latest timestamp of the segment up to here */
+    uint32_t prev;           /* previous entry */
+    uint32_t prev_key;       /* previous entry of the same key */
+    int32_t key;
+    uint32_t size;
+    char line[];
+} entry_t;
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+static bool journal_active = false;
+static char *journal = NULL;
+static char *journal_path = NULL;
+static size_t journal_size;
+static size_t segment_size;
+/* offset of the first entry of a segment, and bytes between time points */
+static size_t entries_start;
+static size_t point_stride;
+
+static journal_header_t *journalHeader(void) {
+    return (journal_header_t *)journal;
+}
+
+static segment_header_t *journalSegment(uint32_t i) {
+    return (segment_header_t *)(journal + JOURNAL_PAGE + (size_t)i * segment_size);
+}
+
+static entry_t *journalEntry(segment_header_t *seg, uint64_t offset) {
+    return (entry_t *)((char *)seg + offset);
+}
+
+/* FNV-1a, kept to 31 bits so that a key is a positive int */
+int daapLogKey(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    if (name == NULL) {
+        return 0;
+    }
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    hash &= 0x7fffffff;
+    return hash != 0 ? (int)hash : 1;
+}
+
+/* The slot of key in the table of seg, taking a free one if insert is set
+ * and the table is not full yet; NULL if there is none */
+static key_slot_t *findKey(segment_header_t *seg, int32_t key, bool insert) {
+    uint32_t i = (uint32_t)key & (JOURNAL_KEYS - 1);
+
+    while (seg->keys[i].key != 0) {
+        if (seg->keys[i].key == key) {
+            return &seg->keys[i];
+        }
+        i = (i + 1) & (JOURNAL_KEYS - 1);
+    }
+    if (!insert) {
+        return NULL;
+    }
+    /* a table filled to three quarters keeps the probes short */
+    if (seg->num_keys >= JOURNAL_KEYS / 4 * 3) {
+        seg->keys_full = 1;
+        return NULL;
+    }
+    seg->keys[i].key = key;
+    seg->num_keys++;
+    return &seg->keys[i];
+}
+
+/* Makes segment i the current one, empty, carrying on the latest timestamp */
+static void startSegment(uint32_t i, int64_t max_ms) {
+    journal_header_t *header = journalHeader();
+    segment_header_t *seg = journalSegment(i);
+
+    memset(seg, 0, sizeof(*seg));
+    seg->sequence = ++header->sequence;
+    seg->used = entries_start;
+    seg->max_ms = max_ms;
+    header->current = i;
+}
+
+/* The lock is held across fork(), so that the child gets it unlocked and
+ * no append is half done in the mapping it lets go of */
+static void forkPrepare(void) {
+    pthread_mutex_lock(&journal_mutex);
+}
+
+static void forkParent(void) {
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+/* The file stays the parent's, to be removed by it */
+static void forkChild(void) {
+    if (journal != NULL) {
+        __atomic_store_n(&journal_active, false, __ATOMIC_RELEASE);
+        munmap(journal, journal_size);
+        free(journal_path);
+        journal = NULL;
+        journal_path = NULL;
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+static void registerFork(void) {
+    pthread_atfork(forkPrepare, forkParent, forkChild);
+}
+
+int daapJournalOpen(void) {
+    const char *dir = getenv(DAAP_JOURNAL_ENVVAR);
+    const char *size_env = getenv(DAAP_JOURNAL_SIZE_ENVVAR);
+    journal_header_t *header;
+    size_t seg_size, total;
+    long mib = JOURNAL_DEFAULT_SIZE;
+    char *path, *tmp_path, *map;
+    int fd, len, err;
+
+    if (dir == NULL || dir[0] == '\0' || journal != NULL) {
+        return DAAP_SUCCESS;
+    }
+    if (size_env != NULL && size_env[0] != '\0') {
+        mib = strtol(size_env, NULL, 10);
+        if (mib < 1 || mib > JOURNAL_MAX_SIZE) {
+            ERROR_OUTPUT(("%s must be from 1 to %d MiB, using %d", DAAP_JOURNAL_SIZE_ENVVAR,
+                          JOURNAL_MAX_SIZE, JOURNAL_DEFAULT_SIZE));
+            mib = JOURNAL_DEFAULT_SIZE;
+        }
+    }
+    seg_size = (((size_t)mib << 20) - JOURNAL_PAGE) / JOURNAL_SEGMENTS & ~((size_t)JOURNAL_PAGE - 1);
+    total = JOURNAL_PAGE + JOURNAL_SEGMENTS * seg_size;
+
+    len = snprintf(NULL, 0, "%s/daap-journal-%ld", dir, (long)getpid());
+    path = malloc(len + 1);
+    tmp_path = malloc(len + 8);
+    if (path == NULL || tmp_path == NULL) {
+        free(path);
+        free(tmp_path);
+        return DAAP_ERROR;
+    }
+    snprintf(path, len + 1, "%s/daap-journal-%ld", dir, (long)getpid());
+    snprintf(tmp_path, len + 8, "%s.XXXXXX", path);
+
+    fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        ERROR_OUTPUT(("Cannot create the journal %s: %s", tmp_path, strerror(errno)));
+        free(path);
+        free(tmp_path);
+        return DAAP_ERROR;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    /* allocated up front, so that a full file system fails here rather
+     * than with a SIGBUS on a later append */
+    err = posix_fallocate(fd, 0, total);
+    if (err != 0) {
+        ERROR_OUTPUT(("Cannot allocate the journal %s: %s", tmp_path, strerror(err)));
+        close(fd);
+        unlink(tmp_path);
+        free(path);
+        free(tmp_path);
+        return DAAP_ERROR;
+    }
+    map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        ERROR_OUTPUT(("Cannot map the journal %s: %s", tmp_path, strerror(errno)));
+        unlink(tmp_path);
+        free(path);
+        free(tmp_path);
+        return DAAP_ERROR;
+    }
+    if (rename(tmp_path, path) != 0) {
+        ERROR_OUTPUT(("Cannot create the journal %s: %s", path, strerror(errno)));
+        munmap(map, total);
+        unlink(tmp_path);
+        free(path);
+        free(tmp_path);
+        return DAAP_ERROR;
+    }
+    free(tmp_path);
+
+    pthread_once(&fork_once, registerFork);
+    pthread_mutex_lock(&journal_mutex);
+    journal = map;
+    journal_path = path;
+    journal_size = total;
+    segment_size = seg_size;
+    entries_start = JOURNAL_ALIGN(sizeof(segment_header_t), 64);
+    point_stride = (segment_size - entries_start) / JOURNAL_POINTS;
+    header = journalHeader();
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->segments = JOURNAL_SEGMENTS;
+    header->segment_size = segment_size;
+    startSegment(0, 0);
+    __atomic_store_n(&journal_active, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&journal_mutex);
+
+    DEBUG_OUTPUT(("Journal %s of %zu bytes", path, total));
+    return DAAP_SUCCESS;
+}
+
+void daapJournalClose(void) {
+    pthread_mutex_lock(&journal_mutex);
+    if (journal != NULL) {
+        __atomic_store_n(&journal_active, false, __ATOMIC_RELEASE);
+        munmap(journal, journal_size);
+        unlink(journal_path);
+        free(journal_path);
+        journal = NULL;
+        journal_path = NULL;
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+bool daapJournalActive(void) {
+    return __atomic_load_n(&journal_active, __ATOMIC_ACQUIRE);
+}
+
+void daapJournalAppend(long timestamp, const char *name, const char *line, size_t len) {
+    size_t size = JOURNAL_ALIGN(sizeof(entry_t) + len + 1, 8);
+    int32_t key = daapLogKey(name);
+    journal_header_t *header;
+    segment_header_t *seg;
+    key_slot_t *slot;
+    entry_t *entry;
+    uint64_t offset;
+
+    if (!daapJournalActive()) {
+        return;
+    }
+    pthread_mutex_lock(&journal_mutex);
+    if (journal == NULL) {
+        pthread_mutex_unlock(&journal_mutex);
+        return;
+    }
+    /* a record that would take over a quarter of a segment is left out */
+    if (size > (segment_size - entries_start) / 4) {
+        pthread_mutex_unlock(&journal_mutex);
+        DEBUG_OUTPUT(("Record of %zu bytes too large for the journal", len));
+        return;
+    }
+
+    header = journalHeader();
+    seg = journalSegment(header->current);
+    if (seg->used + size > segment_size) {
+        startSegment((header->current + 1) % header->segments, seg->max_ms);
+        seg = journalSegment(header->current);
+    }
+
+    offset = seg->used;
+    entry = journalEntry(seg, offset);
+    if (timestamp > seg->max_ms) {
+        seg->max_ms = timestamp;
+    }
+    entry->ms = timestamp;
+    entry->max_ms = seg->max_ms;
+    entry->prev = seg->last;
+    entry->prev_key = 0;
+    entry->key = key;
+    entry->size = size;
+    memcpy(entry->line, line, len);
+    entry->line[len] = '\0';
+
+    if (key != 0 && (slot = findKey(seg, key, true)) != NULL) {
+        entry->prev_key = slot->offset;
+        slot->offset = offset;
+    }
+    if (seg->num_points < JOURNAL_POINTS &&
+        offset >= entries_start + seg->num_points * point_stride) {
+        seg->points[seg->num_points].max_ms = seg->max_ms;
+        seg->points[seg->num_points].offset = offset;
+        seg->num_points++;
+    }
+    seg->last = offset;
+    seg->used += size;
+    seg->entries++;
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+/* The offset from which the entries of seg may be at or after cutoff: that
+ * of the last time point before it (the entries up to there are older) */
+static uint64_t windowStart(segment_header_t *seg, int64_t cutoff) {
+    uint32_t lo = 0, hi = seg->num_points, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (seg->points[mid].max_ms < cutoff) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? seg->points[lo - 1].offset : 0;
+}
+
+int daapJournalRead(int key, int time_interval, int max_rows, char **row_array) {
+    journal_header_t *header;
+    segment_header_t *seg;
+    key_slot_t *slot;
+    entry_t *entry;
+    uint64_t offset, start;
+    int64_t cutoff = INT64_MIN;
+    uint32_t i, n;
+    bool by_key;
+    int rows = 0, j;
+    char *row;
+    bool failed = false;
+
+    if (max_rows <= 0 || row_array == NULL) {
+        errno = EINVAL;
+        return DAAP_ERROR;
+    }
+    if (time_interval > 0) {
+        cutoff = (int64_t)getmillisectime() - (int64_t)time_interval * 1000;
+    }
+
+    pthread_mutex_lock(&journal_mutex);
+    if (journal == NULL) {
+        pthread_mutex_unlock(&journal_mutex);
+        errno = ENOENT;
+        return DAAP_ERROR;
+    }
+    header = journalHeader();
+
+    /* from the newest segment back, while they have records late enough */
+    i = header->current;
+    for (n = 0; n < header->segments && rows < max_rows; n++) {
+        seg = journalSegment(i);
+        if (seg->sequence == 0 || seg->max_ms < cutoff) {
+            break;
+        }
+        i = (i + header->segments - 1) % header->segments;
+
+        by_key = false;
+        offset = seg->last;
+        if (key != 0) {
+            slot = findKey(seg, key, false);
+            if (slot != NULL) {
+                by_key = true;
+                offset = slot->offset;
+            } else if (!seg->keys_full) {
+                continue;
+            }
+        }
+
+        start = windowStart(seg, cutoff);
+        while (offset != 0 && offset >= start && rows < max_rows && !failed) {
+            entry = journalEntry(seg, offset);
+            if (entry->ms >= cutoff && (key == 0 || entry->key == key)) {
+                row_array[rows] = strdup(entry->line);
+                failed = row_array[rows++] == NULL;
+            }
+            offset = by_key ? entry->prev_key : entry->prev;
+        }
+    }
+    pthread_mutex_unlock(&journal_mutex);
+
+    if (failed) {
+        for (j = 0; j < rows; j++) {
+            free(row_array[j]);
+        }
+        errno = ENOMEM;
+        return DAAP_ERROR;
+    }
+
+    /* oldest first */
+    for (j = 0; j < rows / 2; j++) {
+        row = row_array[j];
+        row_array[j] = row_array[rows - 1 - j];
+        row_array[rows - 1 - j] = row;
+    }
+    return rows;
+}
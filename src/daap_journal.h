@@ -0,0 +1,40 @@
+#ifndef DAAP_JOURNAL_H
+#define DAAP_JOURNAL_H
+
+/* Node-local journal of recent records, read by daapLogRead() (not part of
+ * the API).
+ *
+ * With DAAP_JOURNAL set to a directory, daapInit() maps a file there,
+ * daap-journal-<pid>, of DAAP_JOURNAL_SIZE MiB (16 by default) split into
+ * JOURNAL_SEGMENTS segments that are filled in turn, the oldest one being
+ * reused when the current one is full. Each segment holds, after its header,
+ * the records appended to it as line protocol (NUL terminated, so that they
+ * can be handed out without copying), each entry linked to the previous
+ * one and to the previous one of the same key. A segment header has a sparse
+ * time index (an offset every so many bytes, with the latest timestamp up to
+ * it) and a table of the last entry of each key. */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DAAP_JOURNAL_ENVVAR "DAAP_JOURNAL"
+#define DAAP_JOURNAL_SIZE_ENVVAR "DAAP_JOURNAL_SIZE"
+
+/* Maps the journal if DAAP_JOURNAL is set; returns DAAP_SUCCESS, or
+ * DAAP_ERROR if it is set but cannot be used */
+int daapJournalOpen(void);
+
+/* Unmaps and removes the journal */
+void daapJournalClose(void);
+
+/* Whether records are being journaled */
+bool daapJournalActive(void);
+
+/* Appends a record (its line protocol, without the newline) made at
+ * timestamp (milliseconds), under the key of name (NULL for none) */
+void daapJournalAppend(long timestamp, const char *name, const char *line, size_t len);
+
+/* daapLogRead() */
+int daapJournalRead(int key, int time_interval, int max_rows, char **row_array);
+
+#endif /* DAAP_JOURNAL_H */
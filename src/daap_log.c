@@ -34,10 +34,16 @@
  * others to do so.
  */
 
+#include <math.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #include "daap_log_internal.h"
 #include "daap_log.h"
+#include "daap_escape.h"
+#include "daap_journal.h"
+#include "daap_relay.h"
+#include "daap_wire.h"
 
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -47,6 +53,29 @@ static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 #   define USE_SNPRINTF 0
 #endif
 
+/* Sends one influx record over TCP. The connection is kept open between
+ * writes, so the server only sees where a record ends by its newline. */
+static int daapTCPLogWriteLine(char *influx_str) {
+    struct iovec iov[2] = { { influx_str, strlen(influx_str) }, { "\n", 1 } };
+
+    return daapTCPLogWritev(iov, 2);
+}
+
+static int daapLogLine(char *line);
+static int daapLogPriority(bool heartbeat, int num_fields, field_t *fields);
+static int daapLogPriorityMessage(const char *message);
+
+/* everything is written until daapInit() sets the threshold */
+int daap_log_level = LOG_DEBUG;
+
+void daapSetLogLevel(int level) {
+    __atomic_store_n(&daap_log_level, level, __ATOMIC_RELAXED);
+}
+
+void daapsetloglevel_(int *level) {
+    daapSetLogLevel(*level);
+}
+
 /* Function to write out a message to a log (followed by escape/control args),
  * which will then make its way to an off-cluster data analytics system (Tivan
  * on the turquoise network at LANL).
@@ -67,10 +96,11 @@ int daapLogWrite(const char *message, ...) {
     va_list args;
     char *influx_str;
     char full_message[DAAP_MAX_MSG_LEN+1];
+    field_t field;
     unsigned long tstamp;
     int agg_threshold = 0;
     FILE *null_device;
-    int count, msg_len;
+    int msg_len;
     static bool first_time_in_write = true;
 
     if (!daapInit_called) {
@@ -97,6 +127,18 @@ int daapLogWrite(const char *message, ...) {
     va_end(args);
     DEBUG_OUTPUT((full_message));
 
+    /* the relay is sent the message as a record of one field, and builds
+     * the same line from it */
+    if (init_data.transport_type == RELAY) {
+        memset(&field, 0, sizeof(field));
+        field.field_name = MSG_KEY;
+        field.field_val = full_message;
+        if (daapLogFields(0, NULL, 1, &field) == DAAP_SUCCESS) {
+            daapLogFlush();
+        }
+        goto end;
+    }
+
     tstamp = getmillisectime();
     // do some sanity checking on the data here?
 
@@ -106,6 +148,7 @@ int daapLogWrite(const char *message, ...) {
     }
 
     DEBUG_OUTPUT(("Complete influx string: %s", influx_str));
+    daapJournalAppend(tstamp, full_message, influx_str, strlen(influx_str));
 
     // if we are aggregating, just put the data in an internal buffer
     // and increment our aggregator until our threshold is reached;
@@ -127,11 +170,8 @@ int daapLogWrite(const char *message, ...) {
     }
     */
 
-    if (init_data.transport_type == SYSLOG) {
-        DAAP_SYSLOG(init_data.level, influx_str);
-    } else if (init_data.transport_type == TCP) {
-        count = daapTCPLogWrite(influx_str, strlen(influx_str));
-        DEBUG_OUTPUT(("Writing message: %s, written: %d", influx_str, count));
+    if (init_data.transport_type == SYSLOG || init_data.transport_type == TCP) {
+        daapLogLine(influx_str);
     }
     free(influx_str);
 
@@ -146,9 +186,19 @@ void daaplogwrite_(char *message, int len) {
 
 /* Sends a heartbeat message that can then be used in analytics system
    to see status of individual processes that make up a running job and whether
-   all are reporting */
+   all are reporting. It carries the progress counter of daapHeartbeatProgress()
+   and is sent right away, in the priority lane. */
 int daapLogHeartbeat(void) {
-    return daapLogWrite("__daap_heartbeat");
+    field_t fields[2];
+
+    memset(fields, 0, sizeof(fields));
+    fields[0].field_name = MSG_KEY;
+    fields[0].field_val = "__daap_heartbeat";
+    fields[1].field_name = PROGRESS_KEY;
+    fields[1].field_type = DAAP_FIELD_INT;
+    fields[1].int_val = daapHeartbeatProgressValue();
+
+    return daapLogPriority(true, 2, fields);
 }
 
 /* Fortran interface for daapLogHeartbeat */
@@ -158,7 +208,7 @@ void daaplogheartbeat_(void) {
 
 /* Sends a message to mark the point of a job's start */
 int daapLogJobStart(void) {
-    return daapLogWrite("__daap_jobstart");
+    return daapLogPriorityMessage("__daap_jobstart");
 }
 
 /* Fortran interface for daapLogJobStart */
@@ -171,7 +221,10 @@ int daapLogJobDuration(void) {
     //Send the job duration time
 
     unsigned long cur_time = (unsigned long) time(NULL);
-    return daapLogWrite("__daap_jobduration: %d", cur_time - init_data.start_time);
+    char message[64];
+
+    snprintf(message, sizeof(message), "__daap_jobduration: %lu", cur_time - init_data.start_time);
+    return daapLogPriorityMessage(message);
 }
 
 /* Fortran interface for daapLogJobDuration */
@@ -182,7 +235,7 @@ void daaplogjobduration_(void) {
 /* Sends a message to mark the point of a job's end */
 int daapLogJobEnd(void) {
     //Send the job end message
-    return daapLogWrite("__daap_jobend");
+    return daapLogPriorityMessage("__daap_jobend");
 }
 
 /* Fortran interface for daapLogJobEnd */
@@ -212,7 +265,7 @@ int daapLogRawWrite(const char *message, ...) {
     char full_message[DAAP_MAX_MSG_LEN+1];
     int agg_threshold = 0;
     FILE *null_device;
-    int count, msg_len;
+    int msg_len;
     static bool first_time_in_write = true;
 
     if (!daapInit_called) {
@@ -247,56 +300,529 @@ int daapLogRawWrite(const char *message, ...) {
     }
 
     DEBUG_OUTPUT(("Complete influx string: %s", influx_str));
+    daapJournalAppend(getmillisectime(), NULL, influx_str, strlen(influx_str));
 
-    if (init_data.transport_type == SYSLOG) {
-        DAAP_SYSLOG(init_data.level, influx_str);
-    } else if (init_data.transport_type == TCP) {
-        count = daapTCPLogWrite(influx_str, strlen(influx_str));
-        DEBUG_OUTPUT(("Writing message: %s, written: %d", influx_str, count));
-    }
+    daapLogLine(influx_str);
     free(influx_str);
 
  end:
     return 0;
 }
 
-/* Placeholder for now. Will only develop if there is interest.
- * Would provide the ability to read messages that have been written by
- * the application, **local to the node that is calling the function**.
- * Will be further developed if demand exists. */
+/* Reads back the records of key (daapLogKey(), or 0 for all) logged in the
+ * last time_interval seconds (or all those kept, if it is 0) by this
+ * process, from the journal kept local to the node (daap_journal.c) */
 int daapLogRead(int key, int time_interval, int max_rows, char **row_array) {
-
-    /* fopen the local log; */
-    /* search for key and time_interval; */
-    /* populate at most max_rows of row_array with results; */
-    return 0;
+    return daapJournalRead(key, time_interval, max_rows, row_array);
 }
 
-char *daapBuildInflux(long timestamp, char *message) {
+char *daapBuildRawInflux(char *message) {
     int max_size = 2048;
     char *influx_msg = malloc(max_size);
-    long long tstamp = timestamp * 1000000;
 
     snprintf(influx_msg, max_size,
-	    "daap,%s=%s,%s=%s,%s=%s,%s=%ld %s=\"%s\" %lld",
-	    APP_KEY, init_data.appname,
-	    HOST_KEY, init_data.hostname,
-	    CLUSTER_NAME_KEY, init_data.cluster_name,
-	    MPI_RANK_KEY, init_data.mpi_rank,
-	    MSG_KEY, message,
-	    tstamp);
+	     "daap,%s",
+	     message);
 
     return influx_msg;
 }
 
-char *daapBuildRawInflux(char *message) {
-    int max_size = 2048;
-    char *influx_msg = malloc(max_size);
 
-    snprintf(influx_msg, max_size,
-	     "daap,%s",
-	     message);
+/* Growable string used to build batches of influx records (the relay
+ * transport's frames are appended to the same buffer) */
+typedef daap_wire_buf_t strbuf_t;
 
-    return influx_msg;
+/* records waiting to be sent, separated by newlines, or frames for the relay
+ * (protected by log_mutex) */
+static strbuf_t batch;
+static int batch_records = 0;
+
+/* the priority lane: job lifecycle and heartbeat records, in line protocol,
+ * that could not be sent yet (protected by log_mutex) */
+static strbuf_t priority;
+/* where the unsent heartbeat is in it, if there is one */
+static size_t priority_heartbeat = SIZE_MAX;
+/* and the frames they are sent to the relay in */
+static strbuf_t priority_frames;
+
+/* the line protocol of a relay record, for the journal (protected by
+ * log_mutex) */
+static strbuf_t journal_line;
+
+/* what the relay was sent on the current connection */
+static daap_wire_encoder_t *encoder = NULL;
+/* the rank as a tag value, for the relay's records */
+static long encoder_rank = -1;
+static char encoder_rank_str[32];
+
+static int strbufReserve(strbuf_t *sb, size_t len) {
+    size_t size;
+    char *buf;
+
+    if (sb->len + len + 1 <= sb->size) {
+        return 0;
+    }
+    size = sb->size ? sb->size : 1024;
+    while (size < sb->len + len + 1) {
+        size *= 2;
+    }
+    buf = realloc(sb->buf, size);
+    if (buf == NULL) {
+        return -1;
+    }
+    sb->buf = buf;
+    sb->size = size;
+    return 0;
 }
 
+static int strbufAppend(strbuf_t *sb, const char *str, size_t len) {
+    if (strbufReserve(sb, len) != 0) {
+        return -1;
+    }
+    memcpy(sb->buf + sb->len, str, len);
+    sb->len += len;
+    sb->buf[sb->len] = '\0';
+    return 0;
+}
+
+/* Appends str escaped as kind (DAAP_ESCAPE_KEY for tag keys/values and
+ * field keys, DAAP_ESCAPE_STRING for string field values) */
+static int strbufAppendEscaped(strbuf_t *sb, const char *str, int kind) {
+    size_t len = strlen(str);
+
+    /* worst case every character is escaped */
+    if (strbufReserve(sb, 2 * len) != 0) {
+        return -1;
+    }
+    sb->len += daapEscape(sb->buf + sb->len, str, len, kind);
+    sb->buf[sb->len] = '\0';
+    return 0;
+}
+
+/* Appends one tag (skipped if it has no value, which influx does not allow) */
+static int strbufAppendTag(strbuf_t *sb, const char *name, const char *val) {
+    if (name == NULL || val == NULL || name[0] == '\0' || val[0] == '\0') {
+        return 0;
+    }
+    if (strbufAppend(sb, ",", 1) != 0 ||
+        strbufAppendEscaped(sb, name, DAAP_ESCAPE_KEY) != 0 ||
+        strbufAppend(sb, "=", 1) != 0 ||
+        strbufAppendEscaped(sb, val, DAAP_ESCAPE_KEY) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* The record of a message: the message, escaped, is its only field */
+char *daapBuildInflux(long timestamp, char *message) {
+    strbuf_t sb = { NULL, 0, 0 };
+    char num[32];
+    int ret = 0;
+
+    ret |= strbufAppend(&sb, "daap", 4);
+    ret |= strbufAppendTag(&sb, APP_KEY, init_data.appname);
+    ret |= strbufAppendTag(&sb, HOST_KEY, init_data.hostname);
+    ret |= strbufAppendTag(&sb, CLUSTER_NAME_KEY, init_data.cluster_name);
+    snprintf(num, sizeof(num), "%ld", init_data.mpi_rank);
+    ret |= strbufAppendTag(&sb, MPI_RANK_KEY, num);
+    ret |= strbufAppend(&sb, " " MSG_KEY "=\"", strlen(MSG_KEY) + 3);
+    ret |= strbufAppendEscaped(&sb, message, DAAP_ESCAPE_STRING);
+    snprintf(num, sizeof(num), "\" %lld", (long long)timestamp * 1000000);
+    ret |= strbufAppend(&sb, num, strlen(num));
+    if (ret != 0) {
+        free(sb.buf);
+        return NULL;
+    }
+    return sb.buf;
+}
+
+/* Formats a float with the fewest digits (up to 17) that read back exactly */
+void daapFormatDouble(char *buf, size_t size, double val) {
+    snprintf(buf, size, "%.15g", val);
+    if (strtod(buf, NULL) != val) {
+        snprintf(buf, size, "%.17g", val);
+    }
+}
+
+/* Whether a field has a value line protocol can carry: influx has no
+ * representation for inf/nan, and writing them as strings would conflict
+ * with the field's type, so those fields are left out */
+static bool daapFieldWritten(const field_t *field) {
+    return field->field_type != DAAP_FIELD_FLOAT || isfinite(field->float_val);
+}
+
+/* Appends a complete multi-field influx record, terminated by a newline;
+ * the record is expected to have a field daapFieldWritten() */
+static int daapAppendFieldsInflux(strbuf_t *sb, long timestamp, int num_tags, tag_t *tags,
+                                  int num_fields, field_t *fields) {
+    char num[32];
+    int i, written = 0, ret = 0;
+
+    ret |= strbufAppend(sb, "daap", 4);
+    ret |= strbufAppendTag(sb, APP_KEY, init_data.appname);
+    ret |= strbufAppendTag(sb, HOST_KEY, init_data.hostname);
+    ret |= strbufAppendTag(sb, CLUSTER_NAME_KEY, init_data.cluster_name);
+    snprintf(num, sizeof(num), "%ld", init_data.mpi_rank);
+    ret |= strbufAppendTag(sb, MPI_RANK_KEY, num);
+    for (i = 0; i < num_tags; i++) {
+        ret |= strbufAppendTag(sb, tags[i].tag_name, tags[i].tag_val);
+    }
+
+    for (i = 0; i < num_fields; i++) {
+        if (!daapFieldWritten(&fields[i])) {
+            continue;
+        }
+        ret |= strbufAppend(sb, written++ == 0 ? " " : ",", 1);
+        ret |= strbufAppendEscaped(sb, fields[i].field_name, DAAP_ESCAPE_KEY);
+        ret |= strbufAppend(sb, "=", 1);
+        switch (fields[i].field_type) {
+        case DAAP_FIELD_FLOAT:
+            daapFormatDouble(num, sizeof(num), fields[i].float_val);
+            ret |= strbufAppend(sb, num, strlen(num));
+            break;
+        case DAAP_FIELD_INT:
+            snprintf(num, sizeof(num), "%lldi", fields[i].int_val);
+            ret |= strbufAppend(sb, num, strlen(num));
+            break;
+        case DAAP_FIELD_BOOL:
+            ret |= fields[i].int_val ? strbufAppend(sb, "true", 4) :
+                                       strbufAppend(sb, "false", 5);
+            break;
+        default:
+            ret |= strbufAppend(sb, "\"", 1);
+            ret |= strbufAppendEscaped(sb, fields[i].field_val ? fields[i].field_val : "",
+                                       DAAP_ESCAPE_STRING);
+            ret |= strbufAppend(sb, "\"", 1);
+        }
+    }
+
+    snprintf(num, sizeof(num), " %lld\n", (long long)timestamp * 1000000);
+    ret |= strbufAppend(sb, num, strlen(num));
+    return ret;
+}
+
+/* most tags of a relay record kept on the stack */
+#define WIRE_STACK_TAGS 32
+
+/* Appends a record framed for the relay, with the tags of the process
+ * ahead of the caller's as in daapAppendFieldsInflux() */
+static int daapAppendFieldsWire(strbuf_t *sb, long timestamp, int num_tags, tag_t *tags,
+                                int num_fields, field_t *fields) {
+    tag_t stack_tags[WIRE_STACK_TAGS], *all_tags = stack_tags;
+    int ret;
+
+    if (encoder == NULL && (encoder = daapWireEncoderNew()) == NULL) {
+        return -1;
+    }
+    if (num_tags + 4 > WIRE_STACK_TAGS) {
+        all_tags = malloc(sizeof(tag_t) * (num_tags + 4));
+        if (all_tags == NULL) {
+            return -1;
+        }
+    }
+    if (encoder_rank != init_data.mpi_rank) {
+        snprintf(encoder_rank_str, sizeof(encoder_rank_str), "%ld", init_data.mpi_rank);
+        encoder_rank = init_data.mpi_rank;
+    }
+    all_tags[0].tag_name = APP_KEY;
+    all_tags[0].tag_val = init_data.appname;
+    all_tags[1].tag_name = HOST_KEY;
+    all_tags[1].tag_val = init_data.hostname;
+    all_tags[2].tag_name = CLUSTER_NAME_KEY;
+    all_tags[2].tag_val = init_data.cluster_name;
+    all_tags[3].tag_name = MPI_RANK_KEY;
+    all_tags[3].tag_val = encoder_rank_str;
+    if (num_tags > 0) {
+        memcpy(all_tags + 4, tags, sizeof(tag_t) * num_tags);
+    }
+
+    ret = daapWireEncodeRecord(encoder, sb, timestamp, "daap", num_tags + 4, all_tags,
+                               num_fields, fields);
+    if (all_tags != stack_tags) {
+        free(all_tags);
+    }
+    return ret;
+}
+
+/* Sends the records of the priority lane, in their own write, ahead of the
+ * batch. Those that cannot be sent stay in the lane, to be sent again
+ * before anything else. Called with log_mutex held. */
+static int daapSendPriority(void) {
+    char *record, *newline;
+    int ret_val = DAAP_SUCCESS;
+
+    if (priority.len == 0) {
+        return DAAP_SUCCESS;
+    }
+
+    if (init_data.transport_type == SYSLOG) {
+        for (record = priority.buf; record < priority.buf + priority.len; record = newline + 1) {
+            newline = strchr(record, '\n');
+            *newline = '\0';
+            DAAP_SYSLOG(init_data.level, record);
+        }
+    } else if (init_data.transport_type == TCP) {
+        if (daapTCPLogWritePriority(priority.buf, (int)priority.len) < 0) {
+            ret_val = DAAP_ERROR;
+        }
+    } else if (init_data.transport_type == RELAY) {
+        /* as line frames, which need no definitions, so the batch can
+         * still follow them on the same connection */
+        priority_frames.len = 0;
+        for (record = priority.buf; record < priority.buf + priority.len; record = newline + 1) {
+            newline = strchr(record, '\n');
+            if (daapWireEncodeLine(&priority_frames, record, newline - record) != 0) {
+                return DAAP_ERROR_OUT_OF_MEMORY;
+            }
+        }
+        if (daapRelayWritePriority(priority_frames.buf, priority_frames.len) < 0) {
+            /* the batch refers to definitions sent on the lost connection
+             * (there are none before the first record is encoded), so it
+             * is made to carry them to the next one */
+            if (encoder != NULL && daapWireEncodeResend(encoder, &batch) != 0) {
+                ERROR_OUTPUT(("Dropping a batch of %d records that could not be re-encoded",
+                              batch_records));
+                daapWireEncoderReset(encoder);
+                batch.len = 0;
+                batch_records = 0;
+            }
+            ret_val = DAAP_ERROR;
+        }
+    }
+
+    if (ret_val == DAAP_SUCCESS) {
+        priority.len = 0;
+        priority_heartbeat = SIZE_MAX;
+    }
+    return ret_val;
+}
+
+/* The name a record is journaled under: its metric, or else its message */
+static const char *daapRecordName(int num_fields, field_t *fields) {
+    const char *message = NULL;
+    int i;
+
+    for (i = 0; i < num_fields; i++) {
+        if (fields[i].field_type != DAAP_FIELD_STRING || fields[i].field_name == NULL) {
+            continue;
+        }
+        if (strcmp(fields[i].field_name, METRIC_KEY) == 0) {
+            return fields[i].field_val;
+        }
+        if (message == NULL && strcmp(fields[i].field_name, MSG_KEY) == 0) {
+            message = fields[i].field_val;
+        }
+    }
+    return message;
+}
+
+/* Puts a record in the priority lane and sends the lane. Returns
+ * DAAP_SUCCESS once the record is in the lane, which is sent again until
+ * it goes through. An unsent heartbeat gives way to a newer one; job
+ * lifecycle records are kept, and a record that would take the lane past
+ * DAAP_PRIORITY_MAX_BYTES is refused instead. */
+static int daapLogPriority(bool heartbeat, int num_fields, field_t *fields) {
+    long timestamp = getmillisectime();
+    size_t start;
+    char *stale, *end;
+
+    if (!daapInit_called) {
+        errno = EPERM;
+        return DAAP_ERROR;
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    if (heartbeat && priority_heartbeat != SIZE_MAX) {
+        stale = priority.buf + priority_heartbeat;
+        end = (char *)memchr(stale, '\n', priority.buf + priority.len - stale) + 1;
+        memmove(stale, end, priority.buf + priority.len - end);
+        priority.len -= end - stale;
+        priority_heartbeat = SIZE_MAX;
+    }
+    start = priority.len;
+    if (daapAppendFieldsInflux(&priority, timestamp, 0, NULL, num_fields, fields) != 0) {
+        priority.len = start;
+        pthread_mutex_unlock(&log_mutex);
+        ERROR_OUTPUT(("Failed to allocate influx record"));
+        return DAAP_ERROR_OUT_OF_MEMORY;
+    }
+    if (priority.len > DAAP_PRIORITY_MAX_BYTES) {
+        priority.len = start;
+        pthread_mutex_unlock(&log_mutex);
+        ERROR_OUTPUT(("Dropping a lifecycle record: the priority lane is full, with %zu "
+                      "bytes unsent", start));
+        return DAAP_ERROR;
+    }
+    if (heartbeat) {
+        priority_heartbeat = start;
+    }
+    daapJournalAppend(timestamp, daapRecordName(num_fields, fields), priority.buf + start,
+                      priority.len - start - 1);
+    if (daapSendPriority() != DAAP_SUCCESS) {
+        DEBUG_OUTPUT(("Keeping %zu bytes of lifecycle records for the next send",
+                      priority.len));
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return DAAP_SUCCESS;
+}
+
+/* A message record of the priority lane */
+static int daapLogPriorityMessage(const char *message) {
+    field_t field;
+
+    memset(&field, 0, sizeof(field));
+    field.field_name = MSG_KEY;
+    field.field_val = (char *)message;
+    return daapLogPriority(false, 1, &field);
+}
+
+/* Sends the batched records, after the priority lane if it could not be
+ * sent before. Called with log_mutex held. */
+static int daapSendBatch(void) {
+    char *record, *newline;
+    int ret_val = DAAP_SUCCESS;
+    int count;
+
+    if (daapSendPriority() != DAAP_SUCCESS && init_data.transport_type == RELAY &&
+        batch_records > 0 && batch.len < DAAP_BATCH_MAX_BYTES) {
+        /* the relay connection was just lost: the batch, made ready for
+         * the next one, waits for the next send */
+        return DAAP_ERROR;
+    }
+    if (batch_records == 0) {
+        return DAAP_SUCCESS;
+    }
+
+    if (init_data.transport_type == SYSLOG) {
+        /* syslog is line oriented, so each record is its own message */
+        for (record = batch.buf; record < batch.buf + batch.len; record = newline + 1) {
+            newline = strchr(record, '\n');
+            *newline = '\0';
+            DAAP_SYSLOG(init_data.level, record);
+        }
+    } else if (init_data.transport_type == TCP) {
+        count = daapTCPLogWrite(batch.buf, batch.len);
+        DEBUG_OUTPUT(("Writing batch of %d records, written: %d", batch_records, count));
+        if (count < 0) {
+            ret_val = DAAP_ERROR;
+        }
+    } else if (init_data.transport_type == RELAY) {
+        /* the next connection starts without the definitions of this one */
+        if (daapRelayWrite(batch.buf, batch.len) < 0) {
+            daapWireEncoderReset(encoder);
+            ret_val = DAAP_ERROR;
+        }
+    }
+
+    /* a batch that could not be sent is dropped all the same */
+    batch.len = 0;
+    batch_records = 0;
+    if (encoder != NULL) {
+        daapWireEncoderMark(encoder, 0);
+    }
+    return ret_val;
+}
+
+int daapLogFields(int num_tags, tag_t *tags, int num_fields, field_t *fields) {
+    return daapLogFieldsAt(getmillisectime(), num_tags, tags, num_fields, fields);
+}
+
+/* daapLogFields() of a record made earlier, at timestamp (milliseconds) */
+int daapLogFieldsAt(long timestamp, int num_tags, tag_t *tags, int num_fields,
+                    field_t *fields) {
+    int ret_val = DAAP_SUCCESS;
+    size_t start;
+    int i, ret;
+
+    if (!daapInit_called) {
+        errno = EPERM;
+        return DAAP_ERROR;
+    }
+    if (num_fields <= 0 || fields == NULL || (num_tags > 0 && tags == NULL)) {
+        errno = EINVAL;
+        return DAAP_ERROR;
+    }
+    /* a record of inf/nan values alone has nothing to send */
+    for (i = 0; i < num_fields && !daapFieldWritten(&fields[i]); i++) {
+    }
+    if (i == num_fields) {
+        DEBUG_OUTPUT(("Dropping a record without finite values"));
+        return DAAP_SUCCESS;
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    start = batch.len;
+    if (init_data.transport_type == RELAY) {
+        ret = daapAppendFieldsWire(&batch, timestamp, num_tags, tags, num_fields, fields);
+    } else {
+        ret = daapAppendFieldsInflux(&batch, timestamp, num_tags, tags, num_fields, fields);
+    }
+    if (ret != 0) {
+        /* drop the partial record */
+        batch.len = start;
+        pthread_mutex_unlock(&log_mutex);
+        ERROR_OUTPUT(("Failed to allocate influx record"));
+        return DAAP_ERROR_OUT_OF_MEMORY;
+    }
+    batch_records++;
+    if (init_data.transport_type != RELAY) {
+        DEBUG_OUTPUT(("Batched influx record: %s", batch.buf + start));
+        daapJournalAppend(timestamp, daapRecordName(num_fields, fields), batch.buf + start,
+                          batch.len - start - 1);
+    } else if (daapJournalActive()) {
+        /* the relay is sent frames, so the line is built for the journal */
+        journal_line.len = 0;
+        if (daapAppendFieldsInflux(&journal_line, timestamp, num_tags, tags, num_fields,
+                                   fields) == 0) {
+            daapJournalAppend(timestamp, daapRecordName(num_fields, fields), journal_line.buf,
+                              journal_line.len - 1);
+        }
+    }
+
+    if (batch_records >= init_data.agg_val || batch.len >= DAAP_BATCH_MAX_BYTES) {
+        ret_val = daapSendBatch();
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return ret_val;
+}
+
+/* Sends a record already in line protocol right away, after the batched
+ * ones, so that the server gets the records in the order they were logged */
+static int daapLogLine(char *line) {
+    int ret_val;
+
+    pthread_mutex_lock(&log_mutex);
+    if (init_data.transport_type == RELAY) {
+        if (daapWireEncodeLine(&batch, line, strlen(line)) == 0) {
+            batch_records++;
+        }
+        ret_val = daapSendBatch();
+    } else {
+        ret_val = daapSendBatch();
+        if (init_data.transport_type == SYSLOG) {
+            DAAP_SYSLOG(init_data.level, line);
+        } else if (init_data.transport_type == TCP && daapTCPLogWriteLine(line) < 0) {
+            ret_val = DAAP_ERROR;
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return ret_val;
+}
+
+int daapLogFlush(void) {
+    int ret_val;
+
+    if (!daapInit_called) {
+        errno = EPERM;
+        return DAAP_ERROR;
+    }
+
+    pthread_mutex_lock(&log_mutex);
+    ret_val = daapSendBatch();
+    pthread_mutex_unlock(&log_mutex);
+    return ret_val;
+}
+
+void daaplogflush_(void) {
+    daapLogFlush();
+}
@@ -14,6 +14,30 @@
  * as calling printf() and should not be used in untrusted environments.
  *
  *****************
+ * DAAP_LOG()
+ * daapSetLogLevel()
+ *
+ * Calls daapLogWrite() only for syslog levels at or below a threshold,
+ * which daapInit() sets from its msg_level (or DAAP_LOG_LEVEL). A call
+ * that is disabled costs a load and a branch, without evaluating its
+ * arguments, and calls above DAAP_LOG_CEILING are compiled out.
+ *
+ *****************
+ * DAAP_LOG_DEFERRED()
+ *
+ * Like DAAP_LOG(), but the calling thread only copies the arguments, and a
+ * background thread formats and sends the messages later. Defining
+ * DAAP_LOG_DEFER before including this header makes DAAP_LOG() deferred.
+ *
+ *****************
+ * daapLogFields()
+ * daapLogFlush()
+ *
+ * Writes out one record made of a number of named fields (plus optional
+ * extra tags). Records are batched according to the aggregation level given
+ * to daapInit() and sent together; daapLogFlush() sends any pending records.
+ *
+ *****************
  * daapLogHeartbeat()
  * daapLogJobStart()
  * daapLogJobDuration()
@@ -25,18 +49,54 @@
  * should only be called by rank 0.
  *
  *****************
+ * daapParserCreate()
+ * daapParserFeed()
+ * daapParserFlush()
+ * daapParserDestroy()
+ *
+ * Matches text the application produces (such as its own reports) against
+ * the key and table templates of stdout_parser, as the text is produced,
+ * and sends the values found with daapLogFields().
+ *
+ *****************
  * daapInit()
  * daapFinalize()
  *
  * Routines to initialize and destroy structures needed by DAAP. Must be called by all ranks
- * that make DAAP calls.
+ * that make DAAP calls. With DAAP_HEARTBEAT_PERIOD set to a number of seconds,
+ * daapInit() also starts a thread that sends a heartbeat every period, each rank
+ * at its own phase of the period so that the ranks of a job do not all send at
+ * once.
+ *
+ *****************
+ * daapHeartbeatProgress()
+ *
+ * Adds to a progress counter (a single atomic add) that is sent with every
+ * heartbeat.
+ *
+ *****************
+ * daapRegionBegin()
+ * daapRegionEnd()
+ * daapRegionFlush()
+ *
+ * Time named, possibly nested, phases of the application. Each region's
+ * count and total, self, minimum and maximum time are aggregated in
+ * memory and sent as one record per region by daapRegionFlush(), every
+ * DAAP_REGION_PERIOD seconds if that is set, and by daapFinalize().
+ * With DAAP_REGION_COUNTERS=1, perf_event counters (task clock, context
+ * switches, page faults, CPU migrations, and cycles and instructions where
+ * available) are summed per region as well.
  *
  *****************
  * daapLogRead()
+ * daapLogKey()
  *
- *   Placeholder. Would provide the ability to read messages that
- *   have been written by the application, **local to the node that is
- *   calling the function**. Will be further developed if demand exists.
+ *   Reads back the records the process logged, **local to the node that
+ *   is calling the function**: with DAAP_JOURNAL set to a directory, the
+ *   records are also kept in a memory-mapped journal there (of
+ *   DAAP_JOURNAL_SIZE MiB, 16 by default, the oldest records making way),
+ *   indexed by time and by key, the hash of a record's metric field or
+ *   else its message.
  *
  *****************
  * Authors:
@@ -93,7 +153,8 @@
 typedef enum transports {
   NONE,
   SYSLOG,
-  TCP
+  TCP,
+  RELAY       /* binary frames to the node's daap_relay */
 } transport;
 
 /* types of messages that can be sent */
@@ -110,6 +171,25 @@ typedef struct {
     char *tag_val;
 } tag_t;
 
+/* types of field values */
+typedef enum fieldtype {
+    DAAP_FIELD_STRING,
+    DAAP_FIELD_FLOAT,
+    DAAP_FIELD_INT,
+    DAAP_FIELD_BOOL
+} fieldtype;
+
+/* Struct type for holding a field (the combination of field name and field value).
+ * field_type selects which of the values is used; a zeroed field_type is a
+ * string field. */
+typedef struct {
+    char *field_name;
+    char *field_val;         /* DAAP_FIELD_STRING */
+    fieldtype field_type;
+    double float_val;        /* DAAP_FIELD_FLOAT */
+    long long int_val;       /* DAAP_FIELD_INT, DAAP_FIELD_BOOL (0 or 1) */
+} field_t;
+
 /* Struct type for holding metric-related data */
 typedef struct {
     char *metric_name;
@@ -145,6 +225,7 @@ extern daap_init_t init_data;
 #define CLUSTER_NAME_KEY "cluster"
 #define MPI_RANK_KEY     "mpirank"
 #define MSG_KEY          "message"
+#define PROGRESS_KEY     "progress"
 #define METRIC_KEY       "metric"
 
 #define DAAP_SUCCESS 0
@@ -159,6 +240,9 @@ extern daap_init_t init_data;
 #define DAAP_AGG_SUPER 10000
 
 #define DAAP_MAX_MSG_LEN 8096
+#define DAAP_BATCH_MAX_BYTES 65536
+/* unsent job lifecycle and heartbeat records kept for the next send */
+#define DAAP_PRIORITY_MAX_BYTES 65536
 
 extern bool daapRank_zero;
 
@@ -193,16 +277,115 @@ int daapLogWrite(const char *message, ...);
 /* Fortran version of daapLogWrite */
 void daaplogwrite_(char *message, int len);
 
-/* Placeholder for on-node read capability (presently does nothing,
-   could be developed if demand exists) */
+/* Threshold of DAAP_LOG(): the highest syslog level written (LOG_EMERG to
+ * LOG_DEBUG, -1 for none). Read by the macros; change it with
+ * daapSetLogLevel(). */
+extern int daap_log_level;
+
+/* Sets the threshold of DAAP_LOG() at run time */
+void daapSetLogLevel(int level);
+
+/* Fortran version of daapSetLogLevel */
+void daapsetloglevel_(int *level);
+
+/* Level-gated daapLogWrite(): DAAP_LOG(LOG_INFO, "step %d", step) writes
+ * only if LOG_INFO is at or below the threshold. Defining DAAP_LOG_CEILING
+ * to a level before including this header removes the calls above it at
+ * compile time, as linking daap_log_empty removes all of them. */
+#ifndef DAAP_LOG_CEILING
+#    define DAAP_LOG_CEILING LOG_DEBUG
+#endif
+
+#if defined __GNUC__
+#    define DAAP_LOG_ENABLED(level)                                            \
+        ((level) <= DAAP_LOG_CEILING &&                                        \
+         __builtin_expect((level) <= __atomic_load_n(&daap_log_level, __ATOMIC_RELAXED), 1))
+#else
+#    define DAAP_LOG_ENABLED(level)                                            \
+        ((level) <= DAAP_LOG_CEILING && (level) <= *(volatile int *)&daap_log_level)
+#endif
+
+/* A call site of DAAP_LOG_DEFERRED(), which registers its format at its
+ * first call: 0 until then, -1 if the format is formatted right away */
+typedef struct {
+    int id;
+} daap_log_site_t;
+
+/* daapLogWrite() that formats the message later, in the background, and
+ * sends it with the time of the call. The calling thread copies the
+ * arguments (and the strings), which costs tens of nanoseconds instead of
+ * the formatting. format must be the same at each call of a site. Use
+ * through DAAP_LOG_DEFERRED(). */
+int daapLogDeferred(daap_log_site_t *site, const char *format, ...);
+
+#define DAAP_LOG_DEFERRED(level, ...)                                          \
+    do {                                                                       \
+        static daap_log_site_t daap_log_site_ = { 0 };                         \
+        if (DAAP_LOG_ENABLED(level)) {                                         \
+            daapLogDeferred(&daap_log_site_, __VA_ARGS__);                     \
+        }                                                                      \
+    } while (0)
+
+#ifdef DAAP_LOG_DEFER
+#    define DAAP_LOG(level, ...) DAAP_LOG_DEFERRED(level, __VA_ARGS__)
+#else
+#    define DAAP_LOG(level, ...)                                               \
+        do {                                                                   \
+            if (DAAP_LOG_ENABLED(level)) {                                     \
+                daapLogWrite(__VA_ARGS__);                                     \
+            }                                                                  \
+        } while (0)
+#endif
+
+#define DAAP_LOG_ERR(...)     DAAP_LOG(LOG_ERR, __VA_ARGS__)
+#define DAAP_LOG_WARNING(...) DAAP_LOG(LOG_WARNING, __VA_ARGS__)
+#define DAAP_LOG_NOTICE(...)  DAAP_LOG(LOG_NOTICE, __VA_ARGS__)
+#define DAAP_LOG_INFO(...)    DAAP_LOG(LOG_INFO, __VA_ARGS__)
+#define DAAP_LOG_DEBUG(...)   DAAP_LOG(LOG_DEBUG, __VA_ARGS__)
+
+/* Fills row_array with up to max_rows records (line protocol), oldest
+ * first, of key (from daapLogKey(), or 0 for any) logged by this process in
+ * the last time_interval seconds (0 for all those journaled), and returns
+ * how many. The rows are copies, which the caller frees with free().
+ * Returns DAAP_ERROR with errno ENOENT if DAAP_JOURNAL is not set, or
+ * ENOMEM (and no rows). */
 int daapLogRead(int key, int time_interval, int max_rows, char **row_array);
 
+/* The key of the records whose metric (or message) is name */
+int daapLogKey(const char *name);
+
 /* Function to log a heartbeat from an application process */
 int daapLogHeartbeat(void);
 
 /* Fortran version of daapLogHeartbeat */
 void daaplogheartbeat_(void);
 
+/* Adds count to the progress counter sent with each heartbeat. Cheap enough
+ * to call every iteration. */
+void daapHeartbeatProgress(long count);
+
+/* Fortran version of daapHeartbeatProgress */
+void daapheartbeatprogress_(long *count);
+
+/* Starts timing the region name in the calling thread. Regions nest, and
+ * the time of a region does not count in the self time of the one around
+ * it. Cheap enough to wrap every time step; does not need daapInit. */
+int daapRegionBegin(const char *name);
+
+/* Ends the region name, which must be the innermost region open in the
+ * calling thread */
+int daapRegionEnd(const char *name);
+
+/* Sends one record per region timed since the last flush, with the count
+ * and the total, self, min and max times (in seconds) of all threads, and
+ * the sums of their counters with DAAP_REGION_COUNTERS */
+int daapRegionFlush(void);
+
+/* Fortran versions of daapRegionBegin, daapRegionEnd and daapRegionFlush */
+void daapregionbegin_(char *name, int len);
+void daapregionend_(char *name, int len);
+void daapregionflush_(void);
+
 /* Function to log a job start from an application process */
 int daapLogJobStart(void);
 
@@ -227,6 +410,57 @@ void daaplogjobend_(void);
  * called prior to invoking daapLogWrite. */
 int daapLogRawWrite(const char *message, ...);
 
+/* Function to write one record with several fields (and optional extra tags
+ * added to the standard appname/hostname/cluster/mpirank tags). The record
+ * is added to a batch that is sent in a single transport write once
+ * agg_val records (see daapInit) or DAAP_BATCH_MAX_BYTES have accumulated.
+ * Names and values are escaped, so they are not format strings. Returns
+ * DAAP_ERROR if the batch it completed could not be sent (it is dropped). */
+int daapLogFields(int num_tags, tag_t *tags, int num_fields, field_t *fields);
+
+/* Sends any records batched by daapLogFields(). Also done by daapFinalize().
+ * Returns DAAP_ERROR if they could not be sent. */
+int daapLogFlush(void);
+
+/* Fortran version of daapLogFlush */
+void daaplogflush_(void);
+
+/* Handle of a template parser created by daapParserCreate() */
+typedef struct daap_parser daap_parser_t;
+
+/* Creates a parser for the templates in a bundle written by
+ * stdout_parser --compile. If the template files the bundle was compiled
+ * from have changed since, they are compiled instead. Returns NULL on
+ * error. A parser must only be used by one thread at a time. */
+daap_parser_t *daapParserCreate(const char *bundle);
+
+/* Fortran version of daapParserCreate (the handle is an INTEGER(8), 0 on
+ * error) */
+void daapparsercreate_(char *bundle, long *handle, int len);
+
+/* Parses the next len bytes of text. buf does not have to end on a line
+ * boundary: a partial line is kept until the rest of it is fed. The values
+ * of each complete line (or table row) are sent as one record; daapInit
+ * must be called first. */
+int daapParserFeed(daap_parser_t *parser, const char *buf, size_t len);
+
+/* Fortran version of daapParserFeed, feeding one line */
+void daapparserfeed_(long *handle, char *buf, int len);
+
+/* Parses a final line without a newline, ends any table in progress and
+ * sends the batched records with daapLogFlush() */
+int daapParserFlush(daap_parser_t *parser);
+
+/* Fortran version of daapParserFlush */
+void daapparserflush_(long *handle);
+
+/* Frees a parser (text fed since the last daapParserFlush() that does not
+ * end in a newline is not parsed) */
+void daapParserDestroy(daap_parser_t *parser);
+
+/* Fortran version of daapParserDestroy */
+void daapparserdestroy_(long *handle);
+
 /* Initializes the combination of a named metric and a number of named tags
  *   (up to 10). Values for the metric and tags are then specified in each
  *   call to daapMetricWrite(). */
@@ -241,7 +475,8 @@ int daapMetricDestroy(metric_t metric);
  * Tivan on the open side at LANL) */
 int daapMetricWrite(metric_t metric);
 
-/* Builds an influxdb string */
+/* Builds an influxdb string, with the message (and the application, host
+ * and cluster names) escaped as line protocol requires */
 char *daapBuildInflux(long timestamp, char *message);
 
 /* Builds an influxdb string without tags */
@@ -9,16 +9,51 @@
  */
 #include <stdarg.h>
 
+#include "daap_log.h"
+
 int daapLogWrite(const char *message, ...) {
     va_list args;
 
     return 0;
 }
 
+/* DAAP_LOG() writes nothing */
+int daap_log_level = -1;
+
+void daapSetLogLevel(int level) {
+}
+
+int daapLogDeferred(daap_log_site_t *site, const char *format, ...) {
+    return 0;
+}
+
+int daapLogRead(int key, int time_interval, int max_rows, char **row_array) {
+    return 0;
+}
+
+int daapLogKey(const char *name) {
+    return 0;
+}
+
 int daapLogHeartbeat(void) {
     return 0;
 }
 
+void daapHeartbeatProgress(long count) {
+}
+
+int daapRegionBegin(const char *name) {
+    return 0;
+}
+
+int daapRegionEnd(const char *name) {
+    return 0;
+}
+
+int daapRegionFlush(void) {
+    return 0;
+}
+
 int daapLogJobStart(void) {
     return 0;
 }
@@ -26,3 +61,26 @@ int daapLogJobStart(void) {
 int daapLogJobEnd(void) {
     return 0;
 }
+
+int daapLogFields(int num_tags, tag_t *tags, int num_fields, field_t *fields) {
+    return 0;
+}
+
+int daapLogFlush(void) {
+    return 0;
+}
+
+daap_parser_t *daapParserCreate(const char *bundle) {
+    return NULL;
+}
+
+int daapParserFeed(daap_parser_t *parser, const char *buf, size_t len) {
+    return 0;
+}
+
+int daapParserFlush(daap_parser_t *parser) {
+    return 0;
+}
+
+void daapParserDestroy(daap_parser_t *parser) {
+}
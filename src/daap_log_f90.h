@@ -6,12 +6,32 @@ void daapfinalize_(void);
 
 void daaplogwrite_(char *message, int len);
 
+void daapsetloglevel_(int *level);
+
 void daaplogheartbeat_(void);
 
+void daapheartbeatprogress_(long *count);
+
 void daaplogjobstart_(void);
 
 void daaplogjobduration_(void);
 
 void daaplogjobend_(void);
 
+void daaplogflush_(void);
+
+void daapregionbegin_(char *name, int len);
+
+void daapregionend_(char *name, int len);
+
+void daapregionflush_(void);
+
+void daapparsercreate_(char *bundle, long *handle, int len);
+
+void daapparserfeed_(long *handle, char *buf, int len);
+
+void daapparserflush_(long *handle);
+
+void daapparserdestroy_(long *handle);
+
 void daapsetrank_(int *);
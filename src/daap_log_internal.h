@@ -25,7 +25,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
-# define PORT 5555
+#include "daap_log.h"
 
 #define NULL_DEVICE "/dev/null"
 
@@ -40,10 +40,44 @@
 #endif
 
 extern bool daapInit_called;
+/* set before daapInit() to send no job start and end messages whatever
+ * DAAP_DECOUPLE says, as by a process whose output is only captured */
+extern bool daapInit_decoupled;
 
 extern unsigned long getmillisectime();
 extern int getmillisectime_as_str(char **time_str);
 
+/* background heartbeat (daap_heartbeat.c) */
+extern int daapHeartbeatStart(void);
+extern void daapHeartbeatStop(void);
+extern long daapHeartbeatProgressValue(void);
+
+/* periodic flush of the region timings (daap_region.c) */
+extern int daapRegionStart(void);
+extern void daapRegionStop(void);
+
+/* background resource sampler (daap_sampler.c) */
+extern int daapSamplerStart(void);
+extern void daapSamplerStop(void);
+
+/* TLS handshake statistics record, a write of several buffers, and a write
+ * of the priority lane (daap_tcp.c) */
+struct iovec;
+extern int daapTCPLogStats(void);
+extern int daapTCPLogWritev(const struct iovec *iov, int iovcnt);
+extern int daapTCPLogWritePriority(const char *buf, int buf_size);
+
+/* daapLogFields() with the timestamp (milliseconds) of the record (daap_log.c) */
+extern int daapLogFieldsAt(long timestamp, int num_tags, tag_t *tags, int num_fields,
+                           field_t *fields);
+
+/* stops the formatting thread of deferred records, sending them all
+ * (daap_defer.c) */
+extern void daapDeferStop(void);
+
+/* shortest exact text of a float field (daap_log.c) */
+extern void daapFormatDouble(char *buf, size_t size, double val);
+
 #define LOCAL_MAXHOSTNAMELEN 257
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 256
@@ -55,6 +89,10 @@ extern int getmillisectime_as_str(char **time_str);
 
 extern char daap_hostname[LOCAL_MAXHOSTNAMELEN];
 
+/* API functions defined in code compiled with hidden visibility (the
+ * template engine, the preload library) */
+#define DAAP_EXPORT __attribute__((visibility("default")))
+
 #define FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 #define PRINT_MAX 1024
 
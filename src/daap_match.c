@@ -0,0 +1,823 @@
+/*
+ * Key regex matching engine for the stdout parser
+ *
+ * parseResults() used to run every key regex against every line. Most
+ * template regexes can only match lines containing some fixed text (a key
+ * name, a ':' or '=' ...), so each regex is reduced to the literals that
+ * any match of it must contain. All of those literals are put in a single
+ * Aho-Corasick automaton; one pass over a line then yields the regexes
+ * whose literals are all present, and only those candidates are run with
+ * pcre_exec. Regexes are also studied with PCRE_STUDY_JIT_COMPILE so the
+ * candidates that do run use JIT compiled code.
+ *
+ * Literal extraction is deliberately conservative: any pattern construct
+ * that is not clearly understood (alternation, option settings,
+ * lookarounds, \Q..\E, numeric escapes ...) makes the regex an "always
+ * run" regex rather than risking a missed match.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_match.h"
+#include "daap_number.h"
+
+#define MAX_LITERAL_LEN 256
+/* runs collected per pattern before the longest ones are kept */
+#define MAX_RUNS 64
+
+/* Parse a quantifier at p. Returns 1 and sets the minimum repeat count and
+ * the position after the quantifier if there is one, 0 otherwise. */
+static int parseQuantifier(const char *p, int *min_reps, const char **after) {
+    const char *q;
+
+    if (*p == '*' || *p == '?') {
+        *min_reps = 0;
+        q = p + 1;
+    }
+    else if (*p == '+') {
+        *min_reps = 1;
+        q = p + 1;
+    }
+    else if (*p == '{' && isdigit((unsigned char)p[1])) {
+        /* {n}, {n,} or {n,m}; anything else is a literal { in PCRE */
+        q = p + 1;
+        *min_reps = 0;
+        while (isdigit((unsigned char)*q)) {
+            *min_reps = *min_reps * 10 + (*q - '0');
+            q++;
+        }
+        if (*q == ',') {
+            q++;
+            while (isdigit((unsigned char)*q)) {
+                q++;
+            }
+        }
+        if (*q != '}') {
+            return 0;
+        }
+        q++;
+    }
+    else {
+        return 0;
+    }
+
+    /* lazy or possessive modifier */
+    if (*q == '?' || *q == '+') {
+        q++;
+    }
+    *after = q;
+    return 1;
+}
+
+/* Skip a character class starting at p ('['). Returns the position after
+ * the closing ']' or NULL if the class is not terminated. */
+static const char *skipClass(const char *p) {
+    p++;
+    if (*p == '^') {
+        p++;
+    }
+    /* a ] right at the start is a literal */
+    if (*p == ']') {
+        p++;
+    }
+    while (*p && *p != ']') {
+        if (*p == '\\' && p[1]) {
+            p += 2;
+        }
+        else if (*p == '[' && p[1] == ':') {
+            /* POSIX class such as [:digit:] */
+            const char *end = strstr(p + 2, ":]");
+            if (!end) {
+                return NULL;
+            }
+            p = end + 2;
+        }
+        else {
+            p++;
+        }
+    }
+    return *p ? p + 1 : NULL;
+}
+
+/* Find the ')' matching the '(' at p, or NULL */
+static const char *matchingParen(const char *p) {
+    int depth = 0;
+
+    while (*p) {
+        if (*p == '\\' && p[1]) {
+            p += 2;
+            continue;
+        }
+        if (*p == '[') {
+            p = skipClass(p);
+            if (!p) {
+                return NULL;
+            }
+            continue;
+        }
+        if (*p == '(') {
+            depth++;
+        }
+        else if (*p == ')') {
+            depth--;
+            if (depth == 0) {
+                return p;
+            }
+        }
+        p++;
+    }
+    return NULL;
+}
+
+/* Returns 1 if the pattern uses constructs we do not extract literals from */
+static int unsupportedPattern(const char *p) {
+    while (*p) {
+        if (*p == '\\' && p[1]) {
+            p += 2;
+            continue;
+        }
+        if (*p == '[') {
+            p = skipClass(p);
+            if (!p) {
+                return 1;
+            }
+            continue;
+        }
+        if (*p == '|') {
+            return 1;
+        }
+        /* only non-capturing groups and comments are understood */
+        if (*p == '(' && p[1] == '?' && p[2] != ':' && p[2] != '#') {
+            return 1;
+        }
+        p++;
+    }
+    return 0;
+}
+
+/* Escapes that stand for a single literal character we can't easily
+ * decode, or that change how the rest of the pattern is read */
+static int unsupportedEscape(char c) {
+    return strchr("xcopPNkgQE0123456789", c) != NULL;
+}
+
+static void addRun(char runs[MAX_RUNS][MAX_LITERAL_LEN], int *num_runs,
+                   char *run, int *run_len) {
+    int i;
+
+    if (*run_len == 0) {
+        return;
+    }
+    run[*run_len] = '\0';
+    *run_len = 0;
+
+    for (i = 0; i < *num_runs; i++) {
+        if (strcmp(runs[i], run) == 0) {
+            return;
+        }
+    }
+    if (*num_runs < MAX_RUNS) {
+        strcpy(runs[*num_runs], run);
+        (*num_runs)++;
+    }
+}
+
+int daapRequiredLiterals(const char *pattern,
+                         char literals[DAAP_MATCH_MAX_LITERALS][256]) {
+    char runs[MAX_RUNS][MAX_LITERAL_LEN];
+    char run[MAX_LITERAL_LEN];
+    int num_runs = 0, run_len = 0;
+    int used[MAX_RUNS];
+    int num_literals = 0;
+    int min_reps, best, i, j;
+    const char *p = pattern;
+    const char *close, *after;
+    char c;
+
+    if (unsupportedPattern(pattern)) {
+        return 0;
+    }
+
+    while (*p) {
+        c = *p;
+        if (c == '\\') {
+            if (!p[1] || unsupportedEscape(p[1])) {
+                return 0;
+            }
+            if (isalnum((unsigned char)p[1])) {
+                /* \s, \d, \b ... : not a literal */
+                addRun(runs, &num_runs, run, &run_len);
+                p += 2;
+                if (parseQuantifier(p, &min_reps, &after)) {
+                    p = after;
+                }
+                continue;
+            }
+            /* escaped punctuation is a literal character */
+            c = p[1];
+            p += 2;
+        }
+        else if (c == '[') {
+            addRun(runs, &num_runs, run, &run_len);
+            p = skipClass(p);
+            if (!p) {
+                return 0;
+            }
+            if (parseQuantifier(p, &min_reps, &after)) {
+                p = after;
+            }
+            continue;
+        }
+        else if (c == '.' || c == '^' || c == '$') {
+            addRun(runs, &num_runs, run, &run_len);
+            p++;
+            if (parseQuantifier(p, &min_reps, &after)) {
+                p = after;
+            }
+            continue;
+        }
+        else if (c == '(') {
+            addRun(runs, &num_runs, run, &run_len);
+            close = matchingParen(p);
+            if (!close) {
+                return 0;
+            }
+            if (p[1] == '?' && p[2] == '#') {
+                p = close + 1;
+                continue;
+            }
+            /* an optional group contributes nothing */
+            if (parseQuantifier(close + 1, &min_reps, &after) && min_reps == 0) {
+                p = after;
+                continue;
+            }
+            /* otherwise its contents are required */
+            p += (p[1] == '?' && p[2] == ':') ? 3 : 1;
+            continue;
+        }
+        else if (c == ')') {
+            addRun(runs, &num_runs, run, &run_len);
+            p++;
+            if (parseQuantifier(p, &min_reps, &after)) {
+                p = after;
+            }
+            continue;
+        }
+        else if (parseQuantifier(p, &min_reps, &after)) {
+            /* a quantifier with nothing we track in front of it */
+            addRun(runs, &num_runs, run, &run_len);
+            p = after;
+            continue;
+        }
+        else {
+            p++;
+        }
+
+        /* c is a literal character; see whether it is repeated */
+        if (parseQuantifier(p, &min_reps, &after)) {
+            if (min_reps > 0 && run_len < MAX_LITERAL_LEN - 1) {
+                run[run_len++] = c;
+            }
+            addRun(runs, &num_runs, run, &run_len);
+            p = after;
+            continue;
+        }
+        if (run_len < MAX_LITERAL_LEN - 1) {
+            run[run_len++] = c;
+        }
+        else {
+            addRun(runs, &num_runs, run, &run_len);
+            run[run_len++] = c;
+        }
+    }
+    addRun(runs, &num_runs, run, &run_len);
+
+    /* keep the longest (most selective) runs */
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < DAAP_MATCH_MAX_LITERALS; i++) {
+        best = -1;
+        for (j = 0; j < num_runs; j++) {
+            if (!used[j] && (best < 0 || strlen(runs[j]) > strlen(runs[best]))) {
+                best = j;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        used[best] = 1;
+        strcpy(literals[num_literals++], runs[best]);
+    }
+    return num_literals;
+}
+
+/* Grow an array of elements of size elem_size to hold at least count */
+static int growArray(void **array, uint32_t *capacity, uint32_t count,
+                     size_t elem_size) {
+    uint32_t new_capacity;
+    void *new_array;
+
+    if (count <= *capacity) {
+        return 0;
+    }
+    new_capacity = *capacity ? *capacity * 2 : 64;
+    while (new_capacity < count) {
+        new_capacity *= 2;
+    }
+    new_array = realloc(*array, new_capacity * elem_size);
+    if (!new_array) {
+        return -1;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/* Build the automaton over strings[]; owners[i] is recorded for the
+ * literal strings[i] (duplicate strings share one literal). */
+int daapACBuild(daap_ac_t *ac, const char **strings, const uint32_t *owners,
+                uint32_t num_strings) {
+    uint32_t state_capacity = 0;
+    int32_t *terminal = NULL;       /* literal id ending at a state */
+    int32_t *fail = NULL;
+    uint32_t *queue = NULL;
+    uint32_t *lit_count = NULL;
+    uint32_t *string_lit = NULL;    /* literal id of each string */
+    uint32_t num_out = 0, head, tail;
+    uint32_t s, child, f, k, i;
+    int32_t *new_next;
+    int c, ret = -1;
+    uint8_t used_bytes[256];
+    const unsigned char *lit;
+
+    memset(ac, 0, sizeof(daap_ac_t));
+
+    /* byte equivalence classes: one per byte used in a literal, plus
+     * class 0 for every other byte */
+    memset(used_bytes, 0, sizeof(used_bytes));
+    for (i = 0; i < num_strings; i++) {
+        for (lit = (const unsigned char *)strings[i]; *lit; lit++) {
+            used_bytes[*lit] = 1;
+        }
+    }
+    ac->num_classes = 1;
+    for (c = 0; c < 256; c++) {
+        ac->classmap[c] = used_bytes[c] ? ac->num_classes++ : 0;
+    }
+
+    string_lit = calloc(num_strings + 1, sizeof(uint32_t));
+    if (!string_lit) {
+        goto end;
+    }
+
+    /* root state */
+    ac->num_states = 1;
+    if (growArray((void **)&ac->next, &state_capacity, 1,
+                  ac->num_classes * sizeof(int32_t)) < 0) {
+        goto end;
+    }
+    terminal = malloc(state_capacity * sizeof(int32_t));
+    if (!terminal) {
+        goto end;
+    }
+    memset(ac->next, 0xff, ac->num_classes * sizeof(int32_t));
+    terminal[0] = -1;
+
+    /* trie of the distinct literals */
+    for (i = 0; i < num_strings; i++) {
+        s = 0;
+        for (lit = (const unsigned char *)strings[i]; *lit; lit++) {
+            c = ac->classmap[*lit];
+            if (ac->next[s * ac->num_classes + c] < 0) {
+                k = state_capacity;
+                if (growArray((void **)&ac->next, &state_capacity,
+                              ac->num_states + 1,
+                              ac->num_classes * sizeof(int32_t)) < 0) {
+                    goto end;
+                }
+                if (state_capacity != k) {
+                    new_next = realloc(terminal, state_capacity * sizeof(int32_t));
+                    if (!new_next) {
+                        goto end;
+                    }
+                    terminal = new_next;
+                }
+                child = ac->num_states++;
+                memset(ac->next + child * ac->num_classes, 0xff,
+                       ac->num_classes * sizeof(int32_t));
+                terminal[child] = -1;
+                ac->next[s * ac->num_classes + c] = child;
+            }
+            s = ac->next[s * ac->num_classes + c];
+        }
+        if (terminal[s] < 0) {
+            terminal[s] = ac->num_literals++;
+        }
+        string_lit[i] = terminal[s];
+    }
+
+    /* owners of each literal */
+    lit_count = calloc(ac->num_literals + 1, sizeof(uint32_t));
+    ac->lit_start = calloc(ac->num_literals + 1, sizeof(uint32_t));
+    ac->lit_owners = malloc((num_strings ? num_strings : 1) * sizeof(uint32_t));
+    if (!lit_count || !ac->lit_start || !ac->lit_owners) {
+        goto end;
+    }
+    for (i = 0; i < num_strings; i++) {
+        lit_count[string_lit[i]]++;
+    }
+    for (k = 0; k < ac->num_literals; k++) {
+        ac->lit_start[k + 1] = ac->lit_start[k] + lit_count[k];
+        lit_count[k] = ac->lit_start[k];
+    }
+    for (i = 0; i < num_strings; i++) {
+        ac->lit_owners[lit_count[string_lit[i]]++] = owners[i];
+    }
+
+    /* failure links in breadth first order, turning the trie into a DFA */
+    fail = calloc(ac->num_states, sizeof(int32_t));
+    queue = malloc(ac->num_states * sizeof(uint32_t));
+    if (!fail || !queue) {
+        goto end;
+    }
+    head = tail = 0;
+    for (c = 0; c < (int)ac->num_classes; c++) {
+        child = ac->next[c];
+        if ((int32_t)child < 0) {
+            ac->next[c] = 0;
+        }
+        else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        s = queue[head++];
+        f = fail[s];
+        for (c = 0; c < (int)ac->num_classes; c++) {
+            child = ac->next[s * ac->num_classes + c];
+            if ((int32_t)child < 0) {
+                ac->next[s * ac->num_classes + c] = ac->next[f * ac->num_classes + c];
+            }
+            else {
+                fail[child] = ac->next[f * ac->num_classes + c];
+                queue[tail++] = child;
+            }
+        }
+    }
+
+    /* outputs of a state are its own literal plus those of its failure
+     * chain */
+    ac->out_start = calloc(ac->num_states + 1, sizeof(uint32_t));
+    if (!ac->out_start) {
+        goto end;
+    }
+    for (s = 0; s < ac->num_states; s++) {
+        for (f = s; f != 0; f = fail[f]) {
+            if (terminal[f] >= 0) {
+                num_out++;
+            }
+        }
+        ac->out_start[s + 1] = num_out;
+    }
+    ac->out = malloc((num_out ? num_out : 1) * sizeof(uint32_t));
+    if (!ac->out) {
+        goto end;
+    }
+    for (s = 0; s < ac->num_states; s++) {
+        k = ac->out_start[s];
+        for (f = s; f != 0; f = fail[f]) {
+            if (terminal[f] >= 0) {
+                ac->out[k++] = terminal[f];
+            }
+        }
+    }
+    ret = 0;
+
+ end:
+    if (ret < 0) {
+        ERROR_OUTPUT(("Failed to allocate the literal automaton"));
+        daapACFree(ac);
+    }
+    free(terminal);
+    free(fail);
+    free(queue);
+    free(lit_count);
+    free(string_lit);
+    return ret;
+}
+
+void daapACFree(daap_ac_t *ac) {
+    free(ac->next);
+    free(ac->out_start);
+    free(ac->out);
+    free(ac->lit_start);
+    free(ac->lit_owners);
+    memset(ac, 0, sizeof(daap_ac_t));
+}
+
+/* Build the automaton from the literals of every regex.
+ * regex_lits[r][k] is the k-th literal of regex r. */
+static int buildAutomaton(daap_keyset_t *keys,
+                          char (*regex_lits)[DAAP_MATCH_MAX_LITERALS][256]) {
+    const char **strings;
+    uint32_t *owners;
+    uint32_t n = 0;
+    int r, l, ret;
+
+    strings = malloc((keys->num_regexes * DAAP_MATCH_MAX_LITERALS + 1) * sizeof(char *));
+    owners = malloc((keys->num_regexes * DAAP_MATCH_MAX_LITERALS + 1) * sizeof(uint32_t));
+    if (!strings || !owners) {
+        ERROR_OUTPUT(("Failed to allocate the literal prefilter"));
+        free(strings);
+        free(owners);
+        return -1;
+    }
+    for (r = 0; r < keys->num_regexes; r++) {
+        for (l = 0; l < keys->num_required[r]; l++) {
+            strings[n] = regex_lits[r][l];
+            owners[n++] = r;
+        }
+    }
+
+    ret = daapACBuild(&keys->ac, strings, owners, n);
+    free(strings);
+    free(owners);
+    return ret;
+}
+
+/* Add a unit name to the unit pool; returns its offset or 0 on failure */
+static uint32_t addUnit(daap_keyset_t *keys, uint32_t *units_size,
+                        const char *unit, size_t len) {
+    uint32_t offset = keys->units_len;
+
+    if (growArray((void **)&keys->units, units_size, keys->units_len + len + 1, 1) < 0) {
+        return 0;
+    }
+    memcpy(keys->units + offset, unit, len);
+    keys->units[offset + len] = '\0';
+    keys->units_len += len + 1;
+    return offset;
+}
+
+/* Read the (?#type[:unit]) annotations of a pattern into types[0, num_pairs).
+ * An annotation applies to the value group (an even numbered capture
+ * group) that precedes it. */
+static int parseValueTypes(daap_keyset_t *keys, uint32_t *units_size,
+                           const char *pattern, daap_value_type_t *types,
+                           int num_pairs) {
+    const char *p, *spec, *end, *colon;
+    int groups = 0, type, len;
+
+    for (p = pattern; *p; p++) {
+        if (*p == '\\') {
+            if (p[1]) {
+                p++;
+            }
+            continue;
+        }
+        if (*p == '[') {
+            if (!(end = skipClass(p))) {
+                break;
+            }
+            p = end - 1;
+            continue;
+        }
+        if (*p != '(') {
+            continue;
+        }
+        if (p[1] != '?') {
+            groups++;
+            continue;
+        }
+        /* named groups capture too */
+        if ((p[2] == 'P' && p[3] == '<') || p[2] == '\'' ||
+            (p[2] == '<' && p[3] != '=' && p[3] != '!')) {
+            groups++;
+            continue;
+        }
+        if (p[2] != '#' || !(end = strchr(p, ')'))) {
+            continue;
+        }
+
+        spec = p + 3;
+        len = end - spec;
+        p = end;
+        colon = memchr(spec, ':', len);
+        type = daapFieldType(spec, colon ? colon - spec : len);
+        if (type < 0) {
+            /* an ordinary comment */
+            continue;
+        }
+        if (groups == 0 || groups % 2 != 0 || groups / 2 > num_pairs) {
+            ERROR_OUTPUT(("Type annotation does not follow a value group: %s", pattern));
+            continue;
+        }
+        types[groups / 2 - 1].type = type;
+        if (colon && end - colon > 1) {
+            types[groups / 2 - 1].unit = addUnit(keys, units_size, colon + 1,
+                                                 end - colon - 1);
+        }
+    }
+    return 0;
+}
+
+daap_value_type_t *daapKeysetValueType(daap_keyset_t *keys, int regex, int pair) {
+    static daap_value_type_t string_type = { DAAP_FIELD_STRING, 0 };
+
+    if (pair < 0 || keys->type_start[regex] + pair >= keys->type_start[regex + 1]) {
+        return &string_type;
+    }
+    return &keys->types[keys->type_start[regex] + pair];
+}
+
+int daapKeysetCompile(daap_keyset_t *keys, char **patterns, int num_patterns) {
+    char (*regex_lits)[DAAP_MATCH_MAX_LITERALS][256] = NULL;
+    const char *error;
+    int erroffset;
+    int i, n, ret;
+    int captures;
+    uint32_t types_size = 0, units_size = 0;
+    pcre *re;
+
+    memset(keys, 0, sizeof(daap_keyset_t));
+    keys->regexes = calloc(num_patterns + 1, sizeof(pcre *));
+    keys->extras = calloc(num_patterns + 1, sizeof(pcre_extra *));
+    keys->num_required = calloc(num_patterns + 1, sizeof(uint8_t));
+    keys->always = calloc(num_patterns + 1, sizeof(int));
+    keys->type_start = calloc(num_patterns + 1, sizeof(uint32_t));
+    regex_lits = calloc(num_patterns + 1, sizeof(*regex_lits));
+    if (!keys->regexes || !keys->extras || !keys->num_required ||
+        !keys->always || !keys->type_start || !regex_lits ||
+        addUnit(keys, &units_size, "", 0) != 0 || !keys->units) {
+        ERROR_OUTPUT(("Failed to allocate the key regexes"));
+        free(regex_lits);
+        daapKeysetFree(keys);
+        return -1;
+    }
+
+    for (i = 0; i < num_patterns; i++) {
+        /* based off of:
+           https://www.ncbi.nlm.nih.gov/IEB/ToolBox/C_DOC/lxr/source/regexp/
+           demo/pcredemo.c */
+        //compile the regexp with pcre
+        re = pcre_compile(patterns[i],       /* the pattern */
+                          0,                 /* default options */
+                          &error,            /* for error message */
+                          &erroffset,        /* for error offset */
+                          NULL);             /* use default character tables */
+
+        /* Regex compilation failed */
+        if (re == NULL) {
+            ERROR_OUTPUT(("Failed to compile regex at offset: %d : %s", erroffset,
+                          error));
+            continue;
+        }
+
+        n = keys->num_regexes++;
+        keys->regexes[n] = re;
+        /* JIT compile; without JIT support pcre_study still optimizes */
+        keys->extras[n] = pcre_study(re, PCRE_STUDY_JIT_COMPILE, &error);
+        if (error != NULL) {
+            ERROR_OUTPUT(("Failed to study regex %s: %s", patterns[i], error));
+        }
+
+        /* one declared type per key/value pair, strings unless annotated */
+        captures = 0;
+        pcre_fullinfo(re, NULL, PCRE_INFO_CAPTURECOUNT, &captures);
+        keys->type_start[n + 1] = keys->type_start[n] + captures / 2;
+        if (growArray((void **)&keys->types, &types_size,
+                      keys->type_start[n + 1] + 1, sizeof(daap_value_type_t)) < 0) {
+            ERROR_OUTPUT(("Failed to allocate the key value types"));
+            free(regex_lits);
+            daapKeysetFree(keys);
+            return -1;
+        }
+        memset(keys->types + keys->type_start[n], 0,
+               (captures / 2) * sizeof(daap_value_type_t));
+        parseValueTypes(keys, &units_size, patterns[i],
+                        keys->types + keys->type_start[n], captures / 2);
+
+        keys->num_required[n] = daapRequiredLiterals(patterns[i], regex_lits[n]);
+        if (keys->num_required[n] == 0) {
+            keys->always[keys->num_always++] = n;
+        }
+        DEBUG_OUTPUT(("Regex %d has %d required literals", n, keys->num_required[n]));
+    }
+
+    ret = buildAutomaton(keys, regex_lits);
+    free(regex_lits);
+    if (ret < 0) {
+        daapKeysetFree(keys);
+    }
+    return ret;
+}
+
+void daapKeysetFree(daap_keyset_t *keys) {
+    int i;
+
+    for (i = 0; i < keys->num_regexes; i++) {
+        if (keys->extras && keys->extras[i]) {
+            pcre_free_study(keys->extras[i]);
+        }
+        if (keys->regexes && keys->regexes[i] && !keys->mapped) {
+            pcre_free(keys->regexes[i]);
+        }
+    }
+    free(keys->regexes);
+    free(keys->extras);
+    if (keys->mapped) {
+        /* the rest belongs to the bundle mapping */
+        memset(keys, 0, sizeof(daap_keyset_t));
+        return;
+    }
+    free(keys->num_required);
+    free(keys->always);
+    free(keys->type_start);
+    free(keys->types);
+    free(keys->units);
+    daapACFree(&keys->ac);
+    memset(keys, 0, sizeof(daap_keyset_t));
+}
+
+int daapMatchScratchInit(daap_match_scratch_t *scratch, daap_keyset_t *keys) {
+    size_t num_regexes = keys->num_regexes + 1;
+    size_t num_literals = keys->ac.num_literals + 1;
+
+    memset(scratch, 0, sizeof(daap_match_scratch_t));
+    scratch->lit_seen = calloc(num_literals, sizeof(uint32_t));
+    scratch->regex_seen = calloc(num_regexes, sizeof(uint32_t));
+    scratch->regex_count = calloc(num_regexes, sizeof(uint8_t));
+    scratch->cands = calloc(num_regexes, sizeof(int));
+    if (!scratch->lit_seen || !scratch->regex_seen || !scratch->regex_count ||
+        !scratch->cands) {
+        daapMatchScratchFree(scratch);
+        return -1;
+    }
+    return 0;
+}
+
+void daapMatchScratchFree(daap_match_scratch_t *scratch) {
+    free(scratch->lit_seen);
+    free(scratch->regex_seen);
+    free(scratch->regex_count);
+    free(scratch->cands);
+    memset(scratch, 0, sizeof(daap_match_scratch_t));
+}
+
+int daapKeysetCandidates(daap_keyset_t *keys, daap_match_scratch_t *scratch,
+                         const char *line, int line_len) {
+    daap_ac_t *ac = &keys->ac;
+    const unsigned char *p = (const unsigned char *)line;
+    const unsigned char *end = p + line_len;
+    uint32_t state = 0;
+    uint32_t k, m, lit;
+    int r, i, j, tmp;
+
+    scratch->num_cands = 0;
+    /* a new generation invalidates the marks of the previous line */
+    if (++scratch->gen == 0) {
+        memset(scratch->lit_seen, 0, (ac->num_literals + 1) * sizeof(uint32_t));
+        memset(scratch->regex_seen, 0, (keys->num_regexes + 1) * sizeof(uint32_t));
+        scratch->gen = 1;
+    }
+
+    for (i = 0; i < keys->num_always; i++) {
+        scratch->cands[scratch->num_cands++] = keys->always[i];
+    }
+
+    if (ac->num_literals > 0) {
+        for (; p < end; p++) {
+            state = ac->next[state * ac->num_classes + ac->classmap[*p]];
+            for (k = ac->out_start[state]; k < ac->out_start[state + 1]; k++) {
+                lit = ac->out[k];
+                if (scratch->lit_seen[lit] == scratch->gen) {
+                    continue;
+                }
+                scratch->lit_seen[lit] = scratch->gen;
+                for (m = ac->lit_start[lit]; m < ac->lit_start[lit + 1]; m++) {
+                    r = ac->lit_owners[m];
+                    if (scratch->regex_seen[r] != scratch->gen) {
+                        scratch->regex_seen[r] = scratch->gen;
+                        scratch->regex_count[r] = 0;
+                    }
+                    if (++scratch->regex_count[r] == keys->num_required[r]) {
+                        scratch->cands[scratch->num_cands++] = r;
+                    }
+                }
+            }
+        }
+    }
+
+    /* run the candidates in template order, as the results used to be sent */
+    for (i = 1; i < scratch->num_cands; i++) {
+        tmp = scratch->cands[i];
+        for (j = i - 1; j >= 0 && scratch->cands[j] > tmp; j--) {
+            scratch->cands[j + 1] = scratch->cands[j];
+        }
+        scratch->cands[j + 1] = tmp;
+    }
+    return scratch->num_cands;
+}
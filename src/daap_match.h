@@ -0,0 +1,100 @@
+#ifndef DAAP_MATCH_H
+#define DAAP_MATCH_H
+
+/* Key regex matching engine used by the stdout parser (not part of the API).
+ *
+ * Every key regex is JIT compiled, and the literal strings that any match
+ * must contain are extracted from it. All literals go into one
+ * Aho-Corasick automaton, so a single scan of a line tells which regexes
+ * could possibly match it; only those are then run with pcre_exec. */
+
+#include <stdint.h>
+#include <pcre.h>
+
+/* literals kept per regex (the longest ones) */
+#define DAAP_MATCH_MAX_LITERALS 4
+
+/* Aho-Corasick automaton over the required literals. Everything is kept in
+ * flat arrays indexed by state/literal number (no pointers) so the tables
+ * can be stored and used as they are. */
+typedef struct {
+    uint32_t num_states;
+    uint32_t num_classes;      /* byte equivalence classes */
+    uint8_t classmap[256];     /* byte -> class */
+    int32_t *next;             /* num_states * num_classes transitions */
+    uint32_t *out_start;       /* num_states + 1 offsets into out */
+    uint32_t *out;             /* literal ids found on entering a state */
+    uint32_t num_literals;
+    uint32_t *lit_start;       /* num_literals + 1 offsets into lit_owners */
+    uint32_t *lit_owners;      /* owner ids (e.g. regexes) of each literal */
+} daap_ac_t;
+
+/* Declared type of a captured value */
+typedef struct {
+    uint32_t type;             /* DAAP_FIELD_* */
+    uint32_t unit;             /* offset into the unit pool, 0 if none */
+} daap_value_type_t;
+
+/* A compiled set of key regexes */
+typedef struct {
+    int num_regexes;
+    pcre **regexes;
+    pcre_extra **extras;       /* study/JIT data, may be NULL per regex */
+    uint8_t *num_required;     /* number of distinct literals per regex */
+    int num_always;
+    int *always;               /* regexes without literals, always run */
+    daap_ac_t ac;
+    uint32_t *type_start;      /* num_regexes + 1 offsets into types */
+    daap_value_type_t *types;  /* type of each key/value pair of a regex */
+    uint32_t units_len;
+    char *units;               /* unit names, starting with "" */
+    int mapped;                /* regexes, tables and the automaton point into
+                                  a template bundle (see daap_bundle.h) */
+} daap_keyset_t;
+
+/* Per-thread scratch space for candidate selection */
+typedef struct {
+    uint32_t gen;              /* current line generation */
+    uint32_t *lit_seen;        /* generation a literal was last seen */
+    uint32_t *regex_seen;      /* generation a regex count was reset */
+    uint8_t *regex_count;      /* distinct literals seen per regex */
+    int *cands;                /* candidate regex ids for the line */
+    int num_cands;
+} daap_match_scratch_t;
+
+/* Build an automaton finding any of strings; owners[i] is listed as an
+ * owner of the literal strings[i]. */
+int daapACBuild(daap_ac_t *ac, const char **strings, const uint32_t *owners,
+                uint32_t num_strings);
+
+/* Free an automaton built by daapACBuild */
+void daapACFree(daap_ac_t *ac);
+
+/* Compile the patterns into a key set. Patterns that do not compile are
+ * reported and skipped. A (?#type[:unit]) comment after a value group
+ * declares the type (string, float, int, bool) and unit of that value;
+ * values are strings by default. */
+int daapKeysetCompile(daap_keyset_t *keys, char **patterns, int num_patterns);
+
+/* Free a key set built by daapKeysetCompile */
+void daapKeysetFree(daap_keyset_t *keys);
+
+/* Allocate/free scratch space for a key set */
+int daapMatchScratchInit(daap_match_scratch_t *scratch, daap_keyset_t *keys);
+void daapMatchScratchFree(daap_match_scratch_t *scratch);
+
+/* The declared type of key/value pair number pair (0 based) of a regex */
+daap_value_type_t *daapKeysetValueType(daap_keyset_t *keys, int regex, int pair);
+
+/* Find the regexes that could match the line. Their ids are left in
+ * scratch->cands in ascending (template) order; returns their number. */
+int daapKeysetCandidates(daap_keyset_t *keys, daap_match_scratch_t *scratch,
+                         const char *line, int line_len);
+
+/* Extract the literals that any match of pattern must contain. Returns the
+ * number of literals (0 if none could be determined), each written as a
+ * null-terminated string into literals. */
+int daapRequiredLiterals(const char *pattern,
+                         char literals[DAAP_MATCH_MAX_LITERALS][256]);
+
+#endif /* DAAP_MATCH_H */
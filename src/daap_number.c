@@ -0,0 +1,183 @@
+/*
+ * Typed value conversion for the stdout parser
+ *
+ * Captured values used to be sent as strings and split apart again at
+ * ingest. Templates can now declare them as float, int or bool, and they
+ * are converted here and sent as native influx fields.
+ *
+ * Floats take the exact fast path whenever the significant digits fit in
+ * 53 bits and the decimal exponent is within the exactly representable
+ * powers of ten (10^22), which covers nearly all application output; the
+ * rest are validated here and handed to strtod from a stack buffer.
+ */
+
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <strings.h>
+
+#include "daap_log_internal.h"
+#include "daap_number.h"
+
+/* longest number handed to strtod */
+#define MAX_NUMBER_LEN 64
+
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+int daapFieldType(const char *name, int len) {
+    static const char *types[] = { "string", "float", "int", "bool" };
+    static const int values[] = { DAAP_FIELD_STRING, DAAP_FIELD_FLOAT,
+                                  DAAP_FIELD_INT, DAAP_FIELD_BOOL };
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if ((int)strlen(types[i]) == len && strncmp(name, types[i], len) == 0) {
+            return values[i];
+        }
+    }
+    return -1;
+}
+
+/* Trim blanks around str[0, len), and a '%' after a number if percent */
+static void trimValue(const char **str, const char **end, int percent) {
+    while (*str < *end && isspace((unsigned char)**str)) {
+        (*str)++;
+    }
+    while (*end > *str && isspace((unsigned char)(*end)[-1])) {
+        (*end)--;
+    }
+    if (percent && *end > *str && (*end)[-1] == '%') {
+        (*end)--;
+    }
+}
+
+int daapParseDouble(const char *str, int len, double *val) {
+    const char *p = str, *end = str + len, *start;
+    char buf[MAX_NUMBER_LEN];
+    uint64_t mantissa = 0;
+    int sig_digits = 0, any_digits = 0, frac_digits = 0;
+    int exp = 0, exp_neg = 0, exp_digits = 0, neg = 0;
+    double d;
+
+    trimValue(&p, &end, 1);
+    start = p;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+    for (; p < end && isdigit((unsigned char)*p); p++) {
+        any_digits = 1;
+        if (mantissa || *p != '0') {
+            mantissa = mantissa * 10 + (*p - '0');
+            sig_digits++;
+            if (sig_digits > 19) {
+                break;
+            }
+        }
+    }
+    if (sig_digits <= 19 && p < end && *p == '.') {
+        for (p++; p < end && isdigit((unsigned char)*p); p++) {
+            any_digits = 1;
+            if (mantissa || *p != '0') {
+                mantissa = mantissa * 10 + (*p - '0');
+                sig_digits++;
+                if (sig_digits > 19) {
+                    break;
+                }
+            }
+            frac_digits++;
+        }
+    }
+    if (sig_digits <= 19 && any_digits && p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_neg = *p == '-';
+            p++;
+        }
+        for (; p < end && isdigit((unsigned char)*p); p++) {
+            exp_digits++;
+            if (exp < 100000) {
+                exp = exp * 10 + (*p - '0');
+            }
+        }
+        if (exp_digits == 0) {
+            return -1;
+        }
+    }
+
+    if (sig_digits <= 19) {
+        if (!any_digits || p != end) {
+            return -1;
+        }
+        exp = (exp_neg ? -exp : exp) - frac_digits;
+        if (mantissa <= (UINT64_C(1) << 53) && exp >= -22 && exp <= 22) {
+            d = (double)mantissa;
+            d = exp < 0 ? d / exact_pow10[-exp] : d * exact_pow10[exp];
+            *val = neg ? -d : d;
+            return 0;
+        }
+    }
+
+    /* long mantissa or large exponent: let strtod round it */
+    if (end - start >= MAX_NUMBER_LEN) {
+        return -1;
+    }
+    memcpy(buf, start, end - start);
+    buf[end - start] = '\0';
+    d = strtod(buf, (char **)&p);
+    if (p != buf + (end - start) || !isfinite(d)) {
+        return -1;
+    }
+    *val = d;
+    return 0;
+}
+
+int daapParseInt(const char *str, int len, long long *val) {
+    const char *p = str, *end = str + len;
+    unsigned long long n = 0, limit;
+    int neg = 0;
+
+    trimValue(&p, &end, 1);
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p == '-';
+        p++;
+    }
+    if (p == end) {
+        return -1;
+    }
+    limit = neg ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX;
+    for (; p < end; p++) {
+        if (!isdigit((unsigned char)*p) || n > (limit - (*p - '0')) / 10) {
+            return -1;
+        }
+        n = n * 10 + (*p - '0');
+    }
+    *val = neg ? (long long)(0 - n) : (long long)n;
+    return 0;
+}
+
+int daapParseBool(const char *str, int len, long long *val) {
+    static const char *true_words[] = { "true", "t", "yes", "y", "on", "1" };
+    static const char *false_words[] = { "false", "f", "no", "n", "off", "0" };
+    const char *p = str, *end = str + len;
+    int i;
+
+    trimValue(&p, &end, 0);
+    for (i = 0; i < 6; i++) {
+        if ((int)strlen(true_words[i]) == end - p &&
+            strncasecmp(p, true_words[i], end - p) == 0) {
+            *val = 1;
+            return 0;
+        }
+        if ((int)strlen(false_words[i]) == end - p &&
+            strncasecmp(p, false_words[i], end - p) == 0) {
+            *val = 0;
+            return 0;
+        }
+    }
+    return -1;
+}
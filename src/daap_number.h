@@ -0,0 +1,25 @@
+#ifndef DAAP_NUMBER_H
+#define DAAP_NUMBER_H
+
+/* Typed values for the stdout parser (not part of the API).
+ *
+ * Templates declare a type, and optionally a unit, for captured values as
+ * "type[:unit]": in a (?#type[:unit]) comment after a key regex value
+ * group, or as val_name=name:type[:unit] in a table template. Values are
+ * converted without allocating; those that do not parse as their declared
+ * type are sent as strings. */
+
+#include "daap_log.h"
+
+/* Parse a type name (string, float, int or bool). Returns the DAAP_FIELD_*
+ * type, or -1 if name[0, len) is not a type. */
+int daapFieldType(const char *name, int len);
+
+/* Convert str[0, len) (not null-terminated) to a double/long long/bool.
+ * Leading/trailing blanks and a trailing '%' are allowed around numbers.
+ * Return 0 on success, -1 if the text is not a (finite) value of the type. */
+int daapParseDouble(const char *str, int len, double *val);
+int daapParseInt(const char *str, int len, long long *val);
+int daapParseBool(const char *str, int len, long long *val);
+
+#endif /* DAAP_NUMBER_H */
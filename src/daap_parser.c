@@ -0,0 +1,650 @@
+/*
+ * Template engine of the stdout parser
+ *
+ * Moved out of stdout_parser.c so that the stdout preload library can
+ * match an application's output against the same templates, in process.
+ * Everything here works on a parser_t (the compiled templates) and a
+ * stream_t (the table state and partial line of one output stream); how
+ * the bytes are obtained is left to the caller.
+ */
+#include <pcre.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_number.h"
+#include "daap_parser.h"
+
+#define OVECCOUNT 30
+
+//Sends the values found in one line or table row as one record, printing
+//it to stdout if echo is set
+static int sendRecord(result_t *results, int num_results, int echo) {
+    tag_t *tags;
+    field_t *fields;
+    int num_tags = 0;
+    int num_fields = 0;
+    int ret_val = 0;
+    int i;
+
+    tags = malloc(num_results * sizeof(tag_t));
+    fields = malloc(num_results * sizeof(field_t));
+    if (!tags || !fields) {
+        ERROR_OUTPUT(("Failed to allocate record"));
+        free(tags);
+        free(fields);
+        return -1;
+    }
+
+    if (echo) {
+        printf("Sending result:");
+    }
+    for (i = 0; i < num_results; i++) {
+        if (results[i].tag) {
+            tags[num_tags].tag_name = results[i].key;
+            tags[num_tags++].tag_val = results[i].val;
+        }
+        else {
+            fields[num_fields].field_name = results[i].key;
+            fields[num_fields].field_val = results[i].val;
+            fields[num_fields].field_type = results[i].type;
+            fields[num_fields].float_val = results[i].float_val;
+            fields[num_fields++].int_val = results[i].int_val;
+        }
+        if (echo) {
+            printf(" %s=%s", results[i].key, results[i].val);
+        }
+    }
+    if (echo) {
+        printf("\n");
+    }
+
+    if (num_fields > 0) {
+        ret_val = daapLogFields(num_tags, tags, num_fields, fields);
+        if (ret_val != 0) {
+            perror("Error in call to daapLogFields");
+        }
+    }
+    free(tags);
+    free(fields);
+    return ret_val;
+}
+
+//Grow a results list so that one more result fits
+static int growResults(results_t *results) {
+  result_t *new_results;
+  size_t size;
+
+  if (results->num < results->size) {
+    return 0;
+  }
+  size = results->size ? results->size * 2 : 64;
+  new_results = realloc(results->results, size * sizeof(result_t));
+  if (!new_results) {
+    ERROR_OUTPUT(("Failed to allocate results"));
+    return -1;
+  }
+  results->results = new_results;
+  results->size = size;
+  return 0;
+}
+
+//Convert a value to its declared type; values that do not parse as that
+//type are kept as strings
+static void convertResult(result_t *result, int type, const char *val,
+			  int val_len) {
+  int ret = -1;
+
+  switch (type) {
+  case DAAP_FIELD_FLOAT:
+    ret = daapParseDouble(val, val_len, &result->float_val);
+    break;
+  case DAAP_FIELD_INT:
+    ret = daapParseInt(val, val_len, &result->int_val);
+    break;
+  case DAAP_FIELD_BOOL:
+    ret = daapParseBool(val, val_len, &result->int_val);
+    break;
+  }
+  result->type = ret == 0 ? type : DAAP_FIELD_STRING;
+}
+
+//Save a copy of a key/value pair found in the line at offset. A unit is
+//appended to the key (e.g. time_s); the value is converted to type.
+static int addResult(results_t *results, off_t offset, int tag, int type,
+		     const char *unit, const char *key, int key_len,
+		     const char *val, int val_len) {
+  result_t *result;
+  size_t unit_len = unit ? strlen(unit) : 0;
+
+  if (growResults(results) < 0) {
+    return -1;
+  }
+  result = &results->results[results->num];
+  result->offset = offset;
+  result->tag = tag;
+  convertResult(result, tag ? DAAP_FIELD_STRING : type, val, val_len);
+  if (unit_len > 0) {
+    result->key = malloc(key_len + unit_len + 2);
+    if (result->key) {
+      snprintf(result->key, key_len + unit_len + 2, "%.*s_%s", key_len, key, unit);
+    }
+  }
+  else {
+    result->key = strndup(key, key_len);
+  }
+  result->val = strndup(val, val_len);
+  if (!result->key || !result->val) {
+    ERROR_OUTPUT(("Failed to allocate result"));
+    free(result->key);
+    free(result->val);
+    return -1;
+  }
+  results->num++;
+  return 0;
+}
+
+//Move a result into another list (the strings are not copied)
+int moveResult(results_t *results, result_t *result) {
+  if (growResults(results) < 0) {
+    free(result->key);
+    free(result->val);
+    return -1;
+  }
+  results->results[results->num++] = *result;
+  return 0;
+}
+
+//Free the results in a list
+void freeResults(results_t *results) {
+  size_t i;
+
+  for (i = 0; i < results->num; i++) {
+    free(results->results[i].key);
+    free(results->results[i].val);
+  }
+  free(results->results);
+  memset(results, 0, sizeof(results_t));
+}
+
+/* Send the results in a list, in order, and empty it. The values found in
+   the same line (same offset) go into one record, and the records are sent
+   as a batch. */
+int sendResults(parser_t *parser, results_t *results) {
+  int ret = DAAP_SUCCESS;
+  size_t i, j;
+
+  for (i = 0; i < results->num; i = j) {
+    for (j = i + 1; j < results->num &&
+	   results->results[j].offset == results->results[i].offset; j++);
+    if (sendRecord(&results->results[i], j - i, parser->echo) < 0) {
+      ret = DAAP_ERROR;
+    }
+  }
+  if (results->num > 0 && daapLogFlush() != DAAP_SUCCESS) {
+    ret = DAAP_ERROR;
+  }
+  freeResults(results);
+  return ret;
+}
+
+//Read the lines of a template file, without their newlines
+static char **readTemplate(char *template_file, int *num_lines) {
+  FILE *template;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t line_len;
+  char **lines = NULL, **new_lines;
+  int max_lines = 0;
+
+  *num_lines = 0;
+  template = fopen(template_file, "r");
+  if (!template) {
+    ERROR_OUTPUT(("Failed to open template file: %s", template_file));
+    return NULL;
+  }
+
+  while ((line_len = getline(&line, &line_size, template)) >= 0) {
+    //Remove trailing new line
+    while (line_len > 0 && (line[line_len-1] == '\n' || line[line_len-1] == '\r')) {
+      line[--line_len] = '\0';
+    }
+
+    if (*num_lines == max_lines) {
+      max_lines = max_lines ? max_lines * 2 : 64;
+      new_lines = realloc(lines, max_lines * sizeof(char *));
+      if (!new_lines) {
+	ERROR_OUTPUT(("Failed to allocate template lines"));
+	break;
+      }
+      lines = new_lines;
+    }
+    lines[(*num_lines)++] = strdup(line);
+  }
+  free(line);
+  fclose(template);
+
+  //an empty template still needs an array
+  if (!lines) {
+    lines = calloc(1, sizeof(char *));
+  }
+  return lines;
+}
+
+static void freeTemplateLines(char **lines, int num_lines) {
+  int i;
+
+  for (i = 0; i < num_lines; i++) {
+    free(lines[i]);
+  }
+  free(lines);
+}
+
+//Parse the key template
+int parseKeyTemplate(char *key_template_file, daap_keyset_t *keys) {
+  char **lines;
+  int num_lines, num_patterns = 0;
+  int i;
+  int ret;
+
+  lines = readTemplate(key_template_file, &num_lines);
+  if (!lines) {
+    return -1;
+  }
+
+  //every non-empty line is a regex
+  for (i = 0; i < num_lines; i++) {
+    if (lines[i] && lines[i][0]) {
+      lines[num_patterns++] = lines[i];
+    }
+    else {
+      free(lines[i]);
+    }
+  }
+
+  //compile the regexes and build the literal prefilter
+  ret = daapKeysetCompile(keys, lines, num_patterns);
+  freeTemplateLines(lines, num_patterns);
+  return ret;
+}
+
+//Parse the table template and compile the tables
+int parseTableTemplate(char *table_template_file, daap_tableset_t *tables) {
+  char **lines;
+  int num_lines;
+  int ret;
+
+  lines = readTemplate(table_template_file, &num_lines);
+  if (!lines) {
+    return -1;
+  }
+  ret = daapTablesetCompile(tables, lines, num_lines);
+  freeTemplateLines(lines, num_lines);
+  return ret;
+}
+
+/* Parse the key and table templates once; the compiled templates are then
+   shared by every results file/stream that is parsed */
+int loadTemplates(parser_t *parser, char *key_template_file,
+		  char *table_template_file, char *bundle_file) {
+  int ret;
+
+  memset(parser, 0, sizeof(parser_t));
+
+  //use the precompiled templates unless the template files changed
+  if (bundle_file && bundle_file[0]) {
+    ret = daapBundleLoad(&parser->bundle, bundle_file, key_template_file,
+			 table_template_file, &parser->keys, &parser->tables);
+    if (ret == DAAP_BUNDLE_OK) {
+      goto scratch;
+    }
+    if (ret == DAAP_BUNDLE_STALE) {
+      ERROR_OUTPUT(("Template bundle %s is stale, compiling the templates "
+		    "(run --compile again to update it)", bundle_file));
+    }
+    if (key_template_file[0] == 0) {
+      ERROR_OUTPUT(("No key template to fall back to"));
+      return -1;
+    }
+  }
+
+  //parse the table template and store the results in tables
+  if (table_template_file && table_template_file[0]) {
+    ret = parseTableTemplate(table_template_file, &parser->tables);
+    if (ret < 0) {
+      ERROR_OUTPUT(("Failed to parse table template file: %s", table_template_file));
+      freeTemplates(parser);
+      return -1;
+    }
+  }
+
+  //parse the key template regexes and store the results in key_regexes
+  ret = parseKeyTemplate(key_template_file, &parser->keys);
+  if (ret < 0) {
+    ERROR_OUTPUT(("Failed to parse key template file: %s", key_template_file));
+    freeTemplates(parser);
+    return -1;
+  }
+
+ scratch:
+  ret = daapMatchScratchInit(&parser->scratch, &parser->keys);
+  if (ret < 0) {
+    ERROR_OUTPUT(("Failed to allocate key matching scratch space"));
+    freeTemplates(parser);
+    return -1;
+  }
+
+  return 0;
+}
+
+void freeTemplates(parser_t *parser) {
+  daapMatchScratchFree(&parser->scratch);
+  daapKeysetFree(&parser->keys);
+  daapTablesetFree(&parser->tables);
+  daapBundleClose(&parser->bundle);
+  memset(parser, 0, sizeof(parser_t));
+}
+
+//where the values of a table row go
+typedef struct {
+  results_t *results;
+  off_t offset;
+} row_t;
+
+static void addTableValue(void *arg, const char *name, int name_len, int kind,
+			  int type, const char *val, int val_len) {
+  row_t *row = (row_t *)arg;
+
+  //the unit is already part of the name
+  addResult(row->results, row->offset, kind == DAAP_TABLE_TAG, type, NULL,
+	    name, name_len, val, val_len);
+}
+
+/* Compare a line (newline already removed) with the table templates. Table
+   matching is stateful, so the state is kept in the stream the line came
+   from. Returns 1 if the line was consumed by a table (a header or a row),
+   0 if it should be compared with the key regexes. */
+int matchTables(parser_t *parser, stream_t *stream, const char *line,
+		int line_len, off_t offset, results_t *results) {
+  row_t row;
+
+  row.results = results;
+  row.offset = offset;
+  return daapTableMatch(&parser->tables, &stream->table, line, line_len,
+			addTableValue, &row) != DAAP_TABLE_NONE;
+}
+
+/* Compare a line with the key regexes. The line does not need to be
+   null-terminated and is not modified, so workers can run this directly
+   on the mapped results file. */
+int matchKeys(parser_t *parser, daap_match_scratch_t *scratch,
+	      const char *line, int line_len, off_t offset,
+	      results_t *results) {
+  int j = 0;
+  int ret;
+  int regex_id; //current regex
+  int c; //current candidate
+  int ovector[OVECCOUNT]; //for the regexp matches
+  int key_start, val_start; //key and val starts in the line
+  daap_value_type_t *type; //declared type of the value
+
+  /* Loop over the key regexps that can match the line (those whose
+     required literals all occur in it) and compare the line to each one.
+     We do want to compare multiple regexes to each line for the
+     case when there are multiple key/value pairs per line */
+  daapKeysetCandidates(&parser->keys, scratch, line, line_len);
+  for( c = 0; c < scratch->num_cands; c++) {
+    regex_id = scratch->cands[c];
+    ret = pcre_exec(parser->keys.regexes[regex_id], /* the compiled pattern */
+		    parser->keys.extras[regex_id], /* study and JIT data */
+		    line,                     /* the subject string */
+		    line_len,                 /* the length of the subject */
+		    0,                        /* start at offset 0 in the subject */
+		    0,                        /* default options */
+		    ovector,                  /* output vector for substring information */
+		    OVECCOUNT);               /* number of elements in the output vector */
+
+    /* Matching failed */
+    if ( ret < 0 ) {
+      continue;
+    }
+
+    /* Matching succeded */
+
+    /*The output vector wasn't large enough */
+    if ( ret == 0 ) {
+      ERROR_OUTPUT(("Output vector wasn't large enough for number of matches: %d\n",
+		    OVECCOUNT/3 - 1));
+    }
+
+    /* Show substrings stored in the output vector */
+    for ( j = 0; j < ret; j++ ) {
+      //the first match is the whole line, so skip it
+      if ( j == 0 ) {
+	continue;
+      }
+
+      /* We expect a key/value pair. If we don't have a value, but
+	 only a key, then continue/quit the loop
+      */
+      if ( j+1 >= ret ) {
+	continue;
+      }
+
+      //Get the key and value matches from the regex and save them
+      key_start = ovector[2*j];
+      j++;
+      val_start = ovector[2*j];
+      type = daapKeysetValueType(&parser->keys, regex_id, j/2 - 1);
+      addResult(results, offset, 0, type->type,
+		parser->keys.units + type->unit, line + key_start,
+		ovector[2*j-1] - key_start, line + val_start,
+		ovector[2*j+1] - val_start);
+    }
+  }
+
+  return 0;
+}
+
+/* Compare a single line (newline already removed, null-terminated) with the
+   table templates and, if no table consumed it, the key regexes. */
+int parseLine(parser_t *parser, stream_t *stream, char *line, off_t offset,
+	      results_t *results) {
+  int line_len = strlen(line);
+
+  if (matchTables(parser, stream, line, line_len, offset, results)) {
+    return 0;
+  }
+  return matchKeys(parser, &parser->scratch, line, line_len, offset,
+		   results);
+}
+
+//Parse every complete line in the stream buffer and keep the remainder
+int appendStream(stream_t *stream, const char *data, size_t len) {
+  char *new_buf;
+  size_t size;
+
+  //one byte more for parseStreamBuffer to terminate a final partial line
+  if (stream->buf_size - stream->buf_len < len + 1) {
+    size = stream->buf_size ? stream->buf_size : 65536;
+    while (size - stream->buf_len < len + 1) {
+      size *= 2;
+    }
+    new_buf = realloc(stream->buf, size);
+    if (!new_buf) {
+      ERROR_OUTPUT(("Failed to grow the stream buffer"));
+      return -1;
+    }
+    stream->buf = new_buf;
+    stream->buf_size = size;
+  }
+  memcpy(stream->buf + stream->buf_len, data, len);
+  stream->buf_len += len;
+  stream->offset += len;
+  return 0;
+}
+
+int parseStreamBuffer(parser_t *parser, stream_t *stream, int final) {
+  char *line = stream->buf;
+  char *end = stream->buf + stream->buf_len;
+  char *newline;
+  size_t line_len;
+  off_t offset;
+  results_t results;
+  int lines = 0;
+
+  if (!stream->buf) {
+    return 0;
+  }
+  memset(&results, 0, sizeof(results_t));
+
+  while (line < end) {
+    newline = memchr(line, '\n', end - line);
+    if (!newline) {
+      //the rest is a partial line, unless the file is done
+      if (!final) {
+	break;
+      }
+      newline = end;
+    }
+
+    line_len = newline - line;
+    if (line_len > 0 && line[line_len - 1] == '\r') {
+      line_len--;
+    }
+    line[line_len] = '\0';
+    //the buffer ends at stream->offset in the file
+    offset = stream->offset - (end - line);
+    parseLine(parser, stream, line, offset, &results);
+    lines++;
+    line = newline < end ? newline + 1 : end;
+  }
+
+  //move the partial line to the start of the buffer
+  stream->buf_len = end - line;
+  memmove(stream->buf, line, stream->buf_len);
+  if (sendResults(parser, &results) == DAAP_SUCCESS) {
+    stream->sent = stream->offset - (off_t)stream->buf_len;
+  }
+  return lines;
+}
+
+/*
+ * Embeddable parser API (see daap_log.h)
+ */
+
+struct daap_parser {
+  parser_t parser;
+  stream_t stream;
+};
+
+DAAP_EXPORT daap_parser_t *daapParserCreate(const char *bundle) {
+  char key_template_file[PATH_MAX] = "";
+  char table_template_file[PATH_MAX] = "";
+  char bundle_file[PATH_MAX];
+  daap_parser_t *handle;
+
+  if (!bundle || strlen(bundle) >= PATH_MAX) {
+    ERROR_OUTPUT(("Invalid template bundle path"));
+    return NULL;
+  }
+  snprintf(bundle_file, sizeof(bundle_file), "%s", bundle);
+
+  handle = calloc(1, sizeof(daap_parser_t));
+  if (!handle) {
+    ERROR_OUTPUT(("Failed to allocate a parser"));
+    return NULL;
+  }
+  //the key/table templates default to the files named in the bundle
+  if (loadTemplates(&handle->parser, key_template_file, table_template_file,
+		    bundle_file) != 0) {
+    free(handle);
+    return NULL;
+  }
+  if (daapTableStateInit(&handle->stream.table, &handle->parser.tables) < 0) {
+    ERROR_OUTPUT(("Failed to allocate the table state"));
+    freeTemplates(&handle->parser);
+    free(handle);
+    return NULL;
+  }
+  handle->stream.fd = -1;
+  return handle;
+}
+
+DAAP_EXPORT int daapParserFeed(daap_parser_t *handle, const char *buf, size_t len) {
+  if (!handle || len == 0) {
+    return 0;
+  }
+  if (appendStream(&handle->stream, buf, len) < 0) {
+    return DAAP_ERROR;
+  }
+  //nothing to parse until a line is complete
+  if (!memchr(buf, '\n', len)) {
+    return 0;
+  }
+  parseStreamBuffer(&handle->parser, &handle->stream, 0);
+  return 0;
+}
+
+DAAP_EXPORT int daapParserFlush(daap_parser_t *handle) {
+  if (!handle) {
+    return 0;
+  }
+  parseStreamBuffer(&handle->parser, &handle->stream, 1);
+  //a table still open at the end of the text is not continued by later feeds
+  daapTableStateReset(&handle->stream.table);
+  return daapLogFlush();
+}
+
+DAAP_EXPORT void daapParserDestroy(daap_parser_t *handle) {
+  if (!handle) {
+    return;
+  }
+  daapTableStateFree(&handle->stream.table);
+  free(handle->stream.buf);
+  freeTemplates(&handle->parser);
+  free(handle);
+}
+
+/* Fortran versions. The handle is kept in an INTEGER(8), and character
+ * arguments are copied so that their trailing blanks can be dropped. */
+static char *fortranString(const char *str, int len) {
+  char *copy;
+
+  while (len > 0 && str[len - 1] == ' ') {
+    len--;
+  }
+  copy = malloc(len + 2);
+  if (copy) {
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+DAAP_EXPORT void daapparsercreate_(char *bundle, long *handle, int len) {
+  char *path = fortranString(bundle, len);
+
+  *handle = path ? (long)daapParserCreate(path) : 0;
+  free(path);
+}
+
+//feeds one line: a Fortran string carries no newline of its own
+DAAP_EXPORT void daapparserfeed_(long *handle, char *buf, int len) {
+  char *line = fortranString(buf, len);
+
+  if (line) {
+    len = strlen(line);
+    line[len] = '\n';
+    daapParserFeed((daap_parser_t *)*handle, line, len + 1);
+    free(line);
+  }
+}
+
+DAAP_EXPORT void daapparserflush_(long *handle) {
+  daapParserFlush((daap_parser_t *)*handle);
+}
+
+DAAP_EXPORT void daapparserdestroy_(long *handle) {
+  daapParserDestroy((daap_parser_t *)*handle);
+  *handle = 0;
+}
@@ -0,0 +1,98 @@
+#ifndef DAAP_PARSER_H
+#define DAAP_PARSER_H
+
+/* Template engine of the stdout parser (not part of the API).
+ *
+ * The compiled key and table templates, and the matching of results lines
+ * against them, shared by stdout_parser and the stdout preload library.
+ * Values found in a line are collected as results that carry the offset of
+ * their line, and each line's (or table row's) results are sent as one
+ * record. */
+
+#include <linux/limits.h>
+#include <sys/types.h>
+
+#include "daap_bundle.h"
+#include "daap_match.h"
+#include "daap_table.h"
+
+//compiled templates, shared by every results stream
+typedef struct {
+  daap_keyset_t keys; //key regexes stored and compiled
+  daap_match_scratch_t scratch; //candidate selection scratch space
+  daap_tableset_t tables; //table templates compiled into matchers
+  daap_bundle_t bundle; //mapped template bundle the sets point into, if any
+  int echo; //print every record sent to stdout
+} parser_t;
+
+//per results stream state (one per results file or captured output). The
+//file fields are only used by stdout_parser's follow mode.
+typedef struct {
+  char path[PATH_MAX]; //results file path
+  int fd; //open descriptor, -1 if the file is not open
+  int wd; //inotify watch on the file itself
+  int dir_wd; //inotify watch on the file's directory
+  dev_t dev; //device and inode of the open file
+  ino_t ino;
+  off_t offset; //bytes read from the file so far
+  off_t sent; //end of the lines whose records were sent
+  char *buf; //bytes read but not yet parsed (partial line)
+  size_t buf_len;
+  size_t buf_size;
+  daap_table_state_t table; //table headers/rows being matched
+} stream_t;
+
+//a key/value pair found in a results file, with the offset of its line
+typedef struct {
+  off_t offset;
+  int tag; //sent as a tag of the line's record rather than a field
+  int type; //DAAP_FIELD_* the value was converted to
+  double float_val;
+  long long int_val;
+  char *key;
+  char *val;
+} result_t;
+
+//results collected before sending, in file order
+typedef struct {
+  result_t *results;
+  size_t num;
+  size_t size;
+} results_t;
+
+//Load the key and table templates, from a template bundle if one is given
+//and still matches the templates
+int loadTemplates(parser_t *parser, char *key_template_file,
+		  char *table_template_file, char *bundle_file);
+//Free the compiled templates
+void freeTemplates(parser_t *parser);
+//Compare a single line to the table templates and the key templates
+int parseLine(parser_t *parser, stream_t *stream, char *line, off_t offset,
+	      results_t *results);
+//Parse the key template and store the regexps
+int parseKeyTemplate(char *key_template_file, daap_keyset_t *keys);
+//Parse the table template and the tables
+int parseTableTemplate(char *table_template_file, daap_tableset_t *tables);
+//Compare a line with the table templates; returns 1 if a table consumed it
+int matchTables(parser_t *parser, stream_t *stream, const char *line,
+		int line_len, off_t offset, results_t *results);
+//Compare a line (not necessarily null-terminated) with the key regexes
+int matchKeys(parser_t *parser, daap_match_scratch_t *scratch,
+	      const char *line, int line_len, off_t offset,
+	      results_t *results);
+//Append bytes read or captured from a stream to its buffer
+int appendStream(stream_t *stream, const char *data, size_t len);
+//Parse the complete lines read into a stream buffer and send their results;
+//the final partial line is parsed too if final is set. stream->sent moves
+//past the lines only if their records were sent.
+int parseStreamBuffer(parser_t *parser, stream_t *stream, int final);
+
+//Move a result into another list (the strings are not copied)
+int moveResult(results_t *results, result_t *result);
+//Free the results in a list
+void freeResults(results_t *results);
+//Send the results in a list, one record per line, and empty it; returns
+//DAAP_ERROR if a record could not be logged or the batch not flushed
+int sendResults(parser_t *parser, results_t *results);
+
+#endif /* DAAP_PARSER_H */
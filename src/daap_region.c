@@ -0,0 +1,620 @@
+/*
+ * Data Analytics Application Profiling API
+ *
+ * Region timing
+ *
+ * daapRegionBegin()/daapRegionEnd() time named phases of an application
+ * (a solver, an output step, a whole time step) and keep, per region, the
+ * number of times it ran and its total, minimum, maximum and self time
+ * (the total less the time spent in regions nested in it). Only the
+ * aggregates are sent: one record per region, when daapRegionFlush() is
+ * called, every DAAP_REGION_PERIOD seconds if that is set, and at
+ * daapFinalize().
+ *
+ * Each thread has its own stack of open regions and its own aggregates, set
+ * up (the one allocation) on its first call, so that begin and end only
+ * read the monotonic clock and update memory no other thread writes; the
+ * thread's aggregates are locked only for the few stores of an end, and by
+ * a flush collecting them. Region names are interned once into small
+ * integer ids, and each thread caches the ids of the name pointers it was
+ * given, so a call usually costs a compare of the name with its interned
+ * copy rather than a hash table lookup.
+ *
+ * With DAAP_REGION_COUNTERS=1 (Linux), each thread also opens a group of
+ * perf_event counters on itself: task-clock, context switches, page faults
+ * and CPU migrations, which the kernel always provides, and cycles and
+ * instructions where the CPU's counters are exposed (usually not in a VM).
+ * The whole group is read with one read() at each begin and end, and the
+ * differences are summed per region and sent with its timings, so that OS
+ * noise and paging show up in production runs. This costs two system calls
+ * per region, which is why it is opt-in. rdpmc is not used: it can only
+ * read hardware counters, and the software ones need the read() anyway.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined __linux__
+#    include <linux/perf_event.h>
+#    include <sys/syscall.h>
+#    define HAVE_PERF_EVENT 1
+#endif
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+
+#define REGION_PERIOD_ENVVAR "DAAP_REGION_PERIOD"
+/* the shortest period accepted, in seconds */
+#define REGION_MIN_PERIOD 0.1
+/* distinct region names, and open regions per thread, that are tracked */
+#define REGIONS_MAX 256
+#define REGION_DEPTH_MAX 64
+/* longest name kept (longer ones are truncated) */
+#define REGION_NAME_MAX 128
+/* slots of the interning table, and of each thread's name cache */
+#define NAME_TABLE_SIZE (2 * REGIONS_MAX)
+#define NAME_CACHE_SIZE 64
+#define REGION_TAG "region"
+#define REGION_COUNTERS_ENVVAR "DAAP_REGION_COUNTERS"
+#define COUNTERS_MAX 6
+/* the counter of the task clock, sent in seconds rather than nanoseconds */
+#define COUNTER_TASK_CLOCK 0
+
+#ifdef HAVE_PERF_EVENT
+/* the counters of a group, the first one leading it */
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} counter_events[COUNTERS_MAX] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+};
+#endif
+
+static const char *counter_fields[COUNTERS_MAX] = {
+    "task_clock_s", "context_switches", "page_faults", "cpu_migrations", "cycles",
+    "instructions",
+};
+
+typedef struct region_stats {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t self_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    /* by counter, as in counter_fields */
+    uint64_t counters[COUNTERS_MAX];
+} region_stats_t;
+
+typedef struct open_region {
+    int id;
+    uint64_t start_ns;
+    /* time spent in regions nested in this one */
+    uint64_t child_ns;
+    /* the counters at the begin */
+    uint64_t counters[COUNTERS_MAX];
+} open_region_t;
+
+typedef struct name_cache_entry {
+    const char *name;
+    int id;
+} name_cache_entry_t;
+
+typedef struct region_thread {
+    /* protects stats, and exited */
+    pthread_mutex_t mutex;
+    region_stats_t stats[REGIONS_MAX];
+    bool exited;
+    /* open regions; depth may exceed REGION_DEPTH_MAX, and those deeper
+     * are not timed */
+    open_region_t stack[REGION_DEPTH_MAX];
+    int depth;
+    name_cache_entry_t cache[NAME_CACHE_SIZE];
+    /* the thread's counter group (the leader first; -1 without one), and
+     * the counter of each of its values */
+    int counter_fds[COUNTERS_MAX];
+    int num_counters;
+    int counter_of[COUNTERS_MAX];
+    struct region_thread *next;
+} region_thread_t;
+
+static __thread region_thread_t *self = NULL;
+
+/* protects the list of threads, the interning table and the period thread */
+static pthread_mutex_t region_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* one flush at a time, so that the totals can be sent without region_mutex */
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static region_thread_t *threads = NULL;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+/* interned names, by id; written once under region_mutex before their id
+ * is handed out */
+static char *region_names[REGIONS_MAX];
+static int name_table[NAME_TABLE_SIZE];
+static int num_regions = 0;
+static bool overflow_reported = false;
+static bool mismatch_reported = false;
+
+/* DAAP_REGION_COUNTERS was read, and is set; the counters some thread has */
+static bool counters_checked = false;
+static bool counters_enabled = false;
+static unsigned int counters_available = 0;
+
+static pthread_t period_thread;
+static pthread_cond_t period_cond = PTHREAD_COND_INITIALIZER;
+static bool period_running = false;
+static bool period_stop = false;
+static double region_period;
+
+static uint64_t monotonicNs(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#ifdef HAVE_PERF_EVENT
+/* Opens a counter of the calling thread. The kernel may refuse to count in
+ * kernel mode (perf_event_paranoid), in which case user mode is counted. */
+static int openCounter(int event, int group_fd) {
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter_events[event].type;
+    attr.config = counter_events[event].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+#endif
+
+/* Opens the thread's counter group: whichever of the counters the kernel
+ * provides, without the group if it has not even the task clock */
+static void openCounters(region_thread_t *thread) {
+    int i;
+
+    for (i = 0; i < COUNTERS_MAX; i++) {
+        thread->counter_fds[i] = -1;
+    }
+#ifdef HAVE_PERF_EVENT
+    for (i = 0; i < COUNTERS_MAX; i++) {
+        thread->counter_fds[thread->num_counters] =
+            openCounter(i, thread->num_counters ? thread->counter_fds[0] : -1);
+        if (thread->counter_fds[thread->num_counters] >= 0) {
+            thread->counter_of[thread->num_counters++] = i;
+        }
+        else if (i == COUNTER_TASK_CLOCK) {
+            DEBUG_OUTPUT(("No perf_event counters for regions: %s", strerror(errno)));
+            return;
+        }
+    }
+#endif
+}
+
+static void closeCounters(region_thread_t *thread) {
+    int i;
+
+    for (i = 0; i < thread->num_counters; i++) {
+        close(thread->counter_fds[i]);
+    }
+    thread->num_counters = 0;
+}
+
+/* Reads the thread's counters into values, by counter */
+static void readCounters(region_thread_t *thread, uint64_t *values) {
+    uint64_t group[1 + COUNTERS_MAX];
+    uint64_t i;
+
+    if (read(thread->counter_fds[0], group, sizeof(group)) < (ssize_t)sizeof(uint64_t)) {
+        return;
+    }
+    for (i = 0; i < group[0] && i < (uint64_t)thread->num_counters; i++) {
+        values[thread->counter_of[i]] = group[1 + i];
+    }
+}
+
+/* Marks the state of an exiting thread, which the next flush frees */
+static void threadExited(void *arg) {
+    region_thread_t *thread = arg;
+
+    pthread_mutex_lock(&thread->mutex);
+    thread->exited = true;
+    closeCounters(thread);
+    pthread_mutex_unlock(&thread->mutex);
+}
+
+static void createThreadKey(void) {
+    pthread_key_create(&thread_key, threadExited);
+}
+
+static region_thread_t *threadState(void) {
+    region_thread_t *thread;
+    int i;
+
+    if (self) {
+        return self;
+    }
+    thread = calloc(1, sizeof(*thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&thread->mutex, NULL);
+    pthread_once(&thread_key_once, createThreadKey);
+    pthread_setspecific(thread_key, thread);
+
+    pthread_mutex_lock(&region_mutex);
+    if (!counters_checked) {
+        counters_enabled = getenv(REGION_COUNTERS_ENVVAR) &&
+                           strcmp(getenv(REGION_COUNTERS_ENVVAR), "0") != 0;
+        counters_checked = true;
+    }
+    if (counters_enabled) {
+        openCounters(thread);
+        for (i = 0; i < thread->num_counters; i++) {
+            counters_available |= 1U << thread->counter_of[i];
+        }
+    }
+    thread->next = threads;
+    threads = thread;
+    pthread_mutex_unlock(&region_mutex);
+    self = thread;
+    return thread;
+}
+
+/* Hash of the part of name that is kept, so that the names cut to the
+ * same text are found in the same place */
+static unsigned int hashName(const char *name) {
+    unsigned int hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < REGION_NAME_MAX - 1 && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Id of name, interning it if new; -1 if there are too many names */
+static int internName(const char *name) {
+    unsigned int i = hashName(name) & (NAME_TABLE_SIZE - 1);
+    int id = -1;
+
+    pthread_mutex_lock(&region_mutex);
+    for (;; i = (i + 1) & (NAME_TABLE_SIZE - 1)) {
+        if (name_table[i] == 0) {
+            break;
+        }
+        if (strncmp(region_names[name_table[i] - 1], name, REGION_NAME_MAX - 1) == 0) {
+            id = name_table[i] - 1;
+            break;
+        }
+    }
+    if (id < 0 && num_regions < REGIONS_MAX) {
+        region_names[num_regions] = strndup(name, REGION_NAME_MAX - 1);
+        if (region_names[num_regions]) {
+            id = num_regions++;
+            name_table[i] = id + 1;
+        }
+    }
+    else if (id < 0 && !overflow_reported) {
+        ERROR_OUTPUT(("More than %d region names, %s and later ones are not timed",
+                      REGIONS_MAX, name));
+        overflow_reported = true;
+    }
+    pthread_mutex_unlock(&region_mutex);
+    return id;
+}
+
+/* Id of name, from the thread's cache when it was given the same pointer
+ * (and the text there has not changed) */
+static int regionId(region_thread_t *thread, const char *name) {
+    name_cache_entry_t *entry = &thread->cache[((uintptr_t)name >> 3) & (NAME_CACHE_SIZE - 1)];
+
+    if (entry->name == name && strncmp(region_names[entry->id], name, REGION_NAME_MAX - 1) == 0) {
+        return entry->id;
+    }
+    entry->id = internName(name);
+    entry->name = entry->id < 0 ? NULL : name;
+    return entry->id;
+}
+
+int daapRegionBegin(const char *name) {
+    region_thread_t *thread = threadState();
+    open_region_t *region;
+    int id;
+
+    if (thread == NULL || name == NULL) {
+        return DAAP_ERROR;
+    }
+    if (thread->depth >= REGION_DEPTH_MAX) {
+        thread->depth++;
+        return DAAP_SUCCESS;
+    }
+    /* a name past REGIONS_MAX is still pushed, untimed, to keep the nesting */
+    id = regionId(thread, name);
+    region = &thread->stack[thread->depth++];
+    region->id = id;
+    region->child_ns = 0;
+    if (thread->num_counters) {
+        readCounters(thread, region->counters);
+    }
+    region->start_ns = monotonicNs();
+    return id < 0 ? DAAP_ERROR : DAAP_SUCCESS;
+}
+
+int daapRegionEnd(const char *name) {
+    uint64_t now = monotonicNs(), elapsed, self_ns, counters[COUNTERS_MAX];
+    region_thread_t *thread = self;
+    region_stats_t *stats;
+    open_region_t *region;
+    int i;
+
+    if (thread == NULL || thread->depth == 0 || name == NULL) {
+        errno = EINVAL;
+        return DAAP_ERROR;
+    }
+    if (thread->depth > REGION_DEPTH_MAX) {
+        thread->depth--;
+        return DAAP_SUCCESS;
+    }
+    region = &thread->stack[thread->depth - 1];
+    if (region->id < 0) {
+        thread->depth--;
+        return DAAP_ERROR;
+    }
+    if (regionId(thread, name) != region->id) {
+        if (!mismatch_reported) {
+            ERROR_OUTPUT(("daapRegionEnd(%s) does not end the innermost region, %s", name,
+                          region_names[region->id]));
+            mismatch_reported = true;
+        }
+        errno = EINVAL;
+        return DAAP_ERROR;
+    }
+    if (thread->num_counters) {
+        memcpy(counters, region->counters, sizeof(counters));
+        readCounters(thread, counters);
+    }
+    thread->depth--;
+    elapsed = now - region->start_ns;
+    self_ns = elapsed - region->child_ns;
+    if (thread->depth > 0) {
+        thread->stack[thread->depth - 1].child_ns += elapsed;
+    }
+
+    stats = &thread->stats[region->id];
+    pthread_mutex_lock(&thread->mutex);
+    if (stats->count == 0 || elapsed < stats->min_ns) {
+        stats->min_ns = elapsed;
+    }
+    if (elapsed > stats->max_ns) {
+        stats->max_ns = elapsed;
+    }
+    stats->count++;
+    stats->total_ns += elapsed;
+    stats->self_ns += self_ns;
+    for (i = 0; i < thread->num_counters; i++) {
+        stats->counters[thread->counter_of[i]] +=
+            counters[thread->counter_of[i]] - region->counters[thread->counter_of[i]];
+    }
+    pthread_mutex_unlock(&thread->mutex);
+    return DAAP_SUCCESS;
+}
+
+/* Copies name, a Fortran string, without its trailing blanks */
+static void fortranName(char *copy, const char *name, int len) {
+    while (len > 0 && name[len - 1] == ' ') {
+        len--;
+    }
+    if (len > REGION_NAME_MAX - 1) {
+        len = REGION_NAME_MAX - 1;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+}
+
+void daapregionbegin_(char *name, int len) {
+    char copy[REGION_NAME_MAX];
+
+    fortranName(copy, name, len);
+    daapRegionBegin(copy);
+}
+
+void daapregionend_(char *name, int len) {
+    char copy[REGION_NAME_MAX];
+
+    fortranName(copy, name, len);
+    daapRegionEnd(copy);
+}
+
+int daapRegionFlush(void) {
+    static region_stats_t totals[REGIONS_MAX];
+    region_thread_t **link, *thread;
+    region_stats_t *from, *to;
+    field_t fields[6 + COUNTERS_MAX];
+    tag_t tag;
+    unsigned int available;
+    bool exited;
+    int i, j, n, num_fields, ret_val = DAAP_SUCCESS;
+
+    pthread_mutex_lock(&flush_mutex);
+    pthread_mutex_lock(&region_mutex);
+    n = num_regions;
+    available = counters_available;
+    memset(totals, 0, sizeof(totals[0]) * n);
+    for (link = &threads; (thread = *link) != NULL; ) {
+        pthread_mutex_lock(&thread->mutex);
+        for (i = 0; i < n; i++) {
+            from = &thread->stats[i];
+            to = &totals[i];
+            if (from->count == 0) {
+                continue;
+            }
+            if (to->count == 0 || from->min_ns < to->min_ns) {
+                to->min_ns = from->min_ns;
+            }
+            if (from->max_ns > to->max_ns) {
+                to->max_ns = from->max_ns;
+            }
+            to->count += from->count;
+            to->total_ns += from->total_ns;
+            to->self_ns += from->self_ns;
+            for (j = 0; j < COUNTERS_MAX; j++) {
+                to->counters[j] += from->counters[j];
+            }
+            memset(from, 0, sizeof(*from));
+        }
+        exited = thread->exited;
+        pthread_mutex_unlock(&thread->mutex);
+        if (exited) {
+            *link = thread->next;
+            pthread_mutex_destroy(&thread->mutex);
+            free(thread);
+        }
+        else {
+            link = &thread->next;
+        }
+    }
+    /* the names up to n do not change, and the records are sent without
+     * holding up the threads starting to run */
+    pthread_mutex_unlock(&region_mutex);
+
+    memset(fields, 0, sizeof(fields));
+    fields[0].field_name = MSG_KEY;
+    fields[0].field_val = "__daap_region";
+    fields[1].field_name = "count";
+    fields[1].field_type = DAAP_FIELD_INT;
+    fields[2].field_name = "total_s";
+    fields[3].field_name = "self_s";
+    fields[4].field_name = "min_s";
+    fields[5].field_name = "max_s";
+    for (i = 2; i < 6; i++) {
+        fields[i].field_type = DAAP_FIELD_FLOAT;
+    }
+    /* the counters some thread could open */
+    num_fields = 6;
+    for (j = 0; j < COUNTERS_MAX; j++) {
+        if (available & (1U << j)) {
+            fields[num_fields].field_name = (char *)counter_fields[j];
+            fields[num_fields].field_type = j == COUNTER_TASK_CLOCK ? DAAP_FIELD_FLOAT :
+                                                                      DAAP_FIELD_INT;
+            num_fields++;
+        }
+    }
+    tag.tag_name = REGION_TAG;
+    for (i = 0; i < n; i++) {
+        if (totals[i].count == 0) {
+            continue;
+        }
+        tag.tag_val = region_names[i];
+        fields[1].int_val = (long long)totals[i].count;
+        fields[2].float_val = totals[i].total_ns / 1e9;
+        fields[3].float_val = totals[i].self_ns / 1e9;
+        fields[4].float_val = totals[i].min_ns / 1e9;
+        fields[5].float_val = totals[i].max_ns / 1e9;
+        for (j = 0, num_fields = 6; j < COUNTERS_MAX; j++) {
+            if (available & (1U << j)) {
+                fields[num_fields].float_val = totals[i].counters[j] / 1e9;
+                fields[num_fields].int_val = (long long)totals[i].counters[j];
+                num_fields++;
+            }
+        }
+        if (daapLogFields(1, &tag, num_fields, fields) != DAAP_SUCCESS) {
+            ret_val = DAAP_ERROR;
+        }
+    }
+    pthread_mutex_unlock(&flush_mutex);
+
+    if (daapLogFlush() != DAAP_SUCCESS) {
+        ret_val = DAAP_ERROR;
+    }
+    return ret_val;
+}
+
+void daapregionflush_(void) {
+    daapRegionFlush();
+}
+
+static void *periodMain(void *arg) {
+    struct timespec deadline;
+
+    (void)arg;
+    pthread_mutex_lock(&region_mutex);
+    while (!period_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)region_period;
+        deadline.tv_nsec += (long)((region_period - (time_t)region_period) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!period_stop &&
+               pthread_cond_timedwait(&period_cond, &region_mutex, &deadline) != ETIMEDOUT) {
+        }
+        if (period_stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&region_mutex);
+        daapRegionFlush();
+        pthread_mutex_lock(&region_mutex);
+    }
+    pthread_mutex_unlock(&region_mutex);
+    return NULL;
+}
+
+/* Starts the periodic flush if DAAP_REGION_PERIOD is set; called at the end
+ * of daapInit() */
+int daapRegionStart(void) {
+    const char *env = getenv(REGION_PERIOD_ENVVAR);
+    double period;
+
+    if (env == NULL || period_running) {
+        return DAAP_SUCCESS;
+    }
+    period = strtod(env, NULL);
+    if (period <= 0) {
+        return DAAP_SUCCESS;
+    }
+    if (period < REGION_MIN_PERIOD) {
+        ERROR_OUTPUT(("%s is below the minimum of %g s, using the minimum",
+                      REGION_PERIOD_ENVVAR, REGION_MIN_PERIOD));
+        period = REGION_MIN_PERIOD;
+    }
+
+    region_period = period;
+    period_stop = false;
+    if (pthread_create(&period_thread, NULL, periodMain, NULL) != 0) {
+        ERROR_OUTPUT(("Failed to start the region flush thread"));
+        return DAAP_ERROR;
+    }
+    period_running = true;
+    return DAAP_SUCCESS;
+}
+
+/* Stops the periodic flush and sends what was timed since the last one;
+ * called by daapFinalize() */
+void daapRegionStop(void) {
+    if (period_running) {
+        pthread_mutex_lock(&region_mutex);
+        period_stop = true;
+        pthread_cond_signal(&period_cond);
+        pthread_mutex_unlock(&region_mutex);
+        pthread_join(period_thread, NULL);
+        period_running = false;
+    }
+    daapRegionFlush();
+}
@@ -0,0 +1,249 @@
+/*
+ * daap_relay: node-local relay for the RELAY transport
+ *
+ * Processes that log with the RELAY transport write their records, framed
+ * in binary with their tag sets and schemas sent once (daap_wire.h), to
+ * this relay's Unix socket instead of each connecting to telegraf. The
+ * relay expands them back to line protocol and sends what every client
+ * wrote since the last poll in one write of the TCP transport, so that
+ * DAAP_ENDPOINTS, TLS, DAAP_SHARD_BY and the send engine apply as they do
+ * to a process sending directly.
+ *
+ * A client that sends something that is not valid framing is disconnected;
+ * it reconnects and starts over with its next write.
+ */
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_relay.h"
+#include "daap_wire.h"
+
+#define READ_CHUNK 65536
+//expanded bytes sent before reading on, when clients keep the relay busy
+#define SEND_THRESHOLD (1 << 20)
+#define LISTEN_BACKLOG 128
+
+extern void daapShutdownSSL();
+
+typedef struct {
+  int fd;
+  daap_wire_decoder_t *decoder;
+  //bytes of an incomplete frame
+  daap_wire_buf_t in;
+} client_t;
+
+static volatile sig_atomic_t stop = 0;
+
+static void usage(void) {
+  printf(
+"./daap_relay [-s socket]\n\
+   -s: Unix socket to listen on (default: $DAAP_RELAY_SOCKET, or\n\
+       /tmp/daap-relay-<uid>.sock)\n\
+Records are sent on to the endpoints of the TCP transport (DAAP_ENDPOINTS).\n\n");
+  exit(0);
+}
+
+static void onSignal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+//Binds the socket, replacing the file of a relay that is no longer running
+static int listenSocket(const char *path) {
+  struct sockaddr_un addr;
+  int fd, probe;
+  mode_t mask;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    ERROR_OUTPUT(("A relay is already listening on %s", path));
+    close(probe);
+    return -1;
+  }
+  if (probe >= 0) {
+    close(probe);
+  }
+  unlink(path);
+
+  //only the user's own processes may send through the relay, from the
+  //moment the socket exists
+  mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, LISTEN_BACKLOG) != 0) {
+    umask(mask);
+    ERROR_OUTPUT(("Cannot listen on %s: %s", path, strerror(errno)));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  umask(mask);
+  return fd;
+}
+
+static void closeClient(client_t *client) {
+  close(client->fd);
+  daapWireDecoderFree(client->decoder);
+  free(client->in.buf);
+}
+
+//Reads what the client wrote and expands its complete frames into out;
+//returns 0, or -1 if the client is gone or sent invalid data
+static int readClient(client_t *client, daap_wire_buf_t *out) {
+  ssize_t n;
+  long used;
+
+  if (daapWireBufReserve(&client->in, READ_CHUNK) != 0) {
+    ERROR_OUTPUT(("Out of memory reading from a client"));
+    return -1;
+  }
+  n = read(client->fd, client->in.buf + client->in.len, READ_CHUNK);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return 0;
+  }
+  if (n <= 0) {
+    return -1;
+  }
+  client->in.len += n;
+
+  used = daapWireDecode(client->decoder, client->in.buf, client->in.len, out);
+  if (used < 0) {
+    ERROR_OUTPUT(("Invalid data from a client, disconnecting it"));
+    return -1;
+  }
+  client->in.len -= used;
+  memmove(client->in.buf, client->in.buf + used, client->in.len);
+  if (client->in.len > DAAP_WIRE_FRAME_MAX) {
+    ERROR_OUTPUT(("Frame larger than %d bytes from a client, disconnecting it",
+                  DAAP_WIRE_FRAME_MAX));
+    return -1;
+  }
+  return 0;
+}
+
+static void sendRecords(daap_wire_buf_t *out) {
+  if (out->len > 0) {
+    if (daapTCPLogWrite(out->buf, (int)out->len) < 0) {
+      DEBUG_OUTPUT(("Failed to send %zu bytes of records", out->len));
+    }
+    out->len = 0;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct sigaction action;
+  struct pollfd *fds = NULL;
+  client_t *clients = NULL, *client;
+  daap_wire_buf_t out = { NULL, 0, 0 };
+  char path[PATH_MAX] = "";
+  int listen_fd, fd, num_clients = 0, max_clients = 0, options, i, n;
+
+  while ((options = getopt(argc, argv, "s:h")) != -1) {
+    switch (options) {
+    case 's':
+      snprintf(path, sizeof(path), "%s", optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (path[0] == '\0' && daapRelaySocketPath(path, sizeof(path)) != 0) {
+    return 1;
+  }
+  gethostname(daap_hostname, LOCAL_MAXHOSTNAMELEN - 1);
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onSignal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  listen_fd = listenSocket(path);
+  if (listen_fd < 0) {
+    return 1;
+  }
+  DEBUG_OUTPUT(("Relaying from %s", path));
+
+  while (!stop) {
+    if (num_clients + 1 > max_clients) {
+      max_clients = max_clients ? 2 * max_clients : 64;
+      fds = realloc(fds, sizeof(*fds) * (max_clients + 1));
+      clients = realloc(clients, sizeof(*clients) * max_clients);
+      if (fds == NULL || clients == NULL) {
+        ERROR_OUTPUT(("Out of memory"));
+        break;
+      }
+    }
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for (i = 0; i < num_clients; i++) {
+      fds[i + 1].fd = clients[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+
+    n = poll(fds, num_clients + 1, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ERROR_OUTPUT(("poll failed: %s", strerror(errno)));
+      break;
+    }
+
+    //clients that went away are swapped with the last one, so walk back
+    for (i = num_clients - 1; i >= 0; i--) {
+      if (fds[i + 1].revents == 0) {
+        continue;
+      }
+      client = &clients[i];
+      if (readClient(client, &out) != 0) {
+        closeClient(client);
+        clients[i] = clients[--num_clients];
+      }
+      if (out.len >= SEND_THRESHOLD) {
+        sendRecords(&out);
+      }
+    }
+    sendRecords(&out);
+
+    if (fds[0].revents & POLLIN) {
+      fd = accept(listen_fd, NULL, NULL);
+      if (fd >= 0) {
+        client = &clients[num_clients];
+        memset(client, 0, sizeof(*client));
+        client->fd = fd;
+        client->decoder = daapWireDecoderNew();
+        if (client->decoder == NULL) {
+          close(fd);
+        }
+        else {
+          num_clients++;
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < num_clients; i++) {
+    closeClient(&clients[i]);
+  }
+  close(listen_fd);
+  unlink(path);
+  daapShutdownSSL();
+  free(fds);
+  free(clients);
+  free(out.buf);
+  return 0;
+}
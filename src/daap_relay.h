@@ -0,0 +1,31 @@
+#ifndef DAAP_RELAY_H
+#define DAAP_RELAY_H
+
+/* Relay transport (not part of the API).
+ *
+ * With the RELAY transport, records are framed in binary (daap_wire.h) and
+ * written to the node's daap_relay over a Unix socket, DAAP_RELAY_SOCKET
+ * (/tmp/daap-relay-<uid>.sock by default); the relay expands them to line
+ * protocol and sends them on with the TCP transport. */
+
+#include <stddef.h>
+
+#define DAAP_RELAY_SOCKET_ENVVAR "DAAP_RELAY_SOCKET"
+
+/* The path of the relay's socket; returns 0, or -1 if it does not fit in
+ * a socket address */
+int daapRelaySocketPath(char *path, size_t size);
+
+/* Writes frames to the relay, connecting first if needed. Returns len, or
+ * -1 if they were not all written: the connection is then closed, and the
+ * encoder has to be reset for the next one. */
+int daapRelayWrite(const char *buf, size_t len);
+
+/* daapRelayWrite() of the priority lane, which reconnects at once rather
+ * than after the delay that follows a failure */
+int daapRelayWritePriority(const char *buf, size_t len);
+
+/* Closes the connection */
+void daapRelayClose(void);
+
+#endif /* DAAP_RELAY_H */
@@ -0,0 +1,186 @@
+/*
+ * Relay transport: the connection to the node's daap_relay
+ *
+ * The connection is made by the first write and kept open. The relay is on
+ * the same node, so a write only fails if it has gone away (or was never
+ * started); what was being written is then dropped, the connection closed,
+ * and reconnecting is not attempted again for a second, so that a missing
+ * relay costs a failed connect per second rather than one per record.
+ * Writes of the priority lane, which are few, try to connect regardless.
+ *
+ * The default socket is in /tmp, where another user could bind it first,
+ * so a relay is only written to if it runs as the same user.
+ */
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_relay.h"
+#include "daap_wire.h"
+
+#define RELAY_SOCKET_DEFAULT "/tmp/daap-relay-%d.sock"
+/* how long after a failed connect the next one is attempted, in seconds */
+#define RECONNECT_DELAY 1.0
+
+#ifndef MSG_NOSIGNAL
+#    define MSG_NOSIGNAL 0
+#endif
+
+/* protects everything below */
+static pthread_mutex_t relay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int relay_fd = -1;
+static double retry_at = 0;
+/* the failure was reported, and is not again until a connect succeeds */
+static bool failure_reported = false;
+
+static double monotonicTime(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int daapRelaySocketPath(char *path, size_t size) {
+    const char *env = getenv(DAAP_RELAY_SOCKET_ENVVAR);
+    struct sockaddr_un addr;
+    int len;
+
+    if (env && env[0]) {
+        len = snprintf(path, size, "%s", env);
+    }
+    else {
+        len = snprintf(path, size, RELAY_SOCKET_DEFAULT, (int)getuid());
+    }
+    if (len < 0 || (size_t)len >= size || (size_t)len >= sizeof(addr.sun_path)) {
+        ERROR_OUTPUT(("Relay socket path %s is too long", path));
+        return -1;
+    }
+    return 0;
+}
+
+static int writeAll(int fd, const char *buf, size_t len) {
+    ssize_t written;
+
+    while (len > 0) {
+        written = send(fd, buf, len, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static void relayFailed(const char *what, const char *path) {
+    if (!failure_reported) {
+        ERROR_OUTPUT(("%s relay %s: %s; records are dropped until it is back", what,
+                      path, strerror(errno)));
+        failure_reported = true;
+    }
+    if (relay_fd >= 0) {
+        close(relay_fd);
+        relay_fd = -1;
+    }
+    retry_at = monotonicTime() + RECONNECT_DELAY;
+}
+
+/* Whether the process listening on fd runs as this user */
+static bool relayIsOurs(int fd) {
+#if defined SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+        cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
+
+/* Connects and sends the magic that starts the framing */
+static int relayConnect(void) {
+    struct sockaddr_un addr;
+#if defined __APPLE__
+    int on = 1;
+#endif
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (daapRelaySocketPath(addr.sun_path, sizeof(addr.sun_path)) != 0) {
+        retry_at = monotonicTime() + RECONNECT_DELAY;
+        return -1;
+    }
+    relay_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (relay_fd < 0) {
+        relayFailed("Cannot create a socket for the", addr.sun_path);
+        return -1;
+    }
+#if defined __APPLE__
+    setsockopt(relay_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    if (connect(relay_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        relayFailed("Cannot connect to the", addr.sun_path);
+        return -1;
+    }
+    if (!relayIsOurs(relay_fd)) {
+        errno = EPERM;
+        relayFailed("Another user listens as the", addr.sun_path);
+        return -1;
+    }
+    if (writeAll(relay_fd, DAAP_WIRE_MAGIC, DAAP_WIRE_MAGIC_LEN) != 0) {
+        relayFailed("Cannot write to the", addr.sun_path);
+        return -1;
+    }
+    failure_reported = false;
+    DEBUG_OUTPUT(("Connected to the relay at %s", addr.sun_path));
+    return 0;
+}
+
+static int relayWrite(const char *buf, size_t len, bool now) {
+    char path[PATH_MAX];
+    int ret_val = (int)len;
+
+    pthread_mutex_lock(&relay_mutex);
+    if (relay_fd < 0 && ((!now && monotonicTime() < retry_at) || relayConnect() != 0)) {
+        ret_val = -1;
+    }
+    else if (writeAll(relay_fd, buf, len) != 0) {
+        daapRelaySocketPath(path, sizeof(path));
+        relayFailed("Lost the connection to the", path);
+        ret_val = -1;
+    }
+    pthread_mutex_unlock(&relay_mutex);
+    return ret_val;
+}
+
+int daapRelayWrite(const char *buf, size_t len) {
+    return relayWrite(buf, len, false);
+}
+
+int daapRelayWritePriority(const char *buf, size_t len) {
+    return relayWrite(buf, len, true);
+}
+
+void daapRelayClose(void) {
+    pthread_mutex_lock(&relay_mutex);
+    if (relay_fd >= 0) {
+        close(relay_fd);
+        relay_fd = -1;
+    }
+    retry_at = 0;
+    failure_reported = false;
+    pthread_mutex_unlock(&relay_mutex);
+}
@@ -0,0 +1,325 @@
+/*
+ * Data Analytics Application Profiling API
+ *
+ * Background process resource sampler
+ *
+ * A heartbeat says that a rank is alive, not whether it is swapping,
+ * starved of I/O or leaking memory. With DAAP_SAMPLE_PERIOD set (in
+ * seconds), daapInit() starts a thread that reads /proc/self/stat, statm,
+ * io and status every period and sends one __daap_sample record with the
+ * process's CPU use, faults, I/O and context switch rates over the period
+ * and its current memory, swap and thread counts. The files are opened
+ * once and read with pread() into a static buffer, so a sample opens and
+ * allocates nothing. A file that cannot be opened (io needs task I/O
+ * accounting in the kernel) leaves its fields out of the records.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+
+#define SAMPLE_PERIOD_ENVVAR "DAAP_SAMPLE_PERIOD"
+/* the shortest period accepted, in seconds */
+#define SAMPLE_MIN_PERIOD 0.1
+#define PROC_BUF_SIZE 4096
+/* fields of /proc/self/stat that are parsed, counting from 1 as proc(5) does */
+#define STAT_FIELDS 42
+/* fields of a record */
+#define SAMPLE_FIELDS_MAX 20
+
+enum {
+    PROC_STAT,
+    PROC_STATM,
+    PROC_IO,
+    PROC_STATUS,
+    PROC_FILES
+};
+
+static const char *proc_paths[PROC_FILES] = {
+    "/proc/self/stat", "/proc/self/statm", "/proc/self/io", "/proc/self/status",
+};
+
+/* the values read in one sample, the counters since the process started */
+typedef struct {
+    double time;
+    unsigned long long utime, stime, blkio, minflt, majflt;
+    unsigned long long threads, vsize, rss, shared;
+    unsigned long long rchar, wchar, read_bytes, write_bytes;
+    unsigned long long swap, rss_peak, voluntary, nonvoluntary;
+} sample_t;
+
+static pthread_t sampler_thread;
+static pthread_mutex_t sampler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sampler_cond = PTHREAD_COND_INITIALIZER;
+static bool sampler_running = false;
+static bool sampler_stop = false;
+static double sampler_period;
+
+static int proc_fds[PROC_FILES] = { -1, -1, -1, -1 };
+static char proc_buf[PROC_BUF_SIZE];
+static double clock_ticks;
+static long page_size;
+
+static double monotonicTime(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* Reads one of the files into proc_buf, NUL terminated; returns its length,
+ * or -1 if it is not open or cannot be read */
+static ssize_t readProc(int file) {
+    ssize_t len;
+
+    if (proc_fds[file] < 0) {
+        return -1;
+    }
+    len = pread(proc_fds[file], proc_buf, sizeof(proc_buf) - 1, 0);
+    if (len < 0) {
+        return -1;
+    }
+    proc_buf[len] = '\0';
+    return len;
+}
+
+/* The number after "key:" at the start of a line of proc_buf, or 0 */
+static unsigned long long procValue(const char *key) {
+    size_t key_len = strlen(key);
+    const char *line = proc_buf;
+
+    while (line != NULL && *line != '\0') {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            return strtoull(line + key_len + 1, NULL, 10);
+        }
+        line = strchr(line, '\n');
+        if (line != NULL) {
+            line++;
+        }
+    }
+    return 0;
+}
+
+static void readSample(sample_t *sample) {
+    unsigned long long stat[STAT_FIELDS + 1];
+    char *pos, *end;
+    int i;
+
+    memset(sample, 0, sizeof(*sample));
+    sample->time = monotonicTime();
+
+    /* the command name (2) is in parentheses and may contain anything,
+     * so the fields after it are found from its last ')' */
+    memset(stat, 0, sizeof(stat));
+    if (readProc(PROC_STAT) > 0 && (pos = strrchr(proc_buf, ')')) != NULL &&
+        pos[1] != '\0' && pos[2] != '\0') {
+        /* skip the state (3), a letter */
+        pos += 3;
+        for (i = 4; i <= STAT_FIELDS; i++) {
+            stat[i] = strtoull(pos, &end, 10);
+            if (end == pos) {
+                break;
+            }
+            pos = end;
+        }
+        sample->minflt = stat[10];
+        sample->majflt = stat[12];
+        sample->utime = stat[14];
+        sample->stime = stat[15];
+        sample->threads = stat[20];
+        sample->vsize = stat[23];
+        sample->blkio = stat[42];
+    }
+
+    if (readProc(PROC_STATM) > 0) {
+        pos = proc_buf;
+        strtoull(pos, &pos, 10);
+        sample->rss = strtoull(pos, &pos, 10) * page_size;
+        sample->shared = strtoull(pos, &pos, 10) * page_size;
+    }
+
+    if (readProc(PROC_IO) > 0) {
+        sample->rchar = procValue("rchar");
+        sample->wchar = procValue("wchar");
+        sample->read_bytes = procValue("read_bytes");
+        sample->write_bytes = procValue("write_bytes");
+    }
+
+    if (readProc(PROC_STATUS) > 0) {
+        sample->swap = procValue("VmSwap") * 1024;
+        sample->rss_peak = procValue("VmHWM") * 1024;
+        sample->voluntary = procValue("voluntary_ctxt_switches");
+        sample->nonvoluntary = procValue("nonvoluntary_ctxt_switches");
+    }
+}
+
+/* Rate per second of a counter between two samples; counters do not go
+ * back, but a wrapped or reset one is taken as no change */
+static double rate(unsigned long long now, unsigned long long then, double elapsed) {
+    return now >= then ? (now - then) / elapsed : 0;
+}
+
+static void addField(field_t *fields, int *num_fields, const char *name, fieldtype type,
+                     double float_val, unsigned long long int_val) {
+    field_t *field = &fields[(*num_fields)++];
+
+    field->field_name = (char *)name;
+    field->field_type = type;
+    field->float_val = float_val;
+    field->int_val = (long long)int_val;
+}
+
+#define ADD_RATE(name, counter)                                                  \
+    addField(fields, &num_fields, name, DAAP_FIELD_FLOAT,                        \
+             rate(now->counter, last->counter, elapsed), 0)
+#define ADD_INT(name, value) addField(fields, &num_fields, name, DAAP_FIELD_INT, 0, now->value)
+
+/* Sends the record of the period from last to now, with the fields of the
+ * files that are open */
+static int sendSample(const sample_t *last, const sample_t *now) {
+    field_t fields[SAMPLE_FIELDS_MAX];
+    double elapsed = now->time - last->time;
+    int num_fields = 0;
+
+    if (elapsed <= 0) {
+        return DAAP_SUCCESS;
+    }
+    memset(fields, 0, sizeof(fields));
+    fields[num_fields].field_name = MSG_KEY;
+    fields[num_fields++].field_val = "__daap_sample";
+
+    /* CPU time and block I/O delay in CPUs busy, on average over the period */
+    addField(fields, &num_fields, "cpu_user", DAAP_FIELD_FLOAT,
+             rate(now->utime, last->utime, elapsed) / clock_ticks, 0);
+    addField(fields, &num_fields, "cpu_system", DAAP_FIELD_FLOAT,
+             rate(now->stime, last->stime, elapsed) / clock_ticks, 0);
+    addField(fields, &num_fields, "io_wait", DAAP_FIELD_FLOAT,
+             rate(now->blkio, last->blkio, elapsed) / clock_ticks, 0);
+    ADD_RATE("minor_faults_s", minflt);
+    ADD_RATE("major_faults_s", majflt);
+    ADD_INT("threads", threads);
+    ADD_INT("vsize_bytes", vsize);
+    if (proc_fds[PROC_STATM] >= 0) {
+        ADD_INT("rss_bytes", rss);
+        ADD_INT("shared_bytes", shared);
+    }
+    if (proc_fds[PROC_IO] >= 0) {
+        ADD_RATE("read_bytes_s", rchar);
+        ADD_RATE("write_bytes_s", wchar);
+        ADD_RATE("read_disk_bytes_s", read_bytes);
+        ADD_RATE("write_disk_bytes_s", write_bytes);
+    }
+    if (proc_fds[PROC_STATUS] >= 0) {
+        ADD_INT("swap_bytes", swap);
+        ADD_INT("rss_peak_bytes", rss_peak);
+        ADD_RATE("voluntary_switches_s", voluntary);
+        ADD_RATE("involuntary_switches_s", nonvoluntary);
+    }
+    return daapLogFields(0, NULL, num_fields, fields);
+}
+
+static void *samplerMain(void *arg) {
+    struct timespec deadline;
+    sample_t samples[2];
+    int last = 0;
+    double next;
+
+    (void)arg;
+    readSample(&samples[last]);
+    pthread_mutex_lock(&sampler_mutex);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    next = deadline.tv_sec + deadline.tv_nsec * 1e-9;
+    while (!sampler_stop) {
+        next += sampler_period;
+        deadline.tv_sec = (time_t)next;
+        deadline.tv_nsec = (long)((next - deadline.tv_sec) * 1e9);
+        while (!sampler_stop &&
+               pthread_cond_timedwait(&sampler_cond, &sampler_mutex, &deadline) != ETIMEDOUT) {
+        }
+        if (sampler_stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&sampler_mutex);
+        readSample(&samples[!last]);
+        if (sendSample(&samples[last], &samples[!last]) != DAAP_SUCCESS) {
+            DEBUG_OUTPUT(("Failed to send a resource sample"));
+        }
+        last = !last;
+        pthread_mutex_lock(&sampler_mutex);
+    }
+    pthread_mutex_unlock(&sampler_mutex);
+    return NULL;
+}
+
+static void closeProcFiles(void) {
+    int i;
+
+    for (i = 0; i < PROC_FILES; i++) {
+        if (proc_fds[i] >= 0) {
+            close(proc_fds[i]);
+            proc_fds[i] = -1;
+        }
+    }
+}
+
+/* Starts the sampler thread if DAAP_SAMPLE_PERIOD is set; called at the end
+ * of daapInit() */
+int daapSamplerStart(void) {
+    const char *env = getenv(SAMPLE_PERIOD_ENVVAR);
+    double period;
+    int i;
+
+    if (env == NULL || sampler_running) {
+        return DAAP_SUCCESS;
+    }
+    period = strtod(env, NULL);
+    if (period <= 0) {
+        return DAAP_SUCCESS;
+    }
+    if (period < SAMPLE_MIN_PERIOD) {
+        ERROR_OUTPUT(("%s is below the minimum of %g s, using the minimum",
+                      SAMPLE_PERIOD_ENVVAR, SAMPLE_MIN_PERIOD));
+        period = SAMPLE_MIN_PERIOD;
+    }
+
+    for (i = 0; i < PROC_FILES; i++) {
+        proc_fds[i] = open(proc_paths[i], O_RDONLY | O_CLOEXEC);
+        if (proc_fds[i] < 0) {
+            DEBUG_OUTPUT(("Cannot sample %s: %s", proc_paths[i], strerror(errno)));
+        }
+    }
+    if (proc_fds[PROC_STAT] < 0) {
+        ERROR_OUTPUT(("Cannot read %s, not sampling resources", proc_paths[PROC_STAT]));
+        closeProcFiles();
+        return DAAP_ERROR;
+    }
+    clock_ticks = sysconf(_SC_CLK_TCK);
+    page_size = sysconf(_SC_PAGESIZE);
+
+    sampler_period = period;
+    sampler_stop = false;
+    if (pthread_create(&sampler_thread, NULL, samplerMain, NULL) != 0) {
+        ERROR_OUTPUT(("Failed to start the sampler thread"));
+        closeProcFiles();
+        return DAAP_ERROR;
+    }
+    sampler_running = true;
+    return DAAP_SUCCESS;
+}
+
+/* Stops the sampler thread, if running; called by daapFinalize() */
+void daapSamplerStop(void) {
+    if (!sampler_running) {
+        return;
+    }
+    pthread_mutex_lock(&sampler_mutex);
+    sampler_stop = true;
+    pthread_cond_signal(&sampler_cond);
+    pthread_mutex_unlock(&sampler_mutex);
+    pthread_join(sampler_thread, NULL);
+    closeProcFiles();
+    sampler_running = false;
+}
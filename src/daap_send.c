@@ -0,0 +1,408 @@
+/*
+ * Asynchronous send engine of the TCP transport
+ *
+ * Each record used to cost at least one write system call (two with its
+ * newline), made while the application waited. With DAAP_SEND_ENGINE=uring
+ * the bytes of a connection (TLS records, or plain text with kTLS) are
+ * instead copied into one of a few buffers registered with an io_uring,
+ * so the kernel does not map them for every write, and submitted as a
+ * fixed-buffer write, which completes in the background. All the records of
+ * a call go out in one submission, and completions are read from the ring
+ * shared with the kernel without a system call. With uring-sqpoll a kernel
+ * thread polls the submission ring as well, so that a busy logger makes no
+ * system calls at all, at the cost of that thread spinning for
+ * SQPOLL_IDLE_MS after the last submission.
+ *
+ * A stream socket has one write in flight at a time, to keep the bytes in
+ * order: a connection fills its next buffer while the previous one is
+ * written, and waits for it only when submitting again, which is when a
+ * blocking write would have waited too. A write that fails is reported by
+ * the next call on the connection, and the transport reconnects; what was
+ * in that write is lost, as it would be in the socket's send buffer.
+ *
+ * The engine talks to the kernel directly rather than through liburing,
+ * which is not available everywhere. If the io_uring cannot be set up (an
+ * old kernel, io_uring disabled, or buffers that cannot be locked), the
+ * transport writes to its connections directly, as with
+ * DAAP_SEND_ENGINE=writev, the default.
+ */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_send.h"
+
+#define SEND_ENGINE_ENVVAR "DAAP_SEND_ENGINE"
+/* registered buffers, shared by the connections, and their size */
+#define SEND_BUFFERS 8
+#define SEND_BUFFER_SIZE 65536
+#define SEND_RING_ENTRIES 16
+/* how long the submission thread of uring-sqpoll polls before sleeping */
+#define SQPOLL_IDLE_MS 100
+
+typedef struct send_buffer {
+    char *data;
+    /* bytes queued, and written so far */
+    size_t len;
+    size_t sent;
+    /* the connection it belongs to; NULL when free */
+    daap_send_queue_t *queue;
+} send_buffer_t;
+
+/* the rings shared with the kernel */
+static struct {
+    int fd;
+    bool sqpoll;
+    void *rings;
+    size_t rings_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring = { .fd = -1 };
+
+static send_buffer_t buffers[SEND_BUFFERS];
+static char *buffer_memory = NULL;
+static bool engine_active = false;
+
+static void submitBuffer(int index);
+
+static int uringEnter(unsigned to_submit, unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    if (uring.sqpoll) {
+        /* the kernel thread picks up submissions by itself unless it went
+         * to sleep */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(uring.sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+        else if (min_complete == 0) {
+            return 0;
+        }
+    }
+    do {
+        ret = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+/* Handles the completion of a write of the buffer */
+static void completeBuffer(int index, int res) {
+    send_buffer_t *buffer = &buffers[index];
+    daap_send_queue_t *q = buffer->queue;
+
+    if (res == -EINTR || res == -EAGAIN) {
+        submitBuffer(index);
+        return;
+    }
+    if (res > 0) {
+        buffer->sent += res;
+        if (buffer->sent < buffer->len) {
+            /* a short write: the rest goes out before anything else */
+            submitBuffer(index);
+            return;
+        }
+    }
+    else {
+        q->error = res < 0 ? -res : EPIPE;
+        DEBUG_OUTPUT(("Send engine write failed: %s", strerror(q->error)));
+    }
+    q->in_flight = -1;
+    buffer->queue = NULL;
+}
+
+/* Reads the completions the kernel posted, without a system call */
+static void reapCompletions(void) {
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+
+    while (head != tail) {
+        cqe = &uring.cqes[head & *uring.cq_mask];
+        completeBuffer((int)cqe->user_data, cqe->res);
+        head++;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Waits for at least one write to complete */
+static void waitCompletion(void) {
+    if (uringEnter(0, 1) < 0) {
+        ERROR_OUTPUT(("io_uring wait failed: %s", strerror(errno)));
+    }
+    reapCompletions();
+}
+
+/* Submits the unwritten part of the buffer as a fixed-buffer write */
+static void submitBuffer(int index) {
+    send_buffer_t *buffer = &buffers[index];
+    struct io_uring_sqe *sqe;
+    unsigned tail, slot;
+
+    /* at most SEND_BUFFERS writes are in flight, so there is always room */
+    tail = *uring.sq_tail;
+    while (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) >= uring.sq_entries) {
+        uringEnter(0, 0);
+    }
+    slot = tail & *uring.sq_mask;
+    sqe = &uring.sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = buffer->queue->fd;
+    sqe->addr = (unsigned long)(buffer->data + buffer->sent);
+    sqe->len = buffer->len - buffer->sent;
+    /* sockets have no position */
+    sqe->off = (__u64)-1;
+    sqe->buf_index = index;
+    sqe->user_data = index;
+    uring.sq_array[slot] = slot;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    buffer->queue->in_flight = index;
+    if (uringEnter(1, 0) < 0) {
+        ERROR_OUTPUT(("io_uring submission failed: %s", strerror(errno)));
+    }
+}
+
+/* Submits the buffer being filled once the previous write of the
+ * connection is done */
+static int submitFilling(daap_send_queue_t *q) {
+    reapCompletions();
+    while (q->in_flight >= 0) {
+        waitCompletion();
+    }
+    if (q->error) {
+        errno = q->error;
+        return -1;
+    }
+    if (q->filling >= 0) {
+        submitBuffer(q->filling);
+        q->filling = -1;
+    }
+    return 0;
+}
+
+/* A free buffer for the connection, waiting for a write to complete if
+ * there is none. Only the connection being written to can be filling a
+ * buffer, so all others are in flight. */
+static int takeBuffer(daap_send_queue_t *q) {
+    int i;
+
+    for (;;) {
+        reapCompletions();
+        for (i = 0; i < SEND_BUFFERS; i++) {
+            if (buffers[i].queue == NULL) {
+                buffers[i].queue = q;
+                buffers[i].len = 0;
+                buffers[i].sent = 0;
+                return i;
+            }
+        }
+        waitCompletion();
+    }
+}
+
+static int uringSetup(bool sqpoll) {
+    struct io_uring_params params;
+    struct iovec iov[SEND_BUFFERS];
+    size_t sq_len, cq_len;
+    char *rings;
+    int i;
+
+    memset(&params, 0, sizeof(params));
+    if (sqpoll) {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+    uring.fd = syscall(__NR_io_uring_setup, SEND_RING_ENTRIES, &params);
+    if (uring.fd < 0) {
+        return -1;
+    }
+    uring.sqpoll = sqpoll;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring.rings_len = sq_len > cq_len ? sq_len : cq_len;
+    uring.rings = mmap(NULL, uring.rings_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (uring.rings == MAP_FAILED) {
+        uring.rings = NULL;
+        return -1;
+    }
+    uring.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        uring.sqes = NULL;
+        return -1;
+    }
+    rings = uring.rings;
+    uring.sq_entries = params.sq_entries;
+    uring.sq_head = (unsigned *)(rings + params.sq_off.head);
+    uring.sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    uring.sq_mask = (unsigned *)(rings + params.sq_off.ring_mask);
+    uring.sq_flags = (unsigned *)(rings + params.sq_off.flags);
+    uring.sq_array = (unsigned *)(rings + params.sq_off.array);
+    uring.cq_head = (unsigned *)(rings + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    uring.cq_mask = (unsigned *)(rings + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    /* the buffers are pinned once here instead of for every write */
+    buffer_memory = mmap(NULL, SEND_BUFFERS * SEND_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer_memory == MAP_FAILED) {
+        buffer_memory = NULL;
+        return -1;
+    }
+    for (i = 0; i < SEND_BUFFERS; i++) {
+        buffers[i].data = buffer_memory + i * SEND_BUFFER_SIZE;
+        buffers[i].queue = NULL;
+        iov[i].iov_base = buffers[i].data;
+        iov[i].iov_len = SEND_BUFFER_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, iov,
+                SEND_BUFFERS) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+bool daapSendEngineInit(void) {
+    const char *engine = getenv(SEND_ENGINE_ENVVAR);
+    bool sqpoll;
+
+    if (engine_active || engine == NULL || engine[0] == '\0' || strcmp(engine, "writev") == 0) {
+        return engine_active;
+    }
+    if (strcmp(engine, "uring") != 0 && strcmp(engine, "uring-sqpoll") != 0) {
+        ERROR_OUTPUT(("Unknown %s %s, using writev", SEND_ENGINE_ENVVAR, engine));
+        return false;
+    }
+    sqpoll = strcmp(engine, "uring-sqpoll") == 0;
+
+    if (uringSetup(sqpoll) < 0) {
+        DEBUG_OUTPUT(("io_uring is not available (%s), using writev", strerror(errno)));
+        daapSendEngineFree();
+        return false;
+    }
+    engine_active = true;
+    DEBUG_OUTPUT(("Sending through io_uring%s", sqpoll ? " with a polling thread" : ""));
+    return true;
+}
+
+bool daapSendEngineActive(void) {
+    return engine_active;
+}
+
+void daapSendQueueOpen(daap_send_queue_t *q, int fd) {
+    q->fd = fd;
+    q->filling = -1;
+    q->in_flight = -1;
+    q->error = 0;
+}
+
+void daapSendQueueClose(daap_send_queue_t *q) {
+    if (q->fd < 0) {
+        return;
+    }
+    /* after a failure the connection is gone, so what is left is dropped */
+    if (q->error == 0) {
+        daapSendDrain(q);
+    }
+    while (q->in_flight >= 0) {
+        waitCompletion();
+    }
+    if (q->filling >= 0) {
+        buffers[q->filling].queue = NULL;
+        q->filling = -1;
+    }
+    q->fd = -1;
+}
+
+int daapSendQueued(daap_send_queue_t *q, const void *buf, size_t len) {
+    send_buffer_t *buffer;
+    size_t n;
+
+    while (len > 0) {
+        if (q->error) {
+            errno = q->error;
+            return -1;
+        }
+        if (q->filling < 0) {
+            q->filling = takeBuffer(q);
+        }
+        buffer = &buffers[q->filling];
+        n = SEND_BUFFER_SIZE - buffer->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buffer->data + buffer->len, buf, n);
+        buffer->len += n;
+        buf = (const char *)buf + n;
+        len -= n;
+        if (buffer->len == SEND_BUFFER_SIZE && submitFilling(q) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int daapSendSubmit(daap_send_queue_t *q) {
+    reapCompletions();
+    if (q->filling >= 0 && submitFilling(q) < 0) {
+        return -1;
+    }
+    if (q->error) {
+        errno = q->error;
+        return -1;
+    }
+    return 0;
+}
+
+int daapSendDrain(daap_send_queue_t *q) {
+    if (daapSendSubmit(q) < 0) {
+        return -1;
+    }
+    while (q->in_flight >= 0) {
+        waitCompletion();
+    }
+    if (q->error) {
+        errno = q->error;
+        return -1;
+    }
+    return 0;
+}
+
+void daapSendEngineFree(void) {
+    if (uring.fd >= 0) {
+        close(uring.fd);
+        uring.fd = -1;
+    }
+    if (uring.sqes) {
+        munmap(uring.sqes, uring.sqes_len);
+        uring.sqes = NULL;
+    }
+    if (uring.rings) {
+        munmap(uring.rings, uring.rings_len);
+        uring.rings = NULL;
+    }
+    if (buffer_memory) {
+        munmap(buffer_memory, SEND_BUFFERS * SEND_BUFFER_SIZE);
+        buffer_memory = NULL;
+    }
+    engine_active = false;
+}
@@ -0,0 +1,51 @@
+#ifndef DAAP_SEND_H
+#define DAAP_SEND_H
+
+/* Asynchronous send engine of the TCP transport (not part of the API).
+ *
+ * With DAAP_SEND_ENGINE=uring (or uring-sqpoll) the bytes of a connection
+ * are copied into buffers registered with an io_uring and submitted as
+ * fixed-buffer writes, which complete in the background; completions are
+ * read from the shared ring. Otherwise, or if the io_uring cannot be set up,
+ * connections are written to directly (the writev engine). The functions
+ * are called with the transport's write mutex held. */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bytes of one connection waiting to be sent */
+typedef struct daap_send_queue {
+    int fd;
+    /* buffer being filled, and the one being written; -1 if none */
+    int filling;
+    int in_flight;
+    /* errno of a write that failed since the last check */
+    int error;
+} daap_send_queue_t;
+
+/* Sets up the engine named by DAAP_SEND_ENGINE; true if it is io_uring */
+bool daapSendEngineInit(void);
+
+/* True if connections are sent through the io_uring */
+bool daapSendEngineActive(void);
+
+/* Starts and ends the queue of the connection on fd; the end waits until
+ * everything queued is written */
+void daapSendQueueOpen(daap_send_queue_t *q, int fd);
+void daapSendQueueClose(daap_send_queue_t *q);
+
+/* Copies len bytes into the queue, submitting the buffers that fill up.
+ * Returns 0, or -1 if a write of the connection failed. */
+int daapSendQueued(daap_send_queue_t *q, const void *buf, size_t len);
+
+/* Submits what was queued without waiting for it to be written. Returns 0,
+ * or -1 (errno set) if a write of the connection failed. */
+int daapSendSubmit(daap_send_queue_t *q);
+
+/* Waits until everything queued is written; returns 0 or -1 as above */
+int daapSendDrain(daap_send_queue_t *q);
+
+/* Releases the io_uring and its buffers (the queues must be closed) */
+void daapSendEngineFree(void);
+
+#endif /* DAAP_SEND_H */
@@ -0,0 +1,610 @@
+/*
+ * In-process stdout/stderr capture for unmodified applications
+ *
+ * Results used to reach DAAP only when stdout_parser was run on an output
+ * file after the fact. Loaded with
+ *
+ *   LD_PRELOAD=libdaap_stdout_preload.so DAAP_STDOUT_KEY_TEMPLATE=... app
+ *
+ * this library interposes the calls that write to file descriptors 1 and
+ * 2 (write, writev, and the stdio functions that write to stdout/stderr)
+ * and runs the stdout parser's template engine on the output in a
+ * background thread, sending what it finds through libdaap_log while the
+ * application runs.
+ *
+ * The application's output is written exactly as before, by the real
+ * function. On top of that the calling thread only reserves space in a
+ * lock-free multi-producer ring (one compare-and-swap) and copies the
+ * bytes that were written into it. The engine thread drains the ring,
+ * reassembles each stream's lines, matches them and sends the records.
+ * When the ring is full, the captured bytes are dropped (and counted)
+ * rather than making the application wait.
+ *
+ * The interposed functions, and the daapParser*() calls of the parser
+ * engine it is built with (daap_parser.c), are the only symbols this
+ * library exports.
+ *
+ * Configuration, read at load time:
+ *   DAAP_STDOUT_BUNDLE          template bundle written by stdout_parser --compile
+ *   DAAP_STDOUT_KEY_TEMPLATE    key template (or the source of the bundle)
+ *   DAAP_STDOUT_TABLE_TEMPLATE  table template
+ *   DAAP_STDOUT_TRANSPORT       tcp (default), syslog or relay
+ *   DAAP_STDOUT_APPNAME         appname of the records (default: program name)
+ *   DAAP_STDOUT_BUFFER          ring size in bytes (default 4 MiB)
+ * Without a key template or bundle, nothing is captured.
+ */
+#define _GNU_SOURCE
+#undef _FORTIFY_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_parser.h"
+
+#define DEFAULT_RING_SIZE (4 << 20)
+#define MIN_RING_SIZE (64 << 10)
+#define RECORD_ALIGN 8
+/* ready value of the filler record that skips to the start of the ring */
+#define RECORD_PAD 3
+/* formatted output up to this size is formatted on the stack */
+#define FORMAT_BUF_SIZE 1024
+/* how long the engine sleeps when there is nothing to parse */
+#define IDLE_SLEEP_NS 5000000
+
+#define ALIGN_UP(n) (((n) + RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1))
+
+/* Header of the bytes of one write in the ring. The ring is all zeroes
+ * where nothing is stored, so a record is complete once ready is set. */
+typedef struct {
+    _Atomic uint32_t ready;        /* 1 stdout, 2 stderr, RECORD_PAD */
+    uint32_t len;
+} record_t;
+
+static struct {
+    char *data;
+    uint64_t size;                 /* a power of 2 */
+    _Atomic uint64_t head;         /* bytes reserved by writers */
+    _Atomic uint64_t tail;         /* bytes released by the engine */
+    _Atomic uint64_t dropped;      /* bytes not captured because it was full */
+} ring;
+
+static atomic_int capturing;
+static atomic_int stopping;
+static int engine_running;
+static pthread_t engine_thread;
+/* set in the engine thread, whose own output must not be captured */
+static __thread int in_engine __attribute__((tls_model("initial-exec")));
+
+static parser_t parser;
+static stream_t streams[2];        /* stdout, stderr */
+static char appname[256];
+static transport transport_type = TCP;
+
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_writev)(int, const struct iovec *, int);
+static size_t (*real_fwrite)(const void *, size_t, size_t, FILE *);
+static int (*real_fputs)(const char *, FILE *);
+static int (*real_puts)(const char *);
+static int (*real_fputc)(int, FILE *);
+static int (*real_putc)(int, FILE *);
+static int (*real_putchar)(int);
+static int (*real_vfprintf)(FILE *, const char *, va_list);
+static int (*real___vfprintf_chk)(FILE *, int, const char *, va_list);
+
+#define RESOLVE(name) do {                                     \
+        if (!real_##name) {                                    \
+            real_##name = dlsym(RTLD_NEXT, #name);             \
+        }                                                      \
+    } while (0)
+
+/* Resolve every real function up front: dlsym takes the loader lock, which
+ * the engine thread must not wait for while the process exits */
+static void resolveReal(void) {
+    RESOLVE(write);
+    RESOLVE(writev);
+    RESOLVE(fwrite);
+    RESOLVE(fputs);
+    RESOLVE(puts);
+    RESOLVE(fputc);
+    RESOLVE(putc);
+    RESOLVE(putchar);
+    RESOLVE(vfprintf);
+    RESOLVE(__vfprintf_chk);
+}
+
+/*
+ * Capture (application threads)
+ */
+
+/* Copy one piece of output into the ring */
+static void captureChunk(int stream, const char *buf, uint32_t len) {
+    uint64_t total = sizeof(record_t) + ALIGN_UP(len);
+    uint64_t head, pos, pad;
+    record_t *rec;
+
+    head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    do {
+        pos = head & (ring.size - 1);
+        /* a record never wraps; the rest of the ring is skipped instead */
+        pad = ring.size - pos < total ? ring.size - pos : 0;
+        /* head may be older than tail here (the CAS then fails), so no
+         * subtraction */
+        if (head + pad + total >
+            atomic_load_explicit(&ring.tail, memory_order_acquire) + ring.size) {
+            atomic_fetch_add_explicit(&ring.dropped, len, memory_order_relaxed);
+            return;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&ring.head, &head, head + pad + total,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+
+    if (pad) {
+        rec = (record_t *)(ring.data + pos);
+        rec->len = pad - sizeof(record_t);
+        atomic_store_explicit(&rec->ready, RECORD_PAD, memory_order_release);
+        pos = 0;
+    }
+    rec = (record_t *)(ring.data + pos);
+    rec->len = len;
+    memcpy(rec + 1, buf, len);
+    atomic_store_explicit(&rec->ready, stream, memory_order_release);
+}
+
+/* Capture bytes written to fd 1 or 2 */
+static void capture(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    size_t chunk;
+
+    if ((fd != 1 && fd != 2) || len == 0 || in_engine) {
+        return;
+    }
+    /* large writes go in as several records */
+    while (len > 0) {
+        chunk = len < ring.size / 4 ? len : ring.size / 4;
+        captureChunk(fd, p, chunk);
+        p += chunk;
+        len -= chunk;
+    }
+}
+
+static inline int capturingFd(int fd) {
+    return (fd == 1 || fd == 2) &&
+        atomic_load_explicit(&capturing, memory_order_relaxed);
+}
+
+/* The captured fd of a stdio stream, or -1 */
+static inline int capturedFile(FILE *stream) {
+    int fd;
+
+    if (!atomic_load_explicit(&capturing, memory_order_relaxed) || !stream) {
+        return -1;
+    }
+    fd = fileno_unlocked(stream);
+    return fd == 1 || fd == 2 ? fd : -1;
+}
+
+/* printf and friends: format once, write with the real fwrite and capture
+ * the same bytes */
+static int formatAndWrite(FILE *stream, int fd, const char *format, va_list ap) {
+    char buf[FORMAT_BUF_SIZE];
+    char *out = buf;
+    va_list copy;
+    int len;
+
+    RESOLVE(fwrite);
+    va_copy(copy, ap);
+    len = vsnprintf(buf, sizeof(buf), format, ap);
+    if (len >= (int)sizeof(buf)) {
+        out = malloc(len + 1);
+        if (!out) {
+            /* still write the output, uncaptured */
+            RESOLVE(vfprintf);
+            len = real_vfprintf(stream, format, copy);
+            va_end(copy);
+            return len;
+        }
+        vsnprintf(out, len + 1, format, copy);
+    }
+    va_end(copy);
+
+    if (len > 0) {
+        if (real_fwrite(out, 1, len, stream) < (size_t)len) {
+            len = -1;
+        }
+        else {
+            capture(fd, out, len);
+        }
+    }
+    if (out != buf) {
+        free(out);
+    }
+    return len;
+}
+
+DAAP_EXPORT ssize_t write(int fd, const void *buf, size_t count) {
+    ssize_t ret;
+
+    RESOLVE(write);
+    ret = real_write(fd, buf, count);
+    if (ret > 0 && capturingFd(fd)) {
+        capture(fd, buf, ret);
+    }
+    return ret;
+}
+
+DAAP_EXPORT ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+    ssize_t ret;
+    size_t left, len;
+    int i;
+
+    RESOLVE(writev);
+    ret = real_writev(fd, iov, iovcnt);
+    if (ret > 0 && capturingFd(fd)) {
+        left = ret;
+        for (i = 0; i < iovcnt && left > 0; i++) {
+            len = iov[i].iov_len < left ? iov[i].iov_len : left;
+            capture(fd, iov[i].iov_base, len);
+            left -= len;
+        }
+    }
+    return ret;
+}
+
+DAAP_EXPORT size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream) {
+    size_t ret;
+    int fd;
+
+    RESOLVE(fwrite);
+    ret = real_fwrite(ptr, size, nmemb, stream);
+    if (ret > 0 && (fd = capturedFile(stream)) > 0) {
+        capture(fd, ptr, ret * size);
+    }
+    return ret;
+}
+
+DAAP_EXPORT int fputs(const char *s, FILE *stream) {
+    int ret, fd;
+
+    RESOLVE(fputs);
+    ret = real_fputs(s, stream);
+    if (ret >= 0 && (fd = capturedFile(stream)) > 0) {
+        capture(fd, s, strlen(s));
+    }
+    return ret;
+}
+
+DAAP_EXPORT int puts(const char *s) {
+    int ret;
+
+    RESOLVE(puts);
+    ret = real_puts(s);
+    if (ret >= 0 && capturingFd(1)) {
+        capture(1, s, strlen(s));
+        capture(1, "\n", 1);
+    }
+    return ret;
+}
+
+DAAP_EXPORT int fputc(int c, FILE *stream) {
+    char ch = c;
+    int ret, fd;
+
+    RESOLVE(fputc);
+    ret = real_fputc(c, stream);
+    if (ret != EOF && (fd = capturedFile(stream)) > 0) {
+        capture(fd, &ch, 1);
+    }
+    return ret;
+}
+
+DAAP_EXPORT int putc(int c, FILE *stream) {
+    char ch = c;
+    int ret, fd;
+
+    RESOLVE(putc);
+    ret = real_putc(c, stream);
+    if (ret != EOF && (fd = capturedFile(stream)) > 0) {
+        capture(fd, &ch, 1);
+    }
+    return ret;
+}
+
+DAAP_EXPORT int putchar(int c) {
+    char ch = c;
+    int ret;
+
+    RESOLVE(putchar);
+    ret = real_putchar(c);
+    if (ret != EOF && capturingFd(1)) {
+        capture(1, &ch, 1);
+    }
+    return ret;
+}
+
+DAAP_EXPORT int vfprintf(FILE *stream, const char *format, va_list ap) {
+    int fd;
+
+    if ((fd = capturedFile(stream)) > 0) {
+        return formatAndWrite(stream, fd, format, ap);
+    }
+    RESOLVE(vfprintf);
+    return real_vfprintf(stream, format, ap);
+}
+
+DAAP_EXPORT int vprintf(const char *format, va_list ap) {
+    return vfprintf(stdout, format, ap);
+}
+
+DAAP_EXPORT int fprintf(FILE *stream, const char *format, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = vfprintf(stream, format, ap);
+    va_end(ap);
+    return ret;
+}
+
+DAAP_EXPORT int printf(const char *format, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = vfprintf(stdout, format, ap);
+    va_end(ap);
+    return ret;
+}
+
+/* the _FORTIFY_SOURCE variants that applications are often built with */
+DAAP_EXPORT int __vfprintf_chk(FILE *stream, int flag, const char *format, va_list ap) {
+    int fd;
+
+    if ((fd = capturedFile(stream)) > 0) {
+        return formatAndWrite(stream, fd, format, ap);
+    }
+    RESOLVE(__vfprintf_chk);
+    return real___vfprintf_chk(stream, flag, format, ap);
+}
+
+DAAP_EXPORT int __vprintf_chk(int flag, const char *format, va_list ap) {
+    return __vfprintf_chk(stdout, flag, format, ap);
+}
+
+DAAP_EXPORT int __fprintf_chk(FILE *stream, int flag, const char *format, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = __vfprintf_chk(stream, flag, format, ap);
+    va_end(ap);
+    return ret;
+}
+
+DAAP_EXPORT int __printf_chk(int flag, const char *format, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, format);
+    ret = __vfprintf_chk(stdout, flag, format, ap);
+    va_end(ap);
+    return ret;
+}
+
+/*
+ * The engine thread
+ */
+
+/* Move everything committed to the ring into the stream buffers. Returns
+ * the number of bytes consumed. */
+static uint64_t drainRing(void) {
+    uint64_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+    uint64_t start = tail, pos, advance;
+    record_t *rec;
+    uint32_t ready;
+
+    while (tail < head) {
+        pos = tail & (ring.size - 1);
+        rec = (record_t *)(ring.data + pos);
+        ready = atomic_load_explicit(&rec->ready, memory_order_acquire);
+        if (!ready) {
+            /* reserved, but still being copied */
+            break;
+        }
+        if (ready == RECORD_PAD) {
+            advance = ring.size - pos;
+        }
+        else {
+            appendStream(&streams[ready - 1], (char *)(rec + 1), rec->len);
+            advance = sizeof(record_t) + ALIGN_UP(rec->len);
+        }
+        /* free space is kept zeroed for the writers */
+        memset(rec, 0, advance);
+        tail += advance;
+        atomic_store_explicit(&ring.tail, tail, memory_order_release);
+    }
+    return tail - start;
+}
+
+/* Whether the engine initializes libdaap_log, decided when there is first
+ * output to parse: the engine starts before main(), so an application that
+ * uses libdaap_log itself has not called daapInit() yet, but will have
+ * before its output by then, and it keeps its settings and finalizes it.
+ * Otherwise the process's lifecycle is not ours to report (every process
+ * started with LD_PRELOAD inherited, a wrapper shell or env included,
+ * would send one), so it is initialized decoupled. */
+static int takeLog(void) {
+    if (daapInit_called) {
+        return 0;
+    }
+    daapInit_decoupled = true;
+    if (daapInit(appname, LOG_NOTICE, DAAP_AGG_MED, transport_type) != 0) {
+        ERROR_OUTPUT(("daapInit failed, captured output will not be sent"));
+    }
+    return 1;
+}
+
+static void *engineMain(void *arg) {
+    struct timespec idle = { 0, IDLE_SLEEP_NS };
+    uint64_t drained;
+    int stop, i;
+    /* -1 until takeLog() */
+    int owns_log = -1;
+
+    (void)arg;
+    in_engine = 1;
+
+    while (1) {
+        stop = atomic_load(&stopping);
+        drained = drainRing();
+        if (drained > 0) {
+            if (owns_log < 0) {
+                owns_log = takeLog();
+            }
+            for (i = 0; i < 2; i++) {
+                parseStreamBuffer(&parser, &streams[i], 0);
+            }
+        }
+        else if (stop) {
+            break;
+        }
+        else {
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        parseStreamBuffer(&parser, &streams[i], 1);
+    }
+    if (atomic_load(&ring.dropped) > 0) {
+        ERROR_OUTPUT(("%llu bytes of output were not parsed (capture buffer full)",
+                      (unsigned long long)atomic_load(&ring.dropped)));
+    }
+    /* sends the rest, and stops the threads daapInit() may have started */
+    if (owns_log > 0) {
+        daapFinalize();
+    } else if (owns_log == 0) {
+        daapLogFlush();
+    }
+    return NULL;
+}
+
+/* The engine thread does not exist in a forked child */
+static void forkChild(void) {
+    atomic_store(&capturing, 0);
+    engine_running = 0;
+}
+
+static void freeEngine(void) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        daapTableStateFree(&streams[i].table);
+        free(streams[i].buf);
+    }
+    memset(streams, 0, sizeof(streams));
+    freeTemplates(&parser);
+}
+
+static void preloadFini(void) {
+    if (!engine_running) {
+        return;
+    }
+    /* parse what is left and send it */
+    atomic_store(&capturing, 0);
+    atomic_store(&stopping, 1);
+    pthread_join(engine_thread, NULL);
+    engine_running = 0;
+    /* the ring is not freed: other threads may still be in capture() */
+    freeEngine();
+}
+
+__attribute__((constructor))
+static void preloadInit(void) {
+    char key_file[PATH_MAX], table_file[PATH_MAX], bundle_file[PATH_MAX];
+    const char *env;
+    uint64_t size;
+    int i;
+
+    resolveReal();
+    in_engine = 1;
+    snprintf(key_file, sizeof(key_file), "%s",
+             getenv("DAAP_STDOUT_KEY_TEMPLATE") ? getenv("DAAP_STDOUT_KEY_TEMPLATE") : "");
+    snprintf(table_file, sizeof(table_file), "%s",
+             getenv("DAAP_STDOUT_TABLE_TEMPLATE") ? getenv("DAAP_STDOUT_TABLE_TEMPLATE") : "");
+    snprintf(bundle_file, sizeof(bundle_file), "%s",
+             getenv("DAAP_STDOUT_BUNDLE") ? getenv("DAAP_STDOUT_BUNDLE") : "");
+    if (!key_file[0] && !bundle_file[0]) {
+        /* nothing to match: output passes straight through */
+        in_engine = 0;
+        return;
+    }
+
+    env = getenv("DAAP_STDOUT_TRANSPORT");
+    if (env && strcmp(env, "syslog") == 0) {
+        transport_type = SYSLOG;
+    }
+    else if (env && strcmp(env, "relay") == 0) {
+        transport_type = RELAY;
+    }
+    env = getenv("DAAP_STDOUT_APPNAME");
+    snprintf(appname, sizeof(appname), "%s",
+             env ? env : program_invocation_short_name);
+
+    size = DEFAULT_RING_SIZE;
+    if ((env = getenv("DAAP_STDOUT_BUFFER"))) {
+        size = MIN_RING_SIZE;
+        while (size < strtoull(env, NULL, 0)) {
+            size *= 2;
+        }
+    }
+
+    if (loadTemplates(&parser, key_file, table_file, bundle_file) != 0) {
+        ERROR_OUTPUT(("Failed to load the templates, output will not be captured"));
+        in_engine = 0;
+        return;
+    }
+    ring.size = size;
+    ring.data = calloc(1, size);
+    for (i = 0; i < 2 && ring.data; i++) {
+        if (daapTableStateInit(&streams[i].table, &parser.tables) < 0) {
+            free(ring.data);
+            ring.data = NULL;
+        }
+    }
+    if (!ring.data) {
+        ERROR_OUTPUT(("Failed to allocate the capture buffer"));
+        freeEngine();
+        in_engine = 0;
+        return;
+    }
+
+    pthread_atfork(NULL, NULL, forkChild);
+    /* stopped from exit() rather than a destructor, so that the output of
+     * the application's own exit handlers is still parsed and the engine
+     * can finish without the loader lock held by the destructors */
+    atexit(preloadFini);
+    if (pthread_create(&engine_thread, NULL, engineMain, NULL) != 0) {
+        ERROR_OUTPUT(("Failed to start the parser thread"));
+        freeEngine();
+        free(ring.data);
+        ring.data = NULL;
+        in_engine = 0;
+        return;
+    }
+    engine_running = 1;
+    in_engine = 0;
+    atomic_store(&capturing, 1);
+}
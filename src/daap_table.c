@@ -0,0 +1,474 @@
+/*
+ * Table matching engine for the stdout parser
+ *
+ * Table templates used to be read into fixed size table_t structs (10
+ * tables of 10 headers, 10 columns and 20 values, 512 bytes per string)
+ * and every line was compared with the next header of every table using
+ * strstr, with rows copied into column buffers by strtok.
+ *
+ * Here a template is compiled into flat arrays plus a string pool, with no
+ * limits on the number of tables, headers, columns or values. All header
+ * lines go into one Aho-Corasick automaton, so one pass over a line finds
+ * every header it contains. A table's headers have to be found on
+ * consecutive lines; once they all are, the following lines are rows
+ * until a line without the column separator ends the table. Rows are
+ * split with the same character set semantics as strtok, but as spans of
+ * the line, which is neither copied nor modified.
+ */
+
+#include <stdint.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_number.h"
+#include "daap_table.h"
+
+#define TABLE_START "===table==="
+#define TABLE_END "===end_table==="
+
+#define IN_SET(set, c) ((set)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+/* Grow an array of elements of size elem_size to hold at least count */
+static int growArray(void **array, uint32_t *capacity, uint32_t count,
+                     size_t elem_size) {
+    uint32_t new_capacity;
+    void *new_array;
+
+    if (count <= *capacity) {
+        return 0;
+    }
+    new_capacity = *capacity ? *capacity * 2 : 16;
+    while (new_capacity < count) {
+        new_capacity *= 2;
+    }
+    new_array = realloc(*array, new_capacity * elem_size);
+    if (!new_array) {
+        return -1;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/* Add a string to the pool and return its offset (or -1) */
+static int64_t poolAdd(daap_tableset_t *tables, uint32_t *pool_size,
+                       const char *str, size_t len) {
+    uint32_t offset = tables->pool_len;
+
+    if (growArray((void **)&tables->pool, pool_size,
+                  tables->pool_len + len + 1, 1) < 0) {
+        return -1;
+    }
+    memcpy(tables->pool + offset, str, len);
+    tables->pool[offset + len] = '\0';
+    tables->pool_len += len + 1;
+    return offset;
+}
+
+/* Add name[0, len), followed by _unit if unit is set, to the pool */
+static int64_t poolAddName(daap_tableset_t *tables, uint32_t *pool_size,
+                           const char *name, size_t len, const char *unit) {
+    size_t unit_len = unit ? strlen(unit) : 0;
+    uint32_t offset = tables->pool_len;
+    char *p;
+
+    if (growArray((void **)&tables->pool, pool_size,
+                  tables->pool_len + len + unit_len + 2, 1) < 0) {
+        return -1;
+    }
+    p = tables->pool + offset;
+    memcpy(p, name, len);
+    p += len;
+    if (unit) {
+        *p++ = '_';
+        memcpy(p, unit, unit_len);
+        p += unit_len;
+    }
+    *p++ = '\0';
+    tables->pool_len = p - tables->pool;
+    return offset;
+}
+
+static void setBytes(uint8_t set[32], const char *str) {
+    memset(set, 0, 32);
+    for (; *str; str++) {
+        set[(unsigned char)*str >> 3] |= 1 << ((unsigned char)*str & 7);
+    }
+}
+
+/* Returns 1 if str[0, len) contains needle[0, needle_len) */
+static int containsBytes(const char *str, int len, const char *needle,
+                         int needle_len) {
+    const char *p = str;
+    const char *last = str + len - needle_len;
+
+    if (needle_len == 0) {
+        return 1;
+    }
+    while (p <= last) {
+        p = memchr(p, needle[0], last - p + 1);
+        if (!p) {
+            return 0;
+        }
+        if (memcmp(p, needle, needle_len) == 0) {
+            return 1;
+        }
+        p++;
+    }
+    return 0;
+}
+
+/* Find the next token of [p, end) delimited by the bytes in set, as strtok
+ * does. Returns the token start (NULL if none) and sets *tok_end. */
+static const char *nextToken(const char *p, const char *end, const uint8_t *set,
+                             const char **tok_end) {
+    while (p < end && IN_SET(set, *p)) {
+        p++;
+    }
+    if (p == end) {
+        return NULL;
+    }
+    *tok_end = p;
+    while (*tok_end < end && !IN_SET(set, **tok_end)) {
+        (*tok_end)++;
+    }
+    return p;
+}
+
+/* The value after key in line if line starts with key, else NULL */
+static const char *templateValue(const char *line, const char *key) {
+    size_t len = strlen(key);
+
+    return strncmp(line, key, len) == 0 ? line + len : NULL;
+}
+
+int daapTablesetCompile(daap_tableset_t *tables, char **lines, int num_lines) {
+    uint32_t tables_size = 0, headers_size = 0, vals_size = 0, pool_size = 0;
+    daap_table_def_t *table = NULL;
+    daap_table_val_t *val;
+    const char *type, *unit;
+    const char **strings = NULL;
+    uint32_t *owners = NULL;
+    const char *value;
+    int64_t offset;
+    size_t len, type_len;
+    uint32_t h;
+    int i, ret;
+
+    memset(tables, 0, sizeof(daap_tableset_t));
+
+    for (i = 0; i < num_lines; i++) {
+        //If we have not found the first ===table===, then we are not in a table def
+        if (!table) {
+            if (strstr(lines[i], TABLE_START)) {
+                if (growArray((void **)&tables->tables, &tables_size,
+                              tables->num_tables + 1, sizeof(daap_table_def_t)) < 0) {
+                    goto nomem;
+                }
+                table = &tables->tables[tables->num_tables++];
+                memset(table, 0, sizeof(daap_table_def_t));
+                table->first_header = tables->num_headers;
+                table->first_val = tables->num_vals;
+                /* both separators are empty strings until set */
+                if ((offset = poolAdd(tables, &pool_size, "", 0)) < 0) {
+                    goto nomem;
+                }
+                table->sep = table->val_sep = offset;
+            }
+            continue;
+        }
+
+        //table_sep= is the column separator (e.g., |)
+        if ((value = templateValue(lines[i], "table_sep="))) {
+            table->sep_len = strlen(value);
+            if ((offset = poolAdd(tables, &pool_size, value, table->sep_len)) < 0) {
+                goto nomem;
+            }
+            table->sep = offset;
+        }
+        //val_sep= is the separator between column values (e.g., space)
+        else if ((value = templateValue(lines[i], "val_sep="))) {
+            table->val_sep_len = strlen(value);
+            if ((offset = poolAdd(tables, &pool_size, value, table->val_sep_len)) < 0) {
+                goto nomem;
+            }
+            table->val_sep = offset;
+        }
+        //header= lines are the headers of the table, in order
+        else if ((value = templateValue(lines[i], "header="))) {
+            if (value[0] == '\0') {
+                ERROR_OUTPUT(("Ignoring empty header in table %u", tables->num_tables));
+                continue;
+            }
+            if (growArray((void **)&tables->headers, &headers_size,
+                          tables->num_headers + 1, sizeof(daap_table_header_t)) < 0 ||
+                (offset = poolAdd(tables, &pool_size, value, strlen(value))) < 0) {
+                goto nomem;
+            }
+            tables->headers[tables->num_headers].table = tables->num_tables - 1;
+            tables->headers[tables->num_headers].pos = table->num_headers++;
+            tables->headers[tables->num_headers++].text = offset;
+        }
+        //val_name= lines name each column value, in order
+        else if ((value = templateValue(lines[i], "val_name="))) {
+            if (growArray((void **)&tables->vals, &vals_size,
+                          tables->num_vals + 1, sizeof(daap_table_val_t)) < 0) {
+                goto nomem;
+            }
+            val = &tables->vals[tables->num_vals];
+            val->kind = DAAP_TABLE_FIELD;
+            val->type = DAAP_FIELD_STRING;
+            //name:type:unit declares the type and unit of the value
+            unit = NULL;
+            if ((type = strchr(value, ':'))) {
+                len = type - value;
+                type++;
+                unit = strchr(type, ':');
+                type_len = unit ? (size_t)(unit - type) : strlen(type);
+                if (unit && *++unit == '\0') {
+                    unit = NULL;
+                }
+                if (daapFieldType(type, type_len) < 0) {
+                    ERROR_OUTPUT(("Unknown type of table value %s", value));
+                }
+                else {
+                    val->type = daapFieldType(type, type_len);
+                }
+            }
+            else {
+                len = strlen(value);
+            }
+            //skip this value if "_skip" is in the name
+            if (containsBytes(value, len, "_skip", 5)) {
+                val->kind = DAAP_TABLE_SKIP;
+            }
+            //send it as a tag if the name ends in _tag
+            else if (len > 4 && strncmp(value + len - 4, "_tag", 4) == 0) {
+                val->kind = DAAP_TABLE_TAG;
+                len -= 4;
+            }
+            //the unit goes at the end of the field name, e.g. time_s
+            if ((offset = poolAddName(tables, &pool_size, value, len, unit)) < 0) {
+                goto nomem;
+            }
+            val->name = offset;
+            val->name_len = strlen(tables->pool + offset);
+            tables->num_vals++;
+            table->num_vals++;
+        }
+        //cols= is the number of columns holding values
+        else if ((value = templateValue(lines[i], "cols="))) {
+            table->cols = atoi(value);
+        }
+        //num_vals= is implied by the val_name= lines
+        else if (templateValue(lines[i], "num_vals=")) {
+            continue;
+        }
+        else if (strstr(lines[i], TABLE_END)) {
+            table = NULL;
+        }
+    }
+
+    /* the pool is complete, so the separator sets and header strings can
+     * be taken from it */
+    for (i = 0; i < (int)tables->num_tables; i++) {
+        setBytes(tables->tables[i].sep_set, tables->pool + tables->tables[i].sep);
+        setBytes(tables->tables[i].val_sep_set, tables->pool + tables->tables[i].val_sep);
+        if (tables->tables[i].num_headers == 0) {
+            ERROR_OUTPUT(("Table %d has no headers and will never match", i + 1));
+        }
+    }
+
+    strings = malloc((tables->num_headers + 1) * sizeof(char *));
+    owners = malloc((tables->num_headers + 1) * sizeof(uint32_t));
+    if (!strings || !owners) {
+        goto nomem;
+    }
+    for (h = 0; h < tables->num_headers; h++) {
+        strings[h] = tables->pool + tables->headers[h].text;
+        owners[h] = h;
+    }
+    ret = daapACBuild(&tables->ac, strings, owners, tables->num_headers);
+    free(strings);
+    free(owners);
+    if (ret < 0) {
+        daapTablesetFree(tables);
+    }
+    return ret;
+
+ nomem:
+    ERROR_OUTPUT(("Failed to allocate the table templates"));
+    free(strings);
+    free(owners);
+    daapTablesetFree(tables);
+    return -1;
+}
+
+void daapTablesetFree(daap_tableset_t *tables) {
+    if (tables->mapped) {
+        memset(tables, 0, sizeof(daap_tableset_t));
+        return;
+    }
+    free(tables->tables);
+    free(tables->headers);
+    free(tables->vals);
+    free(tables->pool);
+    daapACFree(&tables->ac);
+    memset(tables, 0, sizeof(daap_tableset_t));
+}
+
+int daapTableStateInit(daap_table_state_t *state, daap_tableset_t *tables) {
+    memset(state, 0, sizeof(daap_table_state_t));
+    state->table = -1;
+    state->progress = calloc(tables->num_tables + 1, sizeof(uint32_t));
+    state->active = calloc(tables->num_tables + 1, sizeof(uint32_t));
+    state->header_seen = calloc(tables->num_headers + 1, sizeof(uint32_t));
+    state->found = calloc(tables->num_headers + 1, sizeof(uint32_t));
+    if (!state->progress || !state->active || !state->header_seen || !state->found) {
+        daapTableStateFree(state);
+        return -1;
+    }
+    return 0;
+}
+
+void daapTableStateFree(daap_table_state_t *state) {
+    free(state->progress);
+    free(state->active);
+    free(state->header_seen);
+    free(state->found);
+    memset(state, 0, sizeof(daap_table_state_t));
+    state->table = -1;
+}
+
+void daapTableStateReset(daap_table_state_t *state) {
+    uint32_t i;
+
+    for (i = 0; i < state->num_active; i++) {
+        state->progress[state->active[i]] = 0;
+    }
+    state->num_active = 0;
+    state->table = -1;
+}
+
+/* Pass the values of a row to value_fn. Columns are split by the bytes of
+ * the column separator and, in the first cols columns that contain the
+ * value separator, values by the bytes of the value separator. */
+static void splitRow(daap_tableset_t *tables, daap_table_def_t *table,
+                     const char *line, int line_len,
+                     daap_table_value_fn value_fn, void *arg) {
+    const char *end = line + line_len;
+    const char *col, *col_end, *val, *val_end;
+    const char *val_sep = tables->pool + table->val_sep;
+    daap_table_val_t *name;
+    uint32_t c, val_found = 0;
+
+    col_end = line;
+    for (c = 0; c < table->cols && val_found < table->num_vals; c++) {
+        col = nextToken(col_end, end, table->sep_set, &col_end);
+        if (!col) {
+            break;
+        }
+        if (!containsBytes(col, col_end - col, val_sep, table->val_sep_len)) {
+            continue;
+        }
+
+        val_end = col;
+        while (val_found < table->num_vals &&
+               (val = nextToken(val_end, col_end, table->val_sep_set, &val_end))) {
+            name = &tables->vals[table->first_val + val_found++];
+            if (name->kind != DAAP_TABLE_SKIP) {
+                value_fn(arg, tables->pool + name->name, name->name_len,
+                         name->kind, name->type, val, val_end - val);
+            }
+        }
+    }
+}
+
+int daapTableMatch(daap_tableset_t *tables, daap_table_state_t *state,
+                   const char *line, int line_len,
+                   daap_table_value_fn value_fn, void *arg) {
+    daap_ac_t *ac = &tables->ac;
+    daap_table_def_t *table;
+    daap_table_header_t *header;
+    const unsigned char *p = (const unsigned char *)line;
+    const unsigned char *end = p + line_len;
+    uint32_t ac_state = 0;
+    uint32_t i, k, m, n, h, t;
+    int32_t complete = -1;
+
+    if (state->table >= 0) {
+        table = &tables->tables[state->table];
+        if (containsBytes(line, line_len, tables->pool + table->sep, table->sep_len)) {
+            splitRow(tables, table, line, line_len, value_fn, arg);
+            return DAAP_TABLE_ROW;
+        }
+        //a line without a column separator ends the table
+        state->table = -1;
+    }
+
+    if (tables->num_headers == 0) {
+        return DAAP_TABLE_NONE;
+    }
+
+    /* find every header in the line */
+    if (++state->gen == 0) {
+        memset(state->header_seen, 0, tables->num_headers * sizeof(uint32_t));
+        state->gen = 1;
+    }
+    state->num_found = 0;
+    for (; p < end; p++) {
+        ac_state = ac->next[ac_state * ac->num_classes + ac->classmap[*p]];
+        for (k = ac->out_start[ac_state]; k < ac->out_start[ac_state + 1]; k++) {
+            for (m = ac->lit_start[ac->out[k]]; m < ac->lit_start[ac->out[k] + 1]; m++) {
+                h = ac->lit_owners[m];
+                if (state->header_seen[h] != state->gen) {
+                    state->header_seen[h] = state->gen;
+                    state->found[state->num_found++] = h;
+                }
+            }
+        }
+    }
+
+    /* tables part way through their headers need the next one on this line */
+    n = 0;
+    for (i = 0; i < state->num_active; i++) {
+        t = state->active[i];
+        h = tables->tables[t].first_header + state->progress[t];
+        if (state->header_seen[h] == state->gen) {
+            state->progress[t]++;
+            state->active[n++] = t;
+        }
+        else {
+            state->progress[t] = 0;
+        }
+    }
+    state->num_active = n;
+
+    /* and a first header starts a table */
+    for (i = 0; i < state->num_found; i++) {
+        header = &tables->headers[state->found[i]];
+        if (header->pos == 0 && state->progress[header->table] == 0) {
+            state->progress[header->table] = 1;
+            state->active[state->num_active++] = header->table;
+        }
+    }
+
+    if (state->num_active == 0) {
+        return DAAP_TABLE_NONE;
+    }
+
+    /* with all of its headers found, the first such table (in template
+     * order) is entered */
+    for (i = 0; i < state->num_active; i++) {
+        t = state->active[i];
+        if (state->progress[t] == tables->tables[t].num_headers &&
+            (complete < 0 || (int32_t)t < complete)) {
+            complete = t;
+        }
+    }
+    if (complete >= 0) {
+        daapTableStateReset(state);
+        state->table = complete;
+    }
+    return DAAP_TABLE_HEADER;
+}
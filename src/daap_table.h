@@ -0,0 +1,107 @@
+#ifndef DAAP_TABLE_H
+#define DAAP_TABLE_H
+
+/* Table matching engine used by the stdout parser (not part of the API).
+ *
+ * Table templates are compiled into flat arrays and one string pool. The
+ * header lines of every table go into one Aho-Corasick automaton, so a
+ * single scan of a line tells which headers it contains; each table then
+ * advances through its header sequence as a small state machine. Rows are
+ * split into columns and values in place, as spans of the line. */
+
+#include <stdint.h>
+
+#include "daap_match.h"
+
+/* what is done with a table value, from the suffix of its name */
+#define DAAP_TABLE_FIELD 0         /* sent as a field */
+#define DAAP_TABLE_TAG   1         /* name_tag: sent as a tag */
+#define DAAP_TABLE_SKIP  2         /* name_skip: dropped */
+
+/* results of daapTableMatch */
+#define DAAP_TABLE_NONE   0        /* the line is not part of a table */
+#define DAAP_TABLE_HEADER 1        /* the line is a table header */
+#define DAAP_TABLE_ROW    2        /* the line is a table row */
+
+/* A value of a table row. Strings are offsets into the pool. */
+typedef struct {
+    uint32_t name;
+    uint32_t name_len;             /* without the _tag/_skip suffix */
+    uint32_t kind;                 /* DAAP_TABLE_FIELD/TAG/SKIP */
+    uint32_t type;                 /* DAAP_FIELD_*, from name:type[:unit] */
+} daap_table_val_t;
+
+/* A header line of a table */
+typedef struct {
+    uint32_t table;
+    uint32_t pos;                  /* position in the table's header sequence */
+    uint32_t text;
+} daap_table_header_t;
+
+typedef struct {
+    uint32_t sep;                  /* column separator */
+    uint32_t sep_len;
+    uint32_t val_sep;              /* value separator */
+    uint32_t val_sep_len;
+    uint8_t sep_set[32];           /* bytes of sep/val_sep, as bitmaps */
+    uint8_t val_sep_set[32];
+    uint32_t cols;                 /* columns holding values */
+    uint32_t first_header;         /* headers[first_header ...] */
+    uint32_t num_headers;
+    uint32_t first_val;            /* vals[first_val ...] */
+    uint32_t num_vals;
+} daap_table_def_t;
+
+/* A compiled set of table templates */
+typedef struct {
+    uint32_t num_tables;
+    daap_table_def_t *tables;
+    uint32_t num_headers;
+    daap_table_header_t *headers;
+    uint32_t num_vals;
+    daap_table_val_t *vals;
+    uint32_t pool_len;
+    char *pool;
+    daap_ac_t ac;                  /* owners are header ids */
+    int mapped;                    /* arrays point into a template bundle */
+} daap_tableset_t;
+
+/* Table matching state of one results stream */
+typedef struct {
+    int32_t table;                 /* table whose rows are read, -1 if none */
+    uint32_t *progress;            /* headers matched so far per table */
+    uint32_t *active;              /* tables with progress > 0 */
+    uint32_t num_active;
+    uint32_t gen;                  /* current line generation */
+    uint32_t *header_seen;         /* generation a header was last seen */
+    uint32_t *found;               /* headers found in the current line */
+    uint32_t num_found;
+} daap_table_state_t;
+
+/* Called for each value of a row; name/val are not null-terminated. A unit
+ * declared for the value is already appended to its name. */
+typedef void (*daap_table_value_fn)(void *arg, const char *name, int name_len,
+                                    int kind, int type,
+                                    const char *val, int val_len);
+
+/* Compile table template lines (====table==== ... ====end_table====
+ * blocks of table_sep=, val_sep=, header=, cols= and val_name= lines).
+ * val_name=name[:type[:unit]] declares the type and unit of a value. */
+int daapTablesetCompile(daap_tableset_t *tables, char **lines, int num_lines);
+
+/* Free a table set built by daapTablesetCompile */
+void daapTablesetFree(daap_tableset_t *tables);
+
+/* Allocate/free/reset the table matching state of a stream */
+int daapTableStateInit(daap_table_state_t *state, daap_tableset_t *tables);
+void daapTableStateFree(daap_table_state_t *state);
+void daapTableStateReset(daap_table_state_t *state);
+
+/* Match a line (without its newline) against the tables. Values of a row
+ * are passed to value_fn. Returns DAAP_TABLE_NONE if the line should be
+ * matched against the key regexes instead. */
+int daapTableMatch(daap_tableset_t *tables, daap_table_state_t *state,
+                   const char *line, int line_len,
+                   daap_table_value_fn value_fn, void *arg);
+
+#endif /* DAAP_TABLE_H */
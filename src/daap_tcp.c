@@ -9,9 +9,16 @@
 #include <strings.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <netdb.h>
 
 #include "daap_log.h"
 #include "daap_log_internal.h"
+#include "daap_endpoint.h"
+#include "daap_tls_session.h"
 
 /* SSL includes */
 #include <openssl/crypto.h>
@@ -20,22 +27,70 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
-#define PORT 5555
-
-//#define CHK_NULL(x) if ((x)==NULL) exit (1)
-//#define CHK_ERR(err,s) if ((err)==-1) { perror(s); exit(1); }
-#define CHK_SSL(err) if ((err)==-1) { ERR_print_errors_fp(stderr); exit(2); }
-
 #define SSL_CLIENT_CERT "client_cert.pem"
 #define SSL_CLIENT_KEY "client_key.pem"
 #define DAAP_CERTS_ENVVAR "DAAP_CERTS"
+/* set to 1 to connect in the background as soon as daapInit() returns */
+#define DAAP_TCP_WARMUP_ENVVAR "DAAP_TCP_WARMUP"
+/* set to 1 to have the kernel encrypt the records (kTLS) where available */
+#define DAAP_KTLS_ENVVAR "DAAP_KTLS"
+/* most buffers sent in one write */
+#define WRITE_MAX_IOV 8
+/* how long a full handshake waits for the TLS 1.3 session tickets the
+ * server sends after it, so that they can be cached for the other ranks */
+#define TICKET_WAIT_MS 20
+/* how long a connection attempt to one address may take */
+#define CONNECT_TIMEOUT_MS 2000
+
+
+/* protects everything below; held for a whole write, connect or handshake */
 static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-SSL *cSSL = NULL;
-int sockfd = -1;
 static SSL_CTX *sslctx;
+/* the context and the endpoint list are built on first use rather than in
+ * daapInit(), and only attempted once if the certificates are missing */
+static bool ssl_initialized = false;
+static bool ssl_init_failed = false;
 
-int daapInitializeSSL() {
+static pthread_t warmup_thread;
+static bool warmup_started = false;
+
+/* kTLS was asked for */
+static bool ktls_requested = false;
+static bool ktls_warned = false;
+
+/* with the io_uring send engine, OpenSSL writes its records into the
+ * endpoint's send queue through a BIO of this type */
+static BIO_METHOD *send_bio_method = NULL;
+
+static int sendBioWrite(BIO *bio, const char *buf, int len) {
+  BIO_clear_retry_flags(bio);
+  if (daapSendQueued(BIO_get_data(bio), buf, len) < 0) {
+    return -1;
+  }
+  return len;
+}
+
+static long sendBioCtrl(BIO *bio, int cmd, long num, void *ptr) {
+  (void)bio; (void)num; (void)ptr;
+  /* the queue is submitted by writeConnection(), once for all records */
+  return cmd == BIO_CTRL_FLUSH ? 1 : 0;
+}
+
+static BIO_METHOD *newSendBioMethod(void) {
+  BIO_METHOD *method;
+
+  method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "daap send queue");
+  if (method) {
+    BIO_meth_set_write(method, sendBioWrite);
+    BIO_meth_set_ctrl(method, sendBioCtrl);
+  }
+  return method;
+}
+
+/* Builds the SSL context from the certificates in DAAP_CERTS, and reads the
+ * endpoints. Called with write_mutex held. */
+static int initializeSSL(void) {
   char ssl_client_cert[PATH_MAX];
   char ssl_client_key[PATH_MAX];
   int cert_dir_len;
@@ -44,6 +99,15 @@ int daapInitializeSSL() {
   char *cert_dir;
   long options;
 
+  if (ssl_initialized) {
+    return 0;
+  }
+  if (ssl_init_failed) {
+    return -1;
+  }
+  /* not retried: the certificates will not appear during the run */
+  ssl_init_failed = true;
+
   SSL_load_error_strings();
   SSL_library_init();
   OpenSSL_add_all_algorithms();
@@ -73,6 +137,11 @@ int daapInitializeSSL() {
       return -1;
   }
 
+  if (daapEndpointsLoad() < 0) {
+    ERROR_OUTPUT(("Out of memory reading the endpoints"));
+    return -1;
+  }
+
   // create context, which will remain the same throughout the run
   // (this code moved from daapTCPConnect())
   sslctx = SSL_CTX_new(SSLv23_client_method());
@@ -80,7 +149,6 @@ int daapInitializeSSL() {
     ERROR_OUTPUT(("Error in creation of SSL_CTX object"));
     return -1;
   }
-  SSL_CTX_clear_options(sslctx, options);
   // recommended to not allow use of SSLv3 protocol for security reasons, so we turn it off
   options = SSL_OP_NO_SSLv3;
   SSL_CTX_set_options(sslctx, options);
@@ -88,6 +156,329 @@ int daapInitializeSSL() {
   SSL_CTX_use_certificate_file(sslctx, ssl_client_cert, SSL_FILETYPE_PEM);
   SSL_CTX_use_PrivateKey_file(sslctx, ssl_client_key, SSL_FILETYPE_PEM);
   SSL_CTX_set_verify(sslctx, SSL_VERIFY_NONE, NULL); 
+  daapTLSSessionInit(sslctx, cert_dir);
+
+  /* OpenSSL hands the keys to the kernel after the handshake if it was
+   * built with kTLS and the kernel has the tls module; otherwise this is
+   * ignored and records are encrypted by SSL_write */
+  ktls_requested = getenv(DAAP_KTLS_ENVVAR) && strcmp(getenv(DAAP_KTLS_ENVVAR), "0");
+#ifdef SSL_OP_ENABLE_KTLS
+  if (ktls_requested) {
+    SSL_CTX_set_options(sslctx, SSL_OP_ENABLE_KTLS);
+  }
+#endif
+
+  if (daapSendEngineInit() && (send_bio_method = newSendBioMethod()) == NULL) {
+    daapSendEngineFree();
+  }
+
+  ssl_init_failed = false;
+  ssl_initialized = true;
+  return 0;
+}
+
+/* Builds the SSL context now rather than on the first write */
+int daapInitializeSSL() {
+  int ret_val;
+
+  pthread_mutex_lock(&write_mutex);
+  ret_val = initializeSSL();
+  pthread_mutex_unlock(&write_mutex);
+  return ret_val;
+}
+
+/* A write into a connection the server has closed raises SIGPIPE, which
+ * would end the application, so it is blocked in this thread while the
+ * connection is used and a pending one is discarded afterwards */
+static void blockSigpipe(sigset_t *old_mask) {
+  sigset_t sigpipe;
+
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, old_mask);
+}
+
+static void restoreSigpipe(sigset_t *old_mask) {
+  struct timespec no_wait = { 0, 0 };
+  sigset_t sigpipe;
+
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  if (!sigismember(old_mask, SIGPIPE)) {
+    while (sigtimedwait(&sigpipe, NULL, &no_wait) > 0) {
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, old_mask, NULL);
+}
+
+/* Reads what the server sent without waiting: TLS 1.3 session tickets
+ * (which OpenSSL hands to the session cache) or the end of the connection.
+ * Returns -1 if the server closed it. Called with write_mutex held. */
+static int readPending(daap_endpoint_t *ep) {
+  char buf[256];
+  int flags, ret, err, closed = 0;
+
+  flags = fcntl(ep->sockfd, F_GETFL);
+  fcntl(ep->sockfd, F_SETFL, flags | O_NONBLOCK);
+  while ((ret = SSL_read(ep->ssl, buf, sizeof(buf))) > 0) {
+    /* the server has nothing to say beyond tickets; ignored */
+  }
+  err = SSL_get_error(ep->ssl, ret);
+  if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+    closed = 1;
+  }
+  ERR_clear_error();
+  fcntl(ep->sockfd, F_SETFL, flags);
+  return closed ? -1 : 0;
+}
+
+/* A readable socket means that the server either sent session tickets or
+ * closed the connection (or reset it) since the last write */
+static bool connectionClosed(daap_endpoint_t *ep) {
+  struct pollfd pfd = { ep->sockfd, POLLIN, 0 };
+
+  if (poll(&pfd, 1, 0) != 0 && readPending(ep) < 0) {
+    return true;
+  }
+  /* or a background write failed */
+  return ep->queue.fd >= 0 && daapSendSubmit(&ep->queue) < 0;
+}
+
+/* Closes the connection to the endpoint. Called with write_mutex held. */
+static void closeConnection(daap_endpoint_t *ep) {
+  bool queued = ep->queue.fd >= 0;
+
+  if (queued) {
+    daapSendDrain(&ep->queue);
+  }
+  if (ep->ssl) {
+    // One SSL_shutdown sends close_notify alert, other receives response from peer (server)
+    if (SSL_shutdown(ep->ssl) == 0) {
+      if (queued) {
+        daapSendDrain(&ep->queue);
+      }
+      SSL_shutdown(ep->ssl);
+    }
+    SSL_free(ep->ssl);
+    ep->ssl = NULL;
+  }
+  if (queued) {
+    daapSendQueueClose(&ep->queue);
+  }
+  ep->ktls_active = false;
+  if (ep->sockfd >= 0) {
+    close(ep->sockfd);
+    ep->sockfd = -1;
+  }
+}
+
+static void closeAllConnections(void) {
+  int i;
+
+  for (i = 0; i < daapEndpointCount(); i++) {
+    closeConnection(daapEndpointGet(i));
+  }
+}
+
+/* Opens a TCP connection to one of the endpoint's addresses, giving up on
+ * each after CONNECT_TIMEOUT_MS rather than the kernel's minutes when a
+ * remote host is down. Returns the socket, or -1. */
+static int openSocket(daap_endpoint_t *ep) {
+  struct addrinfo hints, *addrs, *ai;
+  struct pollfd pfd;
+  char port[16];
+  socklen_t len;
+  int fd = -1, flags, err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port, sizeof(port), "%d", ep->port);
+  err = getaddrinfo(ep->host, port, &hints, &addrs);
+  if (err != 0) {
+    ERROR_OUTPUT(("Cannot resolve endpoint %s: %s", ep->host, gai_strerror(err)));
+    return -1;
+  }
+
+  for (ai = addrs; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      err = errno;
+      continue;
+    }
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    err = 0;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+      err = errno;
+      if (err == EINPROGRESS) {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        len = sizeof(err);
+        if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) != 1) {
+          err = ETIMEDOUT;
+        }
+        else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+          err = errno;
+        }
+      }
+    }
+    if (err == 0) {
+      fcntl(fd, F_SETFL, flags);
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+
+  if (fd < 0) {
+    ERROR_OUTPUT(("Connection to the TCP server %s:%d failed: %s", ep->host, ep->port,
+                  strerror(err)));
+  }
+  return fd;
+}
+
+/* Connects to the endpoint and completes the handshake unless already
+ * connected. Called with write_mutex held. */
+static int connectServer(daap_endpoint_t *ep) {
+  int ret_val = 0;
+
+  if (ep->ssl) {
+    if (!connectionClosed(ep)) {
+      return 0;
+    }
+    /* a write would seem to succeed and be lost */
+    closeConnection(ep);
+  }
+
+  ep->sockfd = openSocket(ep);
+  if (ep->sockfd < 0) {
+    daapEndpointFailed(ep);
+    return -1;
+  }
+
+  ep->ssl = SSL_new(sslctx);
+  if (ep->ssl == NULL) {
+      ERROR_OUTPUT(("Error in creation of SSL object"));
+      closeConnection(ep);
+      return -1;
+  }
+  SSL_set_fd(ep->ssl, ep->sockfd);
+  daapTLSSessionOffer(ep->ssl, ep->host, ep->port);
+  ret_val = SSL_connect (ep->ssl);
+  if(ret_val <= 0) {
+      //Error occurred, log and close down the connection (the context is kept)
+      ERR_print_errors_fp(stderr);
+      SSL_free(ep->ssl);
+      ep->ssl = NULL;
+      closeConnection(ep);
+      daapEndpointFailed(ep);
+      return -1;    
+  }
+  daapTLSSessionConnected(ep->ssl);
+
+  if (ktls_requested) {
+    // OpenSSL before 3.0 has no kTLS, and ktls_active stays false
+#ifdef BIO_get_ktls_send
+    ep->ktls_active = BIO_get_ktls_send(SSL_get_wbio(ep->ssl)) > 0;
+#endif
+    if (!ep->ktls_active && !ktls_warned) {
+      DEBUG_OUTPUT(("Kernel TLS is not available, records are encrypted by OpenSSL"));
+      ktls_warned = true;
+    }
+  }
+
+  /* after a full TLS 1.3 handshake, pick up the tickets right away so the
+   * other ranks can resume */
+  if (!SSL_session_reused(ep->ssl) && SSL_version(ep->ssl) >= TLS1_3_VERSION) {
+    struct pollfd pfd = { ep->sockfd, POLLIN, 0 };
+
+    if (poll(&pfd, 1, TICKET_WAIT_MS) > 0 && readPending(ep) < 0) {
+      closeConnection(ep);
+      daapEndpointFailed(ep);
+      return -1;
+    }
+  }
+
+  /* from here on, what OpenSSL writes (or the records themselves, with
+   * kTLS) goes through the send engine */
+  if (daapSendEngineActive()) {
+    daapSendQueueOpen(&ep->queue, ep->sockfd);
+    if (!ep->ktls_active) {
+      BIO *bio = BIO_new(send_bio_method);
+
+      if (bio == NULL) {
+        closeConnection(ep);
+        return -1;
+      }
+      BIO_set_data(bio, &ep->queue);
+      BIO_set_init(bio, 1);
+      SSL_set0_wbio(ep->ssl, bio);
+    }
+  }
+
+  daapEndpointSucceeded(ep);
+  return 0;
+}
+
+/* Where this process's records go when sharding by rank */
+static uint64_t rankHash(void) {
+  return daapEndpointHashRank(init_data.mpi_rank);
+}
+
+/* Length of the series of an influx record: its measurement and tags, up
+ * to the first space that is not escaped */
+static size_t seriesLength(const char *record, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len && record[i] != ' ' && record[i] != '\n'; i++) {
+    if (record[i] == '\\' && i + 1 < len) {
+      i++;
+    }
+  }
+  return i;
+}
+
+/* Connects in the background so that the first write finds the handshake
+ * done: to this rank's endpoint, or to all of them when sharding by metric */
+static void *warmupMain(void *arg) {
+  sigset_t old_mask;
+  daap_endpoint_t *ep;
+  int i;
+
+  (void)arg;
+  pthread_mutex_lock(&write_mutex);
+  blockSigpipe(&old_mask);
+  if (initializeSSL() == 0) {
+    if (daapEndpointsByMetric()) {
+      for (i = 0; i < daapEndpointCount(); i++) {
+        connectServer(daapEndpointGet(i));
+      }
+    }
+    else if ((ep = daapEndpointFor(rankHash(), NULL)) != NULL) {
+      connectServer(ep);
+    }
+  }
+  restoreSigpipe(&old_mask);
+  pthread_mutex_unlock(&write_mutex);
+  return NULL;
+}
+
+/* Starts the background connection if DAAP_TCP_WARMUP is set; called by
+ * daapInit() for the TCP transport */
+int daapTCPWarmup(void) {
+  char *warmup = getenv(DAAP_TCP_WARMUP_ENVVAR);
+
+  if (warmup == NULL || strcmp(warmup, "0") == 0 || warmup_started) {
+    return 0;
+  }
+  if (pthread_create(&warmup_thread, NULL, warmupMain, NULL) != 0) {
+    ERROR_OUTPUT(("Failed to start the TCP warm-up thread"));
+    return -1;
+  }
+  warmup_started = true;
+  return 0;
 }
 
 // function below integrated into daapShutdownSSL
@@ -98,89 +489,288 @@ void daapDestroySSL() {
 }
 */
 void daapShutdownSSL() {
-  SSL_CTX_free(sslctx);
-  // One SSL_shutdown sends close_notify alert, other receives response from peer (server)
-  if (cSSL) {
-    SSL_shutdown(cSSL);
-    SSL_shutdown(cSSL);
-    SSL_free(cSSL);
-  }
-  // migrated from daapDestroySSL()
-  ERR_free_strings();
-  EVP_cleanup();
+  sigset_t old_mask;
+
+  if (warmup_started) {
+    pthread_join(warmup_thread, NULL);
+    warmup_started = false;
+  }
+
+  pthread_mutex_lock(&write_mutex);
+  blockSigpipe(&old_mask);
+  closeAllConnections();
+  restoreSigpipe(&old_mask);
+  daapSendEngineFree();
+  if (send_bio_method) {
+    BIO_meth_free(send_bio_method);
+    send_bio_method = NULL;
+  }
+  daapEndpointsFree();
+  daapTLSSessionFree();
+  if (sslctx) {
+    SSL_CTX_free(sslctx);
+    sslctx = NULL;
+    // migrated from daapDestroySSL()
+    ERR_free_strings();
+    EVP_cleanup();
+  }
+  ssl_initialized = false;
+  ssl_init_failed = false;
+  pthread_mutex_unlock(&write_mutex);
 }
 
-int daapTCPLogWrite(char *buf, int buf_size) {
-    int count = 0, total_count = 0;
-    int retries = 0;
-    int ret;
-
-    pthread_mutex_lock(&write_mutex);
-    ret = daapTCPConnect();
-    if (ret < 0) {
-        pthread_mutex_unlock(&write_mutex);
-        return DAAP_ERROR;
+/* Points rest at the bytes of iov after the first skip ones; returns the
+ * number of buffers */
+static int skipIov(const struct iovec *iov, int iovcnt, size_t skip,
+                   struct iovec *rest) {
+  int i, n = 0;
+
+  for (i = 0; i < iovcnt; i++) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    rest[n].iov_base = (char *)iov[i].iov_base + skip;
+    rest[n].iov_len = iov[i].iov_len - skip;
+    skip = 0;
+    n++;
+  }
+  return n;
+}
+
+/* Queues the buffers on the send engine, as TLS records or, with kTLS, as
+ * they are, and submits them all at once; returns the bytes queued or -1 */
+static ssize_t queueConnection(daap_endpoint_t *ep, const struct iovec *iov, int iovcnt) {
+  ssize_t count = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len == 0) {
+      continue;
+    }
+    if (ep->ktls_active) {
+      if (daapSendQueued(&ep->queue, iov[i].iov_base, iov[i].iov_len) < 0) {
+        return -1;
+      }
+    }
+    else if (SSL_write(ep->ssl, iov[i].iov_base, iov[i].iov_len) <= 0) {
+      return -1;
+    }
+    count += iov[i].iov_len;
+  }
+  return daapSendSubmit(&ep->queue) < 0 ? -1 : count;
+}
+
+/* Writes the buffers to the endpoint, reconnecting once if the server
+ * closed the connection. With the send engine they are queued; otherwise,
+ * with kTLS the socket encrypts what is written to it, so all buffers go
+ * out in one writev without a copy, and without it each one is an
+ * SSL_write. Called with write_mutex held and SIGPIPE blocked. */
+static int writeConnection(daap_endpoint_t *ep, const struct iovec *iov, int iovcnt) {
+  struct iovec rest[WRITE_MAX_IOV];
+  unsigned long ssl_err;
+  ssize_t count = 0;
+  int total_count = 0, buf_size = 0;
+  int i, n, retries = 0;
+
+  for (i = 0; i < iovcnt; i++) {
+    buf_size += iov[i].iov_len;
+  }
+
+  while (total_count != buf_size) {
+    if (connectServer(ep) < 0) {
+      return DAAP_ERROR;
     }
+    n = skipIov(iov, iovcnt, total_count, rest);
     ERR_clear_error();
     /* send log message over socket*/
-    while (total_count != buf_size) {
-        count = SSL_write(cSSL, buf+count, buf_size-count);
-        //err = SSL_get_error(ssl_connection, count);
-
-        // the error handler below doesn't retry, it exits
-        //upon failure. Is there a more robust way to handle problems?
-        CHK_SSL(count);
-        //will the below ever execute if the CHK_SSL above exits when count == -1?
-        if (count < 0) {
-            printf("ssl write count is: %d\n", count);
-            count = -1;
-            break;
-        }
-        total_count += count;
+    if (ep->queue.fd >= 0) {
+      count = queueConnection(ep, rest, n);
+    }
+    else if (ep->ktls_active) {
+      do {
+        count = writev(ep->sockfd, rest, n);
+      } while (count < 0 && errno == EINTR);
+    }
+    else {
+      count = SSL_write(ep->ssl, rest[0].iov_base, rest[0].iov_len);
+    }
+    if (count <= 0) {
+      /* the server went away: start over on a new connection, since a
+       * partial record on the old one is dropped by the server */
+      ssl_err = ERR_get_error();
+      closeConnection(ep);
+      if (retries++ > 0) {
+        ERROR_OUTPUT(("SSL write to %s:%d failed: %s", ep->host, ep->port, ssl_err ?
+                      ERR_reason_error_string(ssl_err) : strerror(errno)));
+        daapEndpointFailed(ep);
+        return DAAP_ERROR;
+      }
+      total_count = 0;
+      continue;
+    }
+    total_count += count;
+  }
+  return total_count;
+}
+
+/* Writes the buffers to the endpoint that owns hash, or, if that fails, to
+ * the next ones on the ring, skipping those that failed recently; with
+ * none left the buffers are not written. Called with write_mutex held. */
+static int writeOwned(uint64_t hash, const struct iovec *iov, int iovcnt) {
+  bool tried[DAAP_ENDPOINTS_MAX] = { false };
+  daap_endpoint_t *ep;
+  sigset_t old_mask;
+  int count = DAAP_ERROR;
+
+  if (initializeSSL() < 0) {
+    return DAAP_ERROR;
+  }
+  blockSigpipe(&old_mask);
+  while ((ep = daapEndpointFor(hash, tried)) != NULL) {
+    count = writeConnection(ep, iov, iovcnt);
+    if (count >= 0) {
+      break;
     }
+    tried[ep - daapEndpointGet(0)] = true;
+  }
+  restoreSigpipe(&old_mask);
+  return count;
+}
+
+/* Writes records; when sharding by metric, each run of records owned by
+ * the same endpoint is written to it separately */
+int daapTCPLogWrite(char *buf, int buf_size) {
+  struct iovec iov = { buf, buf_size };
+  daap_endpoint_t *owner, *run_owner;
+  uint64_t hash, run_hash = 0;
+  char *record, *end, *run;
+  int count = 0, written;
 
-    //daapTCPClose();
-    close(sockfd);
+  pthread_mutex_lock(&write_mutex);
+  if (initializeSSL() < 0 || !daapEndpointsByMetric() || daapEndpointCount() == 1) {
+    count = writeOwned(rankHash(), &iov, 1);
     pthread_mutex_unlock(&write_mutex);
     return count;
+  }
+
+  run = record = buf;
+  run_owner = NULL;
+  while (record < buf + buf_size) {
+    end = memchr(record, '\n', buf + buf_size - record);
+    end = end ? end + 1 : buf + buf_size;
+    hash = daapEndpointHash(record, seriesLength(record, end - record));
+    owner = daapEndpointFor(hash, NULL);
+    if (run != record && owner != run_owner) {
+      iov.iov_base = run;
+      iov.iov_len = record - run;
+      written = writeOwned(run_hash, &iov, 1);
+      count = written < 0 || count < 0 ? DAAP_ERROR : count + written;
+      run = record;
+    }
+    if (run == record) {
+      run_owner = owner;
+      run_hash = hash;
+    }
+    record = end;
+  }
+  iov.iov_base = run;
+  iov.iov_len = record - run;
+  written = writeOwned(run_hash, &iov, 1);
+  count = written < 0 || count < 0 ? DAAP_ERROR : count + written;
+  pthread_mutex_unlock(&write_mutex);
+  return count;
 }
 
-int daapTCPConnect(void) {
-  /* socket struct */
-  struct sockaddr_in servaddr;
-  int ret_val = 0;
-  int ssl_err = 0;
-
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if( sockfd < 0 ) {
-      perror("socket creation failed");
-      return sockfd;
-  }
-	
-  bzero(&servaddr, sizeof(servaddr));
-	
-  /* assign IP, PORT */
-  servaddr.sin_family = AF_INET;
-  /* server is always on the local host */
-  servaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
-  servaddr.sin_port = htons(PORT);
-  
-  /* connect the client to the server */
-  ret_val = connect(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr));
-  if( ret_val != 0 ) {
-      perror("connection to the TCP server failed");
-      return -1;
+/* Writes lifecycle and heartbeat records at once, to the rank's endpoint or
+ * any other; while all of them are down, the priority lane keeps them */
+int daapTCPLogWritePriority(const char *buf, int buf_size) {
+  struct iovec iov = { (void *)buf, buf_size };
+  int count;
+
+  pthread_mutex_lock(&write_mutex);
+  count = writeOwned(rankHash(), &iov, 1);
+  pthread_mutex_unlock(&write_mutex);
+  return count;
+}
+
+/* Writes one record made of several buffers (at most WRITE_MAX_IOV) */
+int daapTCPLogWritev(const struct iovec *iov, int iovcnt) {
+  uint64_t hash;
+  int count;
+
+  if (iovcnt > WRITE_MAX_IOV) {
+    return DAAP_ERROR;
+  }
+  pthread_mutex_lock(&write_mutex);
+  if (initializeSSL() == 0 && daapEndpointsByMetric()) {
+    hash = daapEndpointHash(iov[0].iov_base, seriesLength(iov[0].iov_base, iov[0].iov_len));
+  }
+  else {
+    hash = rankHash();
+  }
+  count = writeOwned(hash, iov, iovcnt);
+  pthread_mutex_unlock(&write_mutex);
+  return count;
+}
+
+/* Sends how many TLS handshakes this process did and how many of them
+ * resumed a session, as one record; called by daapFinalize() */
+int daapTCPLogStats(void) {
+  field_t fields[4];
+  long handshakes, resumed;
+  bool ktls = false;
+  int i;
+
+  daapTLSSessionStats(&handshakes, &resumed);
+  if (handshakes == 0) {
+    return DAAP_SUCCESS;
   }
+  pthread_mutex_lock(&write_mutex);
+  for (i = 0; i < daapEndpointCount(); i++) {
+    ktls = ktls || daapEndpointGet(i)->ktls_active;
+  }
+  pthread_mutex_unlock(&write_mutex);
 
-  cSSL = SSL_new(sslctx);
-  SSL_set_fd(cSSL, sockfd);
-  ret_val = SSL_connect (cSSL);
-  if(ret_val < 0) {
-      //Error occurred, log and close down ssl
-      daapShutdownSSL();
-      return -1;    
+  memset(fields, 0, sizeof(fields));
+  fields[0].field_name = MSG_KEY;
+  fields[0].field_val = "__daap_tls";
+  fields[1].field_name = "handshakes";
+  fields[1].field_type = DAAP_FIELD_INT;
+  fields[1].int_val = handshakes;
+  fields[2].field_name = "resumed";
+  fields[2].field_type = DAAP_FIELD_INT;
+  fields[2].int_val = resumed;
+  fields[3].field_name = "ktls";
+  fields[3].field_type = DAAP_FIELD_BOOL;
+  fields[3].int_val = ktls;
+  return daapLogFields(0, NULL, 4, fields);
+}
+
+/* Connects to this rank's endpoint (if not connected already) */
+int daapTCPConnect(void) {
+  daap_endpoint_t *ep;
+  sigset_t old_mask;
+  int ret_val = -1;
+
+  pthread_mutex_lock(&write_mutex);
+  blockSigpipe(&old_mask);
+  if (initializeSSL() == 0 && (ep = daapEndpointFor(rankHash(), NULL)) != NULL) {
+    ret_val = connectServer(ep);
   }
+  restoreSigpipe(&old_mask);
+  pthread_mutex_unlock(&write_mutex);
+  return ret_val;
+}
+
+/* Closes the connections; the next write connects again */
+int daapTCPClose() {
+  sigset_t old_mask;
 
+  pthread_mutex_lock(&write_mutex);
+  blockSigpipe(&old_mask);
+  closeAllConnections();
+  restoreSigpipe(&old_mask);
+  pthread_mutex_unlock(&write_mutex);
   return 0;
 }
-
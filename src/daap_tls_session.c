@@ -0,0 +1,233 @@
+/*
+ * TLS session resumption for the TCP transport
+ *
+ * Every rank used to do a full TLS handshake with the node's telegraf when
+ * it connected, and again after every reconnect, although all the ranks of
+ * a node present the same client certificate. Sessions handed out by the
+ * server are now kept: in memory, for this process's reconnects, and in a
+ * file in a node-local tmpfs directory (DAAP_TLS_SESSION_DIR, /dev/shm by
+ * default), named after the user, the endpoint and the certificate
+ * directory, which the other ranks of the node offer when they connect.
+ * The server then resumes the session and skips the certificate exchange
+ * and key agreement of a full handshake.
+ *
+ * Files are written to a temporary file of a unique name (mkstemp()) and
+ * renamed, so concurrent ranks read either the previous session or the
+ * new one. They are only readable by their owner, and as the directory is
+ * shared, a file is only read if it is a regular file, not a symlink, of
+ * the user and not accessible to others. A session that cannot be read,
+ * has expired or is rejected by the server just means a full handshake.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_tls_session.h"
+
+#define TLS_SESSION_DIR_ENVVAR "DAAP_TLS_SESSION_DIR"
+#define TLS_SESSION_DIR_DEFAULT "/dev/shm"
+/* largest serialized session accepted from a file */
+#define TLS_SESSION_MAX_SIZE 16384
+
+/* the session of the last handshake and the endpoint it belongs to */
+static SSL_SESSION *cached_session = NULL;
+static char cached_endpoint[PATH_MAX];
+/* "" without a usable directory */
+static char session_dir[PATH_MAX];
+static unsigned long cert_hash;
+/* each connection's endpoint ("host-port"), kept with its SSL object since
+ * tickets may arrive when another endpoint is being connected to */
+static int endpoint_index = -1;
+
+static long handshakes = 0;
+static long resumed = 0;
+
+/* FNV-1a, to tell certificate directories apart in file names */
+static unsigned long hashString(const char *str) {
+    unsigned long hash = 14695981039346656037UL;
+
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static void writeSessionFile(SSL_SESSION *session, const char *path) {
+    char tmp_path[PATH_MAX];
+    unsigned char *der, *p;
+    int len, fd;
+    ssize_t written;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= (int)sizeof(tmp_path)) {
+        return;
+    }
+
+    len = i2d_SSL_SESSION(session, NULL);
+    if (len <= 0 || len > TLS_SESSION_MAX_SIZE) {
+        return;
+    }
+    der = p = malloc(len);
+    if (der == NULL) {
+        return;
+    }
+    i2d_SSL_SESSION(session, &p);
+
+    /* created with O_EXCL and mode 0600 */
+    fd = mkstemp(tmp_path);
+    if (fd >= 0) {
+        written = write(fd, der, len);
+        close(fd);
+        if (written != len || rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+        }
+    }
+    free(der);
+}
+
+/* File of the endpoint's sessions; false without a usable directory */
+static bool sessionPath(const char *endpoint, char *path, size_t size) {
+    int len;
+
+    if (session_dir[0] == '\0') {
+        return false;
+    }
+    len = snprintf(path, size, "%s/daap-tls-%d-%s-%016lx", session_dir, (int)getuid(),
+                   endpoint, cert_hash);
+    return len > 0 && (size_t)len < size;
+}
+
+static void freeEndpoint(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx,
+                         long argl, void *argp) {
+    (void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+    free(ptr);
+}
+
+static SSL_SESSION *readSessionFile(const char *path) {
+    unsigned char der[TLS_SESSION_MAX_SIZE];
+    const unsigned char *p = der;
+    SSL_SESSION *session;
+    struct stat st;
+    ssize_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    /* another user could have put a session of their own there */
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & 0777) != (S_IRUSR | S_IWUSR)) {
+        close(fd);
+        return NULL;
+    }
+    len = read(fd, der, sizeof(der));
+    close(fd);
+    if (len <= 0) {
+        return NULL;
+    }
+    session = d2i_SSL_SESSION(NULL, &p, len);
+    if (session && (!SSL_SESSION_is_resumable(session) ||
+                    SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) <=
+                    time(NULL))) {
+        SSL_SESSION_free(session);
+        session = NULL;
+    }
+    return session;
+}
+
+/* Called by OpenSSL for every session the server hands out: during the
+ * handshake for TLS 1.2, and when a ticket is read after it for TLS 1.3 */
+static int newSession(SSL *ssl, SSL_SESSION *session) {
+    const char *endpoint = SSL_get_ex_data(ssl, endpoint_index);
+    char path[PATH_MAX];
+
+    if (endpoint == NULL || !SSL_SESSION_is_resumable(session)) {
+        return 0;
+    }
+    if (sessionPath(endpoint, path, sizeof(path))) {
+        writeSessionFile(session, path);
+    }
+    /* keep the reference for reconnects */
+    if (cached_session) {
+        SSL_SESSION_free(cached_session);
+    }
+    cached_session = session;
+    snprintf(cached_endpoint, sizeof(cached_endpoint), "%s", endpoint);
+    return 1;
+}
+
+void daapTLSSessionInit(SSL_CTX *ctx, const char *cert_dir) {
+    const char *dir = getenv(TLS_SESSION_DIR_ENVVAR);
+
+    if (dir == NULL) {
+        dir = TLS_SESSION_DIR_DEFAULT;
+    }
+    /* without a writable directory sessions are only reused in process */
+    if (dir[0] && strlen(dir) < sizeof(session_dir) && access(dir, W_OK) == 0) {
+        snprintf(session_dir, sizeof(session_dir), "%s", dir);
+    }
+    else {
+        session_dir[0] = '\0';
+    }
+    cert_hash = hashString(cert_dir);
+    if (endpoint_index < 0) {
+        endpoint_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, freeEndpoint);
+    }
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                   SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, newSession);
+}
+
+void daapTLSSessionOffer(SSL *ssl, const char *host, int port) {
+    SSL_SESSION *session = NULL;
+    char endpoint[PATH_MAX];
+    char path[PATH_MAX];
+    char *key;
+
+    snprintf(endpoint, sizeof(endpoint), "%s-%d", host, port);
+    key = strdup(endpoint);
+    if (key == NULL || !SSL_set_ex_data(ssl, endpoint_index, key)) {
+        free(key);
+        return;
+    }
+
+    /* this process's own session first, then whichever rank wrote last */
+    if (cached_session && strcmp(cached_endpoint, endpoint) == 0 &&
+        SSL_SESSION_is_resumable(cached_session)) {
+        SSL_set_session(ssl, cached_session);
+        return;
+    }
+    if (sessionPath(endpoint, path, sizeof(path))) {
+        session = readSessionFile(path);
+    }
+    if (session) {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+}
+
+void daapTLSSessionConnected(SSL *ssl) {
+    handshakes++;
+    if (SSL_session_reused(ssl)) {
+        resumed++;
+    }
+    DEBUG_OUTPUT(("TLS handshake %ld (%s), %ld of them resumed", handshakes,
+                  SSL_session_reused(ssl) ? "resumed" : "full", resumed));
+}
+
+void daapTLSSessionStats(long *num_handshakes, long *num_resumed) {
+    *num_handshakes = handshakes;
+    *num_resumed = resumed;
+}
+
+void daapTLSSessionFree(void) {
+    if (cached_session) {
+        SSL_SESSION_free(cached_session);
+        cached_session = NULL;
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef DAAP_TLS_SESSION_H
+#define DAAP_TLS_SESSION_H
+
+/* TLS session resumption for the TCP transport (not part of the API).
+ *
+ * Sessions (TLS 1.3 tickets, or TLS 1.2 sessions) are kept in memory for
+ * reconnects and in a node-local file per endpoint and client certificate,
+ * so that the other ranks on the node resume the session of the first one
+ * instead of each doing a full handshake. */
+
+#include <openssl/ssl.h>
+
+/* Enables session caching on ctx. cert_dir (DAAP_CERTS) identifies the
+ * client certificate the cached sessions belong to. */
+void daapTLSSessionInit(SSL_CTX *ctx, const char *cert_dir);
+
+/* Offers a cached session for the endpoint host:port to ssl; called before
+ * SSL_connect */
+void daapTLSSessionOffer(SSL *ssl, const char *host, int port);
+
+/* Counts a completed handshake of ssl as full or resumed */
+void daapTLSSessionConnected(SSL *ssl);
+
+/* Handshakes so far, and how many of them resumed a session */
+void daapTLSSessionStats(long *handshakes, long *resumed);
+
+/* Frees the in-memory session (the files are left for other processes) */
+void daapTLSSessionFree(void);
+
+#endif /* DAAP_TLS_SESSION_H */
@@ -0,0 +1,749 @@
+/*
+ * Binary framing of records for the relay transport
+ *
+ * In line protocol every record repeats its measurement and tags (the
+ * appname, hostname, cluster and rank at least) and the names of its
+ * fields, all escaped, and has its numbers and timestamp printed as text.
+ * On the local hop from the library to daap_relay that is most of the
+ * bytes and most of the time spent building them. Here the tag set and the
+ * schema (field names and types) of a record are sent once per connection
+ * and given an id; a record is then its schema id, its timestamp as a
+ * delta from the previous one, and its values in binary, usually a dozen
+ * bytes or so. The relay keeps the definitions already escaped, so that
+ * turning a record back into line protocol for telegraf is mostly copying.
+ *
+ * The encoder finds the id of a tag set or schema by hashing its encoded
+ * definition into an open-addressing table. When either table holds
+ * DAAP_WIRE_IDS_MAX entries, a reset frame makes both sides start over, so
+ * that a process with many distinct tag values does not grow the relay
+ * without bound.
+ */
+
+#include <math.h>
+
+#include "daap_log.h"
+#include "daap_log_internal.h"
+#include "daap_escape.h"
+#include "daap_wire.h"
+
+#define FRAME_TAGSET 'T'
+#define FRAME_SCHEMA 'S'
+#define FRAME_RECORD 'R'
+#define FRAME_LINE 'L'
+#define FRAME_RESET 'X'
+
+/* hash table slots of each table: at most half of them are used */
+#define TABLE_SIZE (2 * DAAP_WIRE_IDS_MAX)
+/* most fields of a schema the decoder accepts */
+#define FIELDS_MAX 65536
+
+typedef struct wire_slot {
+    uint64_t hash;
+    /* id + 1, 0 for a free slot */
+    uint32_t id;
+    uint32_t len;
+    /* of the definition, in the encoder's keys */
+    size_t off;
+} wire_slot_t;
+
+typedef struct wire_table {
+    wire_slot_t slots[TABLE_SIZE];
+    int count;
+} wire_table_t;
+
+struct daap_wire_encoder {
+    wire_table_t tagsets;
+    wire_table_t schemas;
+    /* the definitions of both tables, and the one being looked up */
+    daap_wire_buf_t keys;
+    daap_wire_buf_t key;
+    long last_timestamp;
+    /* a frame was lost, and the decoder has to be reset */
+    bool need_reset;
+    /* where the batch starts in its buffer, and what was sent before it,
+     * for daapWireEncodeResend() */
+    size_t mark_len;
+    int mark_tagsets;
+    int mark_schemas;
+    long mark_timestamp;
+};
+
+typedef struct wire_tagset {
+    /* escaped measurement and tags, in the decoder's defs */
+    size_t off;
+    size_t len;
+} wire_tagset_t;
+
+typedef struct wire_schema {
+    int tagset;
+    int num_fields;
+    /* each field's type, then the length and bytes of its escaped
+     * "name=", in the decoder's defs */
+    size_t off;
+} wire_schema_t;
+
+struct daap_wire_decoder {
+    bool started;
+    int num_tagsets;
+    int num_schemas;
+    wire_tagset_t tagsets[DAAP_WIRE_IDS_MAX];
+    wire_schema_t schemas[DAAP_WIRE_IDS_MAX];
+    daap_wire_buf_t defs;
+    long last_timestamp;
+};
+
+/* Reads a frame; incomplete is set when it goes past the end of the data,
+ * invalid when the data cannot be a frame */
+typedef struct wire_reader {
+    const unsigned char *p;
+    const unsigned char *end;
+    bool incomplete;
+    bool invalid;
+} wire_reader_t;
+
+int daapWireBufReserve(daap_wire_buf_t *b, size_t len) {
+    size_t size;
+    char *buf;
+
+    if (b->len + len <= b->size) {
+        return 0;
+    }
+    size = b->size ? b->size : 1024;
+    while (size < b->len + len) {
+        size *= 2;
+    }
+    buf = realloc(b->buf, size);
+    if (buf == NULL) {
+        return -1;
+    }
+    b->buf = buf;
+    b->size = size;
+    return 0;
+}
+
+static int putBytes(daap_wire_buf_t *b, const void *bytes, size_t len) {
+    if (daapWireBufReserve(b, len) != 0) {
+        return -1;
+    }
+    memcpy(b->buf + b->len, bytes, len);
+    b->len += len;
+    return 0;
+}
+
+static int putByte(daap_wire_buf_t *b, unsigned char c) {
+    return putBytes(b, &c, 1);
+}
+
+static int putVarint(daap_wire_buf_t *b, uint64_t v) {
+    unsigned char *p;
+
+    if (daapWireBufReserve(b, 10) != 0) {
+        return -1;
+    }
+    p = (unsigned char *)b->buf + b->len;
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    b->len = (char *)p - b->buf;
+    return 0;
+}
+
+static int putString(daap_wire_buf_t *b, const char *str) {
+    size_t len = strlen(str);
+
+    if (putVarint(b, len) != 0) {
+        return -1;
+    }
+    return putBytes(b, str, len);
+}
+
+/* Appends len bytes of str escaped as kind */
+static int putEscaped(daap_wire_buf_t *b, const char *str, size_t len, int kind) {
+    if (daapWireBufReserve(b, 2 * len) != 0) {
+        return -1;
+    }
+    b->len += daapEscape(b->buf + b->len, str, len, kind);
+    return 0;
+}
+
+static uint64_t zigzag(long long v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static long long unzigzag(uint64_t v) {
+    return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+/* FNV-1a */
+static uint64_t hashKey(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void tablesClear(daap_wire_encoder_t *enc) {
+    memset(enc->tagsets.slots, 0, sizeof(enc->tagsets.slots));
+    memset(enc->schemas.slots, 0, sizeof(enc->schemas.slots));
+    enc->tagsets.count = 0;
+    enc->schemas.count = 0;
+    enc->keys.len = 0;
+    enc->last_timestamp = 0;
+}
+
+daap_wire_encoder_t *daapWireEncoderNew(void) {
+    return calloc(1, sizeof(daap_wire_encoder_t));
+}
+
+void daapWireEncoderReset(daap_wire_encoder_t *enc) {
+    tablesClear(enc);
+    enc->need_reset = false;
+    daapWireEncoderMark(enc, 0);
+}
+
+void daapWireEncoderMark(daap_wire_encoder_t *enc, size_t len) {
+    enc->mark_len = len;
+    enc->mark_tagsets = enc->tagsets.count;
+    enc->mark_schemas = enc->schemas.count;
+    enc->mark_timestamp = enc->last_timestamp;
+}
+
+void daapWireEncoderFree(daap_wire_encoder_t *enc) {
+    if (enc) {
+        free(enc->keys.buf);
+        free(enc->key.buf);
+        free(enc);
+    }
+}
+
+/* Returns the id of the definition in enc->key, first appending it to out
+ * as a frame of type if it is new; -1 if out of memory */
+static int tableId(daap_wire_encoder_t *enc, wire_table_t *t, daap_wire_buf_t *out, char type) {
+    uint64_t hash = hashKey(enc->key.buf, enc->key.len);
+    size_t i = hash & (TABLE_SIZE - 1);
+    wire_slot_t *slot;
+
+    for (;; i = (i + 1) & (TABLE_SIZE - 1)) {
+        slot = &t->slots[i];
+        if (slot->id == 0) {
+            break;
+        }
+        if (slot->hash == hash && slot->len == enc->key.len &&
+            memcmp(enc->keys.buf + slot->off, enc->key.buf, enc->key.len) == 0) {
+            return slot->id - 1;
+        }
+    }
+
+    if (putByte(out, type) != 0 || putBytes(out, enc->key.buf, enc->key.len) != 0) {
+        return -1;
+    }
+    slot->off = enc->keys.len;
+    if (putBytes(&enc->keys, enc->key.buf, enc->key.len) != 0) {
+        return -1;
+    }
+    slot->hash = hash;
+    slot->len = enc->key.len;
+    slot->id = ++t->count;
+    return t->count - 1;
+}
+
+int daapWireEncodeRecord(daap_wire_encoder_t *enc, daap_wire_buf_t *out, long timestamp,
+                         const char *measurement, int num_tags, const tag_t *tags,
+                         int num_fields, const field_t *fields) {
+    size_t start = out->len;
+    double float_val;
+    int i, n, tagset, schema, ret = 0;
+    fieldtype type;
+
+    if (enc->need_reset || enc->tagsets.count == DAAP_WIRE_IDS_MAX ||
+        enc->schemas.count == DAAP_WIRE_IDS_MAX) {
+        if (putByte(out, FRAME_RESET) != 0) {
+            return -1;
+        }
+        daapWireEncoderReset(enc);
+        /* what the batch has before the reset refers to forgotten ids */
+        enc->mark_len = start;
+    }
+
+    /* the tag set */
+    enc->key.len = 0;
+    for (i = 0, n = 0; i < num_tags; i++) {
+        n += tags[i].tag_name && tags[i].tag_val && tags[i].tag_name[0] && tags[i].tag_val[0];
+    }
+    ret |= putString(&enc->key, measurement);
+    ret |= putVarint(&enc->key, n);
+    for (i = 0; i < num_tags; i++) {
+        if (tags[i].tag_name && tags[i].tag_val && tags[i].tag_name[0] && tags[i].tag_val[0]) {
+            ret |= putString(&enc->key, tags[i].tag_name);
+            ret |= putString(&enc->key, tags[i].tag_val);
+        }
+    }
+    if (ret != 0 || (tagset = tableId(enc, &enc->tagsets, out, FRAME_TAGSET)) < 0) {
+        goto failed;
+    }
+
+    /* the schema, with any type but the numeric ones sent as a string */
+    enc->key.len = 0;
+    ret |= putVarint(&enc->key, tagset);
+    ret |= putVarint(&enc->key, num_fields);
+    for (i = 0; i < num_fields; i++) {
+        type = fields[i].field_type;
+        if (type != DAAP_FIELD_FLOAT && type != DAAP_FIELD_INT && type != DAAP_FIELD_BOOL) {
+            type = DAAP_FIELD_STRING;
+        }
+        ret |= putByte(&enc->key, type);
+        ret |= putString(&enc->key, fields[i].field_name);
+    }
+    if (ret != 0 || (schema = tableId(enc, &enc->schemas, out, FRAME_SCHEMA)) < 0) {
+        goto failed;
+    }
+
+    ret |= putByte(out, FRAME_RECORD);
+    ret |= putVarint(out, schema);
+    ret |= putVarint(out, zigzag((long long)timestamp - enc->last_timestamp));
+    for (i = 0; i < num_fields; i++) {
+        switch (fields[i].field_type) {
+        case DAAP_FIELD_FLOAT:
+            float_val = fields[i].float_val;
+            ret |= putBytes(out, &float_val, sizeof(float_val));
+            break;
+        case DAAP_FIELD_INT:
+            ret |= putVarint(out, zigzag(fields[i].int_val));
+            break;
+        case DAAP_FIELD_BOOL:
+            ret |= putByte(out, fields[i].int_val ? 1 : 0);
+            break;
+        default:
+            ret |= putString(out, fields[i].field_val ? fields[i].field_val : "");
+        }
+    }
+    if (ret != 0) {
+        goto failed;
+    }
+    enc->last_timestamp = timestamp;
+    return 0;
+
+ failed:
+    /* definitions may have been added without their frames reaching out */
+    out->len = start;
+    enc->need_reset = true;
+    return -1;
+}
+
+int daapWireEncodeLine(daap_wire_buf_t *out, const char *line, size_t len) {
+    size_t start = out->len;
+
+    if (putByte(out, FRAME_LINE) != 0 || putVarint(out, len) != 0 ||
+        putBytes(out, line, len) != 0) {
+        out->len = start;
+        return -1;
+    }
+    return 0;
+}
+
+daap_wire_decoder_t *daapWireDecoderNew(void) {
+    return calloc(1, sizeof(daap_wire_decoder_t));
+}
+
+void daapWireDecoderFree(daap_wire_decoder_t *dec) {
+    if (dec) {
+        free(dec->defs.buf);
+        free(dec);
+    }
+}
+
+static uint64_t getVarint(wire_reader_t *r) {
+    uint64_t v = 0;
+    int shift;
+
+    for (shift = 0; shift < 64; shift += 7) {
+        if (r->p == r->end) {
+            r->incomplete = true;
+            return 0;
+        }
+        v |= (uint64_t)(*r->p & 0x7f) << shift;
+        if ((*r->p++ & 0x80) == 0) {
+            return v;
+        }
+    }
+    r->invalid = true;
+    return 0;
+}
+
+static const char *getBytes(wire_reader_t *r, size_t len) {
+    const char *bytes = (const char *)r->p;
+
+    if (len > DAAP_WIRE_FRAME_MAX) {
+        r->invalid = true;
+        return NULL;
+    }
+    if ((size_t)(r->end - r->p) < len) {
+        r->incomplete = true;
+        return NULL;
+    }
+    r->p += len;
+    return bytes;
+}
+
+/* A string of the frame: its bytes, and their number in len */
+static const char *getString(wire_reader_t *r, size_t *len) {
+    *len = getVarint(r);
+    if (r->incomplete || r->invalid) {
+        return NULL;
+    }
+    return getBytes(r, *len);
+}
+
+#define READ_FAILED(r) ((r)->incomplete || (r)->invalid)
+
+/* Stores the escaped measurement and tags of a tag set */
+static int decodeTagset(daap_wire_decoder_t *dec, wire_reader_t *r) {
+    daap_wire_buf_t *defs = &dec->defs;
+    size_t start = defs->len, len = 0, val_len = 0;
+    const char *str, *val;
+    uint64_t n, i;
+
+    if (dec->num_tagsets == DAAP_WIRE_IDS_MAX) {
+        r->invalid = true;
+        return -1;
+    }
+    str = getString(r, &len);
+    n = getVarint(r);
+    if (READ_FAILED(r) || putEscaped(defs, str, len, DAAP_ESCAPE_KEY) != 0) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        str = getString(r, &len);
+        val = READ_FAILED(r) ? NULL : getString(r, &val_len);
+        if (READ_FAILED(r)) {
+            return -1;
+        }
+        if (len == 0 || val_len == 0) {
+            continue;
+        }
+        if (putByte(defs, ',') != 0 || putEscaped(defs, str, len, DAAP_ESCAPE_KEY) != 0 ||
+            putByte(defs, '=') != 0 || putEscaped(defs, val, val_len, DAAP_ESCAPE_KEY) != 0) {
+            return -1;
+        }
+    }
+    dec->tagsets[dec->num_tagsets].off = start;
+    dec->tagsets[dec->num_tagsets].len = defs->len - start;
+    dec->num_tagsets++;
+    return 0;
+}
+
+/* Stores the types and escaped names of the fields of a schema */
+static int decodeSchema(daap_wire_decoder_t *dec, wire_reader_t *r) {
+    daap_wire_buf_t *defs = &dec->defs;
+    wire_schema_t *schema = &dec->schemas[dec->num_schemas];
+    size_t start = defs->len, len = 0, len_at, escaped;
+    uint64_t tagset, n, i;
+    const char *name;
+    unsigned char type;
+
+    if (dec->num_schemas == DAAP_WIRE_IDS_MAX) {
+        r->invalid = true;
+        return -1;
+    }
+    tagset = getVarint(r);
+    n = getVarint(r);
+    if (READ_FAILED(r)) {
+        return -1;
+    }
+    if (tagset >= (uint64_t)dec->num_tagsets || n == 0 || n > FIELDS_MAX) {
+        r->invalid = true;
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        name = getBytes(r, 1);
+        type = name ? (unsigned char)name[0] : 0;
+        name = READ_FAILED(r) ? NULL : getString(r, &len);
+        if (READ_FAILED(r)) {
+            return -1;
+        }
+        if (type > DAAP_FIELD_BOOL) {
+            r->invalid = true;
+            return -1;
+        }
+        if (putByte(defs, type) != 0 || daapWireBufReserve(defs, sizeof(len) + 2 * len + 1) != 0) {
+            return -1;
+        }
+        len_at = defs->len;
+        defs->len += sizeof(len);
+        escaped = daapEscape(defs->buf + defs->len, name, len, DAAP_ESCAPE_KEY);
+        defs->buf[defs->len + escaped++] = '=';
+        memcpy(defs->buf + len_at, &escaped, sizeof(escaped));
+        defs->len += escaped;
+    }
+    schema->tagset = (int)tagset;
+    schema->num_fields = (int)n;
+    schema->off = start;
+    dec->num_schemas++;
+    return 0;
+}
+
+/* Appends the line protocol of a record */
+static int decodeRecord(daap_wire_decoder_t *dec, wire_reader_t *r, daap_wire_buf_t *out) {
+    const wire_schema_t *schema;
+    const wire_tagset_t *tagset;
+    const char *field, *val;
+    char num[40];
+    long long timestamp;
+    uint64_t id;
+    double float_val;
+    size_t name_len, len, start = out->len;
+    int i, written = 0, ret = 0;
+
+    id = getVarint(r);
+    timestamp = unzigzag(getVarint(r)) + dec->last_timestamp;
+    if (READ_FAILED(r)) {
+        return -1;
+    }
+    if (id >= (uint64_t)dec->num_schemas) {
+        r->invalid = true;
+        return -1;
+    }
+    schema = &dec->schemas[id];
+    tagset = &dec->tagsets[schema->tagset];
+    ret |= putBytes(out, dec->defs.buf + tagset->off, tagset->len);
+
+    field = dec->defs.buf + schema->off;
+    for (i = 0; i < schema->num_fields; i++) {
+        memcpy(&name_len, field + 1, sizeof(name_len));
+        if (field[0] == DAAP_FIELD_FLOAT) {
+            val = getBytes(r, sizeof(float_val));
+            if (val == NULL) {
+                return -1;
+            }
+            memcpy(&float_val, val, sizeof(float_val));
+            /* inf/nan are left out, as daapLogFields() does */
+            if (!isfinite(float_val)) {
+                field += 1 + sizeof(name_len) + name_len;
+                continue;
+            }
+        }
+        ret |= putByte(out, written++ == 0 ? ' ' : ',');
+        ret |= putBytes(out, field + 1 + sizeof(name_len), name_len);
+        switch (field[0]) {
+        case DAAP_FIELD_FLOAT:
+            daapFormatDouble(num, sizeof(num), float_val);
+            ret |= putBytes(out, num, strlen(num));
+            break;
+        case DAAP_FIELD_INT:
+            snprintf(num, sizeof(num), "%lldi", unzigzag(getVarint(r)));
+            ret |= putBytes(out, num, strlen(num));
+            break;
+        case DAAP_FIELD_BOOL:
+            val = getBytes(r, 1);
+            if (val == NULL) {
+                return -1;
+            }
+            ret |= val[0] ? putBytes(out, "true", 4) : putBytes(out, "false", 5);
+            break;
+        default:
+            val = getString(r, &len);
+            if (val == NULL) {
+                return -1;
+            }
+            ret |= putByte(out, '"');
+            ret |= putEscaped(out, val, len, DAAP_ESCAPE_STRING);
+            ret |= putByte(out, '"');
+        }
+        if (READ_FAILED(r)) {
+            return -1;
+        }
+        field += 1 + sizeof(name_len) + name_len;
+    }
+    if (written == 0) {
+        /* no field left: no record, but the timestamps go on from it */
+        out->len = start;
+    } else {
+        snprintf(num, sizeof(num), " %lld\n", timestamp * 1000000);
+        ret |= putBytes(out, num, strlen(num));
+    }
+    if (ret != 0) {
+        return -1;
+    }
+    dec->last_timestamp = timestamp;
+    return 0;
+}
+
+/* Decodes the frame at r; returns 0, or -1 with incomplete or invalid set
+ * in r (or neither, if out of memory) */
+static int decodeFrame(daap_wire_decoder_t *dec, wire_reader_t *r, daap_wire_buf_t *out) {
+    const char *line;
+    size_t len;
+
+    switch (*r->p++) {
+    case FRAME_TAGSET:
+        return decodeTagset(dec, r);
+    case FRAME_SCHEMA:
+        return decodeSchema(dec, r);
+    case FRAME_RECORD:
+        return decodeRecord(dec, r, out);
+    case FRAME_LINE:
+        line = getString(r, &len);
+        if (line == NULL || putBytes(out, line, len) != 0 || putByte(out, '\n') != 0) {
+            return -1;
+        }
+        return 0;
+    case FRAME_RESET:
+        dec->num_tagsets = 0;
+        dec->num_schemas = 0;
+        dec->defs.len = 0;
+        dec->last_timestamp = 0;
+        return 0;
+    default:
+        r->invalid = true;
+        return -1;
+    }
+}
+
+long daapWireDecode(daap_wire_decoder_t *dec, const char *in, size_t len, daap_wire_buf_t *out) {
+    wire_reader_t r = { (const unsigned char *)in, (const unsigned char *)in + len, false, false };
+    const unsigned char *frame;
+    size_t out_len, defs_len;
+
+    if (!dec->started) {
+        if (memcmp(in, DAAP_WIRE_MAGIC, len < DAAP_WIRE_MAGIC_LEN ? len : DAAP_WIRE_MAGIC_LEN) != 0) {
+            return -1;
+        }
+        if (len < DAAP_WIRE_MAGIC_LEN) {
+            return 0;
+        }
+        r.p += DAAP_WIRE_MAGIC_LEN;
+        dec->started = true;
+    }
+
+    while (r.p < r.end) {
+        /* what a frame left unfinished adds is dropped */
+        frame = r.p;
+        out_len = out->len;
+        defs_len = dec->defs.len;
+        if (decodeFrame(dec, &r, out) != 0) {
+            out->len = out_len;
+            dec->defs.len = defs_len;
+            if (r.incomplete && !r.invalid) {
+                r.p = frame;
+                break;
+            }
+            return -1;
+        }
+    }
+    return (const char *)r.p - in;
+}
+
+/* Appends to out the definitions of table with an id below count, in the
+ * order of their ids */
+static int putDefinitions(const daap_wire_encoder_t *enc, const wire_table_t *t, int count,
+                          char type, daap_wire_buf_t *out) {
+    const wire_slot_t *by_id[DAAP_WIRE_IDS_MAX];
+    int i;
+
+    for (i = 0; i < TABLE_SIZE; i++) {
+        if (t->slots[i].id != 0 && (int)t->slots[i].id <= count) {
+            by_id[t->slots[i].id - 1] = &t->slots[i];
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (putByte(out, type) != 0 ||
+            putBytes(out, enc->keys.buf + by_id[i]->off, by_id[i]->len) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Skips the definition or line frame at r, after its type */
+static void skipFrame(wire_reader_t *r, unsigned char type) {
+    uint64_t n, i;
+    size_t len;
+
+    switch (type) {
+    case FRAME_TAGSET:
+        getString(r, &len);
+        n = READ_FAILED(r) ? 0 : getVarint(r);
+        for (i = 0; i < n && !READ_FAILED(r); i++) {
+            getString(r, &len);
+            if (!READ_FAILED(r)) {
+                getString(r, &len);
+            }
+        }
+        break;
+    case FRAME_SCHEMA:
+        getVarint(r);
+        n = READ_FAILED(r) ? 0 : getVarint(r);
+        for (i = 0; i < n && !READ_FAILED(r); i++) {
+            getBytes(r, 1);
+            if (!READ_FAILED(r)) {
+                getString(r, &len);
+            }
+        }
+        break;
+    case FRAME_LINE:
+        getString(r, &len);
+        break;
+    case FRAME_RESET:
+        break;
+    default:
+        r->invalid = true;
+    }
+}
+
+int daapWireEncodeResend(daap_wire_encoder_t *enc, daap_wire_buf_t *out) {
+    daap_wire_buf_t resent = { NULL, 0, 0 };
+    wire_reader_t r = { (const unsigned char *)out->buf + enc->mark_len,
+                        (const unsigned char *)out->buf + out->len, false, false };
+    const unsigned char *frame;
+    uint64_t schema;
+    long long delta;
+    int ret = 0;
+
+    ret |= putDefinitions(enc, &enc->tagsets, enc->mark_tagsets, FRAME_TAGSET, &resent);
+    ret |= putDefinitions(enc, &enc->schemas, enc->mark_schemas, FRAME_SCHEMA, &resent);
+
+    /* the frames up to the first record go as they are, and that record
+     * with its timestamp from 0, as a new connection starts */
+    while (ret == 0 && r.p < r.end) {
+        frame = r.p++;
+        if (*frame != FRAME_RECORD) {
+            skipFrame(&r, *frame);
+            if (READ_FAILED(&r)) {
+                ret = -1;
+                break;
+            }
+            ret |= putBytes(&resent, frame, r.p - frame);
+            continue;
+        }
+        schema = getVarint(&r);
+        delta = READ_FAILED(&r) ? 0 : unzigzag(getVarint(&r));
+        if (READ_FAILED(&r)) {
+            ret = -1;
+            break;
+        }
+        ret |= putByte(&resent, FRAME_RECORD);
+        ret |= putVarint(&resent, schema);
+        ret |= putVarint(&resent, zigzag(delta + enc->mark_timestamp));
+        ret |= putBytes(&resent, r.p, r.end - r.p);
+        break;
+    }
+
+    if (ret != 0) {
+        free(resent.buf);
+        return -1;
+    }
+    free(out->buf);
+    *out = resent;
+    /* all the batch needs is in it now */
+    enc->mark_len = 0;
+    enc->mark_tagsets = 0;
+    enc->mark_schemas = 0;
+    enc->mark_timestamp = 0;
+    return 0;
+}
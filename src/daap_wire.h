@@ -0,0 +1,84 @@
+#ifndef DAAP_WIRE_H
+#define DAAP_WIRE_H
+
+/* Binary framing of records for the relay transport (not part of the API).
+ *
+ * A connection starts with DAAP_WIRE_MAGIC, followed by frames that each
+ * start with their type:
+ *   'T' tag set: measurement, number of tags, then each tag name and value
+ *   'S' schema: tag set id, number of fields, then each field type and name
+ *   'R' record: schema id, timestamp (milliseconds) less the one of the
+ *       previous record, zigzag encoded, then the value of each field
+ *   'L' line: a line protocol record, as is
+ *   'X' reset: the tag sets and schemas are forgotten
+ * Tag sets and schemas are numbered from 0 in the order they are sent, and
+ * a record refers to one sent before it on the same connection. Numbers
+ * are unsigned LEB128 varints, strings a varint length and their bytes (not
+ * escaped), floats 8 bytes in host order (the hop is local), integers
+ * zigzag varints and booleans a byte. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "daap_log.h"
+
+#define DAAP_WIRE_MAGIC "DAAPW1\n"
+#define DAAP_WIRE_MAGIC_LEN 7
+
+/* tag sets, and schemas, known at once on a connection; the encoder
+ * resets both when either is full */
+#define DAAP_WIRE_IDS_MAX 1024
+
+/* largest frame the decoder accepts */
+#define DAAP_WIRE_FRAME_MAX (16 << 20)
+
+/* Growable byte buffer */
+typedef struct daap_wire_buf {
+    char *buf;
+    size_t len;
+    size_t size;
+} daap_wire_buf_t;
+
+typedef struct daap_wire_encoder daap_wire_encoder_t;
+typedef struct daap_wire_decoder daap_wire_decoder_t;
+
+/* The state of one side of a connection; NULL if out of memory */
+daap_wire_encoder_t *daapWireEncoderNew(void);
+daap_wire_decoder_t *daapWireDecoderNew(void);
+
+/* Forgets what was sent, for a new connection */
+void daapWireEncoderReset(daap_wire_encoder_t *enc);
+/* Marks len, the end of the frames sent so far, as the start of a batch
+ * for daapWireEncodeResend() */
+void daapWireEncoderMark(daap_wire_encoder_t *enc, size_t len);
+
+void daapWireEncoderFree(daap_wire_encoder_t *enc);
+void daapWireDecoderFree(daap_wire_decoder_t *dec);
+
+/* Appends the frames of a record to out: the definitions of its tag set
+ * and schema first if they are new. Tags without a value are left out, as
+ * in line protocol. Returns 0, or -1 if out of memory (out is unchanged). */
+int daapWireEncodeRecord(daap_wire_encoder_t *enc, daap_wire_buf_t *out, long timestamp,
+                         const char *measurement, int num_tags, const tag_t *tags,
+                         int num_fields, const field_t *fields);
+
+/* Appends a line frame (a record already in line protocol, without its
+ * newline) to out; returns 0 or -1 */
+int daapWireEncodeLine(daap_wire_buf_t *out, const char *line, size_t len);
+/* Rewrites the batch in out, from its mark, for a new connection: the
+ * definitions sent before it go first, and its first record's timestamp
+ * is made absolute, so that the encoder can go on without a reset. What a
+ * reset frame in the batch left behind is not resent. Returns 0, or -1 if
+ * out of memory (out is unchanged). */
+int daapWireEncodeResend(daap_wire_encoder_t *enc, daap_wire_buf_t *out);
+
+/* Expands the complete frames of in (the magic first) to line protocol
+ * records, appended to out. Returns the number of bytes consumed, which
+ * leaves an incomplete frame for the next call, or -1 if the data is not
+ * valid. */
+long daapWireDecode(daap_wire_decoder_t *dec, const char *in, size_t len, daap_wire_buf_t *out);
+
+/* Makes room for len more bytes in buf; returns 0 or -1 */
+int daapWireBufReserve(daap_wire_buf_t *buf, size_t len);
+
+#endif /* DAAP_WIRE_H */
@@ -4,50 +4,54 @@
 #include <getopt.h>
 #include <linux/limits.h>
 #include <pcre.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include "daap_log.h"
 #include "daap_log_internal.h"
-
-#define LINE_LEN 512
-#define MAX_TOKENS 1024
-#define MAX_TABLES 10
-#define MAX_HEADERS 10
-#define MAX_COLS 10
-#define MAX_VALS 20
-#define OVECCOUNT 30
-#define MAX_KEY_REGEXES 1000
-
-//table information
-typedef struct {
-  char sep[LINE_LEN]; //the column separator
-  char val_sep[LINE_LEN]; //the value separator
-  int num_headers; //the number of headers before the tables tarts
-  char header_names[MAX_HEADERS][LINE_LEN]; //the headers of the table
-  int cols; //the number of columns
-  char val_names[MAX_VALS][LINE_LEN]; //the value names
-  int num_vals; //number of values
-  int headers_found; //the number of headers found 
-} table_t;
+#include "daap_bundle.h"
+#include "daap_decompress.h"
+#include "daap_parser.h"
+
+#define MAX_FILES 64
+#define READ_CHUNK 65536
+#define MAX_EVENTS 16
+//seconds between retries to open files that do not exist yet
+#define REOPEN_INTERVAL 2
+//smallest chunk of a results file given to a key matching thread
+#define MIN_CHUNK_SIZE (1 << 20)
 
 //Read through the results file and compare the lines to the table
-//template and the key template
-int parseResults(char *key_template_file, char *table_template_file, 
-		 char *results_file);
-//Parse the key template and store the regexps
-int parseKeyTemplate(char *key_template_file, pcre **key_regexes,
-		     int *num_keys);
-//Parse the table template and the tables
-int parseTableTemplate(char *table_template_file, table_t **tables, 
-		       int *num_tables);
+//template and the key template, using up to num_threads threads
+int parseResults(parser_t *parser, char *results_file, int num_threads);
+//Follow growing results files and parse lines as they are appended
+int followResults(parser_t *parser, char **results_files, int num_files,
+		  char *checkpoint_file);
 
 void usage() {
     printf(
-"./stdout_parser (-s || -t) -m -f\n\
+"./stdout_parser (-s || -t || -r) (-m || -b) -f [-d] [-j] [-F [-c]]\n\
+./stdout_parser --compile bundle -m [-d]\n\
    -s: syslog transport \n\
    -t: tcp transport \n\
+   -r: relay transport (through the node's daap_relay) \n\
    -m: key_template file \n\
    -d: table_template file \n\
-   -f: stdout/results file\n\n");
+   -b: template bundle written by --compile, used while the templates it\n\
+       was compiled from are unchanged (default: the templates it names)\n\
+   --compile: compile the templates into a bundle and exit\n\
+   -f: stdout/results file (may be repeated)\n\
+   -j: number of threads used to parse each results file (default: all cpus)\n\
+   -F: follow the results files as they grow (runs until SIGINT/SIGTERM)\n\
+   -c: checkpoint file used by -F to resume without resending data\n\n");
     exit(0);
 }
 
@@ -56,14 +60,28 @@ int main( int argc, char *argv[] ) {
     int ret_val = -1;
     transport transport_type = NONE;
     int options = 0;
+    int follow = 0;
+    int num_files = 0;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+    parser_t parser;
     char key_template_file[PATH_MAX];
     char table_template_file[PATH_MAX];
-    char results_file[PATH_MAX];
+    char checkpoint_file[PATH_MAX];
+    char bundle_file[PATH_MAX];
+    char *compile_file = NULL;
+    char *results_files[MAX_FILES];
+    static struct option long_options[] = {
+        {"compile", required_argument, NULL, 'C'},
+        {NULL, 0, NULL, 0}
+    };
     key_template_file[0] = 0;
     table_template_file[0] = 0;
-    results_file[0] = 0;
+    checkpoint_file[0] = 0;
+    bundle_file[0] = 0;
 
-    while (( options = getopt(argc, argv, "tsm:f:d:")) != -1) {
+    while (( options = getopt_long(argc, argv, "tsrm:f:d:j:Fc:b:",
+                                   long_options, NULL)) != -1) {
         switch(options) {
         case 't':
             transport_type = TCP;
@@ -71,6 +89,9 @@ int main( int argc, char *argv[] ) {
         case 's':
             transport_type = SYSLOG;
             break;
+        case 'r':
+            transport_type = RELAY;
+            break;
         case 'm':
             snprintf(key_template_file, PATH_MAX, "%s", optarg);
             break;
@@ -78,452 +99,914 @@ int main( int argc, char *argv[] ) {
             snprintf(table_template_file, PATH_MAX, "%s", optarg);
             break;
         case 'f':
-            snprintf(results_file, PATH_MAX, "%s", optarg);
+            if (num_files == MAX_FILES) {
+                ERROR_OUTPUT(("Too many results files, max: %d", MAX_FILES));
+                usage();
+            }
+            results_files[num_files++] = optarg;
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+        case 'F':
+            follow = 1;
+            break;
+        case 'c':
+            snprintf(checkpoint_file, PATH_MAX, "%s", optarg);
+            break;
+        case 'b':
+            snprintf(bundle_file, PATH_MAX, "%s", optarg);
+            break;
+        case 'C':
+            compile_file = optarg;
             break;
         default:
             usage();
         }
     }
 
-    if ( transport_type == NONE || key_template_file[0] == 0 || results_file[0] == 0 ) {
+    if (compile_file) {
+        if (key_template_file[0] == 0) {
+            usage();
+        }
+        if (loadTemplates(&parser, key_template_file, table_template_file, NULL) != 0) {
+            return -1;
+        }
+        ret_val = daapBundleWrite(compile_file, &parser.keys, &parser.tables,
+                                  key_template_file, table_template_file);
+        freeTemplates(&parser);
+        if (ret_val == 0) {
+            printf("Wrote template bundle %s\n", compile_file);
+        }
+        return ret_val;
+    }
+
+    if ( transport_type == NONE || (key_template_file[0] == 0 && bundle_file[0] == 0) ||
+         num_files == 0 ) {
         usage();
     }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
 
-    if( (ret_val = daapInit("daap_stdout_parser", log_level, 
-                            DAAP_AGG_OFF, transport_type)) != 0 ) {
+    if( (ret_val = daapInit("daap_stdout_parser", log_level,
+                            DAAP_AGG_MED, transport_type)) != 0 ) {
         return ret_val;
     }
 
-    ret_val = parseResults(key_template_file, table_template_file, results_file);
+    ret_val = loadTemplates(&parser, key_template_file, table_template_file,
+                            bundle_file);
+    //print what is sent
+    parser.echo = 1;
+    if (ret_val == 0) {
+        if (follow) {
+            ret_val = followResults(&parser, results_files, num_files,
+                                    checkpoint_file[0] ? checkpoint_file : NULL);
+        }
+        else {
+            for (i = 0; i < num_files; i++) {
+                ret_val = parseResults(&parser, results_files[i], num_threads);
+            }
+        }
+        freeTemplates(&parser);
+    }
     daapFinalize();
 
     return 0;
 }
 
-//Sends the result to the tcp socket or syslog
-int sendResult(char *key, char *val) {
-    char *result;
-    int res_len;
-    int ret_val;
 
-    if (!key || !val) {
-        return -1;
-    }
-
-    res_len = strlen(key) + strlen(val) + 2;
-    result = calloc(res_len, sizeof(char));
-    snprintf(result, res_len, "%s=%s", key, val); 
-    printf("Sending result: %s\n", result);
-    ret_val = daapLogWrite(result);
-    if (ret_val != 0) {
-        perror("Error in call to daapLogWrite");
-    }
-    free(result);
-    return ret_val;
+//Forget any partially matched or open table in the stream
+static void resetTableState(stream_t *stream) {
+  daapTableStateReset(&stream->table);
 }
 
-//Parse the key template
-int parseKeyTemplate(char *key_template_file, pcre **key_regexes, 
-		       int *num_key_regexes) {
-  char line[LINE_LEN];
-  char *regex_key;
-  pcre *key_regex;
-  FILE *key_template;
-  int line_len = 0;
-  int i;
-  const char *error;
-  int erroffset;
-  int ovector[OVECCOUNT];
-  int rc;
-  pcre *re;
-
-  //stores the number of regexes saved
-  *num_key_regexes = -1;
-  key_template = fopen(key_template_file, "r");
-  if (!key_template) {
-    ERROR_OUTPUT(("Failed to open key template file: %s", key_template_file));
-    return -1;
+
+/*
+ * Parsing a complete results file
+ *
+ * The file is memory-mapped and parsed in two passes. Table matching is
+ * stateful (headers have to be found in order before rows are read), so a
+ * first, sequential pass runs only the table templates and records which
+ * line ranges the tables consumed. The key regexes are independent per
+ * line, so the rest of the file is split at line boundaries into chunks
+ * that worker threads match in parallel. Every result carries the offset of
+ * its line, and the per-chunk results are merged with the table results in
+ * file order before anything is sent.
+ */
+
+//A range of lines [start, end) consumed by the table pass
+typedef struct {
+  off_t start;
+  off_t end;
+} range_t;
+
+//Key matching work for one chunk of the mapped file
+typedef struct {
+  parser_t *parser;
+  const char *base; //start of the mapping
+  off_t start; //chunk start/end offsets, on line boundaries
+  off_t end;
+  range_t *skip; //ranges consumed by the table pass
+  size_t num_skip;
+  results_t results; //results found in the chunk
+  int ret;
+} worker_t;
+
+static void *keyWorker(void *arg) {
+  worker_t *worker = (worker_t *)arg;
+  daap_match_scratch_t scratch;
+  const char *line, *newline;
+  const char *end = worker->base + worker->end;
+  size_t lo = 0, hi = worker->num_skip, mid;
+  off_t offset;
+  int line_len;
+
+  if (daapMatchScratchInit(&scratch, &worker->parser->keys) < 0) {
+    ERROR_OUTPUT(("Failed to allocate key matching scratch space"));
+    worker->ret = -1;
+    return NULL;
   }
 
-  // build the key regexes array
-  //Read the file line by line, compile the regex and store
-  while(fgets(line, LINE_LEN, key_template) != NULL) {
-    if (line[0] == 0) {
-      continue;
+  //first consumed range that ends after the chunk start
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (worker->skip[mid].end <= worker->start) {
+      lo = mid + 1;
     }
-
-    line_len = strlen(line);
-    //Remove trailing new line
-    while(line[line_len-1] == '\n' || line[line_len-1] == '\r') {
-      line[line_len - 1] = '\0';
-      line_len--;
+    else {
+      hi = mid;
     }
+  }
 
-    if (strlen(line) == 0) {
-      continue;
-    }
-    /* based off of: 
-       https://www.ncbi.nlm.nih.gov/IEB/ToolBox/C_DOC/lxr/source/regexp/
-       demo/pcredemo.c */
-    //compile the regexp with pcre
-    re = pcre_compile(line,              /* the pattern */
-		      0,                 /* default options */
-		      &error,            /* for error message */
-		      &erroffset,        /* for error offset */
-		      NULL);             /* use default character tables */
-
-    /* Regex compilation failed */
-    if (re == NULL) {
-      ERROR_OUTPUT(("Failed to compile regex at offset: %d : %s", erroffset, 
-		    error));
+  line = worker->base + worker->start;
+  while (line < end) {
+    offset = line - worker->base;
+    if (lo < worker->num_skip && offset >= worker->skip[lo].start) {
+      if (offset < worker->skip[lo].end) {
+	line = worker->base + worker->skip[lo].end;
+      }
+      lo++;
       continue;
     }
 
-    *num_key_regexes += 1;
-    //save the regexp
-    key_regexes[*num_key_regexes] = re;
+    newline = memchr(line, '\n', end - line);
+    if (!newline) {
+      newline = end;
+    }
+    line_len = newline - line;
+    if (line_len > 0 && line[line_len - 1] == '\r') {
+      line_len--;
+    }
+    matchKeys(worker->parser, &scratch, line, line_len, offset,
+	      &worker->results);
+    line = newline + 1;
   }
 
-  fclose(key_template);
-  return 0; 
+  daapMatchScratchFree(&scratch);
+  worker->ret = 0;
+  return NULL;
 }
 
-int parseTableTemplate(char *table_template_file, table_t **tables, 
-		       int *num_tables) {
-  char line[LINE_LEN];
-  char *template_key;
-  int in_table = 0;
-  table_t *table;
-  int tkey_len = 0;
-  FILE *table_template;
-  int line_len = 0;
-  int i;
-  int vals_found = 0;
-
-  //num_tables stores the number of tables found
-  *num_tables = -1;
-  //open the table template file
-  table_template = fopen(table_template_file, "r");
-  if (!table_template) {
-    ERROR_OUTPUT(("Failed to open table template file: %s", table_template_file));
+//Record a consumed line, merging it with the previous range if adjacent
+static int addRange(range_t **ranges, size_t *num_ranges, size_t *size,
+		    off_t start, off_t end) {
+  range_t *new_ranges;
+
+  if (*num_ranges > 0 && (*ranges)[*num_ranges - 1].end == start) {
+    (*ranges)[*num_ranges - 1].end = end;
+    return 0;
+  }
+  if (*num_ranges == *size) {
+    *size = *size ? *size * 2 : 64;
+    new_ranges = realloc(*ranges, *size * sizeof(range_t));
+    if (!new_ranges) {
+      return -1;
+    }
+    *ranges = new_ranges;
+  }
+  (*ranges)[*num_ranges].start = start;
+  (*ranges)[*num_ranges].end = end;
+  (*num_ranges)++;
+  return 0;
+}
+
+//Parse a mapped results file using up to num_threads key matching threads
+static int parseMapped(parser_t *parser, const char *base, off_t size,
+		       int num_threads) {
+  stream_t stream; //table state for this file
+  results_t table_results, merged;
+  range_t *skip = NULL;
+  size_t num_skip = 0, skip_size = 0;
+  worker_t *workers;
+  pthread_t *threads;
+  const char *p, *newline, *end = base + size;
+  size_t line_len, t, r, k;
+  off_t chunk, start;
+  int num_workers, i, ret = 0;
+
+  memset(&stream, 0, sizeof(stream_t));
+  memset(&table_results, 0, sizeof(results_t));
+  memset(&merged, 0, sizeof(results_t));
+  if (daapTableStateInit(&stream.table, &parser->tables) < 0) {
+    ERROR_OUTPUT(("Failed to allocate table state"));
     return -1;
   }
 
-  // build the tables array
-  while(fgets(line, LINE_LEN, table_template) != NULL) {
-    if (line[0] == 0) {
-      continue;
+  //sequential table pass
+  for (p = base; parser->tables.num_tables > 0 && p < end; p = newline + 1) {
+    newline = memchr(p, '\n', end - p);
+    if (!newline) {
+      newline = end;
     }
-
-    line_len = strlen(line);
-    //Remove trailing new line and trailing spaces
-    while(line[line_len-1] == '\n' || line[line_len-1] == '\r') {
-      line[line_len - 1] = '\0';
+    line_len = newline - p;
+    if (line_len > 0 && p[line_len - 1] == '\r') {
       line_len--;
     }
-    //If we have not found the first ===table===, then we are not in a table def
-    if (!in_table) {
-      template_key = strstr(line, "===table===");
-      //we found the first line in the table def
-      if( template_key != NULL ) {
-	*num_tables += 1;
-	//allocate the table's memory
-	tables[*num_tables] = calloc(1, sizeof(table_t));
-	in_table = 1;
-      }
-      continue;
+
+    if (matchTables(parser, &stream, p, line_len, p - base, &table_results) &&
+	addRange(&skip, &num_skip, &skip_size, p - base,
+		 newline < end ? newline + 1 - base : size) < 0) {
+      ERROR_OUTPUT(("Failed to allocate table ranges"));
+      ret = -1;
+      goto end;
     }
+  }
 
-    //get the current table
-    table = tables[*num_tables];
+  //split the file into chunks on line boundaries
+  num_workers = num_threads;
+  if (size / MIN_CHUNK_SIZE < num_workers) {
+    num_workers = size / MIN_CHUNK_SIZE;
+  }
+  if (num_workers < 1) {
+    num_workers = 1;
+  }
+  workers = calloc(num_workers, sizeof(worker_t));
+  threads = calloc(num_workers, sizeof(pthread_t));
+  if (!workers || !threads) {
+    ERROR_OUTPUT(("Failed to allocate key matching workers"));
+    free(workers);
+    free(threads);
+    ret = -1;
+    goto end;
+  }
 
-    //go through the table template to find all of the information
-    //find the table_sep= line for the column seperator (e.g., |)
-    template_key = strstr(line, "table_sep=");
-    if ( template_key != NULL ) {
-      tkey_len = 10;
-      strncpy(table->sep, line+tkey_len, line_len-tkey_len);
+  chunk = size / num_workers;
+  start = 0;
+  for (i = 0; i < num_workers; i++) {
+    workers[i].parser = parser;
+    workers[i].base = base;
+    workers[i].skip = skip;
+    workers[i].num_skip = num_skip;
+    workers[i].start = start;
+    if (i == num_workers - 1) {
+      workers[i].end = size;
+    }
+    else {
+      newline = memchr(base + start + chunk, '\n', size - start - chunk);
+      workers[i].end = newline ? newline + 1 - base : size;
     }
+    start = workers[i].end;
+  }
 
-    //find the header= line for each header in the table
-    template_key = strstr(line, "header=");
-    if ( template_key != NULL && table->num_headers < MAX_HEADERS) {
-      tkey_len = 7;
-      strncpy(table->header_names[table->num_headers], line+tkey_len, line_len-tkey_len);
-      table->num_headers++;
+  //the calling thread takes the first chunk
+  for (i = 1; i < num_workers; i++) {
+    if (pthread_create(&threads[i], NULL, keyWorker, &workers[i]) != 0) {
+      //run it here instead
+      keyWorker(&workers[i]);
+      threads[i] = 0;
     }
-    
-    //find the val_name= line for the name of each column value
-    template_key = strstr(line, "val_name=");
-    if ( template_key != NULL && vals_found < MAX_VALS ) {
-      tkey_len = 9;
-      strncpy(table->val_names[vals_found], line+tkey_len, line_len-tkey_len);
-      vals_found++;
+  }
+  keyWorker(&workers[0]);
+  for (i = 0; i < num_workers; i++) {
+    if (i > 0 && threads[i]) {
+      pthread_join(threads[i], NULL);
     }
+    if (workers[i].ret < 0) {
+      ret = -1;
+    }
+  }
 
-    //find the cols= line for the number of columns in the table
-    template_key = strstr(line, "cols=");
-    if ( template_key != NULL ) {
-      tkey_len = 5;
-      table->cols = atoi(line+tkey_len);
+  //merge the chunk results (in chunk order) with the table results
+  r = 0;
+  for (i = 0; i < num_workers; i++) {
+    for (k = 0; k < workers[i].results.num; k++) {
+      while (r < table_results.num &&
+	     table_results.results[r].offset < workers[i].results.results[k].offset) {
+	moveResult(&merged, &table_results.results[r++]);
+      }
+      moveResult(&merged, &workers[i].results.results[k]);
     }
+    workers[i].results.num = 0;
+    freeResults(&workers[i].results);
+  }
+  for (t = r; t < table_results.num; t++) {
+    moveResult(&merged, &table_results.results[t]);
+  }
+  table_results.num = 0;
+
+  sendResults(parser, &merged);
+  free(workers);
+  free(threads);
+
+ end:
+  freeResults(&table_results);
+  freeResults(&merged);
+  free(skip);
+  daapTableStateFree(&stream.table);
+  return ret;
+}
 
-    //find the num_vals= line for the number of column values per row
-    template_key = strstr(line, "num_vals=");
-    if ( template_key != NULL ) {
-      tkey_len = 9;
-      table->num_vals = atoi(line+tkey_len);
+//Parse a results file that can't be mapped (a pipe, for instance) or that
+//is compressed. prefix holds bytes already read from fd; when decomp is
+//set, the data comes from the decompression thread instead of fd.
+static int parseUnmapped(parser_t *parser, int fd, daap_decomp_t *decomp,
+			 const char *prefix, size_t prefix_len) {
+  stream_t stream;
+  ssize_t count;
+  char *new_buf;
+  int ret = 0;
+
+  memset(&stream, 0, sizeof(stream_t));
+  if (daapTableStateInit(&stream.table, &parser->tables) < 0) {
+    ERROR_OUTPUT(("Failed to allocate table state"));
+    return -1;
+  }
+  stream.fd = fd;
+
+  if (!decomp && prefix_len > 0) {
+    stream.buf = malloc(prefix_len + READ_CHUNK + 1);
+    if (!stream.buf) {
+      ERROR_OUTPUT(("Failed to allocate read buffer"));
+      daapTableStateFree(&stream.table);
+      return -1;
     }
+    stream.buf_size = prefix_len + READ_CHUNK + 1;
+    memcpy(stream.buf, prefix, prefix_len);
+    stream.buf_len = stream.offset = prefix_len;
+  }
 
-    //find the val_sep= for the seperator between column values (e.g., space)
-    template_key = strstr(line, "val_sep=");
-    if ( template_key != NULL ) {
-      tkey_len = 8;
-      strncpy(table->val_sep, line+tkey_len, line_len-tkey_len);
+  while (1) {
+    if (stream.buf_size - stream.buf_len < READ_CHUNK + 1) {
+      new_buf = realloc(stream.buf, stream.buf_len + READ_CHUNK + 1);
+      if (!new_buf) {
+	ERROR_OUTPUT(("Failed to grow read buffer"));
+	break;
+      }
+      stream.buf = new_buf;
+      stream.buf_size = stream.buf_len + READ_CHUNK + 1;
     }
 
-    if (in_table) {
-      //Find the end of the table
-      template_key = strstr(line, "===end_table===");
-      if( template_key != NULL ) {
-	in_table = 0;
+    if (decomp) {
+      //the lines of one buffer are matched while the next is decompressed
+      count = daapDecompRead(decomp, stream.buf + stream.buf_len, READ_CHUNK);
+      if (count < 0) {
+	ret = -1;
+      }
+    }
+    else {
+      count = read(fd, stream.buf + stream.buf_len, READ_CHUNK);
+      if (count < 0 && errno == EINTR) {
+	continue;
       }
     }
+    if (count <= 0) {
+      break;
+    }
+    stream.offset += count;
+    stream.buf_len += count;
+    parseStreamBuffer(parser, &stream, 0);
   }
+  parseStreamBuffer(parser, &stream, 1);
 
-  fclose(table_template);
-  return 0; 
+  free(stream.buf);
+  daapTableStateFree(&stream.table);
+  return ret;
+}
+
+//Read up to len bytes from the start of fd (without moving the offset of
+//a regular file)
+static ssize_t readMagic(int fd, int regular, unsigned char *magic, size_t len) {
+  ssize_t count;
+  size_t total = 0;
+
+  while (total < len) {
+    if (regular) {
+      count = pread(fd, magic + total, len - total, total);
+    }
+    else {
+      count = read(fd, magic + total, len - total);
+    }
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0) {
+      return -1;
+    }
+    if (count == 0) {
+      break;
+    }
+    total += count;
+  }
+  return total;
+}
+
+//Parse a compressed results file through a decompression thread
+static int parseCompressed(parser_t *parser, int fd, int format, int regular,
+			   const unsigned char *magic, size_t magic_len) {
+  daap_decomp_t decomp;
+  int ret;
+
+  //a regular file is read again from the start, a pipe continues after the magic
+  if (daapDecompStart(&decomp, fd, format, (const char *)magic,
+		      regular ? 0 : magic_len) < 0) {
+    return -1;
+  }
+  ret = parseUnmapped(parser, fd, &decomp, NULL, 0);
+  daapDecompStop(&decomp);
+  return ret;
 }
 
 /* Go through each line in the results file. Compare each line in the results
    with the table templates and the key regexes saved */
-int parseResults(char *key_template_file, char *table_template_file, 
-		 char *results_file) {
-  FILE *results; //results file
-  char line[LINE_LEN]; //line read
-  int line_len; //length of the line
-  pcre **key_regexes; //regexes stored and compiled
-  pcre *key_regex; //current regex
-  table_t **tables; //tables stored
-  int num_tables = 0; //num tables stored
-  int num_key_regexes = 0; //num regexes stored
-  int i = 0, j =0;
+int parseResults(parser_t *parser, char *results_file, int num_threads) {
+  struct stat st;
+  unsigned char magic[DAAP_DECOMP_MAGIC_LEN];
+  ssize_t magic_len;
+  void *map;
+  int fd;
   int ret;
-  char *columns_token, *val_token; //current column and val token
-  char *table_header; //current header of the table being compared
-  int in_table; //wether we are in a table
-  table_t *table; //current table
-  char columns[MAX_COLS][LINE_LEN]; //the column tokens found from the table
-  char *key_start; //key start in the regexp
-  int key_length; //key length
-  char *key_to_send; //key to send to daap transport
-  char *val_start; //val start in the regexp
-  int val_length; // val length
-  char *val_to_send; //val to send to daap transport
-  int ovector[OVECCOUNT]; //for the regexp matches
-  char *skip; //if _skip in the column value's name, skip the value
-  int val_found; //number of column values found in the table
-  char *val_name; //the current column value's name
+  int regular, format;
 
   //open the results file
-  results = fopen(results_file, "r");
-  if (!results) {
+  fd = open(results_file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
     ERROR_OUTPUT(("Failed to open results file: %s", results_file));
     return -1;
   }
-  
-  //allocate table and regexes arrays
-  tables = malloc(sizeof(table_t *) * MAX_TABLES);
-  key_regexes = malloc(sizeof(pcre *) * MAX_KEY_REGEXES);
-  //parse the table template and store the results in tables
-  ret = parseTableTemplate(table_template_file, tables, &num_tables);
-  if (ret < 0) {
-    ERROR_OUTPUT(("Failed to parse table template file: %s", table_template_file));
+  regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+  //compressed files are recognized by their magic number, not their name
+  magic_len = readMagic(fd, regular, magic, sizeof(magic));
+  if (magic_len < 0) {
+    ERROR_OUTPUT(("Failed to read results file: %s", results_file));
+    close(fd);
+    return -1;
+  }
+  format = daapDecompFormat(magic, magic_len);
+  if (format != DAAP_DECOMP_NONE) {
+    DEBUG_OUTPUT(("Reading %s compressed results file %s",
+		  daapDecompName(format), results_file));
+    ret = parseCompressed(parser, fd, format, regular, magic, magic_len);
+    close(fd);
+    return ret;
+  }
+
+  if (!regular || st.st_size == 0) {
+    ret = parseUnmapped(parser, fd, NULL, (const char *)magic,
+			regular ? 0 : magic_len);
+    close(fd);
+    return ret;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    ret = parseUnmapped(parser, fd, NULL, NULL, 0);
+    close(fd);
+    return ret;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  ret = parseMapped(parser, (const char *)map, st.st_size, num_threads);
+
+  munmap(map, st.st_size);
+  close(fd);
+  return ret;
+}
+
+/*
+ * Follow mode
+ *
+ * Every results file is tailed from a single epoll loop. inotify tells us
+ * when a file grows, is truncated, or is moved/deleted (log rotation), and
+ * the directory watch tells us when a file with the followed name shows up
+ * again. Only complete lines are parsed; a trailing partial line is kept
+ * until the rest of it is written.
+ *
+ * After every batch of lines the byte offset of the last line whose records
+ * were sent is written to the checkpoint file (if one was given), together
+ * with the device and inode of the file, so that a restarted parser resumes
+ * exactly where the previous one stopped instead of resending data. Lines
+ * whose records could not be sent are read again on the next event or
+ * timer tick, and the checkpoint does not move past them. The checkpoint
+ * is discarded for a file whose inode changed (rotated while we were down)
+ * or that is now shorter than the checkpointed offset (truncated). As with
+ * tail -F, a truncation is only noticed if the file is still shorter than
+ * our offset when we get to read it.
+ */
+
+//offset of the last line whose records were sent
+static off_t streamCheckpointOffset(stream_t *stream) {
+  return stream->sent;
+}
+
+//Write the offsets of every stream to the checkpoint file atomically
+static int writeCheckpoint(char *checkpoint_file, stream_t *streams,
+			   int num_streams) {
+  char tmp_file[PATH_MAX + 8];
+  FILE *fp;
+  int i;
+
+  if (!checkpoint_file) {
+    return 0;
+  }
+
+  snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", checkpoint_file);
+  fp = fopen(tmp_file, "w");
+  if (!fp) {
+    ERROR_OUTPUT(("Failed to open checkpoint file: %s", tmp_file));
+    return -1;
+  }
+
+  for (i = 0; i < num_streams; i++) {
+    if (streams[i].ino == 0) {
+      continue;
+    }
+    fprintf(fp, "%lu %lu %lld %s\n", (unsigned long)streams[i].dev,
+	    (unsigned long)streams[i].ino,
+	    (long long)streamCheckpointOffset(&streams[i]), streams[i].path);
+  }
+
+  if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+    ERROR_OUTPUT(("Failed to write checkpoint file: %s", tmp_file));
+    fclose(fp);
     return -1;
   }
-  
-  //parse the key template regexes and store the results in key_regexes
-  ret = parseKeyTemplate(key_template_file, key_regexes, &num_key_regexes);
-  if (ret < 0) {
-    ERROR_OUTPUT(("Failed to parse key template file: %s", key_template_file));
+  fclose(fp);
+
+  if (rename(tmp_file, checkpoint_file) != 0) {
+    ERROR_OUTPUT(("Failed to rename checkpoint file: %s", tmp_file));
     return -1;
   }
-  
-  in_table = 0;
-  table = NULL;
-  key_regex = NULL;
+  return 0;
+}
 
-  // examine each line in results file
-  while(fgets(line, LINE_LEN, results)) {
-    //remove new line chars
-    while(line[line_len-1] == '\n' || line[line_len-1] == '\r') {
-      line[line_len - 1] = '\0';
-      line_len--;
+//Read the checkpoint file and set the saved dev/ino/offset of each stream
+static void readCheckpoint(char *checkpoint_file, stream_t *streams,
+			   int num_streams) {
+  FILE *fp;
+  char path[PATH_MAX];
+  unsigned long dev, ino;
+  long long offset;
+  int i;
+
+  if (!checkpoint_file) {
+    return;
+  }
+
+  fp = fopen(checkpoint_file, "r");
+  if (!fp) {
+    return;
+  }
+
+  while (fscanf(fp, "%lu %lu %lld %4095[^\n]", &dev, &ino, &offset, path) == 4) {
+    for (i = 0; i < num_streams; i++) {
+      if (strcmp(streams[i].path, path) == 0) {
+	streams[i].dev = (dev_t)dev;
+	streams[i].ino = (ino_t)ino;
+	streams[i].offset = streams[i].sent = (off_t)offset;
+      }
     }
-    
-    /* for each table found in the template, compare the headers with the
-      current result file line */
-    for (i = 0; i <= num_tables && (!table || 
-				    (table && !in_table)); 
-	 i++) {
-      table = tables[i];
-      table_header = NULL;
-      table_header = strstr(line, table->header_names[table->headers_found]);
-      if (table_header != NULL) {
-	table->headers_found++;
-	break;
+  }
+  fclose(fp);
+}
+
+//Read everything appended since the last read and parse the complete lines
+static int readStream(parser_t *parser, stream_t *stream) {
+  struct stat st;
+  ssize_t count;
+  char *new_buf;
+  int lines = 0;
+
+  if (stream->fd < 0) {
+    return 0;
+  }
+
+  if (fstat(stream->fd, &st) == 0 && st.st_size < stream->offset) {
+    ERROR_OUTPUT(("Results file truncated, restarting at offset 0: %s",
+		  stream->path));
+    stream->offset = stream->sent = 0;
+    stream->buf_len = 0;
+    resetTableState(stream);
+  }
+
+  while (1) {
+    //keep room for a chunk and the terminating null of the last line
+    if (stream->buf_size - stream->buf_len < READ_CHUNK + 1) {
+      new_buf = realloc(stream->buf, stream->buf_len + READ_CHUNK + 1);
+      if (!new_buf) {
+	ERROR_OUTPUT(("Failed to grow read buffer for: %s", stream->path));
+	return -1;
       }
+      stream->buf = new_buf;
+      stream->buf_size = stream->buf_len + READ_CHUNK + 1;
     }
-    
-    //if we haven't found any headers, then we aren't going through a table
-    if (table && table->headers_found == 0) {
-      table = NULL;
+
+    count = pread(stream->fd, stream->buf + stream->buf_len, READ_CHUNK,
+		  stream->offset);
+    if (count < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      ERROR_OUTPUT(("Failed to read results file: %s", stream->path));
+      return -1;
     }
-    
-    //if we have matched headers, then we are going through a table
-    if (table && !in_table && table->headers_found == table->num_headers) {
-      in_table = 1;
-      continue;
+    if (count == 0) {
+      break;
     }
-    
-    /*if we have a table saved in the table pointer, but in_table is not 1, 
-      then we haven't found all of the headers yet*/
-    if (table && !in_table) {
-      continue;
+
+    stream->offset += count;
+    stream->buf_len += count;
+    lines += parseStreamBuffer(parser, stream, 0);
+    if (stream->sent != stream->offset - (off_t)stream->buf_len) {
+      //read the lines again later rather than skip their records
+      ERROR_OUTPUT(("Failed to send records, rereading from offset %lld: %s",
+		    (long long)stream->sent, stream->path));
+      stream->offset = stream->sent;
+      stream->buf_len = 0;
+      resetTableState(stream);
+      return -1;
     }
-    
-    columns_token = NULL;
-    val_token = NULL;
-    //We are reading a table from the results file, so we need to find the values
-    if (in_table) {
-      //split the table into column tokens by the column seperator
-      columns_token = strstr(line, table->sep);
-      //if we didn't find a column, then we aren't in a table
-      if (!columns_token) {
-	in_table = 0;
-	table->headers_found = 0;
-	table = NULL;
-	goto rest;
-      }
+  }
 
-      //We have columns
-      columns_token = strtok(line, table->sep);
-      i = 0;
-      //iterate through each column
-      while ( columns_token != NULL) {
-	//copy the column to the columns array
-	strcpy(columns[i], columns_token);
-	columns[i][strlen(columns_token)-1] = '\0';
-	i++;
-	columns_token = strtok(NULL, table->sep);
-      }
+  return lines;
+}
 
-      //now that we have the columns, find the column values for each row
-      val_found = 0;
-      for (i=0; i < table->cols; i++) {
-	//split each column value by the value seperator
-	val_token = strstr(columns[i], table->val_sep);
-	if (!val_token) {
-	  continue;
-	}
-	
-	//get all of the column values per row
-	val_token = strtok(columns[i], table->val_sep);
-	while (val_token != NULL) {
-	  val_name = table->val_names[val_found];
-	  //skip this column if "_skip" is in the name
-	  skip = strstr(val_name, "_skip");
-	  if (skip) {
-	    val_found++;
-	    //Go to the next value
-	    val_token = strtok(NULL, table->val_sep);
-	    continue;
-	  }
-	  
-	  //this is a value we want so send it
-	  sendResult(val_name, val_token);
-	  val_found += 1;
-	  val_token = strtok(NULL, table->val_sep);
-	}
+//Open the results file of a stream, resuming at the checkpointed offset
+static int openStream(int inotify_fd, stream_t *stream) {
+  struct stat st;
+
+  stream->fd = open(stream->path, O_RDONLY | O_CLOEXEC);
+  if (stream->fd < 0) {
+    return -1;
+  }
+
+  if (fstat(stream->fd, &st) != 0) {
+    close(stream->fd);
+    stream->fd = -1;
+    return -1;
+  }
+
+  //a different file or one shorter than our offset starts over
+  if (st.st_dev != stream->dev || st.st_ino != stream->ino ||
+      st.st_size < stream->offset) {
+    stream->offset = 0;
+  }
+  stream->sent = stream->offset;
+  stream->dev = st.st_dev;
+  stream->ino = st.st_ino;
+  stream->buf_len = 0;
+  resetTableState(stream);
+
+  stream->wd = inotify_add_watch(inotify_fd, stream->path,
+				 IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF |
+				 IN_ATTRIB);
+  if (stream->wd < 0) {
+    ERROR_OUTPUT(("Failed to watch results file: %s", stream->path));
+  }
+
+  DEBUG_OUTPUT(("Following %s from offset %lld", stream->path,
+		(long long)stream->offset));
+  return 0;
+}
+
+//Finish the old file of a stream after it was rotated or deleted
+static void closeStream(parser_t *parser, int inotify_fd, stream_t *stream) {
+  if (stream->fd < 0) {
+    return;
+  }
+
+  //whatever was written before the rotation still belongs to the old file
+  readStream(parser, stream);
+  parseStreamBuffer(parser, stream, 1);
+
+  if (stream->wd >= 0) {
+    inotify_rm_watch(inotify_fd, stream->wd);
+  }
+  close(stream->fd);
+  stream->fd = -1;
+  stream->wd = -1;
+}
+
+//The file name part of the path of a stream
+static char *streamFileName(stream_t *stream) {
+  char *name = strrchr(stream->path, '/');
+  return name ? name + 1 : stream->path;
+}
+
+//Store the absolute path of a results file, which may not exist yet
+static void streamSetPath(stream_t *stream, char *results_file) {
+  char dir[PATH_MAX];
+  char name[PATH_MAX];
+  char real_dir[PATH_MAX];
+
+  if (realpath(results_file, stream->path)) {
+    return;
+  }
+
+  snprintf(dir, PATH_MAX, "%s", results_file);
+  snprintf(name, PATH_MAX, "%s", results_file);
+  //a path too long once made absolute is kept as given
+  if (realpath(dirname(dir), real_dir) &&
+      snprintf(stream->path, PATH_MAX, "%s/%s", real_dir, basename(name)) < PATH_MAX) {
+    return;
+  }
+  snprintf(stream->path, PATH_MAX, "%s", results_file);
+}
+
+//Returns whether the open file of a stream still is the file at its path
+static int streamIsCurrent(stream_t *stream) {
+  struct stat st;
+
+  if (stat(stream->path, &st) != 0) {
+    return 0;
+  }
+  return st.st_dev == stream->dev && st.st_ino == stream->ino;
+}
+
+int followResults(parser_t *parser, char **results_files, int num_files,
+		  char *checkpoint_file) {
+  stream_t *streams;
+  struct epoll_event ev, events[MAX_EVENTS];
+  struct itimerspec timer;
+  struct inotify_event *event;
+  struct signalfd_siginfo siginfo;
+  char event_buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  char dir[PATH_MAX];
+  sigset_t mask;
+  uint64_t expirations;
+  ssize_t len;
+  char *ptr;
+  int inotify_fd = -1, epoll_fd = -1, signal_fd = -1, timer_fd = -1;
+  int running = 1;
+  int ret = 0;
+  int dirty, nfds;
+  int i, n;
+
+  streams = calloc(num_files, sizeof(stream_t));
+  if (!streams) {
+    ERROR_OUTPUT(("Failed to allocate results streams"));
+    return -1;
+  }
+
+  for (i = 0; i < num_files; i++) {
+    streamSetPath(&streams[i], results_files[i]);
+    streams[i].fd = -1;
+    streams[i].wd = -1;
+    streams[i].dir_wd = -1;
+    if (daapTableStateInit(&streams[i].table, &parser->tables) < 0) {
+      ERROR_OUTPUT(("Failed to allocate table state"));
+      while (i-- > 0) {
+	daapTableStateFree(&streams[i].table);
       }
+      free(streams);
+      return -1;
     }
-      
-    if (in_table) {
-      continue;
+  }
+  readCheckpoint(checkpoint_file, streams, num_files);
+
+  //stop cleanly on SIGINT/SIGTERM so the last checkpoint is written
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (inotify_fd < 0 || epoll_fd < 0 || signal_fd < 0 || timer_fd < 0) {
+    ERROR_OUTPUT(("Failed to set up the follow event loop: %s", strerror(errno)));
+    ret = -1;
+    goto cleanup;
+  }
+
+  //the timer retries files that do not exist yet and records not sent
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value.tv_sec = REOPEN_INTERVAL;
+  timer.it_interval.tv_sec = REOPEN_INTERVAL;
+  timerfd_settime(timer_fd, 0, &timer, NULL);
+
+  ev.events = EPOLLIN;
+  ev.data.fd = inotify_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev);
+  ev.data.fd = signal_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+  ev.data.fd = timer_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+  for (i = 0; i < num_files; i++) {
+    //watch the directory so that recreated (rotated) files are noticed
+    snprintf(dir, PATH_MAX, "%s", streams[i].path);
+    streams[i].dir_wd = inotify_add_watch(inotify_fd, dirname(dir),
+					  IN_CREATE | IN_MOVED_TO);
+    if (streams[i].dir_wd < 0) {
+      ERROR_OUTPUT(("Failed to watch directory of: %s", streams[i].path));
+    }
+    if (openStream(inotify_fd, &streams[i]) == 0) {
+      readStream(parser, &streams[i]);
     }
+  }
+  writeCheckpoint(checkpoint_file, streams, num_files);
 
-  rest:
-    /* Loop over key regexps and compare the line to each one
-       We do want to compare multiple regexes to each line for the
-       case when there are multiple key/value pairs per line */
-    for( i = 0; i <= num_key_regexes; i++) {
-      key_regex = key_regexes[i];
-      ret = pcre_exec(key_regex,                /* the compiled pattern */
-		      NULL,                     /* no extra data - we didn't study the pattern */
-		      line,                     /* the subject string */
-		      (int)strlen(line),        /* the length of the subject */
-		      0,                        /* start at offset 0 in the subject */
-		      0,                        /* default options */
-		      ovector,                  /* output vector for substring information */
-		      OVECCOUNT);               /* number of elements in the output vector */
-      
-      /* Matching failed */
-      if ( ret < 0 ) {
+  while (running) {
+    nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (nfds < 0) {
+      if (errno == EINTR) {
 	continue;
       }
-      
-      /* Matching succeded */
-      
-      /*The output vector wasn't large enough */
-      if ( ret == 0 ) {
-	ERROR_OUTPUT(("Output vector wasn't large enough for number of matches: %d\n", 
-		      OVECCOUNT/3 - 1));
+      ERROR_OUTPUT(("epoll_wait failed: %s", strerror(errno)));
+      ret = -1;
+      break;
+    }
+
+    dirty = 0;
+    for (n = 0; n < nfds; n++) {
+      if (events[n].data.fd == signal_fd) {
+	while (read(signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo)) {
+	  running = 0;
+	}
       }
-      
-      /* Show substrings stored in the output vector */
-      for ( j = 0; j < ret; j++ ) {
-	//the first match is the whole line, so skip it
-	if ( j == 0 ) {
-	  continue;
+      else if (events[n].data.fd == timer_fd) {
+	while (read(timer_fd, &expirations, sizeof(expirations)) > 0);
+	for (i = 0; i < num_files; i++) {
+	  if (streams[i].fd >= 0) {
+	    dirty += readStream(parser, &streams[i]) > 0;
+	  }
+	  else if (openStream(inotify_fd, &streams[i]) == 0) {
+	    dirty += readStream(parser, &streams[i]) >= 0;
+	  }
 	}
-	
-	/* We expect a key/value pair. If we don't have a value, but
-	   only a key, then continue/quit the loop
-	 */
-	if ( j+1 >= ret ) {
-	  continue;
+      }
+      else if (events[n].data.fd == inotify_fd) {
+	while ((len = read(inotify_fd, event_buf, sizeof(event_buf))) > 0) {
+	  for (ptr = event_buf; ptr < event_buf + len;
+	       ptr += sizeof(struct inotify_event) + event->len) {
+	    event = (struct inotify_event *)ptr;
+	    for (i = 0; i < num_files; i++) {
+	      if (event->wd == streams[i].wd) {
+		if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+		  //rotated away or deleted; finish it and reopen the path
+		  closeStream(parser, inotify_fd, &streams[i]);
+		  if (openStream(inotify_fd, &streams[i]) == 0) {
+		    readStream(parser, &streams[i]);
+		  }
+		}
+		else {
+		  readStream(parser, &streams[i]);
+		}
+		dirty = 1;
+	      }
+	      else if (event->wd == streams[i].dir_wd && event->len > 0 &&
+		       strcmp(event->name, streamFileName(&streams[i])) == 0) {
+		//a new file took the followed name
+		if (streams[i].fd >= 0 && !streamIsCurrent(&streams[i])) {
+		  closeStream(parser, inotify_fd, &streams[i]);
+		}
+		if (streams[i].fd < 0 && openStream(inotify_fd, &streams[i]) == 0) {
+		  readStream(parser, &streams[i]);
+		}
+		dirty = 1;
+	      }
+	    }
+	  }
 	}
-	
-	//Get the key and value matches from the regex
-	key_start = line + ovector[2*j];
-	key_length = ovector[2*j+1] - ovector[2*j];
-	j++;
-	val_start = line + ovector[2*j];
-	val_length = ovector[2*j+1] - ovector[2*j];
-	//allocate and copy the key and value
-	key_to_send = calloc(key_length + 1, sizeof(char));
-	strncpy(key_to_send, key_start, key_length);
-	val_to_send = calloc(val_length + 1, sizeof(char));
-	strncpy(val_to_send, val_start, val_length);
-	//send the key and value
-	sendResult(key_to_send, val_to_send);
-	free(key_to_send);
-	free(val_to_send);
       }
     }
+
+    if (dirty) {
+      writeCheckpoint(checkpoint_file, streams, num_files);
+    }
   }
-  
-  //cleanup memory
-  for (i=0; i < num_key_regexes+1; i++) {
-    free(key_regexes[i]);
+
+  //pick up anything written since the last event before exiting
+  for (i = 0; i < num_files; i++) {
+    readStream(parser, &streams[i]);
   }
-  
-  for (i=0; i < num_tables+1; i++) {
-    free(tables[i]);
+  writeCheckpoint(checkpoint_file, streams, num_files);
+
+ cleanup:
+  for (i = 0; i < num_files; i++) {
+    if (streams[i].fd >= 0) {
+      close(streams[i].fd);
+    }
+    free(streams[i].buf);
+    daapTableStateFree(&streams[i].table);
   }
-  
-  free(key_regexes);
-  free(tables);
-  fclose(results);
-  return 0;
+  free(streams);
+  if (inotify_fd >= 0) close(inotify_fd);
+  if (epoll_fd >= 0) close(epoll_fd);
+  if (signal_fd >= 0) close(signal_fd);
+  if (timer_fd >= 0) close(timer_fd);
+  return ret;
 }
@@ -0,0 +1,143 @@
+/*
+ * Tests of deferred formatting: messages logged through daapLogDeferred()
+ * come out as snprintf() would have formatted them at the call, whatever
+ * the conversions, and read back from the journal once the background
+ * thread has sent them
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "daap_log.h"
+#include "daap_escape.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                             \
+    do {                                             \
+        if (!(cond)) {                               \
+            fprintf(stderr, "FAILED: " __VA_ARGS__); \
+            fprintf(stderr, "\n");                   \
+            failures++;                              \
+        }                                            \
+    } while (0)
+
+#define MAX_MESSAGES 32
+#define MESSAGE_LEN 256
+/* how long the background thread is given to send the messages */
+#define WAIT_MS 5000
+
+static daap_log_site_t sites[MAX_MESSAGES];
+static char expected[MAX_MESSAGES][MESSAGE_LEN];
+static int num_expected = 0;
+
+/* Logs a message at site i, and what snprintf() makes of it */
+#define TRY(i, ...)                                                         \
+    do {                                                                    \
+        daapLogDeferred(&sites[i], __VA_ARGS__);                            \
+        snprintf(expected[num_expected++], MESSAGE_LEN, __VA_ARGS__);       \
+    } while (0)
+
+static void logMessages(void) {
+    char changed[16] = "before";
+    int i;
+
+    TRY(0, "no conversions");
+    TRY(1, "int %d %i %u %x %X %o %+d % d %05d", -5, 7, 4000000000u, 255, 255, 8, 3, 4, 42);
+    TRY(2, "small %c%c %hhd %hhu %hd %hu", 'o', 'k', (signed char)-3, (unsigned char)250,
+        (short)-300, (unsigned short)65000);
+    TRY(3, "long %ld %lu %lld %llx %zu %zd %jd %td", -1234567890123L, 1234567890123UL,
+        -9000000000000000000LL, 0xdeadbeefcafeULL, (size_t)12345, (ssize_t)-12345,
+        (intmax_t)-77, (ptrdiff_t)-88);
+    TRY(4, "float %f %.2f %e %g %10.3f|%-8.1f| %a", 1.5, 3.14159, 12345.678, 0.0001, -2.5, 9.25,
+        0.75);
+    TRY(5, "long double %Lf %.3Lg", 1.5L, 2.0L / 3);
+    TRY(6, "string %s [%.3s] [%10s] [%-6s]", "abc", "truncate", "right", "left");
+    TRY(7, "star [%*d] [%-*d] [%.*f] [%.*s]", 6, 42, 4, 7, 2, 3.14159, 2, "xyz");
+    TRY(8, "pointer %p", (void *)0x1234);
+    TRY(9, "percent 100%% done, %d%%", 50);
+    TRY(10, "mixed %s=%d %s=%.1f %c", "a", 1, "b", 2.5, '!');
+    TRY(11, "quote \" backslash \\ newline\n %s", "tab\there");
+
+    /* a string argument is copied at the call */
+    TRY(12, "copied %s", changed);
+    strcpy(changed, "after!");
+
+    /* one site called several times */
+    for (i = 0; i < 3; i++) {
+        TRY(13, "loop %d of %s", i, "three");
+    }
+
+    /* formatted at the call: a positional argument, and a site given
+     * another format than at its first call */
+    TRY(14, "positional %2$s %1$d", 1, "two");
+    TRY(15, "first format %d", 1);
+    TRY(15, "second format %s", "x");
+}
+
+/* Whether the journal has the message as a record */
+static int logged(const char *message) {
+    char escaped[2 * MESSAGE_LEN + 16], *rows[4];
+    size_t len;
+    int n, i, found = 0;
+
+    len = strlen("message=\"");
+    memcpy(escaped, "message=\"", len);
+    len += daapEscape(escaped + len, message, strlen(message), DAAP_ESCAPE_STRING);
+    memcpy(escaped + len, "\"", 2);
+
+    n = daapLogRead(daapLogKey(message), 0, 4, rows);
+    for (i = 0; i < n; i++) {
+        found |= strstr(rows[i], escaped) != NULL;
+        free(rows[i]);
+    }
+    return found;
+}
+
+int main(void) {
+    char dir[] = "/tmp/test_defer.XXXXXX";
+    int i, waited, missing = 0;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    /* the records go nowhere, and are read back from the journal */
+    setenv("DAAP_JOURNAL", dir, 1);
+    setenv("DAAP_ENDPOINTS", "127.0.0.1:1", 1);
+    setenv("DAAP_DECOUPLE", "1", 1);
+    if (daapInit("test_defer", LOG_NOTICE, DAAP_AGG_OFF, TCP) != 0) {
+        fprintf(stderr, "FAILED: daapInit\n");
+        rmdir(dir);
+        return 1;
+    }
+
+    logMessages();
+    CHECK(sites[0].id > 0 && sites[7].id > 0 && sites[13].id > 0, "sites not deferred");
+    CHECK(sites[14].id == -1, "a positional argument was deferred");
+
+    for (waited = 0; waited < WAIT_MS; waited += 50) {
+        for (missing = 0, i = 0; i < num_expected; i++) {
+            missing += !logged(expected[i]);
+        }
+        if (missing == 0) {
+            break;
+        }
+        usleep(50000);
+    }
+    for (i = 0; i < num_expected && missing > 0; i++) {
+        CHECK(logged(expected[i]), "not logged: %s", expected[i]);
+    }
+
+    daapFinalize();
+    rmdir(dir);
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
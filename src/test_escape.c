@@ -0,0 +1,107 @@
+/*
+ * Tests of line protocol escaping: the vectorized copy of daapEscape()
+ * against a byte by byte escape, for strings of every length up to a few
+ * blocks, with special characters anywhere in them
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daap_escape.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                             \
+    do {                                             \
+        if (!(cond)) {                               \
+            fprintf(stderr, "FAILED: " __VA_ARGS__); \
+            fprintf(stderr, "\n");                   \
+            failures++;                              \
+        }                                            \
+    } while (0)
+
+#define MAX_LEN 200
+
+/* The escape as documented, one byte at a time */
+static size_t escapeScalar(char *dst, const char *src, size_t len, int kind) {
+    const char *special = kind == DAAP_ESCAPE_KEY ? ",= \\\n\r" : "\"\\\n\r";
+    size_t i, out = 0;
+
+    for (i = 0; i < len; i++) {
+        if (src[i] != '\0' && strchr(special, src[i])) {
+            dst[out++] = '\\';
+            dst[out++] = src[i] == '\n' ? 'n' : src[i] == '\r' ? 'r' : src[i];
+        }
+        else {
+            dst[out++] = src[i];
+        }
+    }
+    return out;
+}
+
+/* A string of len bytes with a special character (of either kind) every
+ * spacing bytes on average, none if spacing is 0 */
+static void makeString(char *str, size_t len, int spacing) {
+    static const char special[] = ",= \\\n\r\"";
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (spacing > 0 && rand() % spacing == 0) {
+            str[i] = special[rand() % (sizeof(special) - 1)];
+        }
+        else {
+            str[i] = 'a' + rand() % 26;
+        }
+    }
+}
+
+static void testAgainstScalar(void) {
+    static const int spacings[] = { 0, 64, 16, 4, 1 };
+    char src[MAX_LEN], expected[2 * MAX_LEN], *dst;
+    size_t len, got_len, expected_len;
+    int kind, s, round;
+
+    srand(1);
+    for (len = 0; len <= MAX_LEN; len++) {
+        for (kind = DAAP_ESCAPE_KEY; kind <= DAAP_ESCAPE_STRING; kind++) {
+            for (s = 0; s < (int)(sizeof(spacings) / sizeof(spacings[0])); s++) {
+                for (round = 0; round < 4; round++) {
+                    makeString(src, len, spacings[s]);
+                    expected_len = escapeScalar(expected, src, len, kind);
+                    /* exactly the room documented, so that a store past it
+                     * shows up under a memory checker */
+                    dst = malloc(2 * len + 1);
+                    got_len = daapEscape(dst, src, len, kind);
+                    CHECK(got_len == expected_len && memcmp(dst, expected, got_len) == 0,
+                          "length %zu, kind %d, spacing %d: %zu bytes, %zu expected", len, kind,
+                          spacings[s], got_len, expected_len);
+                    free(dst);
+                }
+            }
+        }
+    }
+}
+
+static void testExamples(void) {
+    char dst[64];
+    size_t len;
+
+    len = daapEscape(dst, "my app,v=2", 10, DAAP_ESCAPE_KEY);
+    CHECK(len == 13 && memcmp(dst, "my\\ app\\,v\\=2", len) == 0, "tag value: %.*s", (int)len, dst);
+    len = daapEscape(dst, "say \"hi\" \\ then\nnext", 20, DAAP_ESCAPE_STRING);
+    CHECK(len == 24 && memcmp(dst, "say \\\"hi\\\" \\\\ then\\nnext", len) == 0,
+          "string value: %.*s", (int)len, dst);
+    /* in a string value, the characters of a key are left alone */
+    len = daapEscape(dst, "a b,c=d", 7, DAAP_ESCAPE_STRING);
+    CHECK(len == 7 && memcmp(dst, "a b,c=d", len) == 0, "string value: %.*s", (int)len, dst);
+}
+
+int main(void) {
+    testExamples();
+    testAgainstScalar();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Tests of the journal read by daapLogRead(): time windows, the chains of
+ * a key, and reads once the oldest segments have been reused
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "daap_log.h"
+#include "daap_journal.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                             \
+    do {                                             \
+        if (!(cond)) {                               \
+            fprintf(stderr, "FAILED: " __VA_ARGS__); \
+            fprintf(stderr, "\n");                   \
+            failures++;                              \
+        }                                            \
+    } while (0)
+
+#define MAX_ROWS 100000
+/* records appended to wrap a journal of 1 MiB several times */
+#define WRAP_RECORDS 40000
+
+static char *rows[MAX_ROWS];
+
+static long nowMs(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+static void append(long timestamp, const char *name, int seq) {
+    char line[128];
+    int len;
+
+    len = snprintf(line, sizeof(line), "rec,key=%s seq=%di,pad=\"%040d\"", name, seq, seq);
+    daapJournalAppend(timestamp, name, line, len);
+}
+
+/* The seq field of a row, -1 if it is not one of ours or not of name */
+static int rowSeq(const char *row, const char *name) {
+    char key[32];
+    int seq;
+
+    snprintf(key, sizeof(key), "rec,key=%s seq=", name);
+    if (strncmp(row, key, strlen(key)) != 0 || sscanf(row + strlen(key), "%di", &seq) != 1) {
+        return -1;
+    }
+    return seq;
+}
+
+/* Reads and checks that the rows are of name (any if NULL) with the seq
+ * numbers first, first + step, ...; returns the number read */
+static int readSeqs(int key, int interval, int max_rows, const char *name, int first, int step) {
+    int n, i, seq;
+
+    n = daapJournalRead(key, interval, max_rows, rows);
+    for (i = 0; i < n; i++) {
+        seq = name ? rowSeq(rows[i], name) : -2;
+        CHECK(!name || seq == first + i * step, "row %d of %s: %s", i, name, rows[i]);
+        free(rows[i]);
+    }
+    return n;
+}
+
+static void testWindows(void) {
+    long now = nowMs();
+    int a = daapLogKey("a"), n, i;
+
+    /* 100 records ten minutes old, then 100 now, of a and b in turn */
+    for (i = 0; i < 100; i++) {
+        append(now - 600000, i % 2 ? "b" : "a", i);
+    }
+    for (i = 100; i < 200; i++) {
+        append(now, i % 2 ? "b" : "a", i);
+    }
+
+    n = readSeqs(a, 60, MAX_ROWS, "a", 100, 2);
+    CHECK(n == 50, "%d records of a in the last minute", n);
+    n = readSeqs(a, 0, MAX_ROWS, "a", 0, 2);
+    CHECK(n == 100, "%d records of a", n);
+    n = readSeqs(a, 0, 5, "a", 190, 2);
+    CHECK(n == 5, "%d of the last 5 records of a", n);
+    n = readSeqs(0, 60, MAX_ROWS, NULL, 0, 0);
+    CHECK(n == 100, "%d records in the last minute", n);
+    n = readSeqs(daapLogKey("c"), 0, MAX_ROWS, NULL, 0, 0);
+    CHECK(n == 0, "%d records of a key never logged", n);
+
+    /* a record that carries the time of an earlier call is not in a
+     * window that starts after it, even when appended last */
+    append(now - 600000, "a", 200);
+    n = readSeqs(a, 60, MAX_ROWS, "a", 100, 2);
+    CHECK(n == 50, "%d records of a in the last minute after a late one", n);
+    n = daapJournalRead(a, 0, MAX_ROWS, rows);
+    CHECK(n == 101 && rowSeq(rows[n - 1], "a") == 200, "%d records of a with the late one", n);
+    for (i = 0; i < n; i++) {
+        free(rows[i]);
+    }
+}
+
+static void testWrap(void) {
+    long now = nowMs();
+    int n, i, last_w = (WRAP_RECORDS - 1) / 3 * 3;
+
+    for (i = 0; i < WRAP_RECORDS; i++) {
+        append(now, i % 3 ? "v" : "w", i);
+    }
+
+    /* what is left of w's chain is every third record, up to the last */
+    n = daapJournalRead(daapLogKey("w"), 0, MAX_ROWS, rows);
+    CHECK(n > 100 && n < WRAP_RECORDS / 3, "%d records of w left", n);
+    for (i = 0; i < n; i++) {
+        CHECK(rowSeq(rows[i], "w") == last_w - (n - 1 - i) * 3, "row %d of w: %s", i, rows[i]);
+        free(rows[i]);
+    }
+
+    /* all keys: consecutive across the segments */
+    n = daapJournalRead(0, 0, MAX_ROWS, rows);
+    CHECK(n > 300, "%d records left", n);
+    for (i = 0; i < n; i++) {
+        CHECK(strstr(rows[i], "seq=") && atoi(strstr(rows[i], "seq=") + 4) == WRAP_RECORDS - n + i,
+              "row %d: %s", i, rows[i]);
+        free(rows[i]);
+    }
+}
+
+int main(void) {
+    char dir[] = "/tmp/test_journal.XXXXXX";
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    setenv(DAAP_JOURNAL_ENVVAR, dir, 1);
+    setenv(DAAP_JOURNAL_SIZE_ENVVAR, "1", 1);
+    if (daapJournalOpen() != DAAP_SUCCESS || !daapJournalActive()) {
+        fprintf(stderr, "FAILED: opening the journal in %s\n", dir);
+        rmdir(dir);
+        return 1;
+    }
+
+    testWindows();
+    testWrap();
+
+    daapJournalClose();
+    CHECK(rmdir(dir) == 0, "the journal was not removed from %s", dir);
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
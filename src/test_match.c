@@ -0,0 +1,135 @@
+/*
+ * Tests of the key regex prefilter: the literals required by a regex, and
+ * the candidates the Aho-Corasick scan finds for a line
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "daap_match.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                             \
+    do {                                             \
+        if (!(cond)) {                               \
+            fprintf(stderr, "FAILED: " __VA_ARGS__); \
+            fprintf(stderr, "\n");                   \
+            failures++;                              \
+        }                                            \
+    } while (0)
+
+/* Whether literal is one of the n literals found */
+static int hasLiteral(char literals[DAAP_MATCH_MAX_LITERALS][256], int n, const char *literal) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(literals[i], literal) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void testRequiredLiterals(void) {
+    char literals[DAAP_MATCH_MAX_LITERALS][256];
+    int n;
+
+    n = daapRequiredLiterals("Total time:\\s*(\\S+)", literals);
+    CHECK(n == 1 && hasLiteral(literals, n, "Total time:"), "plain prefix: %d literals", n);
+
+    n = daapRequiredLiterals("x: (L) = (\\d+)", literals);
+    CHECK(n == 3 && hasLiteral(literals, n, "x: ") && hasLiteral(literals, n, " = ") &&
+          hasLiteral(literals, n, "L"), "literals around groups: %d literals", n);
+
+    /* an optional group is not required, and . splits a literal */
+    n = daapRequiredLiterals("abc(def)?ghi=(\\d)", literals);
+    CHECK(n == 2 && hasLiteral(literals, n, "abc") && hasLiteral(literals, n, "ghi=") &&
+          !hasLiteral(literals, n, "def"), "optional group: %d literals", n);
+    n = daapRequiredLiterals("a.b=(\\d)", literals);
+    CHECK(n == 2 && hasLiteral(literals, n, "a") && hasLiteral(literals, n, "b="),
+          "any character: %d literals", n);
+    n = daapRequiredLiterals("harris\\.cxx\\(\\d+\\): (\\w+)", literals);
+    CHECK(n >= 1 && hasLiteral(literals, n, "harris.cxx("), "escaped characters: %d literals", n);
+
+    /* nothing can be required of a case-insensitive regex */
+    n = daapRequiredLiterals("(?i)energy (\\d+)", literals);
+    CHECK(n == 0, "case-insensitive: %d literals", n);
+}
+
+static void testCandidates(void) {
+    char *patterns[] = {
+        "Total time:\\s*(\\S+)",
+        "harris.cxx\\(\\d+\\): (\\w+) = (\\S+)",
+        "(step|iter)=(\\d+)",
+        "x: (L) = (\\d+)",
+        "(?i)energy (\\d+)",
+        "abc(def)?ghi=(\\d)",
+    };
+    const char *lines[] = {
+        "Total time: 12.5",
+        "harris.cxx(191): dt = 0.025",
+        "harris.cxx(191) dt 0.025",
+        "step=10",
+        "x: L = 7",
+        "ENERGY 42",
+        "abcghi=1",
+        "abcdefghi=2",
+        "abc ghi=3",
+        "",
+        "nothing to see here",
+    };
+    int num_patterns = sizeof(patterns) / sizeof(patterns[0]);
+    int num_lines = sizeof(lines) / sizeof(lines[0]);
+    int ovector[30];
+    int i, j, k, n, found, len;
+    daap_keyset_t keys;
+    daap_match_scratch_t scratch;
+
+    memset(&keys, 0, sizeof(keys));
+    memset(&scratch, 0, sizeof(scratch));
+    CHECK(daapKeysetCompile(&keys, patterns, num_patterns) == 0, "compiling the key set");
+    CHECK(keys.num_regexes == num_patterns, "%d regexes compiled", keys.num_regexes);
+    CHECK(daapMatchScratchInit(&scratch, &keys) == 0, "allocating the scratch space");
+    if (failures > 0) {
+        return;
+    }
+
+    for (i = 0; i < num_lines; i++) {
+        len = (int)strlen(lines[i]);
+        n = daapKeysetCandidates(&keys, &scratch, lines[i], len);
+        for (k = 1; k < n; k++) {
+            CHECK(scratch.cands[k - 1] < scratch.cands[k], "candidates of \"%s\" out of order",
+                  lines[i]);
+        }
+        /* every regex that matches must be a candidate */
+        for (j = 0; j < num_patterns; j++) {
+            for (found = 0, k = 0; k < n; k++) {
+                found |= scratch.cands[k] == j;
+            }
+            if (pcre_exec(keys.regexes[j], keys.extras[j], lines[i], len, 0, 0, ovector, 30) >= 0) {
+                CHECK(found, "\"%s\" matches regex %d but is not a candidate", lines[i], j);
+            }
+        }
+    }
+
+    n = daapKeysetCandidates(&keys, &scratch, "nothing to see here", 19);
+    CHECK(n == 2 && scratch.cands[0] == 2 && scratch.cands[1] == 4,
+          "only the regexes without literals are always run");
+    n = daapKeysetCandidates(&keys, &scratch, "harris.cxx(191) dt 0.025", 24);
+    for (k = 0; k < n; k++) {
+        CHECK(scratch.cands[k] != 1, "a line without \" = \" is a candidate of regex 1");
+    }
+
+    daapMatchScratchFree(&scratch);
+    daapKeysetFree(&keys);
+}
+
+int main(void) {
+    testRequiredLiterals();
+    testCandidates();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
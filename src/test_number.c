@@ -0,0 +1,117 @@
+/*
+ * Tests of the conversion of captured values to typed fields
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "daap_number.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                             \
+    do {                                             \
+        if (!(cond)) {                               \
+            fprintf(stderr, "FAILED: " __VA_ARGS__); \
+            fprintf(stderr, "\n");                   \
+            failures++;                              \
+        }                                            \
+    } while (0)
+
+/* text, whether it parses, and the value it parses to */
+typedef struct {
+    const char *text;
+    int ok;
+    double val;
+} double_case_t;
+
+static const double_case_t double_cases[] = {
+    { "1.5", 1, 1.5 },
+    { "0.1", 1, 0.1 },
+    { "-0.25", 1, -0.25 },
+    { "+3", 1, 3 },
+    { ".5", 1, 0.5 },
+    { "5.", 1, 5 },
+    { " 2e3 ", 1, 2000 },
+    { "1.2e+01", 1, 12 },
+    { "10%", 1, 10 },
+    { "1e308", 1, 1e308 },
+    { "-1e-320", 1, -1e-320 },
+    /* not finite, so not a value a record can carry */
+    { "inf", 0, 0 },
+    { "-inf", 0, 0 },
+    { "infinity", 0, 0 },
+    { "nan", 0, 0 },
+    { "1e400", 0, 0 },
+    /* not a number as a whole */
+    { "", 0, 0 },
+    { "abc", 0, 0 },
+    { "1.5x", 0, 0 },
+    { "1,5", 0, 0 },
+    { "0x10", 0, 0 },
+};
+
+static void testParseDouble(void) {
+    const double_case_t *c;
+    size_t i;
+    double val;
+    int ret;
+
+    for (i = 0; i < sizeof(double_cases) / sizeof(double_cases[0]); i++) {
+        c = &double_cases[i];
+        val = -99;
+        ret = daapParseDouble(c->text, (int)strlen(c->text), &val);
+        if (c->ok) {
+            CHECK(ret == 0 && val == c->val, "\"%s\" -> %d %.17g", c->text, ret, val);
+        }
+        else {
+            CHECK(ret == -1, "\"%s\" parsed as %.17g", c->text, val);
+        }
+    }
+
+    /* the text is not null-terminated */
+    ret = daapParseDouble("1.5e+01xyz", 7, &val);
+    CHECK(ret == 0 && val == 15, "prefix of a longer text -> %d %g", ret, val);
+}
+
+static void testParseInt(void) {
+    long long val = 0;
+
+    CHECK(daapParseInt("42", 2, &val) == 0 && val == 42, "42 -> %lld", val);
+    CHECK(daapParseInt(" -7 ", 4, &val) == 0 && val == -7, "-7 -> %lld", val);
+    CHECK(daapParseInt("12%", 3, &val) == 0 && val == 12, "12%% -> %lld", val);
+    CHECK(daapParseInt("9223372036854775807", 19, &val) == 0 && val == 9223372036854775807LL,
+          "largest integer -> %lld", val);
+    CHECK(daapParseInt("9223372036854775808", 19, &val) == -1, "overflow parsed");
+    CHECK(daapParseInt("1.5", 3, &val) == -1, "1.5 parsed as an integer");
+    CHECK(daapParseInt("", 0, &val) == -1, "empty text parsed as an integer");
+}
+
+static void testParseBool(void) {
+    const char *yes[] = { "true", "yes", "on", "1", "T" };
+    const char *no[] = { "False", "no", "0" };
+    long long val;
+    size_t i;
+
+    for (i = 0; i < sizeof(yes) / sizeof(yes[0]); i++) {
+        val = -1;
+        CHECK(daapParseBool(yes[i], (int)strlen(yes[i]), &val) == 0 && val == 1, "%s -> %lld",
+              yes[i], val);
+    }
+    for (i = 0; i < sizeof(no) / sizeof(no[0]); i++) {
+        val = -1;
+        CHECK(daapParseBool(no[i], (int)strlen(no[i]), &val) == 0 && val == 0, "%s -> %lld",
+              no[i], val);
+    }
+    CHECK(daapParseBool("42", 2, &val) == -1, "42 parsed as a boolean");
+}
+
+int main(void) {
+    testParseDouble();
+    testParseInt();
+    testParseBool();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
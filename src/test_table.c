@@ -0,0 +1,165 @@
+/*
+ * Tests of the table matcher: headers found in order, then the values of
+ * each row split into columns, until a line that is not a row
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "daap_log.h"
+#include "daap_table.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                             \
+    do {                                             \
+        if (!(cond)) {                               \
+            fprintf(stderr, "FAILED: " __VA_ARGS__); \
+            fprintf(stderr, "\n");                   \
+            failures++;                              \
+        }                                            \
+    } while (0)
+
+#define MAX_VALUES 16
+
+/* the values passed for one row */
+typedef struct {
+    int num;
+    char names[MAX_VALUES][64];
+    char vals[MAX_VALUES][64];
+    int kinds[MAX_VALUES];
+    int types[MAX_VALUES];
+} row_t;
+
+static void addValue(void *arg, const char *name, int name_len, int kind, int type,
+                     const char *val, int val_len) {
+    row_t *row = (row_t *)arg;
+
+    if (row->num < MAX_VALUES) {
+        snprintf(row->names[row->num], 64, "%.*s", name_len, name);
+        snprintf(row->vals[row->num], 64, "%.*s", val_len, val);
+        row->kinds[row->num] = kind;
+        row->types[row->num] = type;
+    }
+    row->num++;
+}
+
+static char *template_lines[] = {
+    "====table====",
+    "table_sep=|",
+    "header=                           |      Since Last Update       |     Since Last Restore",
+    "header=    Operation              | Pct   Time    Count    Per   | Pct   Time    Count    Per",
+    "header=---------------------------+------------------------------+------------------------------",
+    "cols=3",
+    "val_sep=  ",
+    "num_vals=9",
+    "val_name=operation_tag",
+    "val_name=since_last_update_pct:float",
+    "val_name=since_last_update_time:float:s",
+    "val_name=since_last_update_count:int",
+    "val_name=since_last_update_per:float:s",
+    "val_name=since_last_restore_pct:float",
+    "val_name=since_last_restore_time:float:s",
+    "val_name=since_last_restore_count:int",
+    "val_name=since_last_restore_per_skip",
+    "====end_table====",
+};
+
+static const char *header_lines[] = {
+    "                           |      Since Last Update       |     Since Last Restore",
+    "    Operation              | Pct   Time    Count    Per   | Pct   Time    Count    Per",
+    "---------------------------+------------------------------+------------------------------",
+};
+
+static int matchLine(daap_tableset_t *tables, daap_table_state_t *state, const char *line,
+                     row_t *row) {
+    memset(row, 0, sizeof(*row));
+    return daapTableMatch(tables, state, line, (int)strlen(line), addValue, row);
+}
+
+static void testRows(daap_tableset_t *tables, daap_table_state_t *state) {
+    row_t row;
+    int i, ret;
+
+    for (i = 0; i < 3; i++) {
+        ret = matchLine(tables, state, header_lines[i], &row);
+        CHECK(ret == DAAP_TABLE_HEADER && row.num == 0, "header %d: %d", i, ret);
+    }
+
+    ret = matchLine(tables, state, "    Sort                   |  10%  1.2e+00  2  6.0e-01 |"
+                    "  20%  2.4e+00  4  6.0e-01", &row);
+    CHECK(ret == DAAP_TABLE_ROW, "row: %d", ret);
+    /* the _skip value is dropped */
+    CHECK(row.num == 8, "%d values in the row", row.num);
+    if (row.num != 8) {
+        return;
+    }
+    CHECK(strcmp(row.names[0], "operation") == 0 && row.kinds[0] == DAAP_TABLE_TAG &&
+          strcmp(row.vals[0], "Sort") == 0, "tag %s=%s", row.names[0], row.vals[0]);
+    CHECK(strcmp(row.names[1], "since_last_update_pct") == 0 && row.kinds[1] == DAAP_TABLE_FIELD &&
+          row.types[1] == DAAP_FIELD_FLOAT && strcmp(row.vals[1], "10%") == 0,
+          "field %s=%s", row.names[1], row.vals[1]);
+    /* a unit is appended to the name */
+    CHECK(strcmp(row.names[2], "since_last_update_time_s") == 0 &&
+          strcmp(row.vals[2], "1.2e+00") == 0, "field %s=%s", row.names[2], row.vals[2]);
+    CHECK(strcmp(row.names[3], "since_last_update_count") == 0 && row.types[3] == DAAP_FIELD_INT &&
+          strcmp(row.vals[3], "2") == 0, "field %s=%s", row.names[3], row.vals[3]);
+    CHECK(strcmp(row.names[5], "since_last_restore_pct") == 0 && strcmp(row.vals[5], "20%") == 0,
+          "field %s=%s", row.names[5], row.vals[5]);
+    CHECK(strcmp(row.names[7], "since_last_restore_count") == 0 && strcmp(row.vals[7], "4") == 0,
+          "field %s=%s", row.names[7], row.vals[7]);
+
+    ret = matchLine(tables, state, "    Total                  | 100%  1.2e+01  1  1.2e+01 |"
+                    " 100%  1.2e+01  1  1.2e+01", &row);
+    CHECK(ret == DAAP_TABLE_ROW && row.num == 8 && strcmp(row.vals[0], "Total") == 0,
+          "second row: %d, %d values", ret, row.num);
+
+    /* the table ends at the first line that is not a row */
+    ret = matchLine(tables, state, "", &row);
+    CHECK(ret == DAAP_TABLE_NONE, "blank line after the table: %d", ret);
+    ret = matchLine(tables, state, "    Sort                   |  10%  1.2e+00  2  6.0e-01 |"
+                    "  20%  2.4e+00  4  6.0e-01", &row);
+    CHECK(ret == DAAP_TABLE_NONE && row.num == 0, "row after the table ended: %d", ret);
+}
+
+static void testHeaderOrder(daap_tableset_t *tables, daap_table_state_t *state) {
+    row_t row;
+    int ret;
+
+    /* rows are only read once every header was found, in order */
+    daapTableStateReset(state);
+    matchLine(tables, state, header_lines[1], &row);
+    matchLine(tables, state, header_lines[2], &row);
+    ret = matchLine(tables, state, "    Sort                   |  10%  1.2e+00  2  6.0e-01 |"
+                    "  20%  2.4e+00  4  6.0e-01", &row);
+    CHECK(ret != DAAP_TABLE_ROW && row.num == 0, "row without the first header: %d", ret);
+
+    ret = matchLine(tables, state, "harris.cxx(191): dt = 0.025", &row);
+    CHECK(ret == DAAP_TABLE_NONE, "line outside a table: %d", ret);
+}
+
+int main(void) {
+    daap_tableset_t tables;
+    daap_table_state_t state;
+
+    memset(&tables, 0, sizeof(tables));
+    memset(&state, 0, sizeof(state));
+    if (daapTablesetCompile(&tables, template_lines,
+                            sizeof(template_lines) / sizeof(template_lines[0])) != 0 ||
+        daapTableStateInit(&state, &tables) != 0) {
+        fprintf(stderr, "FAILED: compiling the table template\n");
+        return 1;
+    }
+    CHECK(tables.num_tables == 1 && tables.num_headers == 3, "%u tables, %u headers",
+          tables.num_tables, tables.num_headers);
+
+    testRows(&tables, &state);
+    testHeaderOrder(&tables, &state);
+
+    daapTableStateFree(&state);
+    daapTablesetFree(&tables);
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
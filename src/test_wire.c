@@ -0,0 +1,196 @@
+/*
+ * Tests of the relay framing: records encoded and decoded back to line
+ * protocol, in one piece or a byte at a time, and a batch rewritten for a
+ * new connection
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daap_wire.h"
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                             \
+    do {                                             \
+        if (!(cond)) {                               \
+            fprintf(stderr, "FAILED: " __VA_ARGS__); \
+            fprintf(stderr, "\n");                   \
+            failures++;                              \
+        }                                            \
+    } while (0)
+
+static tag_t tags[] = { { "app", "my app,v=2" }, { "empty", "" }, { "rank", "3" } };
+static field_t fields[4];
+
+/* the records of encodeRecords(), as line protocol */
+static const char *expected_lines =
+    "daap,app=my\\ app\\,v\\=2,rank=3 message=\"say \\\"hi\\\"\",n=-5i,x=0.1,b=true 1700000000123000000\n"
+    "daap,app=my\\ app\\,v\\=2,rank=3 message=\"say \\\"hi\\\"\",n=-5i,x=0.1,b=true 1700000000100000000\n"
+    "raw,k=v x=1i\n"
+    "other,app=my\\ app\\,v\\=2 n=-5i 1700000001000000000\n";
+
+static void setFields(void) {
+    memset(fields, 0, sizeof(fields));
+    fields[0].field_name = "message";
+    fields[0].field_val = "say \"hi\"";
+    fields[1].field_name = "n";
+    fields[1].field_type = DAAP_FIELD_INT;
+    fields[1].int_val = -5;
+    fields[2].field_name = "x";
+    fields[2].field_type = DAAP_FIELD_FLOAT;
+    fields[2].float_val = 0.1;
+    fields[3].field_name = "b";
+    fields[3].field_type = DAAP_FIELD_BOOL;
+    fields[3].int_val = 1;
+}
+
+static void startConnection(daap_wire_buf_t *buf) {
+    buf->len = 0;
+    daapWireBufReserve(buf, DAAP_WIRE_MAGIC_LEN);
+    memcpy(buf->buf, DAAP_WIRE_MAGIC, DAAP_WIRE_MAGIC_LEN);
+    buf->len = DAAP_WIRE_MAGIC_LEN;
+}
+
+/* Two records of one schema (the second earlier than the first), a line,
+ * and a record of another tag set and schema */
+static int encodeRecords(daap_wire_encoder_t *enc, daap_wire_buf_t *buf) {
+    int ret = 0;
+
+    ret |= daapWireEncodeRecord(enc, buf, 1700000000123L, "daap", 3, tags, 4, fields);
+    ret |= daapWireEncodeRecord(enc, buf, 1700000000100L, "daap", 3, tags, 4, fields);
+    ret |= daapWireEncodeLine(buf, "raw,k=v x=1i", 12);
+    ret |= daapWireEncodeRecord(enc, buf, 1700000001000L, "other", 1, tags, 1, &fields[1]);
+    return ret;
+}
+
+static void testRoundTrip(void) {
+    daap_wire_encoder_t *enc = daapWireEncoderNew();
+    daap_wire_decoder_t *dec = daapWireDecoderNew();
+    daap_wire_buf_t in = { 0 }, out = { 0 };
+    long used;
+
+    startConnection(&in);
+    CHECK(encodeRecords(enc, &in) == 0, "encoding");
+    used = daapWireDecode(dec, in.buf, in.len, &out);
+    CHECK(used == (long)in.len, "%ld of %zu bytes decoded", used, in.len);
+    CHECK(out.len == strlen(expected_lines) && memcmp(out.buf, expected_lines, out.len) == 0,
+          "decoded:\n%.*s", (int)out.len, out.buf);
+
+    daapWireEncoderFree(enc);
+    daapWireDecoderFree(dec);
+    free(in.buf);
+    free(out.buf);
+}
+
+/* Frames split anywhere are left for the next call */
+static void testByteAtATime(void) {
+    daap_wire_encoder_t *enc = daapWireEncoderNew();
+    daap_wire_decoder_t *dec = daapWireDecoderNew();
+    daap_wire_buf_t in = { 0 }, pending = { 0 }, out = { 0 };
+    size_t i;
+    long used;
+
+    startConnection(&in);
+    encodeRecords(enc, &in);
+    for (i = 0; i < in.len; i++) {
+        daapWireBufReserve(&pending, 1);
+        pending.buf[pending.len++] = in.buf[i];
+        used = daapWireDecode(dec, pending.buf, pending.len, &out);
+        if (used < 0) {
+            CHECK(0, "invalid data after %zu bytes", i + 1);
+            break;
+        }
+        pending.len -= used;
+        memmove(pending.buf, pending.buf + used, pending.len);
+    }
+    CHECK(pending.len == 0, "%zu bytes left over", pending.len);
+    CHECK(out.len == strlen(expected_lines) && memcmp(out.buf, expected_lines, out.len) == 0,
+          "decoded a byte at a time:\n%.*s", (int)out.len, out.buf);
+
+    daapWireEncoderFree(enc);
+    daapWireDecoderFree(dec);
+    free(in.buf);
+    free(pending.buf);
+    free(out.buf);
+}
+
+/* A batch that refers to definitions sent on a lost connection is
+ * rewritten to carry them, and is understood by a new decoder */
+static void testResend(void) {
+    daap_wire_encoder_t *enc = daapWireEncoderNew();
+    daap_wire_decoder_t *dec = daapWireDecoderNew();
+    daap_wire_buf_t sent = { 0 }, batch = { 0 }, in = { 0 }, out = { 0 };
+    const char *expected =
+        "other,app=my\\ app\\,v\\=2 n=-5i 1700000002000000000\n"
+        "daap,app=my\\ app\\,v\\=2,rank=3 message=\"say \\\"hi\\\"\",n=-5i,x=0.1,b=true 1700000002500000000\n"
+        "daap,app=my\\ app\\,v\\=2 n=-5i 1700000002400000000\n";
+    long used;
+
+    startConnection(&sent);
+    encodeRecords(enc, &sent);
+    daapWireEncoderMark(enc, 0);
+    /* two known definitions and a new tag set */
+    daapWireEncodeRecord(enc, &batch, 1700000002000L, "other", 1, tags, 1, &fields[1]);
+    daapWireEncodeRecord(enc, &batch, 1700000002500L, "daap", 3, tags, 4, fields);
+    daapWireEncodeRecord(enc, &batch, 1700000002400L, "daap", 1, tags, 1, &fields[1]);
+
+    CHECK(daapWireEncodeResend(enc, &batch) == 0, "rewriting the batch");
+    startConnection(&in);
+    daapWireBufReserve(&in, batch.len);
+    memcpy(in.buf + in.len, batch.buf, batch.len);
+    in.len += batch.len;
+    used = daapWireDecode(dec, in.buf, in.len, &out);
+    CHECK(used == (long)in.len, "%ld of %zu bytes of the rewritten batch decoded", used, in.len);
+    CHECK(out.len == strlen(expected) && memcmp(out.buf, expected, out.len) == 0,
+          "decoded after a resend:\n%.*s", (int)out.len, out.buf);
+
+    /* the encoder goes on from the rewritten batch */
+    out.len = 0;
+    batch.len = 0;
+    daapWireEncoderMark(enc, 0);
+    daapWireEncodeRecord(enc, &batch, 1700000003000L, "other", 1, tags, 1, &fields[1]);
+    used = daapWireDecode(dec, batch.buf, batch.len, &out);
+    expected = "other,app=my\\ app\\,v\\=2 n=-5i 1700000003000000000\n";
+    CHECK(used == (long)batch.len && out.len == strlen(expected) &&
+          memcmp(out.buf, expected, out.len) == 0,
+          "decoded after the resent batch:\n%.*s", (int)out.len, out.buf);
+
+    daapWireEncoderFree(enc);
+    daapWireDecoderFree(dec);
+    free(sent.buf);
+    free(batch.buf);
+    free(in.buf);
+    free(out.buf);
+}
+
+static void testInvalid(void) {
+    daap_wire_decoder_t *dec = daapWireDecoderNew();
+    daap_wire_buf_t out = { 0 };
+    char data[16];
+
+    CHECK(daapWireDecode(dec, "DAAPW0\n", 7, &out) == -1, "wrong magic accepted");
+    daapWireDecoderFree(dec);
+
+    /* a record of a schema that was never defined */
+    dec = daapWireDecoderNew();
+    memcpy(data, DAAP_WIRE_MAGIC, DAAP_WIRE_MAGIC_LEN);
+    memcpy(data + DAAP_WIRE_MAGIC_LEN, "R\x05\x02", 3);
+    CHECK(daapWireDecode(dec, data, DAAP_WIRE_MAGIC_LEN + 3, &out) == -1,
+          "record of an unknown schema accepted");
+    daapWireDecoderFree(dec);
+    free(out.buf);
+}
+
+int main(void) {
+    setFields();
+    testRoundTrip();
+    testByteAtATime();
+    testResend();
+    testInvalid();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}